@@ -33,6 +33,7 @@
 #include <err.h>
 #include <trace.h>
 
+#include <kernel/debug.h>
 #include <kernel/thread.h>
 
 #include <lib/bio.h>
@@ -75,6 +76,12 @@ void lkb_register(const char *name, lkb_handler_t handler, void *cookie) {
     }
 }
 
+#if WITH_KERNEL_EVLOG
+static int lkb_kevlog_write(void *arg, const void *data, size_t len) {
+    return lkb_write(arg, data, len);
+}
+#endif
+
 static int do_reboot(void *arg) {
     thread_sleep(250);
     platform_halt(HALT_ACTION_REBOOT, HALT_REASON_SW_RESET);
@@ -306,6 +313,13 @@ int lkb_handle_command(lkb_t *lkb, const char *cmd, const char *arg, unsigned le
         if (sysparam_get_ptr(arg, &ptr, &len) == 0) {
             lkb_write(lkb, ptr, len);
         }
+#if WITH_KERNEL_EVLOG
+    } else if (!strcmp(cmd, "kevlog")) {
+        if (kernel_evlog_export(&lkb_kevlog_write, lkb) < 0) {
+            *result = "io error";
+            return -1;
+        }
+#endif
     } else if (!strcmp(cmd, "reboot")) {
         thread_resume(thread_create("reboot", &do_reboot, NULL,
             DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
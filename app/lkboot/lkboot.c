@@ -249,6 +249,9 @@ serverloop:
         goto regboot;
     }
 
+    /* image transfers are bulk, give the connection a large window */
+    tcp_set_buffer_sizes(listen_socket, 65536, 65536);
+
     /* run the main lkserver loop */
     printf("lkboot: starting network server\n");
     lk_time_t t = current_time();
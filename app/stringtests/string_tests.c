@@ -23,6 +23,7 @@
 #include <stdio.h>
 #include <string.h>
 #include <malloc.h>
+#include <rand.h>
 #include <app.h>
 #include <platform.h>
 #include <kernel/thread.h>
@@ -138,6 +139,42 @@ static void *c_memset(void *s, int c, size_t count)
     return s;
 }
 
+static int c_memcmp(const void *cs, const void *ct, size_t count)
+{
+    const unsigned char *su1, *su2;
+    int res = 0;
+
+    for (su1 = cs, su2 = ct; 0 < count; ++su1, ++su2, count--)
+        if ((res = *su1 - *su2) != 0)
+            break;
+    return res;
+}
+
+static size_t c_strlen(const char *s)
+{
+    const char *sc;
+
+    for (sc = s; *sc != '\0'; ++sc)
+        ;
+    return sc - s;
+}
+
+static void *c_memchr(const void *buf, int c, size_t count)
+{
+    const unsigned char *b = buf;
+
+    for (; count > 0; count--, b++) {
+        if (*b == (unsigned char)c)
+            return (void *)b;
+    }
+    return NULL;
+}
+
+static int sign(int x)
+{
+    return (x > 0) - (x < 0);
+}
+
 static void *null_memcpy(void *dst, const void *src, size_t len)
 {
     return dst;
@@ -298,6 +335,189 @@ static void validate_memset(void)
     }
 }
 
+static void validate_memmove(void)
+{
+    size_t srcalign, dstalign, size;
+    const size_t maxsize = 256;
+    int errors = 0;
+
+    printf("testing memmove for correctness\n");
+
+    /* src and dst in the same buffer, overlapping in both directions */
+    for (srcalign = 0; srcalign < 64; srcalign++) {
+        for (dstalign = 0; dstalign < 64; dstalign++) {
+            for (size = 0; size < maxsize; size++) {
+                fillbuf(dst, maxsize * 2, 123514);
+                fillbuf(dst2, maxsize * 2, 123514);
+
+                c_memmove(dst + dstalign, dst + srcalign, size);
+                memmove(dst2 + dstalign, dst2 + srcalign, size);
+
+                if (memcmp(dst, dst2, maxsize * 2) != 0) {
+                    printf("error! srcalign %zu, dstalign %zu, size %zu\n", srcalign, dstalign, size);
+                    errors++;
+                }
+            }
+        }
+    }
+
+    printf("memmove: %d errors\n", errors);
+}
+
+static void validate_memcmp(void)
+{
+    size_t align1, align2, size, diff;
+    const size_t maxsize = 128;
+    int errors = 0;
+
+    printf("testing memcmp for correctness\n");
+
+    for (align1 = 0; align1 < 16; align1++) {
+        for (align2 = 0; align2 < 16; align2++) {
+            for (size = 0; size < maxsize; size++) {
+                fillbuf(src, maxsize * 2, 567);
+                memcpy(src2 + align2, src + align1, size);
+
+                /* equal, then a difference at every position either way */
+                for (diff = 0; diff <= size; diff++) {
+                    if (diff < size)
+                        src2[align2 + diff] = src[align1 + diff] + ((diff & 1) ? 1 : -1);
+
+                    int expected = c_memcmp(src + align1, src2 + align2, size);
+                    int result = memcmp(src + align1, src2 + align2, size);
+                    if (sign(result) != sign(expected)) {
+                        printf("error! align1 %zu, align2 %zu, size %zu, diff %zu: %d vs %d\n",
+                               align1, align2, size, diff, result, expected);
+                        errors++;
+                    }
+
+                    if (diff < size)
+                        src2[align2 + diff] = src[align1 + diff];
+                }
+            }
+        }
+    }
+
+    printf("memcmp: %d errors\n", errors);
+}
+
+static void validate_strlen(void)
+{
+    size_t align, len;
+    const size_t maxlen = 256;
+    int errors = 0;
+
+    printf("testing strlen for correctness\n");
+
+    for (align = 0; align < 64; align++) {
+        for (len = 0; len < maxlen; len++) {
+            /* no zeros in the string, garbage with zeros before and after it */
+            fillbuf(src, maxlen * 2 + 64, 123514);
+            for (size_t i = 0; i < len; i++) {
+                if (src[align + i] == 0)
+                    src[align + i] = 1;
+            }
+            src[align + len] = 0;
+            if (align > 0)
+                src[align - 1] = 0;
+
+            size_t expected = c_strlen((char *)src + align);
+            size_t result = strlen((char *)src + align);
+            if (result != expected) {
+                printf("error! align %zu, len %zu: %zu vs %zu\n", align, len, result, expected);
+                errors++;
+            }
+        }
+    }
+
+    printf("strlen: %d errors\n", errors);
+}
+
+static void validate_memchr(void)
+{
+    size_t align, size, pos;
+    const size_t maxsize = 128;
+    int errors = 0;
+
+    printf("testing memchr for correctness\n");
+
+    for (align = 0; align < 16; align++) {
+        for (size = 0; size < maxsize; size++) {
+            /* the byte at every position inside and just outside the buffer, and nowhere */
+            for (pos = 0; pos <= size + 8; pos++) {
+                int c = (pos * 37) & 0xff;
+
+                memset(src, c ^ 0x55, maxsize * 2);
+                if (pos < size + 8)
+                    src[align + pos] = c;
+                if (align > 0)
+                    src[align - 1] = c;
+
+                void *expected = c_memchr(src + align, c, size);
+                void *result = memchr(src + align, c + 256, size);
+                if (result != expected) {
+                    printf("error! align %zu, size %zu, pos %zu: %p vs %p\n", align, size, pos, result, expected);
+                    errors++;
+                }
+            }
+        }
+    }
+
+    printf("memchr: %d errors\n", errors);
+}
+
+/* random sizes, offsets and overlaps across all the routines */
+static void fuzz_string_routines(uint iterations)
+{
+    const size_t maxsize = 4096;
+    int errors = 0;
+
+    printf("fuzzing string routines, %u iterations\n", iterations);
+
+    for (uint i = 0; i < iterations; i++) {
+        size_t size = rand() % ((i & 1) ? 128 : maxsize);
+        size_t a = rand() % (maxsize - size + 1);
+        size_t b = rand() % (maxsize - size + 1);
+        int c = rand();
+
+        fillbuf(dst, maxsize + 64, i);
+        fillbuf(dst2, maxsize + 64, i);
+
+        switch (i % 4) {
+            case 0:
+                c_memmove(dst + a, dst + b, size);
+                memmove(dst2 + a, dst2 + b, size);
+                break;
+            case 1:
+                c_memset(dst + a, c, size);
+                memset(dst2 + a, c, size);
+                break;
+            case 2:
+                dst[a + size] = 0;
+                dst2[a + size] = 0;
+                if (c_strlen((char *)dst + a) != strlen((char *)dst2 + a) ||
+                        c_memchr(dst + a, c, size) != memchr(dst + a, c, size)) {
+                    printf("error! strlen/memchr offset %zu size %zu\n", a, size);
+                    errors++;
+                }
+                break;
+            case 3:
+                if (sign(c_memcmp(dst + a, dst + b, size)) != sign(memcmp(dst + a, dst + b, size))) {
+                    printf("error! memcmp %zu %zu size %zu\n", a, b, size);
+                    errors++;
+                }
+                break;
+        }
+
+        if (memcmp(dst, dst2, maxsize + 64) != 0) {
+            printf("error! iteration %u, op %u, a %zu, b %zu, size %zu\n", i, i % 4, a, b, size);
+            errors++;
+        }
+    }
+
+    printf("fuzz: %d errors\n", errors);
+}
+
 #if defined(WITH_LIB_CONSOLE)
 #include <lib/console.h>
 
@@ -321,6 +541,7 @@ static int string_tests(int argc, const cmd_args *argv)
 usage:
         printf("%s validate <routine>\n", argv[0].str);
         printf("%s bench <routine>\n", argv[0].str);
+        printf("%s fuzz <iterations>\n", argv[0].str);
         goto out;
     }
 
@@ -329,7 +550,17 @@ usage:
             validate_memcpy();
         } else if (!strcmp(argv[2].str, "memset")) {
             validate_memset();
+        } else if (!strcmp(argv[2].str, "memmove")) {
+            validate_memmove();
+        } else if (!strcmp(argv[2].str, "memcmp")) {
+            validate_memcmp();
+        } else if (!strcmp(argv[2].str, "strlen")) {
+            validate_strlen();
+        } else if (!strcmp(argv[2].str, "memchr")) {
+            validate_memchr();
         }
+    } else if (!strcmp(argv[1].str, "fuzz")) {
+        fuzz_string_routines(argv[2].u);
     } else if (!strcmp(argv[1].str, "bench")) {
         if (!strcmp(argv[2].str, "memcpy")) {
             bench_memcpy();
@@ -33,10 +33,10 @@
 #include <kernel/event.h>
 #include <platform.h>
 
-#if ARCH_ARM
 const uint BUFSIZE = (1024*1024);
 const uint ITER = 1024;
 
+#if ARCH_ARM
 void bench_set_overhead(void)
 {
 	uint32_t *buf = malloc(BUFSIZE);
@@ -56,6 +56,7 @@ void bench_set_overhead(void)
 
 	free(buf);
 }
+#endif
 
 void bench_memset(void)
 {
@@ -73,6 +74,7 @@ void bench_memset(void)
 	free(buf);
 }
 
+#if ARCH_ARM
 #define bench_cset(type) \
 void bench_cset_##type(void) \
 { \
@@ -142,7 +144,7 @@ void bench_cset_stm(void)
 
 	free(buf);
 }
-
+#endif
 
 void bench_memcpy(void)
 {
@@ -159,7 +161,51 @@ void bench_memcpy(void)
 
 	free(buf);
 }
-#endif
+
+/* largest buffer in the bandwidth sweep, big enough to fall out of the caches */
+#define BANDWIDTH_MAX (2*1024*1024)
+/* total bytes moved per size in the sweep */
+#define BANDWIDTH_BYTES (64*1024*1024)
+
+static uint64_t bench_mbytes_per_sec(uint64_t bytes, lk_bigtime_t usecs)
+{
+	if (usecs == 0)
+		usecs = 1;
+	return bytes * 1000000 / usecs / (1024*1024);
+}
+
+/* timed rather than counted in cycles, the cycle counter wraps too soon at these sizes */
+void bench_string_bandwidth(void)
+{
+	uint8_t *buf = malloc(BANDWIDTH_MAX * 2);
+	if (!buf) {
+		printf("not enough memory for the string bandwidth benchmark\n");
+		return;
+	}
+	memset(buf, 0x99, BANDWIDTH_MAX * 2);
+
+	for (size_t size = 64; size <= BANDWIDTH_MAX; size *= 4) {
+		uint iter = BANDWIDTH_BYTES / size;
+
+		lk_bigtime_t t = current_time_hires();
+		for (uint i = 0; i < iter; i++) {
+			memcpy(buf, buf + BANDWIDTH_MAX, size);
+		}
+		t = current_time_hires() - t;
+		uint64_t copy = bench_mbytes_per_sec((uint64_t)size * iter, t);
+
+		t = current_time_hires();
+		for (uint i = 0; i < iter; i++) {
+			memset(buf, i, size);
+		}
+		t = current_time_hires() - t;
+		uint64_t set = bench_mbytes_per_sec((uint64_t)size * iter, t);
+
+		printf("%8zu bytes: memcpy %llu MB/s, memset %llu MB/s\n", size, copy, set);
+	}
+
+	free(buf);
+}
 
 #if WITH_LIB_LIBM
 #include <math.h>
@@ -206,15 +252,18 @@ void benchmarks(void)
 {
 #if ARCH_ARM
 	bench_set_overhead();
+#endif
 	bench_memset();
+#if ARCH_ARM
 	bench_cset_uint8_t();
 	bench_cset_uint16_t();
 	bench_cset_uint32_t();
 	bench_cset_uint64_t();
 	bench_cset_wide();
 	bench_cset_stm();
-	bench_memcpy();
 #endif
+	bench_memcpy();
+	bench_string_bandwidth();
 #if WITH_LIB_LIBM
     bench_sincos();
 #endif
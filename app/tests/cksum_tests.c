@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#if WITH_LIB_CKSUM
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <app/tests.h>
+#include <lib/cksum.h>
+
+#define CKSUM_TEST_SIZE 8192
+#define CKSUM_TEST_ITER 2000
+
+/* a word at a time from the first byte, with nothing clever about it */
+static uint16_t cksum_reference(const uint8_t *buf, size_t len)
+{
+	uint32_t sum = 0;
+
+	for (size_t i = 0; i < len; i += 2) {
+		uint16_t w = 0;
+		memcpy(&w, buf + i, MIN(len - i, 2));
+		sum += w;
+		sum = (sum & 0xffff) + (sum >> 16);
+	}
+
+	return sum;
+}
+
+/* 0 and 0xffff are both ones complement zero */
+static bool cksum_equal(uint16_t a, uint16_t b)
+{
+	return (a % 0xffff) == (b % 0xffff);
+}
+
+static int cksum_test_update(void)
+{
+	uint8_t hdr[20];
+
+	for (size_t i = 0; i < sizeof(hdr); i++)
+		hdr[i] = rand();
+
+	hdr[10] = hdr[11] = 0;
+	uint16_t cksum = inet_cksum(hdr, sizeof(hdr));
+	memcpy(hdr + 10, &cksum, 2);
+
+	uint32_t from, to = rand();
+	memcpy(&from, hdr + 12, 4);
+	memcpy(hdr + 12, &to, 4);
+	cksum = inet_cksum_update32(cksum, from, to);
+	memcpy(hdr + 10, &cksum, 2);
+	if (inet_cksum(hdr, sizeof(hdr)) != 0)
+		return -1;
+
+	uint16_t from16, to16 = rand();
+	memcpy(&from16, hdr + 2, 2);
+	memcpy(hdr + 2, &to16, 2);
+	cksum = inet_cksum_update16(cksum, from16, to16);
+	memcpy(hdr + 10, &cksum, 2);
+	if (inet_cksum(hdr, sizeof(hdr)) != 0)
+		return -1;
+
+	return 0;
+}
+
+int cksum_tests(int argc, const cmd_args *argv)
+{
+	uint8_t *src = malloc(CKSUM_TEST_SIZE);
+	uint8_t *dst = malloc(CKSUM_TEST_SIZE);
+	int errors = 0;
+
+	if (!src || !dst) {
+		free(src);
+		free(dst);
+		return ERR_NO_MEMORY;
+	}
+
+	for (size_t i = 0; i < CKSUM_TEST_SIZE; i++)
+		src[i] = rand();
+
+	printf("testing internet checksum\n");
+
+	for (int i = 0; i < CKSUM_TEST_ITER; i++) {
+		/* every alignment, short lengths through to several vector chunks */
+		size_t off = rand() % 16;
+		size_t doff = rand() % 16;
+		size_t len = rand() % ((i & 1) ? 512 : CKSUM_TEST_SIZE - 16);
+
+		/* all ones is where a carry gets dropped */
+		if ((i % 64) == 0)
+			memset(src + off, 0xff, len);
+
+		uint16_t ref = cksum_reference(src + off, len);
+
+		uint16_t sum = inet_cksum_fold(inet_cksum_partial(src + off, len, 0));
+		if (!cksum_equal(sum, ref)) {
+			printf("sum: off %zu len %zu: 0x%04hx, should be 0x%04hx\n", off, len, sum, ref);
+			errors++;
+		}
+
+		/* summed in two pieces, split on an odd or even byte */
+		size_t cut = len ? rand() % len : 0;
+		uint32_t partial = inet_cksum_partial(src + off, cut, 0);
+		partial = inet_cksum_block_add(partial, inet_cksum_partial(src + off + cut, len - cut, 0), cut);
+		if (!cksum_equal(inet_cksum_fold(partial), ref)) {
+			printf("split: off %zu len %zu cut %zu: 0x%04hx, should be 0x%04hx\n", off, len, cut,
+			       inet_cksum_fold(partial), ref);
+			errors++;
+		}
+
+		memset(dst, 0, CKSUM_TEST_SIZE);
+		sum = inet_cksum_fold(inet_cksum_copy(dst + doff, src + off, len, 0));
+		if (!cksum_equal(sum, ref) || memcmp(dst + doff, src + off, len) != 0) {
+			printf("copy: off %zu dst off %zu len %zu: 0x%04hx, should be 0x%04hx\n", off, doff, len, sum, ref);
+			errors++;
+		}
+
+		if (cksum_test_update() < 0) {
+			printf("incremental update failed\n");
+			errors++;
+		}
+
+		if (errors > 10)
+			break;
+	}
+
+	free(src);
+	free(dst);
+
+	printf("internet checksum: %s\n", errors ? "FAILED" : "passed");
+
+	return errors ? ERR_GENERIC : 0;
+}
+
+#endif
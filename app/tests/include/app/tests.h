@@ -33,6 +33,8 @@ void float_tests(void);
 void benchmarks(void);
 int fibo(int argc, const cmd_args *argv);
 int spinner(int argc, const cmd_args *argv);
+int tcp_bench(int argc, const cmd_args *argv);
+int cksum_tests(int argc, const cmd_args *argv);
 
 #endif
 
@@ -174,7 +174,9 @@ static int mem_test(int argc, const cmd_args *argv)
 {
     if (argc < 2) {
         printf("not enough arguments\n");
+#if WITH_KERNEL_VMM
 usage:
+#endif
         printf("usage: %s <length>\n", argv[0].str);
         return -1;
     }
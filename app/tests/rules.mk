@@ -13,9 +13,10 @@ MODULE_SRCS += \
 	$(LOCAL_DIR)/benchmarks.c \
 	$(LOCAL_DIR)/float.c \
 	$(LOCAL_DIR)/float_instructions.S \
-	$(LOCAL_DIR)/float_test_vec.c \
 	$(LOCAL_DIR)/fibo.c \
 	$(LOCAL_DIR)/mem_tests.c \
+	$(LOCAL_DIR)/tcp_tests.c \
+	$(LOCAL_DIR)/cksum_tests.c \
 
 MODULE_COMPILEFLAGS += -Wno-format
 
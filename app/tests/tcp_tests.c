@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#if WITH_LIB_MINIP
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+#include <arch/ops.h>
+#include <app/tests.h>
+#include <kernel/thread.h>
+#include <kernel/semaphore.h>
+#include <lib/minip.h>
+#include <platform.h>
+
+#define BENCH_PORT 5001
+#define BENCH_BUFFER_SIZE (64*1024)
+#define BENCH_WRITE_SIZE (16*1024)
+#define BENCH_ZEROCOPY_OUTSTANDING 4
+
+static tcp_socket_t *bench_listen_socket;
+
+/* accept one connection and count everything read from it until it closes */
+static int bench_sink_thread(void *arg)
+{
+	size_t *received = arg;
+	tcp_socket_t *s;
+
+	if (tcp_accept_timeout(bench_listen_socket, &s, 5000) < 0) {
+		printf("tcp bench: accept failed\n");
+		return ERR_TIMED_OUT;
+	}
+
+	uint8_t *buf = malloc(4096);
+	for (;;) {
+		ssize_t len = tcp_read(s, buf, 4096);
+		if (len <= 0)
+			break;
+		*received += len;
+	}
+
+	free(buf);
+	tcp_close(s);
+
+	return 0;
+}
+
+static void bench_zerocopy_done(void *arg, const void *buf, size_t len, status_t err)
+{
+	sem_post(arg, false);
+}
+
+static int tcp_bench_run(size_t total, bool zerocopy)
+{
+	status_t err;
+	size_t received = 0;
+	tcp_socket_t *s = NULL;
+	uint8_t *buf = NULL;
+	semaphore_t zc_sem;
+
+	sem_init(&zc_sem, BENCH_ZEROCOPY_OUTSTANDING);
+
+	err = tcp_open_listen(&bench_listen_socket, BENCH_PORT);
+	if (err < 0) {
+		printf("tcp bench: error %d opening listen socket\n", err);
+		return err;
+	}
+	tcp_set_buffer_sizes(bench_listen_socket, BENCH_BUFFER_SIZE, BENCH_BUFFER_SIZE);
+
+	thread_t *sink = thread_create("tcp bench sink", &bench_sink_thread, &received,
+	                               DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+	thread_resume(sink);
+
+	err = tcp_connect_etc(&s, IPV4_LOOPBACK, BENCH_PORT, BENCH_BUFFER_SIZE, BENCH_BUFFER_SIZE, 5000);
+	if (err < 0) {
+		printf("tcp bench: error %d connecting\n", err);
+		goto out;
+	}
+
+	buf = malloc(BENCH_WRITE_SIZE);
+	memset(buf, 0x99, BENCH_WRITE_SIZE);
+
+	/* the cycle counter is 32 bits, so sum it per write rather than across the whole run */
+	uint64_t cycles = 0;
+	lk_bigtime_t t = current_time_hires();
+
+	for (size_t sent = 0; sent < total; sent += BENCH_WRITE_SIZE) {
+		uint32_t c = arch_cycle_count();
+
+		if (zerocopy) {
+			/* the buffer is never modified, so the same one can be in flight several times */
+			sem_wait(&zc_sem);
+			err = tcp_write_zerocopy(s, buf, BENCH_WRITE_SIZE, &bench_zerocopy_done, &zc_sem);
+		} else {
+			err = tcp_write(s, buf, BENCH_WRITE_SIZE);
+		}
+
+		cycles += arch_cycle_count() - c;
+
+		if (err < 0) {
+			printf("tcp bench: write error %d\n", err);
+			goto out;
+		}
+	}
+
+	/* wait for the last of it to be acked */
+	if (zerocopy) {
+		for (uint i = 0; i < BENCH_ZEROCOPY_OUTSTANDING; i++) {
+			uint32_t c = arch_cycle_count();
+			sem_wait(&zc_sem);
+			cycles += arch_cycle_count() - c;
+		}
+	}
+
+	tcp_close(s);
+	s = NULL;
+	thread_join(sink, NULL, INFINITE_TIME);
+	sink = NULL;
+
+	t = current_time_hires() - t;
+	if (t == 0)
+		t = 1;
+
+	uint64_t bytes_per_sec = (uint64_t)received * 1000000 / t;
+	uint64_t centicycles_per_byte = received ? cycles * 100 / received : 0;
+
+	printf("tcp bench (%s): %zu bytes in %llu usecs, %llu.%02llu MB/s, %llu.%02llu cycles/byte\n",
+	       zerocopy ? "zero copy" : "copy", received, t,
+	       bytes_per_sec / (1024*1024), (bytes_per_sec % (1024*1024)) * 100 / (1024*1024),
+	       centicycles_per_byte / 100, centicycles_per_byte % 100);
+
+out:
+	if (s)
+		tcp_close(s);
+	tcp_close(bench_listen_socket);
+	if (sink)
+		thread_join(sink, NULL, INFINITE_TIME);
+	free(buf);
+	sem_destroy(&zc_sem);
+
+	return err;
+}
+
+int tcp_bench(int argc, const cmd_args *argv)
+{
+	size_t megabytes = 16;
+	bool zerocopy = false;
+
+	if (argc >= 2)
+		megabytes = argv[1].u;
+	if (argc >= 3)
+		zerocopy = !strcmp(argv[2].str, "zerocopy");
+
+	if (megabytes == 0) {
+		printf("usage: %s [megabytes] [copy|zerocopy]\n", argv[0].str);
+		return ERR_INVALID_ARGS;
+	}
+
+	/* loopback still needs the stack and its packet buffers brought up by a network driver */
+	if (minip_get_ipaddr() == IPV4_NONE) {
+		printf("tcp bench: networking is not up\n");
+		return ERR_NOT_READY;
+	}
+
+	return tcp_bench_run(megabytes * 1024 * 1024, zerocopy);
+}
+
+#endif
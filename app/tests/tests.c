@@ -28,17 +28,40 @@
 #if defined(WITH_LIB_CONSOLE)
 #include <lib/console.h>
 
+/* console entry points for the tests that don't take arguments */
+#define TEST_CMD(func) \
+static int func##_cmd(int argc, const cmd_args *argv) \
+{ \
+	func(); \
+	return 0; \
+}
+
+TEST_CMD(printf_tests)
+TEST_CMD(printf_tests_float)
+TEST_CMD(thread_tests)
+TEST_CMD(clock_tests)
+#if ARM_WITH_VFP
+TEST_CMD(float_tests)
+#endif
+TEST_CMD(benchmarks)
+
 STATIC_COMMAND_START
-STATIC_COMMAND("printf_tests", "test printf", (console_cmd)&printf_tests)
-STATIC_COMMAND("printf_tests_float", "test printf with floating point", (console_cmd)&printf_tests_float)
-STATIC_COMMAND("thread_tests", "test the scheduler", (console_cmd)&thread_tests)
-STATIC_COMMAND("clock_tests", "test clocks", (console_cmd)&clock_tests)
+STATIC_COMMAND("printf_tests", "test printf", &printf_tests_cmd)
+STATIC_COMMAND("printf_tests_float", "test printf with floating point", &printf_tests_float_cmd)
+STATIC_COMMAND("thread_tests", "test the scheduler", &thread_tests_cmd)
+STATIC_COMMAND("clock_tests", "test clocks", &clock_tests_cmd)
 #if ARM_WITH_VFP
-STATIC_COMMAND("float_tests", "floating point test", (console_cmd)&float_tests)
+STATIC_COMMAND("float_tests", "floating point test", &float_tests_cmd)
 #endif
-STATIC_COMMAND("bench", "miscellaneous benchmarks", (console_cmd)&benchmarks)
+STATIC_COMMAND("bench", "miscellaneous benchmarks", &benchmarks_cmd)
 STATIC_COMMAND("fibo", "threaded fibonacci", (console_cmd)&fibo)
 STATIC_COMMAND("spinner", "create a spinning thread", (console_cmd)&spinner)
+#if WITH_LIB_MINIP
+STATIC_COMMAND("tcp_bench", "tcp loopback throughput", (console_cmd)&tcp_bench)
+#endif
+#if WITH_LIB_CKSUM
+STATIC_COMMAND("cksum_tests", "test the internet checksum", (console_cmd)&cksum_tests)
+#endif
 STATIC_COMMAND_END(tests);
 
 #endif
@@ -398,6 +398,60 @@ void context_switch_test(void)
 	thread_sleep(100);
 }
 
+static volatile bool context_switch_rate_done;
+
+static int context_switch_rate_tester(void *arg)
+{
+	ulong *count = (ulong *)arg;
+
+	event_wait(&context_switch_event);
+
+	while (!context_switch_rate_done) {
+		thread_yield();
+		(*count)++;
+	}
+
+	return 0;
+}
+
+/* measure scheduler throughput with 1 through SMP_MAX_CPUS threads yielding
+ * as fast as they can */
+static void context_switch_rate_test(void)
+{
+	const lk_time_t duration = 1000;
+
+	for (uint num_threads = 1; num_threads <= SMP_MAX_CPUS; num_threads++) {
+		thread_t *threads[SMP_MAX_CPUS];
+		ulong counts[SMP_MAX_CPUS];
+
+		event_init(&context_switch_event, false, 0);
+		context_switch_rate_done = false;
+
+		for (uint i = 0; i < num_threads; i++) {
+			counts[i] = 0;
+			threads[i] = thread_create("context switch rate", &context_switch_rate_tester, &counts[i], DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+			thread_resume(threads[i]);
+		}
+		thread_sleep(100);
+
+		lk_time_t start = current_time();
+		event_signal(&context_switch_event, true);
+		thread_sleep(duration);
+		context_switch_rate_done = true;
+		lk_time_t elapsed = current_time() - start;
+
+		ulong total = 0;
+		for (uint i = 0; i < num_threads; i++) {
+			thread_join(threads[i], NULL, INFINITE_TIME);
+			total += counts[i];
+		}
+		event_destroy(&context_switch_event);
+
+		printf("%u threads: %lu context switches in %u ms, %lu per second\n",
+		       num_threads, total, (uint)elapsed, (ulong)((uint64_t)total * 1000 / elapsed));
+	}
+}
+
 static volatile int atomic;
 static volatile int atomic_count;
 
@@ -501,6 +555,67 @@ static void preempt_test(void)
 	printf("done with real-time preempt test, above time stamps should be 1 second apart\n");
 }
 
+#if WITH_SMP
+static volatile int priority_spinners_stop;
+static event_t priority_wake_event;
+static lk_bigtime_t priority_wake_time;
+
+static int priority_spinner(void *arg)
+{
+	while (!priority_spinners_stop)
+		;
+
+	return 0;
+}
+
+static int priority_waiter(void *arg)
+{
+	event_wait(&priority_wake_event);
+	priority_wake_time = current_time_hires();
+
+	return 0;
+}
+
+/* with every cpu busy running low priority threads, a high priority thread woken by
+ * a thread that keeps running should preempt one of them rather than wait in line */
+static void priority_preempt_test(void)
+{
+	thread_t *spinners[SMP_MAX_CPUS];
+
+	printf("testing cross cpu preemption by priority\n");
+
+	event_init(&priority_wake_event, false, 0);
+	priority_spinners_stop = 0;
+	priority_wake_time = 0;
+
+	thread_t *waiter = thread_create("priority waiter", &priority_waiter, NULL, HIGH_PRIORITY, DEFAULT_STACK_SIZE);
+	thread_resume(waiter);
+
+	for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+		spinners[i] = thread_create("priority spinner", &priority_spinner, NULL, LOW_PRIORITY, DEFAULT_STACK_SIZE);
+		thread_resume(spinners[i]);
+	}
+	thread_sleep(100);
+
+	/* wake it without giving up this cpu */
+	lk_bigtime_t t = current_time_hires();
+	event_signal(&priority_wake_event, false);
+	spin(50000);
+
+	thread_join(waiter, NULL, INFINITE_TIME);
+	t = priority_wake_time - t;
+
+	priority_spinners_stop = 1;
+	for (uint i = 0; i < SMP_MAX_CPUS; i++)
+		thread_join(spinners[i], NULL, INFINITE_TIME);
+
+	event_destroy(&priority_wake_event);
+
+	printf("high priority thread ran %llu usecs after being woken\n", t);
+	ASSERT(t < 10000);
+}
+#endif
+
 static int join_tester(void *arg)
 {
 	long val = (long)arg;
@@ -575,6 +690,51 @@ static void join_test(void)
 	printf("thread_join returns err %d, retval %d (should be 0 and 55)\n", err, ret);
 }
 
+#if WITH_SMP
+#define SPINLOCK_CONTENTION_COUNT (64*1024)
+
+static spin_lock_t contention_lock;
+static volatile uint contention_counter;
+
+static int spinlock_contention_thread(void *arg)
+{
+    for (uint i = 0; i < SPINLOCK_CONTENTION_COUNT; i++) {
+        spin_lock_saved_state_t state;
+
+        spin_lock_irqsave(&contention_lock, state);
+        contention_counter++;
+        spin_unlock_irqrestore(&contention_lock, state);
+    }
+
+    return 0;
+}
+
+/* hammer one lock from a thread per cpu and make sure no increment is lost */
+static void spinlock_contention_test(void)
+{
+    thread_t *t[SMP_MAX_CPUS];
+
+    printf("testing spinlock under contention from %u threads\n", SMP_MAX_CPUS);
+
+    spin_lock_init(&contention_lock);
+    spin_lock_stats_register(&contention_lock, "contention test");
+    contention_counter = 0;
+
+    uint32_t c = arch_cycle_count();
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        t[i] = thread_create("spinlock contention", &spinlock_contention_thread, NULL, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        thread_resume(t[i]);
+    }
+    for (uint i = 0; i < SMP_MAX_CPUS; i++)
+        thread_join(t[i], NULL, INFINITE_TIME);
+    c = arch_cycle_count() - c;
+
+    printf("counter %u (should be %u), %u cycles\n",
+           contention_counter, SMP_MAX_CPUS * SPINLOCK_CONTENTION_COUNT, c);
+    ASSERT(contention_counter == SMP_MAX_CPUS * SPINLOCK_CONTENTION_COUNT);
+}
+#endif
+
 static void spinlock_test(void)
 {
     spin_lock_saved_state_t state;
@@ -613,6 +773,10 @@ static void spinlock_test(void)
 
     printf("%u cycles to acquire/release lock w/irqsave %u times (%u cycles per)\n", c, COUNT, c / COUNT);
 #undef COUNT
+
+#if WITH_SMP
+    spinlock_contention_test();
+#endif
 }
 
 int thread_tests(void)
@@ -626,8 +790,12 @@ int thread_tests(void)
 
 	thread_sleep(200);
 	context_switch_test();
+	context_switch_rate_test();
 
 	preempt_test();
+#if WITH_SMP
+	priority_preempt_test();
+#endif
 
 	join_test();
 
@@ -61,7 +61,7 @@ static void spinlock_test(void);
 static void spinlock_test_secondary(void);
 
 #if WITH_SMP
-/* smp boot lock */
+/* smp boot lock, polled directly by start.S so it is always the arch lock */
 spin_lock_t arm_boot_cpu_lock = 1;
 volatile int secondaries_to_init = 0;
 #endif
@@ -131,7 +131,7 @@ void arch_init(void)
 	dprintf(SPEW, "releasing %d secondary cpu%c\n", secondaries_to_init, secondaries_to_init > 1 ? 's' : ' ');
 
 	/* release the secondary cpus */
-	spin_unlock(&arm_boot_cpu_lock);
+	arch_spin_unlock(&arm_boot_cpu_lock);
 
 	/* flush the release of the lock, since the secondary cpus are running without cache on */
 	arch_clean_cache_range((addr_t)&arm_boot_cpu_lock, sizeof(arm_boot_cpu_lock));
@@ -136,6 +136,60 @@ static uint32_t mmu_flags_to_l2_arch_flags(uint flags)
     return arch_flags;
 }
 
+/* the attribute bits a section or supersection descriptor carries besides its address */
+#define MMU_MEMORY_L1_SECTION_ATTR_MASK \
+    (MMU_MEMORY_L1_SECTION_NON_SECURE | MMU_MEMORY_L1_SECTION_NON_GLOBAL | \
+     MMU_MEMORY_L1_SECTION_SHAREABLE | MMU_MEMORY_L1_AP_MASK | (0x7 << 12) | \
+     (0x3 << 2) | MMU_MEMORY_L1_SECTION_XN)
+
+/* the bits small and large page descriptors share: nG, S, AP[2], AP[1:0], C and B */
+#define MMU_MEMORY_L2_COMMON_ATTR_MASK ((0x7 << 9) | (0xf << 2))
+
+/* convert the attributes of a section or supersection to a small page with the same ones */
+static uint32_t l1_section_to_l2_small_page_flags(uint32_t tt_entry)
+{
+    uint32_t arch_flags = MMU_MEMORY_L2_DESCRIPTOR_SMALL_PAGE;
+
+    arch_flags |= tt_entry & (0x3 << 2);
+    arch_flags |= ((tt_entry >> 12) & 0x7) << MMU_MEMORY_L2_TEX_SHIFT;
+    arch_flags |= ((tt_entry >> 10) & 0x3) << 4;
+    if (tt_entry & (1 << 15))
+        arch_flags |= (1 << 9);
+    if (tt_entry & MMU_MEMORY_L1_SECTION_SHAREABLE)
+        arch_flags |= MMU_MEMORY_L2_SHAREABLE;
+    if (tt_entry & MMU_MEMORY_L1_SECTION_NON_GLOBAL)
+        arch_flags |= MMU_MEMORY_L2_NON_GLOBAL;
+    if (tt_entry & MMU_MEMORY_L1_SECTION_XN)
+        arch_flags |= MMU_MEMORY_L2_DESCRIPTOR_SMALL_PAGE_XN;
+
+    return arch_flags;
+}
+
+/* large pages keep TEX and XN in different bits than small pages, the rest lines up */
+static uint32_t l2_small_to_large_page_flags(uint32_t l2_entry)
+{
+    uint32_t arch_flags = MMU_MEMORY_L2_DESCRIPTOR_LARGE_PAGE;
+
+    arch_flags |= l2_entry & MMU_MEMORY_L2_COMMON_ATTR_MASK;
+    arch_flags |= ((l2_entry >> MMU_MEMORY_L2_TEX_SHIFT) & 0x7) << MMU_MEMORY_L2_LARGE_PAGE_TEX_SHIFT;
+    if ((l2_entry & MMU_MEMORY_L2_DESCRIPTOR_MASK) == MMU_MEMORY_L2_DESCRIPTOR_SMALL_PAGE_XN)
+        arch_flags |= MMU_MEMORY_L2_LARGE_PAGE_XN;
+
+    return arch_flags;
+}
+
+static uint32_t l2_large_to_small_page_flags(uint32_t l2_entry)
+{
+    uint32_t arch_flags = MMU_MEMORY_L2_DESCRIPTOR_SMALL_PAGE;
+
+    arch_flags |= l2_entry & MMU_MEMORY_L2_COMMON_ATTR_MASK;
+    arch_flags |= ((l2_entry >> MMU_MEMORY_L2_LARGE_PAGE_TEX_SHIFT) & 0x7) << MMU_MEMORY_L2_TEX_SHIFT;
+    if (l2_entry & MMU_MEMORY_L2_LARGE_PAGE_XN)
+        arch_flags |= MMU_MEMORY_L2_DESCRIPTOR_SMALL_PAGE_XN;
+
+    return arch_flags;
+}
+
 static void arm_mmu_map_section(addr_t paddr, addr_t vaddr, uint flags)
 {
     int index;
@@ -157,6 +211,27 @@ static void arm_mmu_map_section(addr_t paddr, addr_t vaddr, uint flags)
     arm_kernel_translation_table[index] = (paddr & ~(MB-1)) | (MMU_MEMORY_DOMAIN_MEM << 5) | MMU_MEMORY_L1_DESCRIPTOR_SECTION | flags;
 }
 
+static void arm_mmu_map_supersection(addr_t paddr, addr_t vaddr, uint flags)
+{
+    uint index;
+
+    LTRACEF("pa 0x%lx va 0x%lx flags 0x%x\n", paddr, vaddr, flags);
+
+    DEBUG_ASSERT(IS_SUPERSECTION_ALIGNED(paddr));
+    DEBUG_ASSERT(IS_SUPERSECTION_ALIGNED(vaddr));
+    DEBUG_ASSERT((flags & MMU_MEMORY_L1_DESCRIPTOR_SUPERSECTION) == MMU_MEMORY_L1_DESCRIPTOR_SUPERSECTION);
+
+    /* Get the index into the translation table */
+    index = vaddr / SECTION_SIZE;
+
+    /* The same descriptor goes in all 16 entries the supersection covers.
+     * There is no domain field, bits 8:5 hold the extended base address
+     * which stays 0.
+     */
+    for (uint i = 0; i < SUPERSECTION_SIZE / SECTION_SIZE; i++)
+        arm_kernel_translation_table[index + i] = MMU_MEMORY_L1_SUPERSECTION_ADDR(paddr) | flags;
+}
+
 static void arm_mmu_unmap_l1_entry(uint32_t index)
 {
     DEBUG_ASSERT(index < countof(arm_kernel_translation_table));
@@ -172,6 +247,43 @@ static void arm_mmu_unmap_section(addr_t vaddr)
     arm_mmu_unmap_l1_entry(vaddr / SECTION_SIZE);
 }
 
+/* invalidate up to this many addresses one by one per map or unmap, past that flush the whole tlb */
+#ifndef ARM_TLB_BATCH_MAX
+#define ARM_TLB_BATCH_MAX 32
+#endif
+
+/* tlb invalidations collected over a map or unmap and issued together at the end */
+struct arm_tlb_batch {
+    uint count;
+    vaddr_t vaddr[ARM_TLB_BATCH_MAX];
+};
+
+/* one call per translation entry removed or replaced, sections and large pages only need one */
+static void arm_tlb_batch_add(struct arm_tlb_batch *tlb, vaddr_t vaddr)
+{
+    if (tlb->count < ARM_TLB_BATCH_MAX)
+        tlb->vaddr[tlb->count] = vaddr;
+    tlb->count++;
+}
+
+static void arm_tlb_batch_flush(struct arm_tlb_batch *tlb)
+{
+    /* table updates have to be visible to the walker before the old entries go */
+    DSB;
+    if (tlb->count == 0)
+        return;
+
+    if (tlb->count > ARM_TLB_BATCH_MAX) {
+        arm_invalidate_tlb_global_no_barrier();
+    } else {
+        for (uint i = 0; i < tlb->count; i++)
+            arm_invalidate_tlb_mva_no_barrier(tlb->vaddr[i]);
+    }
+    arm_after_invalidate_tlb_barrier();
+
+    tlb->count = 0;
+}
+
 void arm_mmu_early_init(void)
 {
 }
@@ -218,14 +330,17 @@ status_t arch_mmu_query(vaddr_t vaddr, paddr_t *paddr, uint *flags)
         case MMU_MEMORY_L1_DESCRIPTOR_INVALID:
             return ERR_NOT_FOUND;
         case MMU_MEMORY_L1_DESCRIPTOR_SECTION:
-            if (tt_entry & (1<<18)) {
-                /* supersection */
-                PANIC_UNIMPLEMENTED;
+            if (paddr) {
+                if (tt_entry & (1<<18)) {
+                    /* supersection */
+                    *paddr = MMU_MEMORY_L1_SUPERSECTION_ADDR(tt_entry) + (vaddr & (SUPERSECTION_SIZE - 1));
+                } else {
+                    /* section */
+                    *paddr = MMU_MEMORY_L1_SECTION_ADDR(tt_entry) + (vaddr & (SECTION_SIZE - 1));
+                }
             }
 
-            /* section */
-            if (paddr)
-                *paddr = MMU_MEMORY_L1_SECTION_ADDR(tt_entry) + (vaddr & (SECTION_SIZE - 1));
+            /* both keep their attributes in the same bits */
 
             if (flags) {
                 *flags = 0;
@@ -265,12 +380,17 @@ status_t arch_mmu_query(vaddr_t vaddr, paddr_t *paddr, uint *flags)
                 case MMU_MEMORY_L2_DESCRIPTOR_INVALID:
                     return ERR_NOT_FOUND;
                 case MMU_MEMORY_L2_DESCRIPTOR_LARGE_PAGE:
-                    PANIC_UNIMPLEMENTED;
-                    break;
                 case MMU_MEMORY_L2_DESCRIPTOR_SMALL_PAGE:
                 case MMU_MEMORY_L2_DESCRIPTOR_SMALL_PAGE_XN:
-                    if (paddr)
+                    if ((l2_entry & MMU_MEMORY_L2_DESCRIPTOR_MASK) == MMU_MEMORY_L2_DESCRIPTOR_LARGE_PAGE) {
+                        if (paddr)
+                            *paddr = MMU_MEMORY_L2_LARGE_PAGE_ADDR(l2_entry) + (vaddr & (LARGE_PAGE_SIZE - 1));
+
+                        /* decode the attributes as the equivalent small page */
+                        l2_entry = l2_large_to_small_page_flags(l2_entry);
+                    } else if (paddr) {
                         *paddr = MMU_MEMORY_L2_SMALL_PAGE_ADDR(l2_entry);
+                    }
 
                     if (flags) {
                         *flags = 0;
@@ -380,6 +500,104 @@ static void put_l2_table(uint32_t l1_index, paddr_t l2_pa)
     pmm_free_page(page);
 }
 
+/* replace the supersection covering l1_index with the 16 sections it is made of */
+static void arm_mmu_split_supersection(uint32_t l1_index, struct arm_tlb_batch *tlb)
+{
+    uint32_t base = ROUNDDOWN(l1_index, SUPERSECTION_SIZE / SECTION_SIZE);
+    uint32_t tt_entry = arm_kernel_translation_table[base];
+
+    DEBUG_ASSERT((tt_entry & MMU_MEMORY_L1_DESCRIPTOR_SUPERSECTION) == MMU_MEMORY_L1_DESCRIPTOR_SUPERSECTION);
+
+    paddr_t pa = MMU_MEMORY_L1_SUPERSECTION_ADDR(tt_entry);
+    uint flags = (tt_entry & MMU_MEMORY_L1_SECTION_ATTR_MASK) | MMU_MEMORY_L1_DESCRIPTOR_SECTION;
+
+    LTRACEF("l1 index %u pa 0x%lx\n", base, pa);
+
+    for (uint i = 0; i < SUPERSECTION_SIZE / SECTION_SIZE; i++)
+        arm_mmu_map_section(pa + i * SECTION_SIZE, (vaddr_t)(base + i) * SECTION_SIZE, flags);
+
+    arm_tlb_batch_add(tlb, (vaddr_t)base * SECTION_SIZE);
+}
+
+/* replace the section at l1_index with a L2 table of small pages mapping the same memory */
+static status_t arm_mmu_split_section(uint32_t l1_index, struct arm_tlb_batch *tlb)
+{
+    uint32_t tt_entry = arm_kernel_translation_table[l1_index];
+
+    DEBUG_ASSERT((tt_entry & MMU_MEMORY_L1_DESCRIPTOR_MASK) == MMU_MEMORY_L1_DESCRIPTOR_SECTION);
+
+    paddr_t l2_pa = 0;
+    status_t err = get_l2_table(l1_index, &l2_pa);
+    if (err < 0)
+        return err;
+
+    if ((tt_entry & MMU_MEMORY_L1_DESCRIPTOR_SUPERSECTION) == MMU_MEMORY_L1_DESCRIPTOR_SUPERSECTION) {
+        arm_mmu_split_supersection(l1_index, tlb);
+        tt_entry = arm_kernel_translation_table[l1_index];
+    }
+
+    uint32_t *l2_table = paddr_to_kvaddr(l2_pa);
+    paddr_t pa = MMU_MEMORY_L1_SECTION_ADDR(tt_entry);
+    uint arch_flags = l1_section_to_l2_small_page_flags(tt_entry);
+
+    LTRACEF("l1 index %u pa 0x%lx l2 table 0x%lx\n", l1_index, pa, l2_pa);
+
+    for (uint i = 0; i < SECTION_SIZE / PAGE_SIZE; i++)
+        l2_table[i] = (pa + i * PAGE_SIZE) | arch_flags;
+
+    /* the table has to be complete before the walker can find it */
+    DSB;
+
+    uint32_t new_entry = l2_pa | MMU_MEMORY_L1_DESCRIPTOR_PAGE_TABLE;
+    if (tt_entry & MMU_MEMORY_L1_SECTION_NON_SECURE)
+        new_entry |= MMU_MEMORY_L1_PAGETABLE_NON_SECURE;
+
+    arm_kernel_translation_table[l1_index] = new_entry;
+    arm_tlb_batch_add(tlb, (vaddr_t)l1_index * SECTION_SIZE);
+
+    return NO_ERROR;
+}
+
+/* replace the large page covering l2_index with the 16 small pages it is made of */
+static void arm_mmu_split_large_page(uint32_t *l2_table, uint l2_index, vaddr_t vaddr,
+                                     struct arm_tlb_batch *tlb)
+{
+    uint base = ROUNDDOWN(l2_index, LARGE_PAGE_SIZE / PAGE_SIZE);
+    uint32_t l2_entry = l2_table[base];
+
+    DEBUG_ASSERT((l2_entry & MMU_MEMORY_L2_DESCRIPTOR_MASK) == MMU_MEMORY_L2_DESCRIPTOR_LARGE_PAGE);
+
+    paddr_t pa = MMU_MEMORY_L2_LARGE_PAGE_ADDR(l2_entry);
+    uint arch_flags = l2_large_to_small_page_flags(l2_entry);
+
+    for (uint i = 0; i < LARGE_PAGE_SIZE / PAGE_SIZE; i++)
+        l2_table[base + i] = (pa + i * PAGE_SIZE) | arch_flags;
+
+    arm_tlb_batch_add(tlb, ROUNDDOWN(vaddr, LARGE_PAGE_SIZE));
+}
+
+/* a supersection can only go where none of the 16 entries point to L2 tables */
+static bool l1_can_map_supersection(uint32_t l1_index)
+{
+    for (uint i = 0; i < SUPERSECTION_SIZE / SECTION_SIZE; i++) {
+        if ((arm_kernel_translation_table[l1_index + i] & MMU_MEMORY_L1_DESCRIPTOR_MASK)
+                == MMU_MEMORY_L1_DESCRIPTOR_PAGE_TABLE)
+            return false;
+    }
+    return true;
+}
+
+/* a large page can only go where none of the 16 entries are small pages */
+static bool l2_can_map_large_page(const uint32_t *l2_table, uint l2_index)
+{
+    for (uint i = 0; i < LARGE_PAGE_SIZE / PAGE_SIZE; i++) {
+        uint32_t type = l2_table[l2_index + i] & MMU_MEMORY_L2_DESCRIPTOR_MASK;
+        if (type != MMU_MEMORY_L2_DESCRIPTOR_INVALID && type != MMU_MEMORY_L2_DESCRIPTOR_LARGE_PAGE)
+            return false;
+    }
+    return true;
+}
+
 #if WITH_ARCH_MMU_PICK_SPOT
 
 static inline bool are_regions_compatible(uint new_region_flags,
@@ -447,16 +665,48 @@ int arch_mmu_map(vaddr_t vaddr, paddr_t paddr, uint count, uint flags)
     if (count == 0)
         return NO_ERROR;
 
+    struct arm_tlb_batch tlb = { 0 };
+
     /* see what kind of mapping we can use */
     int mapped = 0;
     while (count > 0) {
-        if (IS_SECTION_ALIGNED(vaddr) && IS_SECTION_ALIGNED(paddr) && count >= SECTION_SIZE / PAGE_SIZE) {
+        uint l1_index = vaddr / SECTION_SIZE;
+        uint32_t tt_entry = arm_kernel_translation_table[l1_index];
+
+        if (IS_SUPERSECTION_ALIGNED(vaddr) && IS_SUPERSECTION_ALIGNED(paddr) &&
+                count >= SUPERSECTION_SIZE / PAGE_SIZE && l1_can_map_supersection(l1_index)) {
+            /* we can use a supersection */
+
+            /* compute the arch flags for L1 supersections */
+            uint arch_flags = mmu_flags_to_l1_arch_flags(flags) |
+                MMU_MEMORY_L1_DESCRIPTOR_SUPERSECTION;
+
+            /* anything we are replacing has to go from the tlb */
+            for (uint i = 0; i < SUPERSECTION_SIZE / SECTION_SIZE; i++) {
+                if (arm_kernel_translation_table[l1_index + i])
+                    arm_tlb_batch_add(&tlb, vaddr + i * SECTION_SIZE);
+            }
+
+            /* map it */
+            arm_mmu_map_supersection(paddr, vaddr, arch_flags);
+            count -= SUPERSECTION_SIZE / PAGE_SIZE;
+            mapped += SUPERSECTION_SIZE / PAGE_SIZE;
+            vaddr += SUPERSECTION_SIZE;
+            paddr += SUPERSECTION_SIZE;
+        } else if (IS_SECTION_ALIGNED(vaddr) && IS_SECTION_ALIGNED(paddr) && count >= SECTION_SIZE / PAGE_SIZE &&
+                (tt_entry & MMU_MEMORY_L1_DESCRIPTOR_MASK) != MMU_MEMORY_L1_DESCRIPTOR_PAGE_TABLE) {
             /* we can use a section */
 
             /* compute the arch flags for L1 sections */
             uint arch_flags = mmu_flags_to_l1_arch_flags(flags) |
                 MMU_MEMORY_L1_DESCRIPTOR_SECTION;
 
+            /* a single section can't be replaced inside a supersection */
+            if ((tt_entry & MMU_MEMORY_L1_DESCRIPTOR_SUPERSECTION) == MMU_MEMORY_L1_DESCRIPTOR_SUPERSECTION)
+                arm_mmu_split_supersection(l1_index, &tlb);
+            else if (tt_entry)
+                arm_tlb_batch_add(&tlb, vaddr);
+
             /* map it */
             arm_mmu_map_section(paddr, vaddr, arch_flags);
             count -= SECTION_SIZE / PAGE_SIZE;
@@ -465,14 +715,14 @@ int arch_mmu_map(vaddr_t vaddr, paddr_t paddr, uint count, uint flags)
             paddr += SECTION_SIZE;
         } else {
             /* will have to use a L2 mapping */
-            uint l1_index = vaddr / SECTION_SIZE;
-            uint32_t tt_entry = arm_kernel_translation_table[l1_index];
-
             LTRACEF("tt_entry 0x%x\n", tt_entry);
             switch (tt_entry & MMU_MEMORY_L1_DESCRIPTOR_MASK) {
                 case MMU_MEMORY_L1_DESCRIPTOR_SECTION:
-                    // XXX will have to break L1 mapping into a L2 page table
-                    PANIC_UNIMPLEMENTED;
+                    /* break the section into a L2 page table and go around again */
+                    if (arm_mmu_split_section(l1_index, &tlb) != NO_ERROR) {
+                        TRACEF("failed to allocate pagetable\n");
+                        goto done;
+                    }
                     break;
                 case MMU_MEMORY_L1_DESCRIPTOR_INVALID: {
                     paddr_t l2_pa = 0;
@@ -493,14 +743,34 @@ int arch_mmu_map(vaddr_t vaddr, paddr_t paddr, uint count, uint flags)
 
                     DEBUG_ASSERT(l2_table);
 
-                    // XXX handle 64K pages here
-
-                    /* compute the arch flags for L2 4K pages */
+                    /* compute the arch flags for L2 4K and 64K pages */
                     uint arch_flags = mmu_flags_to_l2_arch_flags(flags) |
                         MMU_MEMORY_L2_DESCRIPTOR_SMALL_PAGE;
+                    uint large_arch_flags = l2_small_to_large_page_flags(arch_flags);
 
                     uint l2_index = (vaddr % SECTION_SIZE) / PAGE_SIZE;
                     do {
+                        if (IS_ALIGNED(vaddr, LARGE_PAGE_SIZE) && IS_ALIGNED(paddr, LARGE_PAGE_SIZE) &&
+                                count >= LARGE_PAGE_SIZE / PAGE_SIZE &&
+                                l2_can_map_large_page(l2_table, l2_index)) {
+                            /* a 64K page, the same descriptor goes in all 16 entries */
+                            if (l2_table[l2_index])
+                                arm_tlb_batch_add(&tlb, vaddr);
+
+                            for (uint i = 0; i < LARGE_PAGE_SIZE / PAGE_SIZE; i++)
+                                l2_table[l2_index++] = MMU_MEMORY_L2_LARGE_PAGE_ADDR(paddr) | large_arch_flags;
+                            count -= LARGE_PAGE_SIZE / PAGE_SIZE;
+                            mapped += LARGE_PAGE_SIZE / PAGE_SIZE;
+                            vaddr += LARGE_PAGE_SIZE;
+                            paddr += LARGE_PAGE_SIZE;
+                            continue;
+                        }
+
+                        if ((l2_table[l2_index] & MMU_MEMORY_L2_DESCRIPTOR_MASK) == MMU_MEMORY_L2_DESCRIPTOR_LARGE_PAGE)
+                            arm_mmu_split_large_page(l2_table, l2_index, vaddr, &tlb);
+                        if (l2_table[l2_index])
+                            arm_tlb_batch_add(&tlb, vaddr);
+
                         l2_table[l2_index++] = paddr | arch_flags;
                         count--;
                         mapped++;
@@ -516,7 +786,7 @@ int arch_mmu_map(vaddr_t vaddr, paddr_t paddr, uint count, uint flags)
     }
 
 done:
-    DSB;
+    arm_tlb_batch_flush(&tlb);
     return mapped;
 }
 
@@ -528,6 +798,8 @@ int arch_mmu_unmap(vaddr_t vaddr, uint count)
 
     LTRACEF("vaddr 0x%lx count %u\n", vaddr, count);
 
+    struct arm_tlb_batch tlb = { 0 };
+
     int unmapped = 0;
     while (count > 0) {
         uint l1_index = vaddr / SECTION_SIZE;
@@ -542,34 +814,61 @@ int arch_mmu_unmap(vaddr_t vaddr, uint count)
                 break;
             }
             case MMU_MEMORY_L1_DESCRIPTOR_SECTION:
-                if (IS_SECTION_ALIGNED(vaddr) && count >= SECTION_SIZE / PAGE_SIZE) {
+                if ((tt_entry & MMU_MEMORY_L1_DESCRIPTOR_SUPERSECTION) == MMU_MEMORY_L1_DESCRIPTOR_SUPERSECTION) {
+                    if (IS_SUPERSECTION_ALIGNED(vaddr) && count >= SUPERSECTION_SIZE / PAGE_SIZE) {
+                        /* the whole supersection goes, zero out all 16 copies of it */
+                        for (uint i = 0; i < SUPERSECTION_SIZE / SECTION_SIZE; i++)
+                            arm_kernel_translation_table[l1_index + i] = 0;
+                        arm_tlb_batch_add(&tlb, vaddr);
+
+                        vaddr += SUPERSECTION_SIZE;
+                        count -= SUPERSECTION_SIZE / PAGE_SIZE;
+                        unmapped += SUPERSECTION_SIZE / PAGE_SIZE;
+                    } else {
+                        /* break it into sections and go around again */
+                        arm_mmu_split_supersection(l1_index, &tlb);
+                    }
+                } else if (IS_SECTION_ALIGNED(vaddr) && count >= SECTION_SIZE / PAGE_SIZE) {
                     /* we're asked to remove at least all of this section, so just zero it out */
-                    // XXX test for supersection
-                    arm_mmu_unmap_section(vaddr);
+                    arm_kernel_translation_table[l1_index] = 0;
+                    arm_tlb_batch_add(&tlb, vaddr);
 
                     vaddr += SECTION_SIZE;
                     count -= SECTION_SIZE / PAGE_SIZE;
                     unmapped += SECTION_SIZE / PAGE_SIZE;
                 } else {
-                    // XXX handle unmapping just part of a section
-                    // will need to convert to a L2 table and then unmap the parts we are asked to
-                    PANIC_UNIMPLEMENTED;
+                    /* only part of the section goes, convert it to a L2 table and go around again */
+                    if (arm_mmu_split_section(l1_index, &tlb) != NO_ERROR) {
+                        TRACEF("failed to allocate pagetable\n");
+                        goto done;
+                    }
                 }
                 break;
             case MMU_MEMORY_L1_DESCRIPTOR_PAGE_TABLE: {
                 uint32_t *l2_table = paddr_to_kvaddr(MMU_MEMORY_L1_PAGE_TABLE_ADDR(tt_entry));
                 uint page_idx = (vaddr % SECTION_SIZE) / PAGE_SIZE;
                 uint page_cnt = MIN((SECTION_SIZE / PAGE_SIZE) - page_idx, count);
+                uint page_end = page_idx + page_cnt;
+
+                /* 64K pages hanging over either end of the run have to be broken up first */
+                if (!IS_ALIGNED(page_idx, LARGE_PAGE_SIZE / PAGE_SIZE) &&
+                        (l2_table[page_idx] & MMU_MEMORY_L2_DESCRIPTOR_MASK) == MMU_MEMORY_L2_DESCRIPTOR_LARGE_PAGE)
+                    arm_mmu_split_large_page(l2_table, page_idx, vaddr, &tlb);
+                if (!IS_ALIGNED(page_end, LARGE_PAGE_SIZE / PAGE_SIZE) &&
+                        (l2_table[page_end - 1] & MMU_MEMORY_L2_DESCRIPTOR_MASK) == MMU_MEMORY_L2_DESCRIPTOR_LARGE_PAGE)
+                    arm_mmu_split_large_page(l2_table, page_end - 1, vaddr + (page_cnt - 1) * PAGE_SIZE, &tlb);
 
                 /* unmap page run */
                 for (uint i = 0; i < page_cnt; i++) {
-                    l2_table[page_idx++] = 0;
-                }
-                DSB;
+                    uint32_t l2_entry = l2_table[page_idx];
+                    l2_table[page_idx] = 0;
 
-                /* invalidate tlb */
-                for (uint i = 0; i < page_cnt; i++) {
-                    arm_invalidate_tlb_mva_no_barrier(vaddr);
+                    /* a 64K page is a single tlb entry */
+                    if (l2_entry && ((l2_entry & MMU_MEMORY_L2_DESCRIPTOR_MASK) != MMU_MEMORY_L2_DESCRIPTOR_LARGE_PAGE ||
+                            IS_ALIGNED(page_idx, LARGE_PAGE_SIZE / PAGE_SIZE)))
+                        arm_tlb_batch_add(&tlb, vaddr);
+
+                    page_idx++;
                     vaddr += PAGE_SIZE;
                 }
                 count -= page_cnt;
@@ -590,7 +889,11 @@ int arch_mmu_unmap(vaddr_t vaddr, uint count)
                 }
                 if (!page_cnt) {
                     /* we can kill l1 entry */
-                    arm_mmu_unmap_l1_entry(l1_index);
+                    arm_kernel_translation_table[l1_index] = 0;
+                    arm_tlb_batch_add(&tlb, (vaddr_t)l1_index * SECTION_SIZE);
+
+                    /* the walker may hold on to the table until the tlb is flushed */
+                    arm_tlb_batch_flush(&tlb);
 
                     /* try to free l2 page itself */
                     put_l2_table(l1_index, MMU_MEMORY_L1_PAGE_TABLE_ADDR(tt_entry));
@@ -599,11 +902,13 @@ int arch_mmu_unmap(vaddr_t vaddr, uint count)
             }
 
             default:
-                // XXX not implemented supersections or L2 tables
+                /* reserved descriptor type, never set up by arch_mmu_map */
                 PANIC_UNIMPLEMENTED;
         }
     }
-    arm_after_invalidate_tlb_barrier();
+
+done:
+    arm_tlb_batch_flush(&tlb);
     return unmapped;
 }
 
@@ -27,6 +27,7 @@
 #define MB                (1024U*1024U)
 #define SECTION_SIZE      MB
 #define SUPERSECTION_SIZE (16 * MB)
+#define LARGE_PAGE_SIZE   (64 * 1024U)
 
 #if defined(ARM_ISA_ARMV6) | defined(ARM_ISA_ARMV7)
 
@@ -113,9 +114,11 @@
 
 #define MMU_MEMORY_L2_SHAREABLE             (1 << 10)
 #define MMU_MEMORY_L2_NON_GLOBAL            (1 << 11)
+#define MMU_MEMORY_L2_LARGE_PAGE_XN         (1 << 15)
 
 #define MMU_MEMORY_L2_CB_SHIFT              2
 #define MMU_MEMORY_L2_TEX_SHIFT             6
+#define MMU_MEMORY_L2_LARGE_PAGE_TEX_SHIFT  12
 
 #define MMU_MEMORY_NON_CACHEABLE            0
 #define MMU_MEMORY_WRITE_BACK_ALLOCATE      1
@@ -127,6 +130,7 @@
 #define MMU_MEMORY_SET_L2_CACHEABLE_MEM     (0x4 << MMU_MEMORY_L2_TEX_SHIFT)
 
 #define MMU_MEMORY_L1_SECTION_ADDR(x)       ((x) & ~((1<<20)-1))
+#define MMU_MEMORY_L1_SUPERSECTION_ADDR(x)  ((x) & ~((1<<24)-1))
 #define MMU_MEMORY_L1_PAGE_TABLE_ADDR(x)    ((x) & ~((1<<10)-1))
 
 #define MMU_MEMORY_L2_SMALL_PAGE_ADDR(x)    ((x) & ~((1<<12)-1))
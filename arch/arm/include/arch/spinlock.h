@@ -48,6 +48,17 @@ void arch_spin_lock(spin_lock_t *lock);
 int arch_spin_trylock(spin_lock_t *lock);
 void arch_spin_unlock(spin_lock_t *lock);
 
+/* waiters sleep in wfe until a release sends an event */
+static inline void arch_spinloop_pause(void)
+{
+    __asm__ volatile("wfe");
+}
+
+static inline void arch_spinloop_signal(void)
+{
+    __asm__ volatile("dsb; sev" ::: "memory");
+}
+
 #else
 
 static inline void arch_spin_lock(spin_lock_t *lock)
@@ -21,13 +21,27 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 #include <debug.h>
+#include <trace.h>
 #include <arch.h>
 #include <arch/ops.h>
 #include <arch/arm64.h>
 #include <arch/arm64/mmu.h>
+#include <arch/mp.h>
+#include <kernel/thread.h>
+#include <lk/init.h>
+#include <lk/main.h>
 #include <platform.h>
 
-void arch_early_init(void)
+#define LOCAL_TRACE 0
+
+#if WITH_SMP
+/* smp boot lock, starts out held so it is always the arch lock whatever spin_lock() is built as */
+static spin_lock_t arm64_boot_cpu_lock = 1;
+static volatile int secondaries_to_init = 0;
+#endif
+
+/* per cpu setup shared between the boot cpu and the secondaries */
+static void arm64_cpu_early_init(void)
 {
     /* set the vector base */
     ARM64_WRITE_SYSREG(VBAR_EL1, (uint64_t)&arm64_exception_base);
@@ -38,12 +52,75 @@ void arch_early_init(void)
         arm64_el3_to_el1();
     }
 
+    /* the kernel is built without fp, but leave the simd unit usable by the few
+     * hand written assembly routines that want it */
+    ARM64_WRITE_SYSREG(CPACR_EL1, (uint64_t)3 << 20);
+}
+
+void arch_early_init(void)
+{
+    arm64_cpu_early_init();
+
     platform_init_mmu_mappings();
 }
 
 void arch_init(void)
 {
+#if WITH_SMP
+    arch_mp_init_percpu();
+
+    LTRACEF("midr_el1 0x%llx\n", ARM64_READ_SYSREG(midr_el1));
+
+    uint count = secondaries_to_init;
+
+    lk_init_secondary_cpus(count);
+
+    dprintf(SPEW, "releasing %u secondary cpu%c\n", count, count != 1 ? 's' : ' ');
+
+    /* release the secondary cpus */
+    arch_spin_unlock(&arm64_boot_cpu_lock);
+
+    /* wait for all of the secondary cpus to boot */
+    while (secondaries_to_init > 0) {
+        __asm__ volatile("wfe");
+    }
+#endif
+}
+
+#if WITH_SMP
+void arm64_set_secondary_cpu_count(int count)
+{
+    secondaries_to_init = count;
+}
+
+/* called from start.S on each secondary cpu, running on its own boot stack */
+void arm64_secondary_entry(ulong asm_cpu_num)
+{
+    uint cpu = arch_curr_cpu_num();
+    if (cpu != asm_cpu_num)
+        return;
+
+    arm64_cpu_early_init();
+
+    /* wait for the boot cpu to release us */
+    arch_spin_lock(&arm64_boot_cpu_lock);
+    arch_spin_unlock(&arm64_boot_cpu_lock);
+
+    /* run early secondary cpu init routines up to the threading level */
+    lk_init_level(LK_INIT_FLAG_SECONDARY_CPUS, LK_INIT_LEVEL_EARLIEST, LK_INIT_LEVEL_THREADING - 1);
+
+    arch_mp_init_percpu();
+
+    LTRACEF("cpu num %u\n", cpu);
+
+    /* we're done, tell the main cpu we're up */
+    atomic_add(&secondaries_to_init, -1);
+    smp_mb();
+    __asm__ volatile("sev");
+
+    lk_secondary_cpu_entry();
 }
+#endif
 
 void arch_quiesce(void)
 {
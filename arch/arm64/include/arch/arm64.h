@@ -65,5 +65,8 @@ struct arm64_iframe_short {
 extern void arm64_exception_base(void);
 void arm64_el3_to_el1(void);
 
+/* number of secondary cpus the platform started, they are released in arch_init */
+void arm64_set_secondary_cpu_count(int count);
+
 __END_CDECLS
 
@@ -25,17 +25,42 @@
 #include <arch/ops.h>
 #include <stdbool.h>
 
-#if WITH_SMP
-#error arm64 does not support SMP
-#endif
-
 #define SPIN_LOCK_INITIAL_VALUE (0)
 
-typedef unsigned int spin_lock_t;
+typedef unsigned long spin_lock_t;
 
 typedef unsigned int spin_lock_saved_state_t;
 typedef unsigned int spin_lock_save_flags_t;
 
+static inline void arch_spin_lock_init(spin_lock_t *lock)
+{
+    *lock = SPIN_LOCK_INITIAL_VALUE;
+}
+
+static inline bool arch_spin_lock_held(spin_lock_t *lock)
+{
+    return *lock != 0;
+}
+
+#if WITH_SMP
+
+void arch_spin_lock(spin_lock_t *lock);
+int arch_spin_trylock(spin_lock_t *lock);
+void arch_spin_unlock(spin_lock_t *lock);
+
+/* waiters sleep in wfe until a release sends an event */
+static inline void arch_spinloop_pause(void)
+{
+    __asm__ volatile("wfe");
+}
+
+static inline void arch_spinloop_signal(void)
+{
+    __asm__ volatile("dsb ish; sev" ::: "memory");
+}
+
+#else
+
 static inline void arch_spin_lock(spin_lock_t *lock)
 {
     *lock = 1;
@@ -51,15 +76,7 @@ static inline void arch_spin_unlock(spin_lock_t *lock)
     *lock = 0;
 }
 
-static inline void arch_spin_lock_init(spin_lock_t *lock)
-{
-    *lock = SPIN_LOCK_INITIAL_VALUE;
-}
-
-static inline bool arch_spin_lock_held(spin_lock_t *lock)
-{
-    return *lock != 0;
-}
+#endif
 
     /* default arm flag is to just disable plain irqs */
 #define ARCH_DEFAULT_SPIN_LOCK_FLAG_INTERRUPTS  0
@@ -75,6 +75,12 @@ static inline int atomic_swap(volatile int *ptr, int val)
     return __atomic_exchange_n(ptr, val, __ATOMIC_RELAXED);
 }
 
+static inline int atomic_cmpxchg(volatile int *ptr, int oldval, int newval)
+{
+    __atomic_compare_exchange_n(ptr, &oldval, newval, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    return oldval;
+}
+
 /* use a global pointer to store the current_thread */
 extern struct thread *_current_thread;
 
@@ -21,40 +21,78 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 #include <debug.h>
+#include <assert.h>
 #include <arch.h>
 #include <arch/ops.h>
 #include <arch/x86.h>
 #include <arch/x86/mmu.h>
 #include <arch/x86/descriptor.h>
+#include <arch/x86/mp.h>
 #include <platform.h>
 #include <sys/types.h>
 #include <string.h>
 
-static tss_t system_tss;
+extern uint8_t _gdt[];
+extern uint8_t _gdt_end[];
+
+struct x86_percpu x86_percpu_array[SMP_MAX_CPUS];
+
+bool x86_has_erms;
+bool x86_has_1gb_pages;
+
+static void x86_feature_init(void)
+{
+	uint32_t a, b, c, d;
+
+	x86_cpuid(0, 0, &a, &b, &c, &d);
+	uint32_t max_leaf = a;
+
+	if (max_leaf >= X86_CPUID_EXT_FEATURES) {
+		x86_cpuid(X86_CPUID_EXT_FEATURES, 0, &a, &b, &c, &d);
+		x86_has_erms = !!(b & X86_CPUID_ERMS);
+	}
+
+	x86_cpuid(0x80000000, 0, &a, &b, &c, &d);
+	if (a >= X86_CPUID_EXT_PROC_FEATURES) {
+		x86_cpuid(X86_CPUID_EXT_PROC_FEATURES, 0, &a, &b, &c, &d);
+		x86_has_1gb_pages = !!(d & X86_CPUID_PAGE1GB);
+	}
+}
 
 void arch_early_init(void)
 {
+	x86_feature_init();
 
 	/* x86-64 MMU init is done as a part of platform init after the heap init */
 #ifndef ARCH_X86_64
 	x86_mmu_init();
 	platform_init_mmu_mappings();
 #endif
+	x86_init_percpu(0);
+}
+
+void x86_init_percpu(uint cpu_num)
+{
+	struct x86_percpu *percpu = &x86_percpu_array[cpu_num];
+
+	/* the boot cpu's gs was pointed here by crt0 so the current thread could be set up early */
+	percpu->self = percpu;
+	percpu->cpu_num = cpu_num;
+	write_msr(X86_MSR_GS_BASE, (uint64_t)percpu);
+
 	/* enable caches here for now */
 	clear_in_cr0(X86_CR0_NW | X86_CR0_CD);
 
-	memset(&system_tss, 0, sizeof(tss_t));
+	/* copy the boot gdt and point its tss descriptor at this cpu's tss */
+	DEBUG_ASSERT(_gdt_end - _gdt == GDT_SIZE);
+	memcpy(percpu->gdt, _gdt, GDT_SIZE);
 
-	system_tss.esp0 = 0;
-	system_tss.ss0 = DATA_SELECTOR;
-	system_tss.ss1 = 0;
-	system_tss.ss2 = 0;
-	system_tss.eflags = 0x00003002;
-	system_tss.bitmap = offsetof(tss_t, tss_bitmap);
-	system_tss.trace = 1; // trap on hardware task switch
+	memset(&percpu->tss, 0, sizeof(tss_t));
+	percpu->tss.iomap_base = sizeof(tss_t);
 
-	set_global_desc(TSS_SELECTOR, &system_tss, sizeof(tss_t), 1, 0, 0, SEG_TYPE_TSS, 0, 0);
+	set_desc(percpu->gdt, TSS_SELECTOR, &percpu->tss, sizeof(tss_t) - 1, 1, 0, 0, SEG_TYPE_TSS, 0, 0);
 
+	x86_lgdt(percpu->gdt, GDT_SIZE);
 	x86_ltr(TSS_SELECTOR);
 }
 
@@ -46,23 +46,39 @@ typedef struct {
 
 extern seg_desc_t _gdt[];
 
-void set_global_desc(seg_sel_t sel, void *base, uint32_t limit,
-                     uint8_t present, uint8_t ring, uint8_t sys, uint8_t type, uint8_t gran, uint8_t bits)
+void set_desc(void *gdt, seg_sel_t sel, void *base, uint32_t limit,
+              uint8_t present, uint8_t ring, uint8_t sys, uint8_t type, uint8_t gran, uint8_t bits)
 {
+	seg_desc_t *desc = gdt;
+
 	// convert selector into index
 	uint16_t index = sel >> 3;
 
-	_gdt[index].limit_15_0 = limit & 0x0000ffff;
-	_gdt[index].limit_19_16 = (limit & 0x000f0000) >> 16;
+	desc[index].limit_15_0 = limit & 0x0000ffff;
+	desc[index].limit_19_16 = (limit & 0x000f0000) >> 16;
+
+	desc[index].base_15_0 = ((uintptr_t) base) & 0x0000ffff;
+	desc[index].base_23_16 = (((uintptr_t) base) & 0x00ff0000) >> 16;
+	desc[index].base_31_24 = (((uintptr_t) base) >> 24) & 0xff;
+
+	desc[index].type = type & 0x0f; // segment type
+	desc[index].p = present != 0;   // present
+	desc[index].dpl = ring & 0x03;  // descriptor privilege level
+	desc[index].g = gran != 0;      // granularity
+	desc[index].s = sys != 0;       // system / non-system
+	desc[index].d_b = bits != 0;    // 16 / 32 bit
 
-	_gdt[index].base_15_0 = ((uint32_t) base) & 0x0000ffff;
-	_gdt[index].base_23_16 = (((uint32_t) base) & 0x00ff0000) >> 16;
-	_gdt[index].base_31_24 = ((uint32_t) base) >> 24;
+	// system descriptors take two slots in long mode, the second holds base 63:32
+	if (!sys) {
+		uint32_t *upper = (uint32_t *)&desc[index + 1];
 
-	_gdt[index].type = type & 0x0f; // segment type
-	_gdt[index].p = present != 0;   // present
-	_gdt[index].dpl = ring & 0x03;  // descriptor privilege level
-	_gdt[index].g = gran != 0;      // granularity
-	_gdt[index].s = sys != 0;       // system / non-system
-	_gdt[index].d_b = bits != 0;    // 16 / 32 bit
+		upper[0] = ((uintptr_t) base) >> 32;
+		upper[1] = 0;
+	}
+}
+
+void set_global_desc(seg_sel_t sel, void *base, uint32_t limit,
+                     uint8_t present, uint8_t ring, uint8_t sys, uint8_t type, uint8_t gran, uint8_t bits)
+{
+	set_desc(_gdt, sel, base, limit, present, ring, sys, type, gran, bits);
 }
@@ -29,7 +29,7 @@
 static void dump_fault_frame(struct x86_iframe *frame)
 {
 
-	dprintf(CRITICAL, " CS:     %04x EIP: %08x EFL: %08x CR2: %08x\n",
+	dprintf(CRITICAL, " CS: %04llx RIP: %016llx EFL: %016llx CR2: %016llx\n",
 	        frame->cs, frame->rip, frame->rflags, x86_get_cr2());
 /*	dprintf(CRITICAL, "EAX: %08x ECX: %08x EDX: %08x EBX: %08x\n",
 	        frame->rax, frame->rcx, frame->rdx, frame->rbx);
@@ -43,14 +43,14 @@ static void dump_fault_frame(struct x86_iframe *frame)
 	addr_t stack = (addr_t) frame; //(addr_t) (((uint32_t *) frame) + (sizeof(struct x86_iframe) / sizeof(uint32_t) - 1));
 
 	if (stack != 0) {
-		dprintf(CRITICAL, "bottom of stack at 0x%08x:\n", (unsigned int)stack);
+		dprintf(CRITICAL, "bottom of stack at 0x%016lx:\n", stack);
 		hexdump((void *)stack, 192);
 	}
 }
 
 static void exception_die(struct x86_iframe *frame, const char *msg)
 {
-	inc_critical_section();
+	x86_cli();
 	dprintf(CRITICAL, msg);
 	dump_fault_frame(frame);
 
@@ -29,6 +29,7 @@
 #ifndef ASSEMBLY
 
 #include <arch/x86.h>
+#include <arch/x86/mp.h>
 
 /* override of some routines */
 static inline void arch_enable_ints(void)
@@ -53,12 +54,11 @@ static inline inline bool arch_ints_disabled(void)
 	   : "=a" (state)
 	   :: "memory");
 
-	return !!(state & (1<<9));
+	return !(state & (1<<9));
 }
 
 int _atomic_and(volatile int *ptr, int val);
 int _atomic_or(volatile int *ptr, int val);
-int _atomic_cmpxchg(volatile int *ptr, int oldval, int newval);
 
 static inline int atomic_add(volatile int *ptr, int val)
 {
@@ -84,10 +84,20 @@ static inline int atomic_swap(volatile int *ptr, int val)
 	return val;
 }
 
+static inline int atomic_cmpxchg(volatile int *ptr, int oldval, int newval)
+{
+	__asm__ volatile(
+		"lock cmpxchgl %[newval], %[ptr];"
+		: "=a" (oldval), [ptr]"+m" (*ptr)
+		: "a" (oldval), [newval]"r" (newval)
+		: "memory"
+	);
+
+	return oldval;
+}
 
 static inline int atomic_and(volatile int *ptr, int val) { return _atomic_and(ptr, val); }
 static inline int atomic_or(volatile int *ptr, int val) { return _atomic_or(ptr, val); }
-static inline int atomic_cmpxchg(volatile int *ptr, int oldval, int newval) { return _atomic_cmpxchg(ptr, oldval, newval); }
 
 static inline uint32_t arch_cycle_count(void)
 {
@@ -97,19 +107,52 @@ static inline uint32_t arch_cycle_count(void)
 	return timestamp;
 }
 
-/* use a global pointer to store the current_thread */
-extern struct thread *_current_thread;
-
+/* the current thread and cpu number live in the per cpu area at gs */
 static inline struct thread *get_current_thread(void)
 {
-    return _current_thread;
+	struct thread *t;
+
+	__asm__ volatile(
+		"movq %%gs:%c1, %0"
+		: "=r" (t)
+		: "i" (offsetof(struct x86_percpu, current_thread)));
+
+	return t;
 }
 
 static inline void set_current_thread(struct thread *t)
 {
-    _current_thread = t;
+	__asm__ volatile(
+		"movq %0, %%gs:%c1"
+		:: "r" (t), "i" (offsetof(struct x86_percpu, current_thread))
+		: "memory");
 }
 
+#if WITH_SMP
+static inline uint arch_curr_cpu_num(void)
+{
+	uint cpu;
+
+	__asm__ volatile(
+		"movl %%gs:%c1, %0"
+		: "=r" (cpu)
+		: "i" (offsetof(struct x86_percpu, cpu_num)));
+
+	return cpu;
+}
+
+/* stores are not reordered with other stores or loads with other loads, only a
+ * store followed by a load needs a real fence */
+#define smp_mb()    __asm__ volatile("mfence" ::: "memory")
+#define smp_rmb()   CF
+#define smp_wmb()   CF
+#else
+static inline uint arch_curr_cpu_num(void)
+{
+	return 0;
+}
+#endif
+
 #endif // !ASSEMBLY
 
 #endif
@@ -26,6 +26,7 @@
 
 #include <compiler.h>
 #include <sys/types.h>
+#include <stdbool.h>
 
 __BEGIN_CDECLS
 
@@ -49,31 +50,18 @@ struct x86_iframe {
 	uint64_t user_rsp, user_ss;                         // pushed by interrupt if priv change occurs
 };
 /*
- * x86 TSS structure
+ * x86-64 TSS structure
  */
 typedef struct {
-	uint16_t    backlink, __blh;
-	uint32_t    esp0;
-	uint16_t    ss0, __ss0h;
-	uint32_t    esp1;
-	uint16_t    ss1, __ss1h;
-	uint32_t    esp2;
-	uint16_t    ss2, __ss2h;
-	uint32_t    cr3;
-	uint32_t    eip;
-	uint32_t    eflags;
-	uint32_t    eax, ecx, edx, ebx;
-	uint32_t    esp, ebp, esi, edi;
-	uint16_t    es, __esh;
-	uint16_t    cs, __csh;
-	uint16_t    ss, __ssh;
-	uint16_t    ds, __dsh;
-	uint16_t    fs, __fsh;
-	uint16_t    gs, __gsh;
-	uint16_t    ldt, __ldth;
-	uint16_t    trace, bitmap;
-
-	uint8_t tss_bitmap[8192];
+	uint32_t    __reserved0;
+	uint64_t    rsp0;
+	uint64_t    rsp1;
+	uint64_t    rsp2;
+	uint64_t    __reserved1;
+	uint64_t    ist[7];
+	uint64_t    __reserved2;
+	uint16_t    __reserved3;
+	uint16_t    iomap_base;
 } __PACKED tss_t;
 
 #define X86_CR0_PE      0x00000001 /* protected mode enable */
@@ -86,6 +74,8 @@ typedef struct {
 #define X86_CR0_PG	0x80000000 /* enable paging */
 #define x86_EFER_NXE	0x00000800 /* to enable execute disable bit */
 #define x86_MSR_EFER	0xc0000080 /* EFER Model Specific Register id */
+#define X86_MSR_APIC_BASE	0x0000001b /* local apic base address and enable */
+#define X86_MSR_GS_BASE	0xc0000101 /* gs segment base */
 
 static inline void set_in_cr0(uint32_t mask)
 {
@@ -116,6 +106,40 @@ static inline void x86_ltr(uint16_t sel)
 	__asm__ __volatile__ ("ltr %%ax" :: "a" (sel));
 }
 
+static inline void x86_lgdt(void *gdt, uint16_t size)
+{
+	struct {
+		uint16_t limit;
+		uint64_t base;
+	} __PACKED gdtr = { size - 1, (uint64_t)gdt };
+
+	__asm__ __volatile__ ("lgdt %0" :: "m" (gdtr));
+}
+
+static inline void x86_pause(void) {__asm__ __volatile__ ("pause" ::: "memory"); }
+
+static inline uint64_t x86_save_rflags(void)
+{
+	uint64_t state;
+
+	__asm__ volatile(
+		"pushfq;"
+		"popq %0"
+		: "=rm" (state)
+		:: "memory");
+
+	return state;
+}
+
+static inline void x86_restore_rflags(uint64_t rflags)
+{
+	__asm__ volatile(
+		"pushq %0;"
+		"popfq"
+		:: "g" (rflags)
+		: "memory", "cc");
+}
+
 static inline uint64_t x86_get_cr2(void)
 {
 	uint64_t rv;
@@ -302,6 +326,25 @@ static inline void x86_set_cr3(uint64_t in_val)
 		:"r" (in_val));
 }
 
+static inline void x86_invlpg(vaddr_t va)
+{
+	__asm__ __volatile__ (
+		"invlpg (%0) \n\t"
+		:
+		:"r" (va)
+		:"memory");
+}
+
+static inline uint64_t x86_get_cr4(void)
+{
+	uint64_t rv;
+
+	__asm__ __volatile__ (
+		"movq %%cr4, %0"
+		: "=r" (rv));
+	return rv;
+}
+
 static inline uint64_t x86_get_cr0(void)
 {
 	uint64_t rv;
@@ -333,6 +376,25 @@ static inline uint32_t x86_get_address_width(void)
 	return ((rv >> 8) & 0x0ff);
 }
 
+static inline void x86_cpuid(uint32_t leaf, uint32_t subleaf,
+	uint32_t *a, uint32_t *b, uint32_t *c, uint32_t *d)
+{
+	__asm__ __volatile__ (
+		"cpuid \n\t"
+		:"=a" (*a), "=b" (*b), "=c" (*c), "=d" (*d)
+		:"a" (leaf), "c" (subleaf));
+}
+
+#define X86_CPUID_FEATURES	0x1
+#define X86_CPUID_EXT_FEATURES	0x7
+#define X86_CPUID_ERMS		(1 << 9)	/* leaf 7 ebx, enhanced rep movsb/stosb */
+#define X86_CPUID_EXT_PROC_FEATURES	0x80000001
+#define X86_CPUID_PAGE1GB	(1 << 26)	/* leaf 0x80000001 edx, 1GB pages */
+
+/* cpu features the string routines in lib/libc and the mmu dispatch on, set in arch_early_init */
+extern bool x86_has_erms;
+extern bool x86_has_1gb_pages;
+
 __END_CDECLS
 
 #endif
@@ -37,6 +37,9 @@
 #define USER_CODE_SELECTOR 0x23
 #define USER_DATA_SELECTOR 0x2b
 
+/* size of the gdt in crt0.S, keep in sync */
+#define GDT_SIZE        0x50
+
 /*
  * Descriptor Types
  */
@@ -52,4 +55,8 @@ typedef uint16_t seg_sel_t;
 void set_global_desc(seg_sel_t sel, void *base, uint32_t limit,
                      uint8_t present, uint8_t ring, uint8_t sys, uint8_t type, uint8_t gran, uint8_t bits);
 
+/* same as above, but in a gdt other than the boot one */
+void set_desc(void *gdt, seg_sel_t sel, void *base, uint32_t limit,
+              uint8_t present, uint8_t ring, uint8_t sys, uint8_t type, uint8_t gran, uint8_t bits);
+
 #endif
@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __ARCH_X86_LAPIC_H
+#define __ARCH_X86_LAPIC_H
+
+#include <compiler.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS
+
+/* map the local apic registers and enable the boot cpu's, once the final page tables are in place */
+status_t lapic_init(void);
+
+/* enable the calling cpu's local apic */
+void lapic_init_percpu(void);
+
+uint32_t lapic_get_id(void);
+void lapic_eoi(void);
+
+void lapic_send_ipi(uint32_t apic_id, uint vector);
+void lapic_send_init_ipi(uint32_t apic_id);
+void lapic_send_startup_ipi(uint32_t apic_id, paddr_t entry);
+
+/* one shot timer, counting down at the bus clock / 16 */
+void lapic_timer_init_percpu(void);
+void lapic_timer_start(uint32_t count);
+void lapic_timer_stop(void);
+uint32_t lapic_timer_current_count(void);
+
+__END_CDECLS
+
+#endif
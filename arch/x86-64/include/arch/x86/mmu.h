@@ -32,7 +32,9 @@ void x86_mmu_init(void);
 #define X86_MMU_PG_P		0x001		/* P    Valid			*/
 #define X86_MMU_PG_RW		0x002		/* R/W  Read/Write		*/
 #define X86_MMU_PG_U		0x004		/* U/S  User/Supervisor		*/
-#define X86_MMU_PG_PS		0x080		/* PS   Page size (0=4k,1=2M)	*/
+#define X86_MMU_PG_PWT		0x008		/* PWT  Write through		*/
+#define X86_MMU_PG_PCD		0x010		/* PCD  Cache disable		*/
+#define X86_MMU_PG_PS		0x080		/* PS   Page size (0=4k,1=2M/1G)	*/
 #define X86_MMU_PG_PTE_PAT	0x080		/* PAT  PAT index		*/
 #define X86_MMU_PG_G		0x100		/* G    Global			*/
 #define X86_MMU_PG_NX		(1ul << 63)	/* NX   No Execute		*/
@@ -43,8 +45,10 @@ void x86_mmu_init(void);
 #define X86_FLAGS_MASK		(0x8000000000000ffful)
 #define X86_PTE_NOT_PRESENT	(0xFFFFFFFFFFFFFFFEul)
 #define X86_2MB_PAGE_FRAME	(0x000fffffffe00000ul)
+#define X86_1GB_PAGE_FRAME	(0x000fffffc0000000ul)
 #define PAGE_OFFSET_MASK_4KB	(0x0000000000000ffful)
 #define PAGE_OFFSET_MASK_2MB	(0x00000000001ffffful)
+#define PAGE_OFFSET_MASK_1GB	(0x000000003ffffffful)
 
 #define PAGE_SIZE		4096
 #define PAGING_LEVELS		4
@@ -66,7 +70,7 @@ enum page_table_levels {
 	PD_L,
 	PDP_L,
 	PML4_L
-} page_level;
+};
 
 struct map_range {
 	vaddr_t start_vaddr;
@@ -79,4 +83,8 @@ status_t x86_mmu_check_mapping (addr_t pml4, paddr_t paddr,
 				vaddr_t vaddr, uint64_t in_flags,
 				uint32_t *ret_level, uint64_t *ret_flags,
 				uint64_t *last_valid_entry);
+
+/* drop the calling cpu's tlb entries for the addresses if pml4 is live on it,
+ * a NULL vaddr drops everything */
+void x86_tlb_invalidate(addr_t pml4, const vaddr_t *vaddr, uint count);
 __END_CDECLS
@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __ARCH_X86_MP_H
+#define __ARCH_X86_MP_H
+
+#include <compiler.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <arch/x86.h>
+#include <arch/x86/descriptor.h>
+
+__BEGIN_CDECLS
+
+struct thread;
+
+/* per cpu state, found through the gs segment base on each cpu */
+struct x86_percpu {
+	/* pointer back to ourselves, so the struct can be found with one gs load */
+	struct x86_percpu *self;
+
+	uint cpu_num;
+	uint32_t apic_id;
+
+	struct thread *current_thread;
+
+	/* each cpu has a copy of the gdt so it can load its own tss */
+	uint8_t gdt[GDT_SIZE] __ALIGNED(16);
+	tss_t tss;
+};
+
+extern struct x86_percpu x86_percpu_array[SMP_MAX_CPUS];
+
+static inline struct x86_percpu *x86_get_percpu(void)
+{
+	struct x86_percpu *percpu;
+
+	__asm__ volatile(
+		"movq %%gs:%c1, %0"
+		: "=r" (percpu)
+		: "i" (offsetof(struct x86_percpu, self)));
+
+	return percpu;
+}
+
+/* set up gs, the gdt and the tss for the calling cpu */
+void x86_init_percpu(uint cpu_num);
+
+#if WITH_SMP
+/* page below 1MB the startup trampoline is copied to */
+#define X86_AP_TRAMPOLINE_ADDR 0x8000
+
+/* start the application processors with the given local apic ids, the calling cpu's is skipped */
+status_t x86_mp_boot_cpus(const uint32_t *apic_ids, uint count);
+
+void x86_secondary_entry(uint cpu_num);
+
+/* run x86_tlb_invalidate on every other cpu that's up and wait for them all to finish.
+ * the caller must not hold a spinlock another cpu could be spinning on with interrupts off. */
+void x86_tlb_shootdown(addr_t pml4, const vaddr_t *vaddr, uint count);
+#endif
+
+__END_CDECLS
+
+#endif
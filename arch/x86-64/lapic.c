@@ -0,0 +1,189 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <debug.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <err.h>
+#include <reg.h>
+#include <trace.h>
+#include <arch/ops.h>
+#include <arch/x86.h>
+#include <arch/x86/lapic.h>
+#include <arch/x86/mmu.h>
+#include <kernel/spinlock.h>
+#include <platform/pc.h>
+
+#define LOCAL_TRACE 0
+
+/* registers */
+#define LAPIC_ID                0x020
+#define LAPIC_VERSION           0x030
+#define LAPIC_TPR               0x080
+#define LAPIC_EOI               0x0b0
+#define LAPIC_SVR               0x0f0
+#define LAPIC_ESR               0x280
+#define LAPIC_ICR_LOW           0x300
+#define LAPIC_ICR_HIGH          0x310
+#define LAPIC_LVT_TIMER         0x320
+#define LAPIC_LVT_LINT0         0x350
+#define LAPIC_LVT_LINT1         0x360
+#define LAPIC_LVT_ERROR         0x370
+#define LAPIC_TIMER_INITIAL     0x380
+#define LAPIC_TIMER_CURRENT     0x390
+#define LAPIC_TIMER_DIVIDE      0x3e0
+
+#define LAPIC_SVR_ENABLE        (1 << 8)
+#define LAPIC_LVT_MASKED        (1 << 16)
+#define LAPIC_TIMER_DIVIDE_16   0x3
+
+#define LAPIC_ICR_FIXED         (0 << 8)
+#define LAPIC_ICR_INIT          (5 << 8)
+#define LAPIC_ICR_STARTUP       (6 << 8)
+#define LAPIC_ICR_PENDING       (1 << 12)
+#define LAPIC_ICR_ASSERT        (1 << 14)
+
+#define APIC_BASE_BSP           (1 << 8)
+#define APIC_BASE_ENABLE        (1 << 11)
+
+static vaddr_t lapic_base;
+
+static inline uint32_t lapic_read(uint reg)
+{
+	return *REG32(lapic_base + reg);
+}
+
+static inline void lapic_write(uint reg, uint32_t val)
+{
+	*REG32(lapic_base + reg) = val;
+}
+
+status_t lapic_init(void)
+{
+	paddr_t pa = read_msr(X86_MSR_APIC_BASE) & X86_PG_FRAME;
+
+	LTRACEF("local apic at 0x%lx\n", pa);
+
+	/* it usually sits up near 4GB, well outside anything the kernel maps */
+	struct map_range range = {
+		.start_vaddr = pa,
+		.start_paddr = pa,
+		.size = PAGE_SIZE,
+	};
+	status_t err = x86_mmu_map_range(x86_get_cr3(), &range,
+	                                 X86_MMU_PG_P | X86_MMU_PG_RW | X86_MMU_PG_NX |
+	                                 X86_MMU_PG_PCD | X86_MMU_PG_PWT);
+	if (err < 0) {
+		dprintf(CRITICAL, "failed to map the local apic, err %d\n", err);
+		return err;
+	}
+
+	lapic_base = pa;
+
+	lapic_init_percpu();
+
+	dprintf(INFO, "local apic id %u, version 0x%x\n", lapic_get_id(), lapic_read(LAPIC_VERSION) & 0xff);
+
+	return NO_ERROR;
+}
+
+void lapic_init_percpu(void)
+{
+	uint64_t apic_base = read_msr(X86_MSR_APIC_BASE);
+
+	if (!(apic_base & APIC_BASE_ENABLE))
+		write_msr(X86_MSR_APIC_BASE, apic_base | APIC_BASE_ENABLE);
+
+	/* the legacy pic is wired to the boot cpu's lint0, keep it off the others */
+	if (!(apic_base & APIC_BASE_BSP))
+		lapic_write(LAPIC_LVT_LINT0, LAPIC_LVT_MASKED);
+
+	lapic_write(LAPIC_LVT_ERROR, LAPIC_LVT_MASKED);
+	lapic_write(LAPIC_ESR, 0);
+	lapic_write(LAPIC_TPR, 0);
+	lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | INT_APIC_SPURIOUS);
+}
+
+uint32_t lapic_get_id(void)
+{
+	return lapic_read(LAPIC_ID) >> 24;
+}
+
+void lapic_eoi(void)
+{
+	lapic_write(LAPIC_EOI, 0);
+}
+
+static void lapic_send_icr(uint32_t apic_id, uint32_t cmd)
+{
+	spin_lock_saved_state_t state;
+
+	/* keep an ipi sent from an irq handler from landing between the two writes */
+	arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+	lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+	lapic_write(LAPIC_ICR_LOW, cmd);
+
+	while (lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING)
+		x86_pause();
+
+	arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+void lapic_send_ipi(uint32_t apic_id, uint vector)
+{
+	lapic_send_icr(apic_id, LAPIC_ICR_ASSERT | LAPIC_ICR_FIXED | vector);
+}
+
+void lapic_send_init_ipi(uint32_t apic_id)
+{
+	lapic_send_icr(apic_id, LAPIC_ICR_ASSERT | LAPIC_ICR_INIT);
+}
+
+void lapic_send_startup_ipi(uint32_t apic_id, paddr_t entry)
+{
+	DEBUG_ASSERT(IS_ALIGNED(entry, PAGE_SIZE) && entry < 0x100000);
+
+	lapic_send_icr(apic_id, LAPIC_ICR_STARTUP | (entry >> PAGE_DIV_SHIFT));
+}
+
+void lapic_timer_init_percpu(void)
+{
+	lapic_write(LAPIC_TIMER_INITIAL, 0);
+	lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+	lapic_write(LAPIC_LVT_TIMER, INT_APIC_TIMER);
+}
+
+void lapic_timer_start(uint32_t count)
+{
+	lapic_write(LAPIC_TIMER_INITIAL, count);
+}
+
+void lapic_timer_stop(void)
+{
+	lapic_write(LAPIC_TIMER_INITIAL, 0);
+}
+
+uint32_t lapic_timer_current_count(void)
+{
+	return lapic_read(LAPIC_TIMER_CURRENT);
+}
@@ -33,6 +33,10 @@
 #include <assert.h>
 #include <err.h>
 #include <arch/arch_ops.h>
+#include <kernel/spinlock.h>
+#if WITH_SMP
+#include <arch/x86/mp.h>
+#endif
 
 /* Enable debug mode */
 #define MMU_DEBUG	0
@@ -115,6 +119,14 @@ static inline uint64_t get_pfn_from_pde(uint64_t pde)
 	return X86_PHYS_TO_VIRT(pfn);
 }
 
+static inline uint64_t get_pfn_from_pdpe(uint64_t pdpe)
+{
+	uint64_t pfn;
+
+	pfn = (pdpe & X86_1GB_PAGE_FRAME);
+	return X86_PHYS_TO_VIRT(pfn);
+}
+
 static void map_zero_page(addr_t *ptr)
 {
 	if(ptr)
@@ -125,7 +137,7 @@ static void map_zero_page(addr_t *ptr)
  * @brief  Walk the page table structures
  *
  * In this scenario, we are considering the paging scheme to be a PAE mode with
- * 4KB pages.
+ * 4KB, 2MB or 1GB pages.
  *
  */
 static status_t x86_mmu_page_walking(addr_t pml4, vaddr_t vaddr, uint32_t *ret_level,
@@ -154,6 +166,14 @@ static status_t x86_mmu_page_walking(addr_t pml4, vaddr_t vaddr, uint32_t *ret_l
 		return ERR_NOT_FOUND;
 	}
 
+	/* 1 GB pages */
+	if (pdpe & X86_MMU_PG_PS) {
+		/* Getting the Page frame & adding the 1GB page offset from the vaddr */
+		*last_valid_entry = get_pfn_from_pdpe(pdpe) + ((uint64_t)vaddr & PAGE_OFFSET_MASK_1GB);
+		*existing_flags = (X86_PHYS_TO_VIRT(pdpe)) & X86_FLAGS_MASK;
+		goto last;
+	}
+
 	pde = get_pd_entry_from_pd_table(vaddr, pdpe);
 	if ((pde & X86_MMU_PG_P) == 0) {
 		*ret_level = PD_L;
@@ -163,7 +183,7 @@ static status_t x86_mmu_page_walking(addr_t pml4, vaddr_t vaddr, uint32_t *ret_l
 
 	/* 2 MB pages */
 	if (pde & X86_MMU_PG_PS) {
-		/* Getting the Page frame & adding the 4KB page offset from the vaddr */
+		/* Getting the Page frame & adding the 2MB page offset from the vaddr */
 		*last_valid_entry = get_pfn_from_pde(pde) + ((uint64_t)vaddr & PAGE_OFFSET_MASK_2MB);
 		*existing_flags = (X86_PHYS_TO_VIRT(pde)) & X86_FLAGS_MASK;
 		goto last;
@@ -225,44 +245,95 @@ status_t x86_mmu_check_mapping(addr_t pml4, paddr_t paddr,
 	return ERR_NOT_FOUND;
 }
 
-static void update_pt_entry(vaddr_t vaddr, paddr_t paddr, uint64_t flags, uint64_t pde)
-{
-	uint32_t pt_index;
+/* invlpg at most this many addresses per map or unmap, past that reload cr3 */
+#ifndef X86_TLB_BATCH_MAX
+#define X86_TLB_BATCH_MAX	32
+#endif
 
-	uint64_t *pt_table = (uint64_t *)(pde & X86_PG_FRAME);
-	pt_index = (((uint64_t)vaddr >> PT_SHIFT) & ((1ul << ADDR_OFFSET) - 1));
-	pt_table[pt_index] = (uint64_t)paddr;
-	pt_table[pt_index] |= flags;
+#define PT_ENTRIES		(PAGE_SIZE / sizeof(uint64_t))
+
+static const uint level_shift[] = {
+	[PT_L] = PT_SHIFT,
+	[PD_L] = PD_SHIFT,
+	[PDP_L] = PDP_SHIFT,
+	[PML4_L] = PML4_SHIFT,
+};
+
+/*
+ * TLB invalidations and page table frees collected over a map or unmap,
+ * issued together at the end. Tables are only freed once nothing can still
+ * be walking them.
+ */
+struct x86_tlb_batch {
+	addr_t pml4;
+	uint count;
+	vaddr_t vaddr[X86_TLB_BATCH_MAX];
+	uint free_count;
+	uint64_t *free_tables[X86_TLB_BATCH_MAX];
+};
+
+static inline uint table_index(vaddr_t vaddr, uint level)
+{
+	return ((uint64_t)vaddr >> level_shift[level]) & ((1ul << ADDR_OFFSET) - 1);
 }
 
-static void update_pd_entry(vaddr_t vaddr, uint64_t pdpe, addr_t *m)
+static inline uint64_t *table_from_entry(uint64_t entry)
 {
-	uint32_t pd_index;
+	return (uint64_t *)X86_PHYS_TO_VIRT(entry & X86_PG_FRAME);
+}
 
-	uint64_t *pd_table = (uint64_t *)(pdpe & X86_PG_FRAME);
-	pd_index = (((uint64_t)vaddr >> PD_SHIFT) & ((1ul << ADDR_OFFSET) - 1));
-	pd_table[pd_index] = (uint64_t)m;
-	pd_table[pd_index] |= X86_MMU_PG_P | X86_MMU_PG_RW;
+void x86_tlb_invalidate(addr_t pml4, const vaddr_t *vaddr, uint count)
+{
+	/* only the live address space can have anything cached */
+	if (pml4 != (x86_get_cr3() & X86_PG_FRAME))
+		return;
+
+	if (!vaddr) {
+		x86_set_cr3(x86_get_cr3());
+	} else {
+		for (uint i = 0; i < count; i++)
+			x86_invlpg(vaddr[i]);
+	}
 }
 
-static void update_pdp_entry(vaddr_t vaddr, uint64_t pml4e, addr_t *m)
+static void tlb_batch_flush(struct x86_tlb_batch *tlb)
 {
-	uint32_t pdp_index;
+	if (tlb->count > 0) {
+		const vaddr_t *vaddr = (tlb->count > X86_TLB_BATCH_MAX) ? NULL : tlb->vaddr;
 
-	uint64_t *pdp_table = (uint64_t *)(pml4e & X86_PG_FRAME);
-	pdp_index = (((uint64_t)vaddr >> PDP_SHIFT) & ((1ul << ADDR_OFFSET) - 1));
-	pdp_table[pdp_index] = (uint64_t)m;
-	pdp_table[pdp_index] |= X86_MMU_PG_P | X86_MMU_PG_RW;
+		/* stay on this cpu so the shootdown covers every cpu but the one invalidated locally */
+		spin_lock_saved_state_t state;
+		arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+		x86_tlb_invalidate(tlb->pml4, vaddr, tlb->count);
+#if WITH_SMP
+		/* the other cpus share the tables, and have to be done with them before any are freed */
+		x86_tlb_shootdown(tlb->pml4, vaddr, tlb->count);
+#endif
+
+		arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+	}
+	tlb->count = 0;
+
+	/* free can block, so only once interrupts are back on */
+	for (uint i = 0; i < tlb->free_count; i++)
+		free(tlb->free_tables[i]);
+	tlb->free_count = 0;
 }
 
-static void update_pml4_entry(vaddr_t vaddr, addr_t pml4_addr, addr_t *m)
+/* one call per page table entry changed, a large page only needs the one */
+static void tlb_batch_add(struct x86_tlb_batch *tlb, vaddr_t vaddr)
 {
-	uint32_t pml4_index;
-	uint64_t *pml4_table = (uint64_t *)(pml4_addr);
+	if (tlb->count < X86_TLB_BATCH_MAX)
+		tlb->vaddr[tlb->count] = vaddr;
+	tlb->count++;
+}
 
-	pml4_index = (((uint64_t)vaddr >> PML4_SHIFT) & ((1ul << ADDR_OFFSET) - 1));
-	pml4_table[pml4_index] = (uint64_t)m;
-	pml4_table[pml4_index] |= X86_MMU_PG_P | X86_MMU_PG_RW;
+static void tlb_batch_free_table(struct x86_tlb_batch *tlb, uint64_t *table)
+{
+	if (tlb->free_count == X86_TLB_BATCH_MAX)
+		tlb_batch_flush(tlb);
+	tlb->free_tables[tlb->free_count++] = table;
 }
 
 /**
@@ -277,170 +348,194 @@ static addr_t *_map_alloc(size_t size)
 }
 
 /**
- * @brief  Add a new mapping for the given virtual address & physical address
+ * @brief  Replace a 1GB or 2MB page with a table of the next smaller pages
  *
- * This is a API which handles the mapping b/w a virtual address & physical address
- * either by checking if the mapping already exists and is valid OR by adding a
- * new mapping with the required flags.
+ * The new table maps the same range with the same flags. The caller has to
+ * invalidate the old entry.
+ */
+static status_t x86_mmu_split_large_page(uint64_t *entry, uint level)
+{
+	DEBUG_ASSERT(level == PDP_L || level == PD_L);
+	DEBUG_ASSERT(*entry & X86_MMU_PG_PS);
+
+	uint64_t *table = (uint64_t *)_map_alloc(PAGE_SIZE);
+	if (!table)
+		return ERR_NO_MEMORY;
+
+	uint64_t flags = *entry & X86_FLAGS_MASK;
+	paddr_t paddr = *entry & ((level == PDP_L) ? X86_1GB_PAGE_FRAME : X86_2MB_PAGE_FRAME);
+	size_t step = 1ul << level_shift[level - 1];
+
+	/* the PS bit is the PAT bit in a 4K pte */
+	if (level == PD_L)
+		flags &= ~X86_MMU_PG_PS;
+
+	for (uint i = 0; i < PT_ENTRIES; i++)
+		table[i] = (paddr + i * step) | flags;
+
+	*entry = X86_VIRT_TO_PHYS((uint64_t)table) | X86_MMU_PG_P | X86_MMU_PG_RW;
+
+	return NO_ERROR;
+}
+
+/**
+ * @brief  Add a new mapping for the given virtual address & physical address
  *
- * In this scenario, we are considering the paging scheme to be a PAE mode with
- * 4KB pages.
+ * Maps a single 4KB page, or a 2MB or 1GB page if level is PD_L or PDP_L,
+ * allocating the tables above it as needed. A larger page already covering
+ * the address is split so the new mapping can go in.
  *
  */
 static status_t x86_mmu_add_mapping(addr_t pml4, paddr_t paddr,
-				vaddr_t vaddr, uint64_t flags)
+				vaddr_t vaddr, uint64_t flags, uint level,
+				struct x86_tlb_batch *tlb)
 {
-	uint32_t pd_new = 0, pdp_new = 0;
-	uint64_t pml4e, pdpe, pde;
-	addr_t *m = NULL;
-	status_t ret = NO_ERROR;
+	uint64_t *new_entries[PAGING_LEVELS];
+	uint new_count = 0;
+	status_t ret;
 
 	DEBUG_ASSERT(pml4);
+	DEBUG_ASSERT(level >= PT_L && level <= PDP_L);
 	if((!x86_mmu_check_map_addr(vaddr)) || (!x86_mmu_check_map_addr(paddr)) )
 		return ERR_INVALID_ARGS;
 
-	pml4e = get_pml4_entry_from_pml4_table(vaddr, pml4);
-
-	if((pml4e & X86_MMU_PG_P) == 0) {
-		/* Creating a new pdp table */
-		m = _map_alloc(PAGE_SIZE);
-		if(m == NULL) {
-			ret = ERR_NO_MEMORY;
-			goto clean;
+	uint64_t *table = (uint64_t *)X86_PHYS_TO_VIRT(pml4);
+	for (uint l = PML4_L; l > level; l--) {
+		uint64_t *entry = &table[table_index(vaddr, l)];
+
+		if ((*entry & X86_MMU_PG_P) == 0) {
+			addr_t *m = _map_alloc(PAGE_SIZE);
+			if (m == NULL) {
+				ret = ERR_NO_MEMORY;
+				goto clean;
+			}
+
+			*entry = X86_VIRT_TO_PHYS((uint64_t)m) | X86_MMU_PG_P | X86_MMU_PG_RW;
+			new_entries[new_count++] = entry;
+		} else if (l != PML4_L && (*entry & X86_MMU_PG_PS)) {
+			ret = x86_mmu_split_large_page(entry, l);
+			if (ret < 0)
+				goto clean;
+
+			tlb_batch_add(tlb, vaddr);
 		}
 
-		update_pml4_entry(vaddr, pml4, m);
-		pml4e = (uint64_t)m;
-		X86_SET_FLAG(pdp_new);
+		table = table_from_entry(*entry);
 	}
 
-	if(!pdp_new)
-		pdpe = get_pdp_entry_from_pdp_table(vaddr, pml4e);
-
-	if(pdp_new || (pdpe & X86_MMU_PG_P) == 0) {
-		/* Creating a new pd table  */
-		m  = _map_alloc(PAGE_SIZE);
-		if(m == NULL) {
-			ret = ERR_NO_MEMORY;
-			if(pdp_new)
-				goto clean_pdp;
-			goto clean;
-		}
+	uint64_t *entry = &table[table_index(vaddr, level)];
 
-		update_pdp_entry(vaddr, pml4e, m);
-		pdpe = (uint64_t)m;
-		X86_SET_FLAG(pd_new);
-	}
+	/* never drop a lower level table by putting a large page over it */
+	DEBUG_ASSERT(level == PT_L || (*entry & X86_MMU_PG_P) == 0 || (*entry & X86_MMU_PG_PS));
 
-	if(!pd_new)
-		pde = get_pd_entry_from_pd_table(vaddr, pdpe);
-
-	if(pd_new || (pde & X86_MMU_PG_P) == 0) {
-		/* Creating a new pt */
-		m  = _map_alloc(PAGE_SIZE);
-		if(m == NULL) {
-			ret = ERR_NO_MEMORY;
-			if(pd_new)
-				goto clean_pd;
-			goto clean;
-		}
+	if (*entry & X86_MMU_PG_P)
+		tlb_batch_add(tlb, vaddr);
+
+	*entry = (uint64_t)paddr | flags | ((level > PT_L) ? X86_MMU_PG_PS : 0);
 
-		update_pd_entry(vaddr, pdpe, m);
-		pde = (uint64_t)m;
+	return NO_ERROR;
+
+clean:
+	/* back out the tables we added, nothing has been mapped through them yet */
+	while (new_count > 0) {
+		uint64_t *e = new_entries[--new_count];
+		tlb_batch_free_table(tlb, table_from_entry(*e));
+		*e = 0;
 	}
+	tlb_batch_add(tlb, vaddr);
+	return ret;
+}
 
-	/* Updating the page table entry with the paddr and access flags required for the mapping */
-	update_pt_entry(vaddr, paddr, flags, pde);
-	ret = NO_ERROR;
-	goto clean;
+/**
+ * @brief  Check if a large page can go at the given level for this address
+ *
+ * The slot has to be empty, or a large page itself. A pointer to a lower
+ * level table has to stay, or the mappings under it would be lost.
+ */
+static bool x86_mmu_can_map_large(addr_t pml4, vaddr_t vaddr, paddr_t paddr,
+				uint64_t size, uint level)
+{
+	uint64_t page_size = 1ul << level_shift[level];
 
-	clean_pd:
-		if(pd_new)
-			free((addr_t *)pdpe);
+	if (!IS_ALIGNED(vaddr, page_size) || !IS_ALIGNED(paddr, page_size) || size < page_size)
+		return false;
 
-	clean_pdp:
-		if(pdp_new)
-			free((addr_t *)pml4e);
+	uint64_t *table = (uint64_t *)X86_PHYS_TO_VIRT(pml4);
+	for (uint l = PML4_L; l >= level; l--) {
+		uint64_t entry = table[table_index(vaddr, l)];
 
-	clean:
-		return ret;
+		if ((entry & X86_MMU_PG_P) == 0)
+			return true;
+		if (l != PML4_L && (entry & X86_MMU_PG_PS))
+			return true;
+		if (l == level)
+			return false;
+
+		table = table_from_entry(entry);
+	}
+
+	return false;
 }
 
 /**
- * @brief  x86-64 MMU unmap an entry in the page tables recursively and clear out tables
+ * @brief  Clear [vaddr, end) out of a page table and the tables under it
+ *
+ * Large pages only partly covered by the range are split first. Tables left
+ * empty are freed. Returns 1 if this table ended up empty.
  *
  */
-static void x86_mmu_unmap_entry(vaddr_t vaddr, int level, vaddr_t table_entry)
+static int x86_mmu_unmap_table(uint64_t *table, uint level, vaddr_t vaddr, vaddr_t end,
+				struct x86_tlb_batch *tlb)
 {
-	uint32_t offset = 0, next_level_offset = 0;
-	vaddr_t *table, *next_table_addr, value;
-
-	next_table_addr = NULL;
-	table = (vaddr_t *)(X86_VIRT_TO_PHYS(table_entry) & X86_PG_FRAME);
-
-	switch(level)
-	{
-		case PML4_L:
-			offset = (((uint64_t)vaddr >> PML4_SHIFT) & ((1ul << ADDR_OFFSET) - 1));
-			next_table_addr = (vaddr_t *)X86_PHYS_TO_VIRT(table[offset]);
-			if((X86_PHYS_TO_VIRT(table[offset]) & X86_MMU_PG_P)== 0)
-				return;
-			break;
-		case PDP_L:
-			offset = (((uint64_t)vaddr >> PDP_SHIFT) & ((1ul << ADDR_OFFSET) - 1));
-			next_table_addr = (vaddr_t *)X86_PHYS_TO_VIRT(table[offset]);
-			if((X86_PHYS_TO_VIRT(table[offset]) & X86_MMU_PG_P) == 0)
-				return;
-			break;
-		case PD_L:
-			offset = (((uint64_t)vaddr >> PD_SHIFT) & ((1ul << ADDR_OFFSET) - 1));
-			next_table_addr = (vaddr_t *)X86_PHYS_TO_VIRT(table[offset]);
-			if((X86_PHYS_TO_VIRT(table[offset]) & X86_MMU_PG_P) == 0)
-				return;
-			break;
-		case PT_L:
-			offset = (((uint64_t)vaddr >> PT_SHIFT) & ((1ul << ADDR_OFFSET) - 1));
-			next_table_addr = (vaddr_t *)X86_PHYS_TO_VIRT(table[offset]);
-			if((X86_PHYS_TO_VIRT(table[offset]) & X86_MMU_PG_P) == 0)
-				return;
-			break;
-		case PF_L:
-			/* Reached page frame, Let's go back */
-		default:
-			return;
-	}
+	uint64_t entry_size = 1ul << level_shift[level];
 
-	level -= 1;
-	x86_mmu_unmap_entry(vaddr, level,(vaddr_t)next_table_addr);
-	level += 1;
+	while (vaddr < end) {
+		uint64_t *entry = &table[table_index(vaddr, level)];
+		vaddr_t entry_start = ROUNDDOWN(vaddr, entry_size);
+		vaddr_t chunk_end = (end - entry_start > entry_size) ? entry_start + entry_size : end;
 
-	next_table_addr = (vaddr_t*)((vaddr_t)(X86_VIRT_TO_PHYS(next_table_addr)) & X86_PG_FRAME);
-	if(level > PT_L) {
-	/* Check all entries of next level table for present bit */
-		for (next_level_offset = 0; next_level_offset < (PAGE_SIZE/8); next_level_offset++) {
-			if((next_table_addr[next_level_offset] & X86_MMU_PG_P) != 0)
-				return;	/* There is an entry in the next level table */
+		if ((*entry & X86_MMU_PG_P) == 0) {
+			vaddr = chunk_end;
+			continue;
 		}
-		free(next_table_addr);
+
+		if (level == PT_L || (level != PML4_L && (*entry & X86_MMU_PG_PS))) {
+			if (level == PT_L || (vaddr == entry_start && chunk_end - entry_start == entry_size)) {
+				*entry = 0;
+				tlb_batch_add(tlb, vaddr);
+				vaddr = chunk_end;
+				continue;
+			}
+
+			/* only part of a large page goes away, break it up and unmap from the pieces */
+			status_t err = x86_mmu_split_large_page(entry, level);
+			if (err < 0)
+				return err;
+			tlb_batch_add(tlb, entry_start);
+		}
+
+		uint64_t *next = table_from_entry(*entry);
+		int ret = x86_mmu_unmap_table(next, level - 1, vaddr, chunk_end, tlb);
+		if (ret < 0)
+			return ret;
+		if (ret > 0) {
+			*entry = 0;
+			tlb_batch_add(tlb, vaddr);
+			tlb_batch_free_table(tlb, next);
+		}
+
+		vaddr = chunk_end;
 	}
-	/* All present bits for all entries in next level table for this address are 0 */
-	if((X86_PHYS_TO_VIRT(table[offset]) & X86_MMU_PG_P) != 0) {
-		arch_disable_ints();
-		value = table[offset];
-		value = value & X86_PTE_NOT_PRESENT;
-		table[offset] = value;
-		if(MMU_DEBUG)
-			dprintf(SPEW, "unmap: vaddr:%llx, page d/table entry: %llx at address = %llx, level = %d\n",
-				(uint64_t)vaddr, (uint64_t)table[offset], (uint64_t)table+(offset),level);
-		arch_enable_ints();
+
+	for (uint i = 0; i < PT_ENTRIES; i++) {
+		if (table[i] & X86_MMU_PG_P)
+			return 0;
 	}
+	return 1;
 }
 
 static int x86_mmu_unmap(addr_t pml4, vaddr_t vaddr, uint count)
 {
-	int unmapped = 0;
-	vaddr_t next_aligned_v_addr;
-
 	DEBUG_ASSERT(pml4);
 	if(!(x86_mmu_check_map_addr(vaddr)))
 		return ERR_INVALID_ARGS;
@@ -448,14 +543,17 @@ static int x86_mmu_unmap(addr_t pml4, vaddr_t vaddr, uint count)
 	if (count == 0)
 		return NO_ERROR;
 
-	next_aligned_v_addr = vaddr;
-	while (count > 0) {
-		x86_mmu_unmap_entry(next_aligned_v_addr, PAGING_LEVELS, X86_PHYS_TO_VIRT(pml4));
-		next_aligned_v_addr += PAGE_SIZE;
-		unmapped++;
-		count--;
+	struct x86_tlb_batch tlb = { .pml4 = pml4 };
+
+	int ret = x86_mmu_unmap_table((uint64_t *)X86_PHYS_TO_VIRT(pml4), PML4_L,
+	                              vaddr, vaddr + (uint64_t)count * PAGE_SIZE, &tlb);
+	tlb_batch_flush(&tlb);
+
+	if (ret < 0) {
+		dprintf(SPEW, "unmap of 0x%llx, %u pages failed with err=%d\n", (uint64_t)vaddr, count, ret);
+		return ret;
 	}
-	return unmapped;
+	return count;
 }
 
 int arch_mmu_unmap(vaddr_t vaddr, uint count)
@@ -477,38 +575,58 @@ int arch_mmu_unmap(vaddr_t vaddr, uint count)
 /**
  * @brief  Mapping a section/range with specific permissions
  *
+ * Uses 1GB and 2MB pages wherever the addresses and the remaining size line
+ * up, 4KB pages for the rest.
+ *
  */
 status_t x86_mmu_map_range(addr_t pml4, struct map_range *range, uint64_t flags)
 {
 	vaddr_t next_aligned_v_addr;
 	paddr_t next_aligned_p_addr;
 	status_t map_status;
-	uint32_t no_of_pages, index;
+	uint64_t remaining, page_size;
+	uint level;
 
 	DEBUG_ASSERT(pml4);
 	if(!range)
 		return ERR_INVALID_ARGS;
 
-	/* Calculating the number of 4k pages */
-	if(IS_ALIGNED(range->size, PAGE_SIZE))
-		no_of_pages = (range->size) >> PAGE_DIV_SHIFT;
-	else
-		no_of_pages = ((range->size) >> PAGE_DIV_SHIFT) + 1;
+	/* Rounding up to a whole number of 4k pages */
+	remaining = ROUNDUP((uint64_t)range->size, PAGE_SIZE);
 
 	next_aligned_v_addr = range->start_vaddr;
 	next_aligned_p_addr = range->start_paddr;
 
-	for(index = 0; index < no_of_pages; index++) {
-		map_status = x86_mmu_add_mapping(pml4, next_aligned_p_addr, next_aligned_v_addr, flags);
+	struct x86_tlb_batch tlb = { .pml4 = pml4 };
+
+	while (remaining > 0) {
+		if (x86_has_1gb_pages &&
+		    x86_mmu_can_map_large(pml4, next_aligned_v_addr, next_aligned_p_addr, remaining, PDP_L))
+			level = PDP_L;
+		else if (x86_mmu_can_map_large(pml4, next_aligned_v_addr, next_aligned_p_addr, remaining, PD_L))
+			level = PD_L;
+		else
+			level = PT_L;
+		page_size = 1ul << level_shift[level];
+
+		map_status = x86_mmu_add_mapping(pml4, next_aligned_p_addr, next_aligned_v_addr,
+		                                 flags, level, &tlb);
 		if(map_status) {
 			dprintf(SPEW, "Add mapping failed with err=%d\n", map_status);
+			tlb_batch_flush(&tlb);
 			/* Unmap the partial mapping - if any */
-			x86_mmu_unmap(pml4, range->start_vaddr, index);
+			if (next_aligned_v_addr != range->start_vaddr)
+				x86_mmu_unmap(pml4, range->start_vaddr,
+				              (next_aligned_v_addr - range->start_vaddr) >> PAGE_DIV_SHIFT);
 			return map_status;
 		}
-		next_aligned_v_addr += PAGE_SIZE;
-		next_aligned_p_addr += PAGE_SIZE;
+		next_aligned_v_addr += page_size;
+		next_aligned_p_addr += page_size;
+		remaining -= page_size;
 	}
+
+	tlb_batch_flush(&tlb);
+
 	return NO_ERROR;
 }
 
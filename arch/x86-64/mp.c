@@ -0,0 +1,283 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <arch/mp.h>
+
+#include <assert.h>
+#include <trace.h>
+#include <err.h>
+#include <debug.h>
+#include <string.h>
+#include <stdlib.h>
+#include <lk/init.h>
+#include <lk/main.h>
+#include <kernel/mp.h>
+#include <kernel/thread.h>
+#include <platform.h>
+#include <platform/interrupts.h>
+#include <platform/pc.h>
+#include <arch/ops.h>
+#include <arch/x86.h>
+#include <arch/x86/mmu.h>
+#include <arch/x86/mp.h>
+#include <arch/x86/lapic.h>
+
+#define LOCAL_TRACE 0
+
+/* start16.S */
+extern uint8_t x86_ap_trampoline[];
+extern uint8_t x86_ap_trampoline_end[];
+extern uint64_t x86_ap_trampoline_cr3;
+extern uint64_t x86_ap_trampoline_cr4;
+extern uint64_t x86_ap_trampoline_stack;
+extern uint32_t x86_ap_trampoline_cpu_num;
+
+/* the variables are patched in the low memory copy, not in the kernel image */
+#define TRAMPOLINE_VAR(var) \
+	(*(__typeof__(var) *)(X86_AP_TRAMPOLINE_ADDR + ((uintptr_t)&(var) - (uintptr_t)x86_ap_trampoline)))
+
+/* number of cpus up and running, including the boot cpu */
+static uint x86_num_cpus = 1;
+
+/* cpus that may have tlb entries cached, each sets its own bit as soon as it's in the kernel */
+static volatile int x86_online_cpus = 1;
+
+/* the tlb shootdown in flight, one at a time under tlb_shootdown_lock */
+static spin_lock_t tlb_shootdown_lock = SPIN_LOCK_INITIAL_VALUE;
+static struct {
+	addr_t pml4;
+	const vaddr_t *vaddr;
+	uint count;
+	volatile int pending; // cpus that haven't invalidated yet
+} tlb_shootdown;
+
+static volatile int ap_started;
+
+static status_t x86_boot_cpu(uint cpu, uint32_t apic_id)
+{
+	LTRACEF("cpu %u, apic id %u\n", cpu, apic_id);
+
+	void *stack = memalign(16, ARCH_DEFAULT_STACK_SIZE);
+	if (!stack)
+		return ERR_NO_MEMORY;
+
+	x86_percpu_array[cpu].apic_id = apic_id;
+
+	/* the trampoline loads cr3 while still in 32 bit mode */
+	uint64_t cr3 = x86_get_cr3();
+	DEBUG_ASSERT(cr3 < (1ULL << 32));
+
+	TRAMPOLINE_VAR(x86_ap_trampoline_cr3) = cr3;
+	TRAMPOLINE_VAR(x86_ap_trampoline_cr4) = x86_get_cr4();
+	TRAMPOLINE_VAR(x86_ap_trampoline_stack) = (uintptr_t)stack + ARCH_DEFAULT_STACK_SIZE;
+	TRAMPOLINE_VAR(x86_ap_trampoline_cpu_num) = cpu;
+	ap_started = 0;
+	smp_mb();
+
+	/* the usual INIT, SIPI, SIPI dance */
+	lapic_send_init_ipi(apic_id);
+	thread_sleep(10);
+
+	for (uint i = 0; i < 2 && !ap_started; i++) {
+		lapic_send_startup_ipi(apic_id, X86_AP_TRAMPOLINE_ADDR);
+		spin(200);
+	}
+
+	lk_time_t start = current_time();
+	while (!ap_started) {
+		if (current_time() - start > 100) {
+			/* it may still wake up later and use the stack, so leak it */
+			dprintf(CRITICAL, "cpu %u (apic id %u) did not start\n", cpu, apic_id);
+			return ERR_TIMED_OUT;
+		}
+		thread_yield();
+	}
+
+	return NO_ERROR;
+}
+
+status_t x86_mp_boot_cpus(const uint32_t *apic_ids, uint count)
+{
+	uint32_t self = lapic_get_id();
+	x86_percpu_array[0].apic_id = self;
+
+	/* copy the trampoline down into low memory, where a startup ipi can reach it */
+	size_t len = x86_ap_trampoline_end - x86_ap_trampoline;
+	DEBUG_ASSERT(len <= PAGE_SIZE);
+
+	struct map_range range;
+	range.start_vaddr = X86_AP_TRAMPOLINE_ADDR;
+	range.start_paddr = X86_AP_TRAMPOLINE_ADDR;
+	range.size = PAGE_SIZE;
+	status_t err = x86_mmu_map_range(x86_get_cr3(), &range, X86_MMU_PG_P | X86_MMU_PG_RW);
+	if (err < 0)
+		return err;
+
+	memcpy((void *)X86_AP_TRAMPOLINE_ADDR, x86_ap_trampoline, len);
+
+	arch_mp_init_percpu();
+
+	uint secondaries = 0;
+	for (uint i = 0; i < count; i++) {
+		if (apic_ids[i] != self)
+			secondaries++;
+	}
+	secondaries = MIN(secondaries, SMP_MAX_CPUS - 1);
+
+	lk_init_secondary_cpus(secondaries);
+
+	uint cpu = 1;
+	for (uint i = 0; i < count && cpu <= secondaries; i++) {
+		if (apic_ids[i] == self)
+			continue;
+
+		err = x86_boot_cpu(cpu, apic_ids[i]);
+		if (err < 0)
+			break;
+
+		x86_num_cpus = ++cpu;
+	}
+
+	dprintf(INFO, "X86: %u cpus online\n", x86_num_cpus);
+
+	return err;
+}
+
+void x86_secondary_entry(uint cpu_num)
+{
+	x86_init_percpu(cpu_num);
+
+	atomic_or(&x86_online_cpus, 1 << cpu_num);
+
+	/* let the boot cpu move on, it owns the trampoline again from here */
+	ap_started = 1;
+	smp_mb();
+
+	lapic_init_percpu();
+
+	/* run the early secondary init hooks, the rest run in the bootstrap thread */
+	lk_init_level(LK_INIT_FLAG_SECONDARY_CPUS, LK_INIT_LEVEL_EARLIEST, LK_INIT_LEVEL_THREADING - 1);
+
+	arch_mp_init_percpu();
+
+	dprintf(SPEW, "X86: secondary cpu %u, apic id %u started\n", cpu_num, lapic_get_id());
+
+	lk_secondary_cpu_entry();
+}
+
+status_t arch_mp_send_ipi(mp_cpu_mask_t target, mp_ipi_t ipi)
+{
+	LTRACEF("target 0x%x, ipi %u\n", target, ipi);
+
+	uint vector = (ipi == MP_IPI_RESCHEDULE) ? INT_IPI_RESCHEDULE : INT_IPI_GENERIC;
+
+	if (target == MP_CPU_ALL_BUT_LOCAL)
+		target &= ~(1U << arch_curr_cpu_num());
+
+	/* filter out targets outside of the cpus that actually came up */
+	target &= (mp_cpu_mask_t)((1ULL << x86_num_cpus) - 1);
+
+	for (uint cpu = 0; target != 0; cpu++, target >>= 1) {
+		if (target & 1)
+			lapic_send_ipi(x86_percpu_array[cpu].apic_id, vector);
+	}
+
+	return NO_ERROR;
+}
+
+/* do our part of the shootdown in flight, if there is one for us */
+static void x86_tlb_shootdown_service(uint cpu)
+{
+	if (!(tlb_shootdown.pending & (1 << cpu)))
+		return;
+
+	x86_tlb_invalidate(tlb_shootdown.pml4, tlb_shootdown.vaddr, tlb_shootdown.count);
+	atomic_and(&tlb_shootdown.pending, ~(1 << cpu));
+}
+
+void x86_tlb_shootdown(addr_t pml4, const vaddr_t *vaddr, uint count)
+{
+	spin_lock_saved_state_t state;
+	arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+	uint cpu = arch_curr_cpu_num();
+	int targets = x86_online_cpus & ~(1 << cpu);
+	if (targets == 0)
+		goto done;
+
+	LTRACEF("cpu %u, targets 0x%x, pml4 0x%lx, count %u\n", cpu, targets, pml4, count);
+
+	/* someone else may be shooting at us with interrupts off, keep answering them while we wait */
+	while (spin_trylock(&tlb_shootdown_lock)) {
+		x86_tlb_shootdown_service(cpu);
+		arch_spinloop_pause();
+	}
+
+	tlb_shootdown.pml4 = pml4;
+	tlb_shootdown.vaddr = vaddr;
+	tlb_shootdown.count = count;
+	smp_mb();
+	tlb_shootdown.pending = targets;
+	smp_mb();
+
+	for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+		if (targets & (1 << i))
+			lapic_send_ipi(x86_percpu_array[i].apic_id, INT_IPI_TLB);
+	}
+
+	while (tlb_shootdown.pending)
+		arch_spinloop_pause();
+
+	spin_unlock(&tlb_shootdown_lock);
+
+done:
+	arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+static enum handler_return x86_ipi_tlb_handler(void *arg)
+{
+	x86_tlb_shootdown_service(arch_curr_cpu_num());
+
+	return INT_NO_RESCHEDULE;
+}
+
+static enum handler_return x86_ipi_generic_handler(void *arg)
+{
+	LTRACEF("cpu %u, arg %p\n", arch_curr_cpu_num(), arg);
+
+	return INT_NO_RESCHEDULE;
+}
+
+static enum handler_return x86_ipi_reschedule_handler(void *arg)
+{
+	LTRACEF("cpu %u, arg %p\n", arch_curr_cpu_num(), arg);
+
+	return mp_mbx_reschedule_irq();
+}
+
+void arch_mp_init_percpu(void)
+{
+	/* the idt and handler table are shared, so this only really has to happen once */
+	register_int_handler(INT_IPI_GENERIC, &x86_ipi_generic_handler, 0);
+	register_int_handler(INT_IPI_RESCHEDULE, &x86_ipi_reschedule_handler, 0);
+	register_int_handler(INT_IPI_TLB, &x86_ipi_tlb_handler, 0);
+}
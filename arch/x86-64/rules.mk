@@ -7,6 +7,7 @@ GLOBAL_INCLUDES += \
 
 WITH_KERNEL_VM=1
 GLOBAL_DEFINES += \
+    IS_64BIT=1 \
     KERNEL_ASPACE_BASE=0x00000000 \
     KERNEL_ASPACE_SIZE=0xc0000000
  
@@ -23,7 +24,24 @@ MODULE_SRCS += \
 	$(LOCAL_DIR)/thread.c \
 	$(LOCAL_DIR)/mmu.c \
 	$(LOCAL_DIR)/faults.c \
-	$(LOCAL_DIR)/descriptor.c
+	$(LOCAL_DIR)/descriptor.c \
+	$(LOCAL_DIR)/lapic.c
+
+# the platform turns this on if it knows how to find the other cpus
+ifeq ($(WITH_SMP),1)
+SMP_MAX_CPUS ?= 8
+
+GLOBAL_DEFINES += \
+	WITH_SMP=1 \
+	SMP_MAX_CPUS=$(SMP_MAX_CPUS)
+
+MODULE_SRCS += \
+	$(LOCAL_DIR)/mp.c \
+	$(LOCAL_DIR)/start16.S
+else
+GLOBAL_DEFINES += \
+	SMP_MAX_CPUS=1
+endif
 
 # set the default toolchain to x86 elf and set a #define
 ifndef TOOLCHAIN_PREFIX
@@ -43,6 +61,9 @@ GLOBAL_COMPILEFLAGS += -fasynchronous-unwind-tables
 GLOBAL_COMPILEFLAGS += -gdwarf-2
 GLOBAL_COMPILEFLAGS += -fno-stack-protector
 
+# none of the assembly needs an executable stack, say so rather than have the linker guess
+GLOBAL_ASMFLAGS += -Wa,--noexecstack
+
 ARCH_OPTFLAGS := -O2
 
 # potentially generated files that should be cleaned out with clean make rule
@@ -38,19 +38,17 @@ struct context_switch_frame {
 	uint64_t rip;
 };
 
-/* we're uniprocessor at this point for x86-64, so store a global pointer to the current thread */
-struct thread *_current_thread;
-
 static void initial_thread_func(void) __NO_RETURN;
 static void initial_thread_func(void)
 {
 	int ret;
+	thread_t *current_thread = get_current_thread();
 
 	/* release the thread lock that was implicitly held across the reschedule */
 	spin_unlock(&thread_lock);
 	arch_enable_ints();
 
-	ret = _current_thread->entry(_current_thread->arg);
+	ret = current_thread->entry(current_thread->arg);
 
 	thread_exit(ret);
 }
@@ -79,6 +77,14 @@ void arch_thread_initialize(thread_t *t)
 	t->arch.rsp = (vaddr_t)frame;
 }
 
+void arch_dump_thread(thread_t *t)
+{
+	if (t->state != THREAD_RUNNING) {
+		dprintf(INFO, "\tarch: ");
+		dprintf(INFO, "sp 0x%lx\n", t->arch.rsp);
+	}
+}
+
 void arch_context_switch(thread_t *oldthread, thread_t *newthread)
 {
 
@@ -32,8 +32,28 @@
 
 static tss_t system_tss;
 
+bool x86_has_erms;
+bool x86_has_sse2;
+
+static void x86_feature_init(void)
+{
+	uint32_t a, b, c, d;
+
+	x86_cpuid(0, 0, &a, &b, &c, &d);
+	uint32_t max_leaf = a;
+
+	x86_cpuid(X86_CPUID_FEATURES, 0, &a, &b, &c, &d);
+	x86_has_sse2 = !!(d & X86_CPUID_SSE2);
+
+	if (max_leaf >= X86_CPUID_EXT_FEATURES) {
+		x86_cpuid(X86_CPUID_EXT_FEATURES, 0, &a, &b, &c, &d);
+		x86_has_erms = !!(b & X86_CPUID_ERMS);
+	}
+}
+
 void arch_early_init(void)
 {
+	x86_feature_init();
 	x86_mmu_init();
 
 	platform_init_mmu_mappings();
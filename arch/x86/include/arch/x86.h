@@ -25,6 +25,7 @@
 
 #include <compiler.h>
 #include <sys/types.h>
+#include <stdbool.h>
 
 __BEGIN_CDECLS
 
@@ -281,6 +282,24 @@ static inline void outpdrep(uint16_t _port, uint32_t *_buffer,
 		  "c" (_writes));
 }
 
+static inline void x86_cpuid(uint32_t leaf, uint32_t subleaf,
+	uint32_t *a, uint32_t *b, uint32_t *c, uint32_t *d)
+{
+	__asm__ __volatile__ (
+		"cpuid \n\t"
+		:"=a" (*a), "=b" (*b), "=c" (*c), "=d" (*d)
+		:"a" (leaf), "c" (subleaf));
+}
+
+#define X86_CPUID_FEATURES	0x1
+#define X86_CPUID_EXT_FEATURES	0x7
+#define X86_CPUID_SSE2		(1 << 26)	/* leaf 1 edx */
+#define X86_CPUID_ERMS		(1 << 9)	/* leaf 7 ebx, enhanced rep movsb/stosb */
+
+/* cpu features the string routines in lib/libc dispatch on, set in arch_early_init */
+extern bool x86_has_erms;
+extern bool x86_has_sse2;
+
 __END_CDECLS
 
 #endif
@@ -33,6 +33,14 @@
 #include <arch/ops.h>
 #include <platform/gic.h>
 #include <trace.h>
+#if ARCH_ARM
+#include <arch/arm.h>
+#define iframe arm_iframe
+#endif
+#if ARCH_ARM64
+#include <arch/arm64.h>
+#define iframe arm64_iframe_short
+#endif
 #if WITH_LIB_SM
 #include <lib/sm.h>
 #include <lib/sm/sm_err.h>
@@ -356,7 +364,7 @@ status_t unmask_interrupt(unsigned int vector)
 }
 
 static
-enum handler_return __platform_irq(struct arm_iframe *frame)
+enum handler_return __platform_irq(struct iframe *frame)
 {
 	// get the current vector
 	uint32_t iar = GICREG(0, GICC_IAR);
@@ -392,7 +400,7 @@ enum handler_return __platform_irq(struct arm_iframe *frame)
 	return ret;
 }
 
-enum handler_return platform_irq(struct arm_iframe *frame)
+enum handler_return platform_irq(struct iframe *frame)
 {
 #if WITH_LIB_SM
 	uint32_t ahppir = GICREG(0, GICC_AHPPIR);
@@ -435,7 +443,7 @@ enum handler_return platform_irq(struct arm_iframe *frame)
 #endif
 }
 
-void platform_fiq(struct arm_iframe *frame)
+void platform_fiq(struct iframe *frame)
 {
 #if WITH_LIB_SM
 	sm_handle_irq();
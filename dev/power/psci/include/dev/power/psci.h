@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS
+
+/* power state coordination interface 0.2 function ids, 64 bit calling convention */
+#define PSCI_VERSION            0x84000000
+#define PSCI_CPU_SUSPEND        0xc4000001
+#define PSCI_CPU_OFF            0x84000002
+#define PSCI_CPU_ON             0xc4000003
+#define PSCI_AFFINITY_INFO      0xc4000004
+#define PSCI_SYSTEM_OFF         0x84000008
+#define PSCI_SYSTEM_RESET       0x84000009
+
+/* return codes */
+#define PSCI_SUCCESS            0
+#define PSCI_NOT_SUPPORTED      -1
+#define PSCI_INVALID_PARAMETERS -2
+#define PSCI_DENIED             -3
+#define PSCI_ALREADY_ON         -4
+#define PSCI_ON_PENDING         -5
+#define PSCI_INTERNAL_FAILURE   -6
+
+int psci_call(ulong function, ulong arg0, ulong arg1, ulong arg2);
+
+/* start the cpu with the given mpidr at physical address entry, with context in x0 */
+static inline int psci_cpu_on(ulong mpidr, paddr_t entry, ulong context)
+{
+	return psci_call(PSCI_CPU_ON, mpidr, entry, context);
+}
+
+static inline void psci_system_off(void)
+{
+	psci_call(PSCI_SYSTEM_OFF, 0, 0, 0);
+}
+
+static inline void psci_system_reset(void)
+{
+	psci_call(PSCI_SYSTEM_RESET, 0, 0, 0);
+}
+
+__END_CDECLS
@@ -0,0 +1,18 @@
+LOCAL_DIR := $(GET_LOCAL_DIR)
+
+MODULE := $(LOCAL_DIR)
+
+GLOBAL_INCLUDES += \
+	$(LOCAL_DIR)/include
+
+# the platform picks the conduit, hvc when the firmware lives in a hypervisor
+# (qemu), smc when it lives in el3 (arm trusted firmware)
+PSCI_USE_HVC ?= 0
+
+MODULE_DEFINES += \
+	PSCI_USE_HVC=$(PSCI_USE_HVC)
+
+MODULE_SRCS += \
+	$(LOCAL_DIR)/psci.S
+
+include make/module.mk
@@ -28,5 +28,7 @@
 
 status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features) __NONNULL();
 
+/* the device is also published as a bio device named virtio<n>, these go through it */
 ssize_t virtio_block_read(struct virtio_device *dev, void *buf, off_t offset, size_t len);
+ssize_t virtio_block_write(struct virtio_device *dev, const void *buf, off_t offset, size_t len);
 
@@ -28,9 +28,17 @@
 #include <compiler.h>
 #include <list.h>
 #include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <malloc.h>
+#include <string.h>
 #include <kernel/thread.h>
 #include <kernel/event.h>
+#include <kernel/spinlock.h>
 #include <kernel/vm.h>
+#include <lib/bio.h>
+
+#include "../virtio_priv.h"
 
 #define LOCAL_TRACE 0
 
@@ -44,6 +52,21 @@ struct virtio_blk_config {
         uint8_t sectors;
     } geometry;
     uint32_t blk_size;
+    struct virtio_blk_topology {
+        uint8_t physical_block_exp;
+        uint8_t alignment_offset;
+        uint16_t min_io_size;
+        uint32_t opt_io_size;
+    } topology;
+    uint8_t writeback;
+    uint8_t unused0[3];
+    uint32_t max_discard_sectors;
+    uint32_t max_discard_seg;
+    uint32_t discard_sector_alignment;
+    uint32_t max_write_zeroes_sectors;
+    uint32_t max_write_zeroes_seg;
+    uint8_t write_zeroes_may_unmap;
+    uint8_t unused1[3];
 } __PACKED;
 
 struct virtio_blk_req {
@@ -52,6 +75,12 @@ struct virtio_blk_req {
     uint64_t sector;
 } __PACKED;
 
+struct virtio_blk_discard_write_zeroes {
+    uint64_t sector;
+    uint32_t num_sectors;
+    uint32_t flags;
+} __PACKED;
+
 #define VIRTIO_BLK_F_BARRIER  (1<<0)
 #define VIRTIO_BLK_F_SIZE_MAX (1<<1)
 #define VIRTIO_BLK_F_SEG_MAX  (1<<2)
@@ -60,18 +89,88 @@ struct virtio_blk_req {
 #define VIRTIO_BLK_F_BLK_SIZE (1<<6)
 #define VIRTIO_BLK_F_SCSI     (1<<7)
 #define VIRTIO_BLK_F_FLUSH    (1<<9)
+#define VIRTIO_BLK_F_DISCARD  (1<<13)
+#define VIRTIO_BLK_F_WRITE_ZEROES (1<<14)
 
 #define VIRTIO_BLK_T_IN         0
 #define VIRTIO_BLK_T_OUT        1
 #define VIRTIO_BLK_T_FLUSH      4
+#define VIRTIO_BLK_T_DISCARD    11
+#define VIRTIO_BLK_T_WRITE_ZEROES 13
+
+#define VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP (1<<0)
 
 #define VIRTIO_BLK_S_OK         0
 #define VIRTIO_BLK_S_IOERR      1
 #define VIRTIO_BLK_S_UNSUPP     2
 
+#define VIRTIO_BLK_SECTOR_SIZE  512
+
+/* features we know how to use */
+#define VIRTIO_BLK_GUEST_FEATURES \
+    (VIRTIO_BLK_F_SIZE_MAX | VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_RO | \
+     VIRTIO_BLK_F_BLK_SIZE | VIRTIO_BLK_F_FLUSH | VIRTIO_BLK_F_DISCARD | \
+     VIRTIO_BLK_F_WRITE_ZEROES)
+
+#define VIRTIO_BLOCK_RING_LEN    128
+/* block requests the driver takes from bio at once */
+#define VIRTIO_BLOCK_QUEUE_DEPTH 16
+/* most data descriptors in a single virtio request */
+#define VIRTIO_BLOCK_MAX_SEGS    32
+
+/* a bio request chain handed to us by the bio layer. big or badly fragmented ones
+ * go out to the device as several virtio requests. */
+struct virtio_block_io {
+    struct list_node node;
+    bio_request_t *req;
+
+    /* how far we've gotten issuing it */
+    bio_request_t *seg;
+    size_t seg_offset;
+    bnum_t block;
+    uint remaining;
+
+    uint outstanding;
+    ssize_t result;
+};
+
+/* per virtio request state, indexed by the head descriptor of its chain. the
+ * alignment keeps the bits the device reads and writes from straddling a page. */
+struct virtio_block_txn {
+    struct virtio_block_io *io;
+    uint32_t len;
+    struct virtio_blk_req req;
+    struct virtio_blk_discard_write_zeroes discard;
+    uint8_t status;
+} __ALIGNED(64);
+
+struct virtio_block_dev {
+    bdev_t bdev;
+    struct virtio_device *dev;
+
+    spin_lock_t lock;
+    uint32_t features;
+    uint sectors_per_block;
+    uint32_t size_max;
+    uint max_segs;
+    uint32_t max_discard_blocks;
+    uint32_t max_write_zeroes_blocks;
+    bool write_zeroes_may_unmap;
+
+    /* ios waiting for descriptors, in submission order */
+    struct list_node waiting;
+    struct virtio_block_io *free_io[VIRTIO_BLOCK_QUEUE_DEPTH];
+    uint free_io_count;
+    struct virtio_block_io io[VIRTIO_BLOCK_QUEUE_DEPTH];
+
+    struct virtio_block_txn *txn;
+};
+
 static enum handler_return virtio_block_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e);
+static status_t virtio_block_submit(bdev_t *bdev, bio_request_t *req);
+static ssize_t virtio_block_erase(bdev_t *bdev, off_t offset, size_t len);
 
-static event_t *curr_event;
+static uint virtio_block_count;
 
 status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features)
 {
@@ -84,19 +183,344 @@ status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features)
     LTRACEF("seg_max  0x%x\n", config->seg_max);
     LTRACEF("blk_size 0x%x\n", config->blk_size);
 
+    struct virtio_block_dev *bdev = calloc(1, sizeof(struct virtio_block_dev));
+    if (!bdev)
+        return ERR_NO_MEMORY;
+
+    bdev->txn = memalign(__alignof__(struct virtio_block_txn), VIRTIO_BLOCK_RING_LEN * sizeof(struct virtio_block_txn));
+    if (!bdev->txn) {
+        free(bdev);
+        return ERR_NO_MEMORY;
+    }
+    memset(bdev->txn, 0, VIRTIO_BLOCK_RING_LEN * sizeof(struct virtio_block_txn));
+
+    bdev->dev = dev;
+    dev->priv = bdev;
+    spin_lock_init(&bdev->lock);
+    list_initialize(&bdev->waiting);
+    for (uint i = 0; i < VIRTIO_BLOCK_QUEUE_DEPTH; i++)
+        bdev->free_io[bdev->free_io_count++] = &bdev->io[i];
+
+    /* negotiate features */
+    bdev->features = host_features & VIRTIO_BLK_GUEST_FEATURES;
+    dev->mmio_config->guest_features_sel = 0;
+    dev->mmio_config->guest_features = bdev->features;
+
+    size_t block_size = VIRTIO_BLK_SECTOR_SIZE;
+    if (bdev->features & VIRTIO_BLK_F_BLK_SIZE)
+        block_size = config->blk_size;
+    bdev->sectors_per_block = block_size / VIRTIO_BLK_SECTOR_SIZE;
+
+    bdev->size_max = (bdev->features & VIRTIO_BLK_F_SIZE_MAX) ? config->size_max : 0;
+
+    /* leave room for the header and status descriptors */
+    bdev->max_segs = MIN(VIRTIO_BLOCK_MAX_SEGS, VIRTIO_BLOCK_RING_LEN - 2);
+    if ((bdev->features & VIRTIO_BLK_F_SEG_MAX) && config->seg_max > 0)
+        bdev->max_segs = MIN(bdev->max_segs, config->seg_max);
+    bdev->max_segs = MAX(bdev->max_segs, 2U);
+
+    if (bdev->features & VIRTIO_BLK_F_DISCARD)
+        bdev->max_discard_blocks = config->max_discard_sectors / bdev->sectors_per_block;
+    if (bdev->features & VIRTIO_BLK_F_WRITE_ZEROES) {
+        bdev->max_write_zeroes_blocks = config->max_write_zeroes_sectors / bdev->sectors_per_block;
+        bdev->write_zeroes_may_unmap = config->write_zeroes_may_unmap;
+    }
+
     /* allocate a virtio ring */
-    virtio_alloc_ring(dev, 0, 128);
+    status_t err = virtio_alloc_ring(dev, 0, VIRTIO_BLOCK_RING_LEN);
+    if (err < 0) {
+        free(bdev->txn);
+        free(bdev);
+        return err;
+    }
 
     /* set our irq handler */
     dev->irq_driver_callback = &virtio_block_irq_driver_callback;
 
+    /* publish it */
+    char name[16];
+    snprintf(name, sizeof(name), "virtio%u", virtio_block_count++);
+    bio_initialize_bdev(&bdev->bdev, name, block_size, config->capacity / bdev->sectors_per_block);
+
+    bdev->bdev.submit = &virtio_block_submit;
+    bdev->bdev.queue_depth = VIRTIO_BLOCK_QUEUE_DEPTH;
+    bdev->bdev.max_segments = VIRTIO_BLOCK_MAX_SEGS;
+    bdev->bdev.max_request_blocks = (bdev->max_segs * PAGE_SIZE) / block_size;
+    /* a discard leaves the contents undefined, only write zeroes can stand in for erase */
+    if ((bdev->features & VIRTIO_BLK_F_WRITE_ZEROES) && bdev->max_write_zeroes_blocks > 0)
+        bdev->bdev.erase = &virtio_block_erase;
+
+    bio_register_device(&bdev->bdev);
+
+    printf("virtio block device '%s': %llu blocks of %zu bytes, features 0x%x\n",
+           name, config->capacity / bdev->sectors_per_block, block_size, bdev->features);
+
+    return NO_ERROR;
+}
+
+/* gather the physical segments for the next chunk of a read or write. a segment
+ * ends at any page boundary that isn't physically contiguous with the next page.
+ * returns the number of segments and the bytes they cover, trimmed to whole blocks. */
+static uint virtio_block_gather(struct virtio_block_dev *bdev, struct virtio_block_io *io,
+                                uint max_segs, paddr_t *pa, uint32_t *len, size_t *total)
+{
+    size_t block_size = bdev->bdev.block_size;
+    size_t limit = (size_t)io->remaining * block_size;
+    bio_request_t *seg = io->seg;
+    size_t seg_offset = io->seg_offset;
+    uint count = 0;
+
+    *total = 0;
+    while (*total < limit && seg) {
+        size_t seg_len = ((size_t)seg->count << bdev->bdev.block_shift) - seg_offset;
+        if (seg_len == 0) {
+            seg = seg->merge_next;
+            seg_offset = 0;
+            continue;
+        }
+
+        uint8_t *va = (uint8_t *)seg->buf + seg_offset;
+        size_t chunk = MIN(seg_len, PAGE_SIZE - ((uintptr_t)va & (PAGE_SIZE - 1)));
+        chunk = MIN(chunk, limit - *total);
+        paddr_t chunk_pa = virtio_vtop(va);
+
+        if (count > 0 && pa[count - 1] + len[count - 1] == chunk_pa &&
+                (!bdev->size_max || len[count - 1] + chunk <= bdev->size_max)) {
+            len[count - 1] += chunk;
+        } else {
+            if (count == max_segs)
+                break;
+            pa[count] = chunk_pa;
+            len[count] = chunk;
+            count++;
+        }
+
+        *total += chunk;
+        seg_offset += chunk;
+    }
+
+    /* the next virtio request has to start on a block boundary */
+    size_t extra = *total & (block_size - 1);
+    *total -= extra;
+    while (extra > 0) {
+        size_t trim = MIN(extra, (size_t)len[count - 1]);
+        len[count - 1] -= trim;
+        extra -= trim;
+        if (len[count - 1] == 0)
+            count--;
+    }
+
+    return count;
+}
+
+/* move an io's cursor past bytes that have been issued */
+static void virtio_block_advance(struct virtio_block_dev *bdev, struct virtio_block_io *io, size_t bytes)
+{
+    io->block += bytes >> bdev->bdev.block_shift;
+    io->remaining -= bytes >> bdev->bdev.block_shift;
+
+    while (bytes > 0 && io->seg) {
+        size_t seg_len = ((size_t)io->seg->count << bdev->bdev.block_shift) - io->seg_offset;
+        if (bytes < seg_len) {
+            io->seg_offset += bytes;
+            return;
+        }
+        bytes -= seg_len;
+        io->seg = io->seg->merge_next;
+        io->seg_offset = 0;
+    }
+}
+
+/* build the next virtio request for an io, returns false if the ring is too full */
+static bool virtio_block_issue_one(struct virtio_block_dev *bdev, struct virtio_block_io *io)
+{
+    struct virtio_device *dev = bdev->dev;
+    paddr_t pa[VIRTIO_BLOCK_MAX_SEGS];
+    uint32_t len[VIRTIO_BLOCK_MAX_SEGS];
+    uint segs = 0;
+    size_t bytes = 0;
+    uint32_t type;
+
+    /* need room for the header, status and at least a couple of data segments */
+    uint free_desc = dev->ring[0].free_count;
+    if (free_desc < 4)
+        return false;
+
+    switch (io->req->op) {
+        case BIO_OP_READ:
+        case BIO_OP_WRITE:
+            type = (io->req->op == BIO_OP_READ) ? VIRTIO_BLK_T_IN : VIRTIO_BLK_T_OUT;
+            segs = virtio_block_gather(bdev, io, MIN(bdev->max_segs, free_desc - 2), pa, len, &bytes);
+            DEBUG_ASSERT(segs > 0 && bytes > 0);
+            break;
+        case BIO_OP_DISCARD:
+            type = VIRTIO_BLK_T_DISCARD;
+            bytes = (size_t)MIN(io->remaining, bdev->max_discard_blocks) << bdev->bdev.block_shift;
+            segs = 1;
+            break;
+        case BIO_OP_WRITE_ZEROES:
+            type = VIRTIO_BLK_T_WRITE_ZEROES;
+            bytes = (size_t)MIN(io->remaining, bdev->max_write_zeroes_blocks) << bdev->bdev.block_shift;
+            segs = 1;
+            break;
+        case BIO_OP_FLUSH:
+        default:
+            type = VIRTIO_BLK_T_FLUSH;
+            break;
+    }
+
+    uint16_t head;
+    struct vring_desc *desc = virtio_alloc_desc_chain(dev, 0, segs + 2, &head);
+    DEBUG_ASSERT(desc);
+
+    struct virtio_block_txn *txn = &bdev->txn[head];
+    txn->io = io;
+    txn->len = bytes;
+    txn->req.type = type;
+    txn->req.ioprio = 0;
+    txn->req.sector = (uint64_t)io->block * bdev->sectors_per_block;
+    txn->status = 0xff;
+
+    /* header */
+    desc->addr = virtio_vtop(&txn->req);
+    desc->len = sizeof(txn->req);
+    desc->flags |= VRING_DESC_F_NEXT;
+
+    /* data */
+    if (type == VIRTIO_BLK_T_DISCARD || type == VIRTIO_BLK_T_WRITE_ZEROES) {
+        txn->discard.sector = txn->req.sector;
+        txn->discard.num_sectors = (bytes >> bdev->bdev.block_shift) * bdev->sectors_per_block;
+        txn->discard.flags = 0;
+        if (type == VIRTIO_BLK_T_WRITE_ZEROES && bdev->write_zeroes_may_unmap)
+            txn->discard.flags = VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP;
+
+        desc = virtio_desc_index_to_desc(dev, 0, desc->next);
+        desc->addr = virtio_vtop(&txn->discard);
+        desc->len = sizeof(txn->discard);
+        desc->flags |= VRING_DESC_F_NEXT;
+    } else {
+        for (uint i = 0; i < segs; i++) {
+            desc = virtio_desc_index_to_desc(dev, 0, desc->next);
+            desc->addr = pa[i];
+            desc->len = len[i];
+            desc->flags |= VRING_DESC_F_NEXT;
+            if (type == VIRTIO_BLK_T_IN)
+                desc->flags |= VRING_DESC_F_WRITE;
+        }
+    }
+
+    /* status */
+    desc = virtio_desc_index_to_desc(dev, 0, desc->next);
+    desc->addr = virtio_vtop(&txn->status);
+    desc->len = 1;
+    desc->flags = VRING_DESC_F_WRITE;
+
+    if (type == VIRTIO_BLK_T_DISCARD || type == VIRTIO_BLK_T_WRITE_ZEROES) {
+        io->block += bytes >> bdev->bdev.block_shift;
+        io->remaining -= bytes >> bdev->bdev.block_shift;
+    } else {
+        virtio_block_advance(bdev, io, bytes);
+    }
+    io->outstanding++;
+
+    virtio_submit_chain(dev, 0, head);
+
+    return true;
+}
+
+/* push as much of the waiting work into the ring as will fit, in order.
+ * called with the lock held. */
+static void virtio_block_pump(struct virtio_block_dev *bdev)
+{
+    bool kick = false;
+    struct virtio_block_io *io;
+
+    while ((io = list_peek_head_type(&bdev->waiting, struct virtio_block_io, node))) {
+        while (io->remaining > 0 || (io->req->op == BIO_OP_FLUSH && io->outstanding == 0)) {
+            if (!virtio_block_issue_one(bdev, io))
+                goto done;
+            kick = true;
+            if (io->req->op == BIO_OP_FLUSH)
+                break;
+        }
+        list_delete(&io->node);
+    }
+
+done:
+    if (kick)
+        virtio_kick(bdev->dev, 0);
+}
+
+static status_t virtio_block_submit(bdev_t *_bdev, bio_request_t *req)
+{
+    struct virtio_block_dev *bdev = containerof(_bdev, struct virtio_block_dev, bdev);
+
+    LTRACEF("bdev %p, req %p, op %u, block %u, blocks %u, segments %u\n", bdev, req,
+            req->op, req->block, req->merge_blocks, req->merge_segments);
+
+    switch (req->op) {
+        case BIO_OP_READ:
+            break;
+        case BIO_OP_WRITE:
+            if (bdev->features & VIRTIO_BLK_F_RO)
+                return ERR_ACCESS_DENIED;
+            break;
+        case BIO_OP_FLUSH:
+            /* without the flush feature the device doesn't cache writes */
+            if (!(bdev->features & VIRTIO_BLK_F_FLUSH)) {
+                bio_complete_request(req, 0);
+                return NO_ERROR;
+            }
+            break;
+        case BIO_OP_DISCARD:
+            if (!(bdev->features & VIRTIO_BLK_F_DISCARD) || bdev->max_discard_blocks == 0)
+                return ERR_NOT_SUPPORTED;
+            break;
+        case BIO_OP_WRITE_ZEROES:
+            if (!(bdev->features & VIRTIO_BLK_F_WRITE_ZEROES) || bdev->max_write_zeroes_blocks == 0)
+                return ERR_NOT_SUPPORTED;
+            if (bdev->features & VIRTIO_BLK_F_RO)
+                return ERR_ACCESS_DENIED;
+            break;
+        default:
+            return ERR_NOT_SUPPORTED;
+    }
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&bdev->lock, state);
+
+    /* bio never hands us more than queue_depth requests */
+    DEBUG_ASSERT(bdev->free_io_count > 0);
+    struct virtio_block_io *io = bdev->free_io[--bdev->free_io_count];
+
+    io->req = req;
+    io->seg = req;
+    io->seg_offset = 0;
+    io->block = req->block;
+    io->remaining = (req->op == BIO_OP_FLUSH) ? 0 : req->merge_blocks;
+    io->outstanding = 0;
+    io->result = 0;
+
+    list_add_tail(&bdev->waiting, &io->node);
+    virtio_block_pump(bdev);
+
+    spin_unlock_irqrestore(&bdev->lock, state);
+
     return NO_ERROR;
 }
 
 static enum handler_return virtio_block_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e)
 {
+    struct virtio_block_dev *bdev = (struct virtio_block_dev *)dev->priv;
+
     LTRACEF("dev %p, ring %u, e %p, id %u, len %u\n", dev, ring, e, e->id, e->len);
 
+    spin_lock(&bdev->lock);
+
+    struct virtio_block_txn *txn = &bdev->txn[e->id];
+    struct virtio_block_io *io = txn->io;
+    txn->io = NULL;
+
     /* parse our descriptor chain, add back to the free queue */
     uint16_t i = e->id;
     for (;;) {
@@ -117,88 +541,96 @@ static enum handler_return virtio_block_irq_driver_callback(struct virtio_device
         i = next;
     }
 
-    /* signal our event */
-    event_signal(curr_event, false);
+    LTRACEF("status 0x%hhx\n", txn->status);
+
+    DEBUG_ASSERT(io && io->outstanding > 0);
+    io->outstanding--;
+    if (io->result >= 0) {
+        if (txn->status == VIRTIO_BLK_S_OK)
+            io->result += txn->len;
+        else if (txn->status == VIRTIO_BLK_S_UNSUPP)
+            io->result = ERR_NOT_SUPPORTED;
+        else
+            io->result = ERR_IO;
+    }
+
+    /* is the whole bio request done? */
+    bio_request_t *done = NULL;
+    ssize_t result = 0;
+    if (io->outstanding == 0 && io->remaining == 0 && !list_in_list(&io->node)) {
+        done = io->req;
+        result = io->result;
+        io->req = NULL;
+        bdev->free_io[bdev->free_io_count++] = io;
+    }
+
+    /* descriptors just came free, keep the ring full */
+    virtio_block_pump(bdev);
+
+    spin_unlock(&bdev->lock);
+
+    if (done)
+        bio_complete_request(done, result);
 
     return INT_RESCHEDULE;
 }
 
-ssize_t virtio_block_read(struct virtio_device *dev, void *buf, off_t offset, size_t len)
+/* write zeros over part of a block */
+static ssize_t virtio_block_zero(bdev_t *bdev, off_t offset, size_t len)
 {
-    uint16_t i;
-    struct vring_desc *desc;
-    paddr_t pa;
+    uint8_t *zero_buf = calloc(1, len);
+    if (!zero_buf)
+        return ERR_NO_MEMORY;
 
-    LTRACEF("dev %p, buf %p, offset 0x%llx, len %zu\n", dev, buf, offset, len);
+    ssize_t err = bio_write(bdev, zero_buf, offset, len);
+    free(zero_buf);
 
-    /* set up the request */
-    struct virtio_blk_req blk_req;
-    blk_req.type = VIRTIO_BLK_T_IN;
-    blk_req.ioprio = 0;
-    blk_req.sector = offset / 512;
-
-    /* put together a transfer */
-    desc = virtio_alloc_desc_chain(dev, 0, 3, &i);
-    LTRACEF("after alloc chain desc %p, i %u\n", desc, i);
-
-    // XXX not cache safe.
-    // At the moment only tested on arm qemu, which doesn't emulate cache.
-
-    /* set up the descriptor pointing to the head */
-#if WITH_KERNEL_VM
-    // XXX handle bufs that cross page boundaries
-    arch_mmu_query((vaddr_t)&blk_req, &pa, NULL);
-    desc->addr = (uint64_t)pa;
-#else
-    desc->addr = (uint64_t)(uintptr_t)&blk_req;
-#endif
-    desc->len = sizeof(blk_req);
-    desc->flags |= VRING_DESC_F_NEXT;
-    virtio_dump_desc(desc);
+    return err;
+}
 
-    /* set up the descriptor pointing to the buffer */
-    desc = virtio_desc_index_to_desc(dev, 0, desc->next);
-#if WITH_KERNEL_VM
-    // XXX handle bufs that cross page boundaries
-    arch_mmu_query((vaddr_t)buf, &pa, NULL);
-    desc->addr = (uint64_t)pa;
-#else
-    desc->addr = (uint64_t)(uintptr_t)buf;
-#endif
-    desc->len = len;
-    desc->flags |= VRING_DESC_F_NEXT | VRING_DESC_F_WRITE;
-    virtio_dump_desc(desc);
-
-    /* set up the descriptor pointing to the response */
-    uint8_t blk_response;
-    desc = virtio_desc_index_to_desc(dev, 0, desc->next);
-#if WITH_KERNEL_VM
-    // XXX handle bufs that cross page boundaries
-    arch_mmu_query((vaddr_t)&blk_response, &pa, NULL);
-    desc->addr = (uint64_t)pa;
-#else
-    desc->addr = (uint64_t)(uintptr_t)&blk_response;
-#endif
-    desc->len = 1;
-    desc->flags = VRING_DESC_F_WRITE;
-    virtio_dump_desc(desc);
+static ssize_t virtio_block_erase(bdev_t *bdev, off_t offset, size_t len)
+{
+    /* have the device zero the whole blocks, and write zeros over the partial ones at either end */
+    off_t start = ROUNDUP(offset, (off_t)bdev->block_size);
+    off_t end = (offset + len) & ~((off_t)bdev->block_size - 1);
+    if (end <= start)
+        return virtio_block_zero(bdev, offset, len);
+
+    ssize_t err;
+    if (start > offset) {
+        err = virtio_block_zero(bdev, offset, start - offset);
+        if (err < 0)
+            return err;
+    }
 
-    /* set up an event to block on */
-    event_t event;
-    event_init(&event, false, 0);
-    curr_event = &event;
+    err = bio_sync_request(bdev, BIO_OP_WRITE_ZEROES, start >> bdev->block_shift,
+                           (end - start) >> bdev->block_shift, NULL);
+    if (err < 0)
+        return err;
 
-    /* submit the transfer */
-    virtio_submit_chain(dev, 0, i);
+    if (offset + (off_t)len > end) {
+        err = virtio_block_zero(bdev, end, offset + len - end);
+        if (err < 0)
+            return err;
+    }
 
-    /* kick it off */
-    virtio_kick(dev, 0);
+    return len;
+}
 
-    /* wait for the transfer to complete */
-    event_wait(&event);
+ssize_t virtio_block_read(struct virtio_device *dev, void *buf, off_t offset, size_t len)
+{
+    struct virtio_block_dev *bdev = (struct virtio_block_dev *)dev->priv;
 
-    LTRACEF("status 0x%hhx\n", blk_response);
+    LTRACEF("dev %p, buf %p, offset 0x%llx, len %zu\n", dev, buf, offset, len);
 
-    return len;
+    return bio_read(&bdev->bdev, buf, offset, len);
 }
 
+ssize_t virtio_block_write(struct virtio_device *dev, const void *buf, off_t offset, size_t len)
+{
+    struct virtio_block_dev *bdev = (struct virtio_block_dev *)dev->priv;
+
+    LTRACEF("dev %p, buf %p, offset 0x%llx, len %zu\n", dev, buf, offset, len);
+
+    return bio_write(&bdev->bdev, buf, offset, len);
+}
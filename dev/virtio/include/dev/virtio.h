@@ -31,7 +31,10 @@
  * returns number of devices found */
 int virtio_mmio_detect(void *ptr, uint count, const uint irqs[]);
 
-#define MAX_VIRTIO_RINGS 4
+/* enough for a few virtio-net queue pairs plus the control queue */
+#ifndef MAX_VIRTIO_RINGS
+#define MAX_VIRTIO_RINGS 16
+#endif
 
 struct virtio_mmio_config;
 
@@ -48,6 +51,14 @@ struct virtio_device {
 
     enum handler_return (*irq_driver_callback)(struct virtio_device *dev, uint ring, const struct vring_used_elem *e);
 
+    /* if set, called from the irq handler instead of walking the used rings. the
+     * driver drains them itself later with virtio_ring_poll() */
+    enum handler_return (*irq_notify_callback)(struct virtio_device *dev);
+
+    /* VIRTIO_RING_F_EVENT_IDX was negotiated, drivers that set it manage their
+     * used event index with virtio_ring_enable/disable_interrupts() */
+    bool event_idx;
+
     /* virtio rings */
     struct vring ring[MAX_VIRTIO_RINGS];
 };
@@ -55,6 +66,9 @@ struct virtio_device {
 /* api used by devices to interact with the virtio bus */
 status_t virtio_alloc_ring(struct virtio_device *dev, uint index, uint16_t len) __NONNULL();
 
+/* detach a ring from the device and free it, if it was allocated */
+void virtio_free_ring(struct virtio_device *dev, uint index) __NONNULL();
+
 /* add a descriptor at index desc_index to the free list on ring_index */
 void virtio_free_desc(struct virtio_device *dev, uint ring_index, uint16_t desc_index);
 
@@ -71,8 +85,24 @@ static inline struct vring_desc *virtio_desc_index_to_desc(struct virtio_device
 
 void virtio_dump_desc(const struct vring_desc *desc);
 
+/* physical address of a kernel buffer, for handing to the device */
+paddr_t virtio_vtop(const void *va);
+
 /* submit a chain to the avail list */
 void virtio_submit_chain(struct virtio_device *dev, uint ring_index, uint16_t desc_index);
 
 void virtio_kick(struct virtio_device *dev, uint ring_idnex);
 
+/* kick the device only if it wants to hear about the chains submitted since the last kick */
+void virtio_kick_if_needed(struct virtio_device *dev, uint ring_index);
+
+/* walk the entries the device has retired on a ring, calling irq_driver_callback for each */
+enum handler_return virtio_ring_poll(struct virtio_device *dev, uint ring_index);
+
+/* ask the device to hold off used ring interrupts for a ring */
+void virtio_ring_disable_interrupts(struct virtio_device *dev, uint ring_index);
+
+/* turn used ring interrupts back on. returns true if entries were retired while
+ * they were off, in which case the caller needs to poll again */
+bool virtio_ring_enable_interrupts(struct virtio_device *dev, uint ring_index);
+
@@ -100,6 +100,7 @@ struct vring {
     uint16_t free_count;
 
     uint16_t last_used;
+    uint16_t kick_idx; /* avail->idx as of the last kick */
 
     struct vring_desc *desc;
 
@@ -145,6 +146,7 @@ static inline void vring_init(struct vring *vr, unsigned int num, void *p,
     vr->free_list = 0xffff;
     vr->free_count = 0;
     vr->last_used = 0;
+    vr->kick_idx = 0;
     vr->desc = p;
     vr->avail = p + num*sizeof(struct vring_desc);
     vr->used = (void *)(((unsigned long)&vr->avail->ring[num] + sizeof(uint16_t)
@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2014 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+#include <compiler.h>
+#include <sys/types.h>
+#include <dev/virtio.h>
+#include <lib/pktbuf.h>
+
+status_t virtio_net_init(struct virtio_device *dev, uint32_t host_features) __NONNULL();
+
+/* number of network devices that have been initialized */
+int virtio_net_found(void);
+
+/* mac address of the first network device */
+status_t virtio_net_get_mac_addr(uint8_t mac_addr[6]);
+
+/* start handing received packets to minip. minip should already be initialized */
+status_t virtio_net_start(void);
+
+/* transmit a packet on the first network device, suitable as minip's tx handler.
+ * the driver takes ownership of the pktbuf and frees it once the device is done.
+ * chains go out with a descriptor per segment. */
+int virtio_net_send_minip_pkt(pktbuf_t *p);
@@ -0,0 +1,696 @@
+/*
+ * Copyright (c) 2014 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <dev/virtio/net.h>
+
+#include <debug.h>
+#include <assert.h>
+#include <trace.h>
+#include <compiler.h>
+#include <list.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <malloc.h>
+#include <string.h>
+#include <arch/ops.h>
+#include <kernel/thread.h>
+#include <kernel/event.h>
+#include <kernel/spinlock.h>
+#include <lib/minip.h>
+#include <lib/pktbuf.h>
+
+#include "../virtio_priv.h"
+
+#define LOCAL_TRACE 0
+
+struct virtio_net_config {
+    uint8_t mac[6];
+    uint16_t status;
+    uint16_t max_virtqueue_pairs;
+} __PACKED;
+
+struct virtio_net_hdr {
+    uint8_t  flags;
+    uint8_t  gso_type;
+    uint16_t hdr_len;
+    uint16_t gso_size;
+    uint16_t csum_start;
+    uint16_t csum_offset;
+    uint16_t num_buffers; // only there with VIRTIO_NET_F_MRG_RXBUF
+} __PACKED;
+
+#define VIRTIO_NET_HDR_LEN      10
+#define VIRTIO_NET_HDR_MRG_LEN  12
+
+struct virtio_net_ctrl_hdr {
+    uint8_t class;
+    uint8_t cmd;
+} __PACKED;
+
+#define VIRTIO_NET_F_MAC        (1<<5)
+#define VIRTIO_NET_F_MRG_RXBUF  (1<<15)
+#define VIRTIO_NET_F_STATUS     (1<<16)
+#define VIRTIO_NET_F_CTRL_VQ    (1<<17)
+#define VIRTIO_NET_F_MQ         (1<<22)
+#define VIRTIO_F_ANY_LAYOUT     (1<<27)
+#define VIRTIO_F_EVENT_IDX      (1<<VIRTIO_RING_F_EVENT_IDX)
+
+#define VIRTIO_NET_CTRL_MQ              4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET 0
+#define VIRTIO_NET_OK                   0
+
+/* features we know how to use */
+#define VIRTIO_NET_GUEST_FEATURES \
+    (VIRTIO_NET_F_MAC | VIRTIO_NET_F_MRG_RXBUF | VIRTIO_NET_F_CTRL_VQ | \
+     VIRTIO_NET_F_MQ | VIRTIO_F_ANY_LAYOUT | VIRTIO_F_EVENT_IDX)
+
+#define VIRTIO_NET_RX_RING_LEN   64
+#define VIRTIO_NET_TX_RING_LEN   128
+#define VIRTIO_NET_CTRL_RING_LEN 4
+
+/* at most one rx/tx queue pair per cpu */
+#ifndef VIRTIO_NET_MAX_QUEUE_PAIRS
+#if WITH_SMP
+#define VIRTIO_NET_MAX_QUEUE_PAIRS SMP_MAX_CPUS
+#else
+#define VIRTIO_NET_MAX_QUEUE_PAIRS 1
+#endif
+#endif
+
+/* pktbufs added to the pool per queue pair for the stack to build outgoing packets in */
+#ifndef VIRTIO_NET_TX_PKTBUFS
+#define VIRTIO_NET_TX_PKTBUFS 64
+#endif
+
+/* longest pktbuf chain sent without flattening it first */
+#ifndef VIRTIO_NET_TX_MAX_SEGS
+#define VIRTIO_NET_TX_MAX_SEGS 16
+#endif
+
+/* where a received frame starts in its pktbuf, puts the ip header on a word boundary */
+#define VIRTIO_NET_RX_FRAME_OFFSET 18
+
+struct virtio_net_dev;
+
+struct virtio_net_queue {
+    struct virtio_net_dev *ndev;
+    uint rx_ring;
+    uint tx_ring;
+
+    /* the rx side is only touched by the queue's worker thread */
+    pktbuf_t *rx_buf[VIRTIO_NET_RX_RING_LEN];
+    struct list_node rx_done;
+    uint rx_skip; // trailing buffers of a merged packet being dropped
+
+    /* tx, shared by everyone sending on this queue */
+    spin_lock_t tx_lock;
+    pktbuf_t *tx_buf[VIRTIO_NET_TX_RING_LEN];
+    struct list_node tx_pending; // waiting for descriptors
+    struct list_node tx_done;    // retired by the device, to be freed
+
+    event_t event;
+    thread_t *thread;
+
+    uint64_t rx_packets;
+    uint64_t rx_dropped;
+    uint64_t tx_packets;
+};
+
+struct virtio_net_dev {
+    struct virtio_device *dev;
+
+    uint32_t features;
+    uint hdr_len;
+    bool rx_single_desc; // header and frame share a descriptor
+    bool tx_single_desc;
+    uint8_t mac[6];
+
+    uint queue_count;   // queue pairs set up
+    uint queue_pairs;   // queue pairs the device is using
+    struct virtio_net_queue *queue;
+
+    volatile bool started;
+};
+
+static enum handler_return virtio_net_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e);
+static enum handler_return virtio_net_irq_notify_callback(struct virtio_device *dev);
+static int virtio_net_worker(void *arg);
+
+static struct virtio_net_dev *the_ndev; // the device minip talks to
+static int virtio_net_count;
+
+/* undo the setup of the first count queue pairs, before any worker has started */
+static void virtio_net_free_queues(struct virtio_net_dev *ndev, uint count)
+{
+    for (uint i = 0; i < count; i++) {
+        struct virtio_net_queue *q = &ndev->queue[i];
+
+        virtio_free_ring(ndev->dev, q->rx_ring);
+        virtio_free_ring(ndev->dev, q->tx_ring);
+
+        for (uint b = 0; b < countof(q->rx_buf); b++) {
+            if (q->rx_buf[b]) {
+                pktbuf_free(q->rx_buf[b]);
+                q->rx_buf[b] = NULL;
+            }
+        }
+
+        event_destroy(&q->event);
+    }
+}
+
+static void virtio_net_free_chain(struct virtio_device *dev, uint ring, uint16_t i)
+{
+    for (;;) {
+        struct vring_desc *desc = virtio_desc_index_to_desc(dev, ring, i);
+        bool more = desc->flags & VRING_DESC_F_NEXT;
+        uint16_t next = desc->next;
+
+        virtio_free_desc(dev, ring, i);
+
+        if (!more)
+            break;
+        i = next;
+    }
+}
+
+/* hand an empty pktbuf to the device. called from the worker thread, or before it starts */
+static void virtio_net_rx_post(struct virtio_net_queue *q, pktbuf_t *p)
+{
+    struct virtio_net_dev *ndev = q->ndev;
+    struct virtio_device *dev = ndev->dev;
+
+    p->data = p->buffer + VIRTIO_NET_RX_FRAME_OFFSET - ndev->hdr_len;
+    p->dlen = 0;
+    uint32_t len = PKTBUF_BUF_SIZE - (p->data - p->buffer);
+
+    uint16_t head;
+    struct vring_desc *desc = virtio_alloc_desc_chain(dev, q->rx_ring, ndev->rx_single_desc ? 1 : 2, &head);
+    DEBUG_ASSERT(desc);
+
+    desc->addr = pktbuf_data_phys(p);
+    if (ndev->rx_single_desc) {
+        desc->len = len;
+        desc->flags = VRING_DESC_F_WRITE;
+    } else {
+        desc->len = ndev->hdr_len;
+        desc->flags |= VRING_DESC_F_WRITE;
+
+        desc = virtio_desc_index_to_desc(dev, q->rx_ring, desc->next);
+        desc->addr = pktbuf_data_phys(p) + ndev->hdr_len;
+        desc->len = len - ndev->hdr_len;
+        desc->flags = VRING_DESC_F_WRITE;
+    }
+
+    DEBUG_ASSERT(!q->rx_buf[head]);
+    q->rx_buf[head] = p;
+
+    virtio_submit_chain(dev, q->rx_ring, head);
+}
+
+/* pass everything received up the stack and recycle the buffers back into the ring */
+static void virtio_net_rx_process(struct virtio_net_queue *q)
+{
+    struct virtio_net_dev *ndev = q->ndev;
+    bool posted = false;
+
+    virtio_ring_poll(ndev->dev, q->rx_ring);
+
+    pktbuf_t *p;
+    while ((p = list_remove_head_type(&q->rx_done, pktbuf_t, list))) {
+        struct virtio_net_hdr *hdr = (struct virtio_net_hdr *)p->data;
+
+        if (q->rx_skip > 0) {
+            /* tail of a packet that didn't fit in one buffer */
+            q->rx_skip--;
+        } else if (p->dlen <= ndev->hdr_len) {
+            q->rx_dropped++;
+        } else if ((ndev->features & VIRTIO_NET_F_MRG_RXBUF) && hdr->num_buffers > 1) {
+            /* a buffer holds a full mtu frame, so only oversized frames get here */
+            q->rx_skip = hdr->num_buffers - 1;
+            q->rx_dropped++;
+        } else if (ndev->started) {
+            pktbuf_consume(p, ndev->hdr_len);
+            minip_rx_driver_callback(p);
+            q->rx_packets++;
+        }
+
+        virtio_net_rx_post(q, p);
+        posted = true;
+    }
+
+    if (posted)
+        virtio_kick_if_needed(ndev->dev, q->rx_ring);
+}
+
+/* descriptors a packet takes: one per non empty segment, plus one for the header if it gets its own */
+static uint virtio_net_tx_descs(struct virtio_net_dev *ndev, pktbuf_t *p)
+{
+    if (ndev->tx_single_desc)
+        return pktbuf_chain_segments(p);
+
+    return 1 + ((p->dlen > ndev->hdr_len) ? 1 : 0) + pktbuf_chain_segments(p->next);
+}
+
+/* move as many pending packets into the tx ring as will fit, with a single kick */
+static void virtio_net_tx_flush_locked(struct virtio_net_queue *q)
+{
+    struct virtio_net_dev *ndev = q->ndev;
+    struct virtio_device *dev = ndev->dev;
+    bool queued = false;
+
+    pktbuf_t *p;
+    while ((p = list_peek_head_type(&q->tx_pending, pktbuf_t, list))) {
+        uint descs = virtio_net_tx_descs(ndev, p);
+        if (dev->ring[q->tx_ring].free_count < descs)
+            break;
+
+        list_delete(&p->list);
+
+        uint16_t head;
+        struct vring_desc *desc = virtio_alloc_desc_chain(dev, q->tx_ring, descs, &head);
+        DEBUG_ASSERT(desc);
+
+        /* the header sits in front of the frame in the first segment, the rest
+         * of the chain is handed over a segment per descriptor */
+        uint filled = 0;
+        uint32_t skip = 0;
+        if (!ndev->tx_single_desc) {
+            desc->addr = pktbuf_data_phys(p);
+            desc->len = ndev->hdr_len;
+            skip = ndev->hdr_len;
+            filled++;
+        }
+
+        for (pktbuf_t *seg = p; seg; seg = seg->next) {
+            if (seg->dlen <= skip) {
+                skip = 0;
+                continue;
+            }
+
+            if (filled++ > 0)
+                desc = virtio_desc_index_to_desc(dev, q->tx_ring, desc->next);
+            desc->addr = pktbuf_data_phys(seg) + skip;
+            desc->len = seg->dlen - skip;
+            skip = 0;
+        }
+        DEBUG_ASSERT(filled == descs);
+
+        DEBUG_ASSERT(!q->tx_buf[head]);
+        q->tx_buf[head] = p;
+
+        virtio_submit_chain(dev, q->tx_ring, head);
+        q->tx_packets++;
+        queued = true;
+    }
+
+    if (queued)
+        virtio_kick_if_needed(dev, q->tx_ring);
+}
+
+/* reap finished transmits, push out anything waiting on descriptors and free the
+ * retired pktbufs. optionally queues one more packet first. */
+static void virtio_net_tx(struct virtio_net_queue *q, pktbuf_t *p)
+{
+    struct list_node done = LIST_INITIAL_VALUE(done);
+    pktbuf_t *freep;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&q->tx_lock, state);
+
+    if (p)
+        list_add_tail(&q->tx_pending, &p->list);
+
+    virtio_ring_poll(q->ndev->dev, q->tx_ring);
+    virtio_net_tx_flush_locked(q);
+
+    while ((freep = list_remove_head_type(&q->tx_done, pktbuf_t, list)))
+        list_add_tail(&done, &freep->list);
+
+    spin_unlock_irqrestore(&q->tx_lock, state);
+
+    while ((freep = list_remove_head_type(&done, pktbuf_t, list)))
+        pktbuf_free(freep);
+}
+
+/* re-arm the tx ring interrupt. senders reap the ring and move its used index under
+ * tx_lock, so look at it under the same lock */
+static bool virtio_net_tx_enable_interrupts(struct virtio_net_queue *q)
+{
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&q->tx_lock, state);
+
+    bool more = virtio_ring_enable_interrupts(q->ndev->dev, q->tx_ring);
+
+    spin_unlock_irqrestore(&q->tx_lock, state);
+
+    return more;
+}
+
+static enum handler_return virtio_net_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e)
+{
+    struct virtio_net_dev *ndev = (struct virtio_net_dev *)dev->priv;
+
+    LTRACEF("dev %p, ring %u, e %p, id %u, len %u\n", dev, ring, e, e->id, e->len);
+
+    DEBUG_ASSERT(ring / 2 < ndev->queue_count);
+    struct virtio_net_queue *q = &ndev->queue[ring / 2];
+
+    pktbuf_t *p;
+    if (ring == q->rx_ring) {
+        p = q->rx_buf[e->id];
+        q->rx_buf[e->id] = NULL;
+        DEBUG_ASSERT(p);
+
+        p->dlen = e->len;
+        list_add_tail(&q->rx_done, &p->list);
+    } else {
+        p = q->tx_buf[e->id];
+        q->tx_buf[e->id] = NULL;
+        DEBUG_ASSERT(p);
+
+        list_add_tail(&q->tx_done, &p->list);
+    }
+
+    virtio_net_free_chain(dev, ring, e->id);
+
+    return INT_NO_RESCHEDULE;
+}
+
+/* the device has retired something, mute it and let the worker threads drain the rings */
+static enum handler_return virtio_net_irq_notify_callback(struct virtio_device *dev)
+{
+    struct virtio_net_dev *ndev = (struct virtio_net_dev *)dev->priv;
+
+    for (uint i = 0; i < ndev->queue_count; i++) {
+        struct virtio_net_queue *q = &ndev->queue[i];
+
+        virtio_ring_disable_interrupts(dev, q->rx_ring);
+        virtio_ring_disable_interrupts(dev, q->tx_ring);
+        event_signal(&q->event, false);
+    }
+
+    return INT_RESCHEDULE;
+}
+
+static int virtio_net_worker(void *arg)
+{
+    struct virtio_net_queue *q = (struct virtio_net_queue *)arg;
+    struct virtio_device *dev = q->ndev->dev;
+
+    for (;;) {
+        event_wait(&q->event);
+
+        /* keep going until the device has nothing more for us with interrupts back on */
+        bool more;
+        do {
+            virtio_net_rx_process(q);
+            virtio_net_tx(q, NULL);
+
+            more = virtio_ring_enable_interrupts(dev, q->rx_ring);
+            more |= virtio_net_tx_enable_interrupts(q);
+        } while (more);
+    }
+
+    return 0;
+}
+
+/* synchronously tell the device how many queue pairs to use */
+static status_t virtio_net_set_queue_pairs(struct virtio_net_dev *ndev, uint ring, uint16_t pairs)
+{
+    struct virtio_device *dev = ndev->dev;
+    struct {
+        struct virtio_net_ctrl_hdr hdr;
+        uint16_t pairs;
+        uint8_t ack;
+    } __PACKED *cmd;
+
+    cmd = memalign(64, sizeof(*cmd));
+    if (!cmd)
+        return ERR_NO_MEMORY;
+
+    cmd->hdr.class = VIRTIO_NET_CTRL_MQ;
+    cmd->hdr.cmd = VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET;
+    cmd->pairs = pairs;
+    cmd->ack = 0xff;
+
+    uint16_t head;
+    struct vring_desc *desc = virtio_alloc_desc_chain(dev, ring, 3, &head);
+    DEBUG_ASSERT(desc);
+
+    desc->addr = virtio_vtop(&cmd->hdr);
+    desc->len = sizeof(cmd->hdr);
+
+    desc = virtio_desc_index_to_desc(dev, ring, desc->next);
+    desc->addr = virtio_vtop(&cmd->pairs);
+    desc->len = sizeof(cmd->pairs);
+
+    desc = virtio_desc_index_to_desc(dev, ring, desc->next);
+    desc->addr = virtio_vtop(&cmd->ack);
+    desc->len = sizeof(cmd->ack);
+    desc->flags = VRING_DESC_F_WRITE;
+
+    virtio_submit_chain(dev, ring, head);
+    virtio_kick(dev, ring);
+
+    /* interrupts aren't on yet, poll for the answer */
+    struct vring *vring = &dev->ring[ring];
+    for (uint i = 0; i < 100 && vring->used->idx == vring->last_used; i++)
+        thread_sleep(1);
+
+    status_t err = ERR_TIMED_OUT;
+    if (vring->used->idx != vring->last_used) {
+        vring->last_used++;
+        virtio_net_free_chain(dev, ring, head);
+        err = (cmd->ack == VIRTIO_NET_OK) ? NO_ERROR : ERR_NOT_SUPPORTED;
+        free(cmd);
+    }
+    /* on timeout the device may still write to the command, leak it */
+
+    return err;
+}
+
+status_t virtio_net_init(struct virtio_device *dev, uint32_t host_features)
+{
+    LTRACEF("dev %p, host_features 0x%x\n", dev, host_features);
+
+    volatile struct virtio_net_config *config = (struct virtio_net_config *)dev->config_ptr;
+
+    struct virtio_net_dev *ndev = calloc(1, sizeof(struct virtio_net_dev));
+    if (!ndev)
+        return ERR_NO_MEMORY;
+
+    ndev->dev = dev;
+    dev->priv = ndev;
+
+    /* negotiate features. multiqueue needs the control queue, which sits after
+     * every queue pair the device has, so it has to fit in our ring table */
+    ndev->features = host_features & VIRTIO_NET_GUEST_FEATURES;
+    uint max_pairs = 1;
+    if ((ndev->features & VIRTIO_NET_F_MQ) && (ndev->features & VIRTIO_NET_F_CTRL_VQ) &&
+            config->max_virtqueue_pairs > 1 && config->max_virtqueue_pairs * 2U < MAX_VIRTIO_RINGS) {
+        max_pairs = config->max_virtqueue_pairs;
+    } else {
+        ndev->features &= ~(VIRTIO_NET_F_MQ | VIRTIO_NET_F_CTRL_VQ);
+    }
+    dev->mmio_config->guest_features_sel = 0;
+    dev->mmio_config->guest_features = ndev->features;
+
+    dev->event_idx = !!(ndev->features & VIRTIO_F_EVENT_IDX);
+    ndev->hdr_len = (ndev->features & VIRTIO_NET_F_MRG_RXBUF) ? VIRTIO_NET_HDR_MRG_LEN : VIRTIO_NET_HDR_LEN;
+    ndev->rx_single_desc = ndev->features & (VIRTIO_NET_F_MRG_RXBUF | VIRTIO_F_ANY_LAYOUT);
+    ndev->tx_single_desc = ndev->features & VIRTIO_F_ANY_LAYOUT;
+
+    if (ndev->features & VIRTIO_NET_F_MAC) {
+        for (uint i = 0; i < sizeof(ndev->mac); i++)
+            ndev->mac[i] = config->mac[i];
+    } else {
+        /* make up a locally administered address */
+        ndev->mac[0] = 0x02;
+        for (uint i = 1; i < sizeof(ndev->mac); i++)
+            ndev->mac[i] = rand();
+    }
+
+    ndev->queue_count = MIN(max_pairs, (uint)VIRTIO_NET_MAX_QUEUE_PAIRS);
+    ndev->queue_pairs = 1; // until the device is told otherwise
+    ndev->queue = calloc(ndev->queue_count, sizeof(struct virtio_net_queue));
+    if (!ndev->queue)
+        goto nomem;
+
+    /* build a pool of pktbufs: enough to fill the rx rings plus some for transmit */
+    uint rx_bufs = VIRTIO_NET_RX_RING_LEN / (ndev->rx_single_desc ? 1 : 2);
+    uint pktbuf_count = ndev->queue_count * (rx_bufs + VIRTIO_NET_TX_PKTBUFS);
+    uint8_t *pool = memalign(PKTBUF_SIZE, pktbuf_count * PKTBUF_SIZE);
+    if (!pool)
+        goto nomem;
+
+    for (uint i = 0; i < pktbuf_count; i++) {
+        void *ptr = pool + i * PKTBUF_SIZE;
+        pktbuf_create(ptr, virtio_vtop(ptr), PKTBUF_SIZE);
+    }
+
+    /* set up the queue pairs, rx buffers go in right away */
+    for (uint i = 0; i < ndev->queue_count; i++) {
+        struct virtio_net_queue *q = &ndev->queue[i];
+
+        q->ndev = ndev;
+        q->rx_ring = i * 2;
+        q->tx_ring = i * 2 + 1;
+        list_initialize(&q->rx_done);
+        list_initialize(&q->tx_pending);
+        list_initialize(&q->tx_done);
+        spin_lock_init(&q->tx_lock);
+        event_init(&q->event, false, EVENT_FLAG_AUTOUNSIGNAL);
+
+        /* the pktbufs already went to the global pool, they're not lost. the rings
+         * and rx buffers of this and the earlier queue pairs have to be given back. */
+        status_t err = virtio_alloc_ring(dev, q->rx_ring, VIRTIO_NET_RX_RING_LEN);
+        if (err >= 0)
+            err = virtio_alloc_ring(dev, q->tx_ring, VIRTIO_NET_TX_RING_LEN);
+        if (err < 0) {
+            virtio_net_free_queues(ndev, i + 1);
+            free(ndev->queue);
+            free(ndev);
+            dev->priv = NULL;
+            return err;
+        }
+
+        for (uint b = 0; b < rx_bufs; b++) {
+            pktbuf_t *p = pktbuf_alloc();
+            DEBUG_ASSERT(p);
+            virtio_net_rx_post(q, p);
+        }
+
+        virtio_ring_enable_interrupts(dev, q->rx_ring);
+        virtio_ring_enable_interrupts(dev, q->tx_ring);
+    }
+
+    /* set our irq handlers */
+    dev->irq_driver_callback = &virtio_net_irq_driver_callback;
+    dev->irq_notify_callback = &virtio_net_irq_notify_callback;
+
+    /* spread the load over the queue pairs. the control queue only works
+     * once the driver is up */
+    if (ndev->queue_count > 1) {
+        uint ctrl_ring = max_pairs * 2;
+        status_t err = virtio_alloc_ring(dev, ctrl_ring, VIRTIO_NET_CTRL_RING_LEN);
+        if (err >= 0) {
+            dev->mmio_config->status |= VIRTIO_STATUS_DRIVER_OK;
+            err = virtio_net_set_queue_pairs(ndev, ctrl_ring, ndev->queue_count);
+        }
+        if (err >= 0)
+            ndev->queue_pairs = ndev->queue_count;
+        else
+            printf("virtio-net: failed to enable %u queue pairs (%d), using one\n", ndev->queue_count, err);
+    }
+
+    for (uint i = 0; i < ndev->queue_count; i++) {
+        struct virtio_net_queue *q = &ndev->queue[i];
+        char name[32];
+
+        snprintf(name, sizeof(name), "virtio-net%d-%u", virtio_net_count, i);
+        q->thread = thread_create(name, &virtio_net_worker, q, HIGH_PRIORITY, DEFAULT_STACK_SIZE);
+        thread_resume(q->thread);
+
+        /* kick the rx rings now that someone is listening */
+        virtio_kick(dev, q->rx_ring);
+    }
+
+    if (!the_ndev)
+        the_ndev = ndev;
+
+    printf("virtio-net%d: mac %02x:%02x:%02x:%02x:%02x:%02x, %u queue pair%s, features 0x%x\n",
+           virtio_net_count, ndev->mac[0], ndev->mac[1], ndev->mac[2], ndev->mac[3], ndev->mac[4], ndev->mac[5],
+           ndev->queue_pairs, (ndev->queue_pairs > 1) ? "s" : "", ndev->features);
+
+    virtio_net_count++;
+
+    return NO_ERROR;
+
+nomem:
+    free(ndev->queue);
+    free(ndev);
+    dev->priv = NULL;
+    return ERR_NO_MEMORY;
+}
+
+int virtio_net_found(void)
+{
+    return virtio_net_count;
+}
+
+status_t virtio_net_get_mac_addr(uint8_t mac_addr[6])
+{
+    if (!the_ndev)
+        return ERR_NOT_FOUND;
+
+    memcpy(mac_addr, the_ndev->mac, sizeof(the_ndev->mac));
+
+    return NO_ERROR;
+}
+
+status_t virtio_net_start(void)
+{
+    if (!the_ndev)
+        return ERR_NOT_FOUND;
+
+    the_ndev->started = true;
+
+    return NO_ERROR;
+}
+
+int virtio_net_send_minip_pkt(pktbuf_t *p)
+{
+    struct virtio_net_dev *ndev = the_ndev;
+
+    LTRACEF("p %p, dlen %u\n", p, p ? p->dlen : 0);
+
+    if (!p)
+        return ERR_INVALID_ARGS;
+
+    if (!ndev || p->dlen == 0 || pktbuf_avail_head(p) < ndev->hdr_len) {
+        pktbuf_free(p);
+        return ndev ? ERR_INVALID_ARGS : ERR_NOT_READY;
+    }
+
+    /* chains are sent as they are, unless they'd hog the ring. the virtio
+     * header still has to fit in front of a flattened one. */
+    if (pktbuf_chain_segments(p) > VIRTIO_NET_TX_MAX_SEGS) {
+        pktbuf_t *flat = pktbuf_linearize(p, ndev->hdr_len);
+        if (!flat) {
+            pktbuf_free(p);
+            return ERR_TOO_BIG;
+        }
+        p = flat;
+    }
+
+    /* no offloads, the header is all zeros */
+    void *hdr = pktbuf_prepend(p, ndev->hdr_len);
+    memset(hdr, 0, ndev->hdr_len);
+
+    /* each cpu sends on its own queue pair */
+    struct virtio_net_queue *q = &ndev->queue[arch_curr_cpu_num() % ndev->queue_pairs];
+    virtio_net_tx(q, p);
+
+    return NO_ERROR;
+}
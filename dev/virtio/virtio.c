@@ -43,6 +43,9 @@
 #if WITH_DEV_VIRTIO_BLOCK
 #include <dev/virtio/block.h>
 #endif
+#if WITH_DEV_VIRTIO_NET
+#include <dev/virtio/net.h>
+#endif
 
 #define LOCAL_TRACE 0
 
@@ -71,6 +74,29 @@ void virtio_dump_desc(const struct vring_desc *desc)
     printf("\tnext  0x%hhx\n", desc->next);
 }
 
+enum handler_return virtio_ring_poll(struct virtio_device *dev, uint ring_index)
+{
+    struct vring *ring = &dev->ring[ring_index];
+    enum handler_return ret = INT_NO_RESCHEDULE;
+
+    LTRACEF("ring %u used flags 0x%hx idx 0x%hx\n", ring_index, ring->used->flags, ring->used->idx);
+
+    /* used->idx is free running, walk everything the device has retired since last time */
+    uint16_t cur_idx = ring->used->idx;
+    DSB;
+    while (ring->last_used != cur_idx) {
+        struct vring_used_elem *used_elem = &ring->used->ring[ring->last_used & ring->num_mask];
+        LTRACEF("id %u, len %u\n", used_elem->id, used_elem->len);
+
+        DEBUG_ASSERT(dev->irq_driver_callback);
+        ret |= dev->irq_driver_callback(dev, ring_index, used_elem);
+
+        ring->last_used++;
+    }
+
+    return ret;
+}
+
 static enum handler_return virtio_mmio_irq(void *arg)
 {
     struct virtio_device *dev = (struct virtio_device *)arg;
@@ -84,20 +110,13 @@ static enum handler_return virtio_mmio_irq(void *arg)
         // XXX is this safe?
         dev->mmio_config->interrupt_ack = 0x1;
 
-        // XXX only handles ring 0
-        struct vring *ring = &dev->ring[0];
-        printf("used flags 0x%hhx idx 0x%hhx\n", ring->used->flags, ring->used->idx);
+        /* let the driver pick up the work from its own context */
+        if (dev->irq_notify_callback)
+            return dev->irq_notify_callback(dev);
 
-        uint cur_idx = ring->used->idx;
-        for (uint i = ring->last_used; i != cur_idx; i = (i + 1) & ring->num_mask) {
-            LTRACEF("looking at idx %u\n", i);
-
-            // process chain
-            struct vring_used_elem *used_elem = &ring->used->ring[i];
-            LTRACEF("id %u, len %u\n", used_elem->id, used_elem->len);
-
-            DEBUG_ASSERT(dev->irq_driver_callback);
-            ret |= dev->irq_driver_callback(dev, 0, used_elem);
+        for (uint r = 0; r < MAX_VIRTIO_RINGS; r++) {
+            if (dev->ring[r].used)
+                ret |= virtio_ring_poll(dev, r);
         }
     }
 
@@ -136,36 +155,60 @@ int virtio_mmio_detect(void *ptr, uint count, const uint irqs[])
 
         //dump_mmio_config(mmio);
 
+        status_t (*driver_init)(struct virtio_device *, uint32_t) = NULL;
+        switch (mmio->device_id) {
+#if WITH_DEV_VIRTIO_NET
+            case 1: // network device
+                LTRACEF("found net device\n");
+                driver_init = &virtio_net_init;
+                break;
+#endif
 #if WITH_DEV_VIRTIO_BLOCK
-        if (mmio->device_id == 2) { // block device
-            LTRACEF("found block device\n");
+            case 2: // block device
+                LTRACEF("found block device\n");
+                driver_init = &virtio_block_init;
+                break;
+#endif
+        }
 
+        if (driver_init) {
             dev->mmio_config = mmio;
             dev->config_ptr = (void *)mmio->config;
-            status_t err = virtio_block_init(dev, mmio->host_features);
+
+            /* reset the device and tell it we've found it and have a driver for it */
+            mmio->status = 0;
+            mmio->status |= VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER;
+
+            status_t err = driver_init(dev, mmio->host_features);
             if (err >= 0) {
                 // good device
                 dev->valid = true;
 
-                if (dev->irq_driver_callback)
+                if (dev->irq_driver_callback || dev->irq_notify_callback)
                     unmask_interrupt(dev->irq);
 
-                // XXX quick test code, remove
-#if 0
-                uint8_t buf[512];
-                memset(buf, 0x99, sizeof(buf));
-                virtio_block_read(dev, buf, 0, sizeof(buf));
-                hexdump8(buf, sizeof(buf));
-#endif
+                mmio->status |= VIRTIO_STATUS_DRIVER_OK;
+            } else {
+                mmio->status |= VIRTIO_STATUS_FAILED;
             }
-
         }
-#endif
     }
 
     return 0;
 }
 
+paddr_t virtio_vtop(const void *va)
+{
+#if WITH_KERNEL_VM
+    paddr_t pa;
+    __UNUSED status_t err = arch_mmu_query((vaddr_t)va, &pa, NULL);
+    DEBUG_ASSERT(err >= 0);
+    return pa;
+#else
+    return (paddr_t)(uintptr_t)va;
+#endif
+}
+
 void virtio_free_desc(struct virtio_device *dev, uint ring_index, uint16_t desc_index)
 {
     LTRACEF("dev %p ring %u index %u\n", dev, ring_index, desc_index);
@@ -215,6 +258,7 @@ struct vring_desc *virtio_alloc_desc_chain(struct virtio_device *dev, uint ring_
         last = desc;
         last_index = i;
         count--;
+        dev->ring[ring_index].free_count--;
     }
 
     if (start_index)
@@ -233,18 +277,69 @@ void virtio_submit_chain(struct virtio_device *dev, uint ring_index, uint16_t de
     avail->ring[avail->idx & dev->ring[ring_index].num_mask] = desc_index;
     DSB;
     avail->idx++;
-
-    hexdump(avail, 16);
 }
 
 void virtio_kick(struct virtio_device *dev, uint ring_index)
 {
     LTRACEF("dev %p, ring %u\n", dev, ring_index);
 
+    dev->ring[ring_index].kick_idx = dev->ring[ring_index].avail->idx;
     dev->mmio_config->queue_notify = ring_index;
     DSB;
 }
 
+void virtio_kick_if_needed(struct virtio_device *dev, uint ring_index)
+{
+    struct vring *ring = &dev->ring[ring_index];
+
+    /* the new avail index has to be visible before we look at what the device wants */
+    DSB;
+
+    uint16_t new_idx = ring->avail->idx;
+    uint16_t old_idx = ring->kick_idx;
+
+    bool kick;
+    if (dev->event_idx)
+        kick = vring_need_event(vring_avail_event(ring), new_idx, old_idx);
+    else
+        kick = !(ring->used->flags & VRING_USED_F_NO_NOTIFY);
+
+    LTRACEF("dev %p, ring %u, avail %hu, last kick %hu, kick %d\n", dev, ring_index, new_idx, old_idx, kick);
+
+    if (kick)
+        virtio_kick(dev, ring_index);
+    else
+        ring->kick_idx = new_idx;
+}
+
+void virtio_ring_disable_interrupts(struct virtio_device *dev, uint ring_index)
+{
+    struct vring *ring = &dev->ring[ring_index];
+
+    if (dev->event_idx) {
+        /* park the event index as far from the consumer as it gets, we'll always
+         * move it back before the device could get there */
+        vring_used_event(ring) = ring->last_used + 0x8000;
+    } else {
+        ring->avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
+    }
+}
+
+bool virtio_ring_enable_interrupts(struct virtio_device *dev, uint ring_index)
+{
+    struct vring *ring = &dev->ring[ring_index];
+
+    if (dev->event_idx)
+        vring_used_event(ring) = ring->last_used;
+    else
+        ring->avail->flags &= ~VRING_AVAIL_F_NO_INTERRUPT;
+
+    /* anything retired before the device saw the update won't raise an interrupt */
+    DSB;
+
+    return ring->used->idx != ring->last_used;
+}
+
 status_t virtio_alloc_ring(struct virtio_device *dev, uint index, uint16_t len)
 {
     LTRACEF("dev %p, index %u, len %u\n", dev, index, len);
@@ -311,6 +406,30 @@ status_t virtio_alloc_ring(struct virtio_device *dev, uint index, uint16_t len)
     return NO_ERROR;
 }
 
+void virtio_free_ring(struct virtio_device *dev, uint index)
+{
+    LTRACEF("dev %p, index %u\n", dev, index);
+
+    DEBUG_ASSERT(dev);
+    DEBUG_ASSERT(index < MAX_VIRTIO_RINGS);
+
+    struct vring *ring = &dev->ring[index];
+    if (!ring->desc)
+        return;
+
+    /* take it away from the device before the memory goes */
+    dev->mmio_config->queue_sel = index;
+    dev->mmio_config->queue_pfn = 0;
+
+#if WITH_KERNEL_VMM
+    vmm_free_region(vmm_get_kernel_aspace(), (vaddr_t)ring->desc);
+#else
+    free(ring->desc);
+#endif
+
+    memset(ring, 0, sizeof(*ring));
+}
+
 void virtio_init(uint level)
 {
 }
@@ -42,6 +42,7 @@ static int atomic_swap(volatile int *ptr, int val);
 static int atomic_add(volatile int *ptr, int val);
 static int atomic_and(volatile int *ptr, int val);
 static int atomic_or(volatile int *ptr, int val);
+static int atomic_cmpxchg(volatile int *ptr, int oldval, int newval);
 
 static uint32_t arch_cycle_count(void);
 
@@ -72,4 +73,9 @@ __END_CDECLS
 
 #include <arch/arch_ops.h>
 
+#ifndef smp_mb
+/* uniprocessor arches */
+#define smp_mb() CF
+#endif
+
 #endif
@@ -24,20 +24,67 @@
 #define __KERNEL_DEBUG_H
 
 #include <debug.h>
+#include <stdint.h>
+#include <sys/types.h>
 
 /* kernel event log */
-#if WITH_KERNEL_EVLOG
 
-#include <lib/evlog.h>
+/* event classes, each tracepoint compiled in only if its class is in KERNEL_EVLOG_CLASSES */
+#define KERNEL_EVLOG_CLASS_SCHED    (1 << 0)
+#define KERNEL_EVLOG_CLASS_IRQ      (1 << 1)
+#define KERNEL_EVLOG_CLASS_TIMER    (1 << 2)
+#define KERNEL_EVLOG_CLASS_HEAP     (1 << 3)
+#define KERNEL_EVLOG_CLASS_BIO      (1 << 4)
+#define KERNEL_EVLOG_CLASS_NET      (1 << 5)
+
+#ifndef KERNEL_EVLOG_CLASSES
+#define KERNEL_EVLOG_CLASSES (KERNEL_EVLOG_CLASS_SCHED | KERNEL_EVLOG_CLASS_IRQ | KERNEL_EVLOG_CLASS_TIMER)
+#endif
+
+/* one record as logged and exported. times are the low 32 bits of current_time_hires()
+ * and the arguments are truncated to 32 bits. */
+struct kernel_evlog_record {
+	uint32_t time;
+	uint16_t id;
+	uint8_t cpu;
+	uint8_t reserved;
+	uint32_t arg0;
+	uint32_t arg1;
+};
+
+/* the export is this header followed by every cpu's records, oldest first per cpu.
+ * everything is in the target's byte order. */
+#define KERNEL_EVLOG_MAGIC 0x4c56454b /* 'KEVL' */
+#define KERNEL_EVLOG_VERSION 1
+
+struct kernel_evlog_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t record_size;
+	uint32_t cpu_count;
+	uint32_t record_count;
+	uint64_t now;           /* current_time_hires() at export, to unwrap the record times */
+	uint32_t dropped;       /* records overwritten before they were exported */
+	uint32_t reserved;
+};
+
+#if WITH_KERNEL_EVLOG
 
 #ifndef KERNEL_EVLOG_LEN
-#define KERNEL_EVLOG_LEN 1024
+#define KERNEL_EVLOG_LEN 1024 /* records per cpu, a power of 2 */
 #endif
 
 void kernel_evlog_init(void);
 
 void kernel_evlog_add(uintptr_t id, uintptr_t arg0, uintptr_t arg1);
 void kernel_evlog_dump(void);
+void kernel_evlog_clear(void);
+
+/* pause logging and pass the binary log to write in pieces, then resume */
+typedef int (*kernel_evlog_write_cb)(void *arg, const void *data, size_t len);
+status_t kernel_evlog_export(kernel_evlog_write_cb write, void *arg);
+
+#define KEVLOG_ON(class) ((KERNEL_EVLOG_CLASSES & (class)) != 0)
 
 #else // !WITH_KERNEL_EVLOG
 
@@ -45,6 +92,9 @@ void kernel_evlog_dump(void);
 static inline void kernel_evlog_init(void) {}
 static inline void kernel_evlog_add(uintptr_t id, uintptr_t arg0, uintptr_t arg1) {}
 static inline void kernel_evlog_dump(void) {}
+static inline void kernel_evlog_clear(void) {}
+
+#define KEVLOG_ON(class) 0
 
 #endif
 
@@ -56,14 +106,40 @@ enum {
 	KERNEL_EVLOG_TIMER_CALL,
 	KERNEL_EVLOG_IRQ_ENTER,
 	KERNEL_EVLOG_IRQ_EXIT,
+	KERNEL_EVLOG_HEAP_ALLOC,
+	KERNEL_EVLOG_HEAP_FREE,
+	KERNEL_EVLOG_BIO_READ_BEGIN,
+	KERNEL_EVLOG_BIO_READ_END,
+	KERNEL_EVLOG_BIO_WRITE_BEGIN,
+	KERNEL_EVLOG_BIO_WRITE_END,
+	KERNEL_EVLOG_BIO_SUBMIT,
+	KERNEL_EVLOG_BIO_COMPLETE,
+	KERNEL_EVLOG_NET_RX,
+	KERNEL_EVLOG_NET_TX,
 };
 
-#define KEVLOG_THREAD_SWITCH(from, to) kernel_evlog_add(KERNEL_EVLOG_CONTEXT_SWITCH, (uintptr_t)from, (uintptr_t)to)
-#define KEVLOG_THREAD_PREEMPT(thread) kernel_evlog_add(KERNEL_EVLOG_PREEMPT, (uintptr_t)thread, 0)
-#define KEVLOG_TIMER_TICK() kernel_evlog_add(KERNEL_EVLOG_TIMER_TICK, 0, 0)
-#define KEVLOG_TIMER_CALL(ptr, arg) kernel_evlog_add(KERNEL_EVLOG_TIMER_CALL, (uintptr_t)ptr, (uintptr_t)arg)
-#define KEVLOG_IRQ_ENTER(irqn) kernel_evlog_add(KERNEL_EVLOG_IRQ_ENTER, (uintptr_t)irqn, 0)
-#define KEVLOG_IRQ_EXIT(irqn) kernel_evlog_add(KERNEL_EVLOG_IRQ_EXIT, (uintptr_t)irqn, 0)
+#define KEVLOG(class, id, arg0, arg1) \
+	do { \
+		if (KEVLOG_ON(class)) \
+			kernel_evlog_add(id, (uintptr_t)(arg0), (uintptr_t)(arg1)); \
+	} while (0)
+
+#define KEVLOG_THREAD_SWITCH(from, to) KEVLOG(KERNEL_EVLOG_CLASS_SCHED, KERNEL_EVLOG_CONTEXT_SWITCH, from, to)
+#define KEVLOG_THREAD_PREEMPT(thread) KEVLOG(KERNEL_EVLOG_CLASS_SCHED, KERNEL_EVLOG_PREEMPT, thread, 0)
+#define KEVLOG_TIMER_TICK() KEVLOG(KERNEL_EVLOG_CLASS_TIMER, KERNEL_EVLOG_TIMER_TICK, 0, 0)
+#define KEVLOG_TIMER_CALL(ptr, arg) KEVLOG(KERNEL_EVLOG_CLASS_TIMER, KERNEL_EVLOG_TIMER_CALL, ptr, arg)
+#define KEVLOG_IRQ_ENTER(irqn) KEVLOG(KERNEL_EVLOG_CLASS_IRQ, KERNEL_EVLOG_IRQ_ENTER, irqn, 0)
+#define KEVLOG_IRQ_EXIT(irqn) KEVLOG(KERNEL_EVLOG_CLASS_IRQ, KERNEL_EVLOG_IRQ_EXIT, irqn, 0)
+#define KEVLOG_HEAP_ALLOC(ptr, size) KEVLOG(KERNEL_EVLOG_CLASS_HEAP, KERNEL_EVLOG_HEAP_ALLOC, ptr, size)
+#define KEVLOG_HEAP_FREE(ptr) KEVLOG(KERNEL_EVLOG_CLASS_HEAP, KERNEL_EVLOG_HEAP_FREE, ptr, 0)
+#define KEVLOG_BIO_READ_BEGIN(dev, len) KEVLOG(KERNEL_EVLOG_CLASS_BIO, KERNEL_EVLOG_BIO_READ_BEGIN, dev, len)
+#define KEVLOG_BIO_READ_END(dev, ret) KEVLOG(KERNEL_EVLOG_CLASS_BIO, KERNEL_EVLOG_BIO_READ_END, dev, ret)
+#define KEVLOG_BIO_WRITE_BEGIN(dev, len) KEVLOG(KERNEL_EVLOG_CLASS_BIO, KERNEL_EVLOG_BIO_WRITE_BEGIN, dev, len)
+#define KEVLOG_BIO_WRITE_END(dev, ret) KEVLOG(KERNEL_EVLOG_CLASS_BIO, KERNEL_EVLOG_BIO_WRITE_END, dev, ret)
+#define KEVLOG_BIO_SUBMIT(req, op) KEVLOG(KERNEL_EVLOG_CLASS_BIO, KERNEL_EVLOG_BIO_SUBMIT, req, op)
+#define KEVLOG_BIO_COMPLETE(req, ret) KEVLOG(KERNEL_EVLOG_CLASS_BIO, KERNEL_EVLOG_BIO_COMPLETE, req, ret)
+#define KEVLOG_NET_RX(pkt, len) KEVLOG(KERNEL_EVLOG_CLASS_NET, KERNEL_EVLOG_NET_RX, pkt, len)
+#define KEVLOG_NET_TX(dest, len) KEVLOG(KERNEL_EVLOG_CLASS_NET, KERNEL_EVLOG_NET_TX, dest, len)
 
 #endif
 
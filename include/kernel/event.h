@@ -29,9 +29,13 @@
 
 #define EVENT_MAGIC 'evnt'
 
+/* event_t.state */
+#define EVENT_STATE_SIGNALLED 1
+#define EVENT_STATE_WAITERS   2 /* threads may be blocked on the wait queue */
+
 typedef struct event {
 	int magic;
-	bool signalled;
+	volatile int state;
 	uint flags;
 	wait_queue_t wait;
 } event_t;
@@ -41,7 +45,7 @@ typedef struct event {
 #define EVENT_INITIAL_VALUE(e, initial, _flags) \
 { \
 	.magic = EVENT_MAGIC, \
-	.signalled = initial, \
+	.state = (initial) ? EVENT_STATE_SIGNALLED : 0, \
 	.flags = _flags, \
 	.wait = WAIT_QUEUE_INITIAL_VALUE((e).wait), \
 }
@@ -30,10 +30,15 @@
 
 #define MUTEX_MAGIC 'mutx'
 
+/* mutex_t.state */
+#define MUTEX_FREE      0
+#define MUTEX_HELD      1
+#define MUTEX_CONTENDED 2 /* held, and threads may be blocked on it */
+
 typedef struct mutex {
 	uint32_t magic;
 	thread_t *holder;
-	int count;
+	volatile int state;
 	wait_queue_t wait;
 } mutex_t;
 
@@ -41,7 +46,7 @@ typedef struct mutex {
 { \
 	.magic = MUTEX_MAGIC, \
 	.holder = NULL, \
-	.count = 0, \
+	.state = MUTEX_FREE, \
 	.wait = WAIT_QUEUE_INITIAL_VALUE((m).wait), \
 }
 
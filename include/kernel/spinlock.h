@@ -23,36 +23,174 @@
 #pragma once
 
 #include <compiler.h>
+#include <stdint.h>
+#include <sys/types.h>
 #include <arch/spinlock.h>
 
 __BEGIN_CDECLS
 
+/*
+ * On SMP builds spin locks are the arch's test and set lock by default. Setting
+ * KERNEL_SPINLOCK_TICKET switches them to a ticket lock, which hands the lock
+ * out in the order cpus asked for it, so a cpu can't be starved by others
+ * repeatedly winning the race for the cache line.
+ */
+#ifndef KERNEL_SPINLOCK_TICKET
+#define KERNEL_SPINLOCK_TICKET 0
+#endif
+
+/* per lock acquisition and spin time counters, for locks registered by name */
+#ifndef KERNEL_SPINLOCK_STATS
+#define KERNEL_SPINLOCK_STATS 0
+#endif
+
+#if WITH_SMP && KERNEL_SPINLOCK_TICKET
+
+/*
+ * The ticket lock lives in the spin_lock_t word: the low half is the ticket
+ * being served, the high half the next ticket to hand out. Unlocked is both
+ * halves equal, so SPIN_LOCK_INITIAL_VALUE still works.
+ */
+#if __SIZEOF_LONG__ == 8
+typedef uint32_t spin_ticket_t __attribute__((__may_alias__));
+#else
+typedef uint16_t spin_ticket_t __attribute__((__may_alias__));
+#endif
+
+#define SPIN_TICKET_SHIFT (sizeof(spin_ticket_t) * 8)
+
+static inline spin_ticket_t *_spin_ticket_owner(spin_lock_t *lock)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return (spin_ticket_t *)lock + (sizeof(spin_lock_t) / sizeof(spin_ticket_t) - 1);
+#else
+    return (spin_ticket_t *)lock;
+#endif
+}
+
+static inline void _spin_lock(spin_lock_t *lock)
+{
+    spin_lock_t val = __atomic_fetch_add(lock, (spin_lock_t)1 << SPIN_TICKET_SHIFT, __ATOMIC_ACQUIRE);
+    spin_ticket_t ticket = (spin_ticket_t)(val >> SPIN_TICKET_SHIFT);
+
+    while ((spin_ticket_t)val != ticket) {
+        arch_spinloop_pause();
+        val = __atomic_load_n(lock, __ATOMIC_ACQUIRE);
+    }
+}
+
+static inline int _spin_trylock(spin_lock_t *lock)
+{
+    spin_lock_t val = __atomic_load_n(lock, __ATOMIC_RELAXED);
+
+    if ((spin_ticket_t)val != (spin_ticket_t)(val >> SPIN_TICKET_SHIFT))
+        return 1;
+
+    return !__atomic_compare_exchange_n(lock, &val, val + ((spin_lock_t)1 << SPIN_TICKET_SHIFT),
+                                        false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline void _spin_unlock(spin_lock_t *lock)
+{
+    /* only the holder writes the owner half, so a plain store of it is enough */
+    spin_ticket_t *owner = _spin_ticket_owner(lock);
+
+    __atomic_store_n(owner, (spin_ticket_t)(*owner + 1), __ATOMIC_RELEASE);
+    arch_spinloop_signal();
+}
+
+static inline void _spin_lock_init(spin_lock_t *lock)
+{
+    *lock = SPIN_LOCK_INITIAL_VALUE;
+}
+
+static inline bool _spin_lock_held(spin_lock_t *lock)
+{
+    spin_lock_t val = __atomic_load_n(lock, __ATOMIC_RELAXED);
+
+    return (spin_ticket_t)val != (spin_ticket_t)(val >> SPIN_TICKET_SHIFT);
+}
+
+#else
+
+static inline void _spin_lock(spin_lock_t *lock)
+{
+    arch_spin_lock(lock);
+}
+
+static inline int _spin_trylock(spin_lock_t *lock)
+{
+    return arch_spin_trylock(lock);
+}
+
+static inline void _spin_unlock(spin_lock_t *lock)
+{
+    arch_spin_unlock(lock);
+}
+
+static inline void _spin_lock_init(spin_lock_t *lock)
+{
+    arch_spin_lock_init(lock);
+}
+
+static inline bool _spin_lock_held(spin_lock_t *lock)
+{
+    return arch_spin_lock_held(lock);
+}
+
+#endif
+
+#if KERNEL_SPINLOCK_STATS
+
+/* give a lock a name and start counting its acquisitions, dumped with the 'spinlocks' command */
+status_t spin_lock_stats_register(spin_lock_t *lock, const char *name);
+
+void spin_lock_stats_lock(spin_lock_t *lock);
+int spin_lock_stats_trylock(spin_lock_t *lock);
+
+#else
+
+static inline status_t spin_lock_stats_register(spin_lock_t *lock, const char *name)
+{
+    return 0;
+}
+
+#endif
+
 /* interrupts should already be disabled */
 static inline void spin_lock(spin_lock_t *lock)
 {
-    arch_spin_lock(lock);
+#if KERNEL_SPINLOCK_STATS
+    spin_lock_stats_lock(lock);
+#else
+    _spin_lock(lock);
+#endif
 }
 
  /* Returns 0 on success, non-0 on failure */
 static inline int spin_trylock(spin_lock_t *lock)
 {
-    return arch_spin_trylock(lock);
+#if KERNEL_SPINLOCK_STATS
+    return spin_lock_stats_trylock(lock);
+#else
+    return _spin_trylock(lock);
+#endif
 }
 
 /* interrupts should already be disabled */
 static inline void spin_unlock(spin_lock_t *lock)
 {
-    arch_spin_unlock(lock);
+    _spin_unlock(lock);
 }
 
 static inline void spin_lock_init(spin_lock_t *lock)
 {
-    arch_spin_lock_init(lock);
+    _spin_lock_init(lock);
 }
 
 static inline bool spin_lock_held(spin_lock_t *lock)
 {
-    return arch_spin_lock_held(lock);
+    return _spin_lock_held(lock);
 }
 
 /* spin lock irq save flags: */
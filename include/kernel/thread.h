@@ -48,6 +48,9 @@ typedef int (*thread_start_routine)(void *arg);
 enum thread_tls_list {
 #ifdef WITH_LIB_UTHREAD
 	TLS_ENTRY_UTHREAD,
+#endif
+#ifdef WITH_LIB_LWIP
+	TLS_ENTRY_LWIP,
 #endif
 	MAX_TLS_ENTRY
 };
@@ -71,6 +74,7 @@ typedef struct thread {
 	int remaining_quantum;
 	unsigned int flags;
 	int curr_cpu;
+	int last_cpu; /* cpu it last ran on, used to pick a run queue */
 	int pinned_cpu; /* only run on pinned_cpu if >= 0 */
 
 	/* if blocked, a pointer to the wait queue */
@@ -193,6 +197,7 @@ struct thread_stats {
 
 #if WITH_SMP
 	ulong reschedule_ipis;
+	ulong steals; /* threads pulled off of another cpu's run queue */
 #endif
 };
 
@@ -39,6 +39,7 @@ typedef struct timer {
 
 	lk_time_t scheduled_time;
 	lk_time_t periodic_time;
+	uint cpu; /* cpu whose timer wheel it was last queued on */
 
 	timer_callback callback;
 	void *arg;
@@ -50,6 +51,7 @@ typedef struct timer {
 	.node = LIST_INITIAL_CLEARED_VALUE, \
 	.scheduled_time = 0, \
 	.periodic_time = 0, \
+	.cpu = 0, \
 	.callback = NULL, \
 	.arg = NULL, \
 }
@@ -83,13 +83,15 @@ typedef struct vm_page {
     struct list_node node;
 
     uint flags : 8;
-    uint ref : 24;
+    uint order : 8; /* buddy order, valid while VM_PAGE_FLAG_BUDDY is set */
+    uint ref : 16;
 
     uint alloc_count;
     uint32_t type;
 } vm_page_t;
 
 #define VM_PAGE_FLAG_NONFREE  (0x1)
+#define VM_PAGE_FLAG_BUDDY    (0x2) /* head page of a free block on an arena free list */
 
 #define VM_PAGE_TYPE_UNKNOWN  (UINT32_MAX)
 #define VM_PAGE_TYPE_RESERVED (0x0)
@@ -115,10 +117,17 @@ STATIC_ASSERT(KERNEL_ASPACE_BASE + (KERNEL_ASPACE_SIZE - 1) > KERNEL_ASPACE_BASE
 
 static inline bool is_kernel_address(vaddr_t va)
 {
-    return (va >= KERNEL_ASPACE_BASE && va <= (KERNEL_ASPACE_BASE + KERNEL_ASPACE_SIZE - 1));
+    /* a single unsigned compare, so a zero base doesn't make half of it a tautology */
+    return (va - KERNEL_ASPACE_BASE) <= (KERNEL_ASPACE_SIZE - 1);
 }
 
 /* physical allocator */
+
+/* number of buddy orders, the largest free block is 1 << (PMM_MAX_ORDER - 1) pages */
+#ifndef PMM_MAX_ORDER
+#define PMM_MAX_ORDER 11
+#endif
+
 typedef struct pmm_arena {
     struct list_node node;
     const char *name;
@@ -132,7 +141,7 @@ typedef struct pmm_arena {
     size_t free_count;
 
     struct vm_page *page_array;
-    struct list_node free_list;
+    struct list_node free_list[PMM_MAX_ORDER];
 } pmm_arena_t;
 
 #define PMM_ARENA_FLAG_RESERVED (0x0)
@@ -29,6 +29,7 @@
 #include <arch/defines.h>
 #include <arch/ops.h>
 #include <arch/thread.h>
+#include <kernel/spinlock.h>
 
 /* wait queue stuff */
 #define WAIT_QUEUE_MAGIC 'wait'
@@ -37,17 +38,24 @@ typedef struct wait_queue {
 	int magic;
 	struct list_node list;
 	int count;
+	spin_lock_t lock;
 } wait_queue_t;
 
 #define WAIT_QUEUE_INITIAL_VALUE(q) \
 { \
 	.magic = WAIT_QUEUE_MAGIC, \
 	.list = LIST_INITIAL_VALUE((q).list), \
-	.count = 0 \
+	.count = 0, \
+	.lock = SPIN_LOCK_INITIAL_VALUE \
 }
 
 /* wait queue primitive */
-/* NOTE: must be inside critical section when using these */
+/*
+ * NOTE: callers must hold the queue's own lock with interrupts disabled. the
+ * routines take thread_lock themselves, so the queue lock always nests outside it.
+ * block, wake and destroy release the queue lock before returning, the interrupt
+ * state is left for the caller to restore.
+ */
 void wait_queue_init(wait_queue_t *wait);
 
 /*
@@ -75,6 +83,7 @@ int wait_queue_wake_all(wait_queue_t *, bool reschedule, status_t wait_queue_err
 
 /*
  * remove the thread from whatever wait queue it's in.
+ * the caller must hold thread_lock and the lock of the queue the thread is blocked on.
  * return an error if the thread is not currently blocked (or is the current thread)
  */
 status_t thread_unblock_from_wait_queue(struct thread *t, status_t wait_queue_error);
@@ -36,5 +36,12 @@ int bcache_read_block(bcache_t, void *, uint block);
 int bcache_get_block(bcache_t, void **, uint block);
 int bcache_put_block(bcache_t, uint block);
 
+// modify cached blocks, they're written back in the background or by bcache_flush
+int bcache_mark_block_dirty(bcache_t, uint block);
+int bcache_zero_block(bcache_t, uint block);
+int bcache_flush(bcache_t);
+
+void bcache_dump(bcache_t, const char *name);
+
 #endif
 
@@ -24,9 +24,26 @@
 
 #include <sys/types.h>
 #include <list.h>
+#include <kernel/spinlock.h>
 
 typedef uint32_t bnum_t;
 
+struct bio_request;
+
+/* per device request queue, managed by bio */
+struct bio_queue {
+	spin_lock_t lock;
+	struct list_node pending;
+	uint inflight;
+	uint plugged;
+	bool dispatching;
+
+	/* stats */
+	ulong submitted;
+	ulong merged;
+	ulong dispatched;
+};
+
 typedef struct bdev {
 	struct list_node node;
 	volatile int ref;
@@ -51,8 +68,52 @@ typedef struct bdev {
 	ssize_t (*erase)(struct bdev *, off_t offset, size_t len);
 	int (*ioctl)(struct bdev *, int request, void *argp);
 	void (*close)(struct bdev *);
+
+	/* asynchronous request interface. a driver that sets submit queues the request
+	 * and calls bio_complete_request() when it's done. submit must not block, it may be
+	 * called from the irq handler that completed an earlier request.
+	 * drivers without it get their read_block/write_block hooks called synchronously.
+	 */
+	status_t (*submit)(struct bdev *, struct bio_request *req);
+	uint queue_depth;        /* max requests outstanding in the driver at once */
+	uint max_request_blocks; /* largest request after merging, 0 for no limit */
+	uint max_segments;       /* most buffers in a merged request, 0 for no limit */
+	struct bio_queue queue;
 } bdev_t;
 
+/* asynchronous block requests */
+enum bio_op {
+	BIO_OP_READ = 0,
+	BIO_OP_WRITE,
+	BIO_OP_FLUSH,
+	BIO_OP_DISCARD,      /* contents of the range are undefined afterwards */
+	BIO_OP_WRITE_ZEROES, /* the range reads back as zeros, only for drivers that implement it */
+};
+
+typedef struct bio_request {
+	struct list_node node;
+	bdev_t *dev;
+
+	uint op;
+	bnum_t block;
+	uint count;
+	void *buf;
+
+	/* called exactly once when the request is done, possibly from interrupt context */
+	void (*callback)(struct bio_request *req);
+	void *cookie;
+
+	/* bytes transferred or negative error, valid in the callback */
+	ssize_t result;
+
+	/* requests merged behind this one, in block order. a driver sees the head of the
+	 * chain and has to transfer merge_blocks blocks across merge_segments buffers.
+	 */
+	struct bio_request *merge_next;
+	uint merge_blocks;
+	uint merge_segments;
+} bio_request_t;
+
 /* user api */
 bdev_t *bio_open(const char *name);
 bdev_t *bio_open_first_dev(void);
@@ -64,6 +125,25 @@ ssize_t bio_write(bdev_t *dev, const void *buf, off_t offset, size_t len);
 ssize_t bio_write_block(bdev_t *dev, const void *buf, bnum_t block, uint count);
 ssize_t bio_erase(bdev_t *dev, off_t offset, size_t len);
 int bio_ioctl(bdev_t *dev, int request, void *argp);
+ssize_t bio_flush(bdev_t *dev);
+
+/* async api. the device must stay open until the request completes, and block/dev
+ * may be rewritten when the request is passed down to a parent device. */
+void bio_request_init(bio_request_t *req, uint op, bnum_t block, uint count, void *buf,
+                      void (*callback)(bio_request_t *), void *cookie);
+void bio_submit_request(bdev_t *dev, bio_request_t *req);
+
+/* submit a request and block until it completes, returns its result */
+ssize_t bio_sync_request(bdev_t *dev, uint op, bnum_t block, uint count, void *buf);
+
+/* hold requests in the queue so adjacent ones can be merged, dispatch on the last unplug.
+ * the plug is per device, so keep plugged sections short and don't make blocking calls
+ * on the device while holding one. */
+void bio_plug(bdev_t *dev);
+void bio_unplug(bdev_t *dev);
+
+/* called by drivers with the head of a request chain */
+void bio_complete_request(bio_request_t *req, ssize_t result);
 
 /* register a block device */
 void bio_register_device(bdev_t *dev);
@@ -2,6 +2,8 @@
 #define __CKSUM_H
 
 #include <compiler.h>
+#include <stddef.h>
+#include <stdint.h>
 
 __BEGIN_CDECLS
 
@@ -24,6 +26,80 @@ unsigned long crc32(unsigned long crc, const unsigned char *buf, unsigned int le
 
 unsigned long adler32(unsigned long adler, const unsigned char *buf, unsigned int len);
 
+ /*
+  * Internet checksum (RFC 1071).
+  *
+  * A partial sum is a 32 bit ones complement accumulator of the data read as native
+  * endian 16 bit words, so the folded and inverted result can be stored straight into
+  * a header. Pass a previous partial sum in to continue it, or combine the sums of
+  * separately summed blocks with inet_cksum_block_add().
+  */
+uint32_t inet_cksum_partial(const void *buf, size_t len, uint32_t sum);
+
+ /*
+  * Copies len bytes from src to dst and sums them in the same pass.
+  */
+uint32_t inet_cksum_copy(void *dst, const void *src, size_t len, uint32_t sum);
+
+static inline uint32_t inet_cksum_add(uint32_t sum, uint32_t val)
+{
+	sum += val;
+	return sum + (sum < val);
+}
+
+ /*
+  * Adds the partial sum of a block that starts offset bytes into the data. A block
+  * starting on an odd byte had its words summed byte swapped (RFC 1071 2.B).
+  */
+static inline uint32_t inet_cksum_block_add(uint32_t sum, uint32_t block, size_t offset)
+{
+	if (offset & 1)
+		block = (block >> 8) | (block << 24);
+	return inet_cksum_add(sum, block);
+}
+
+ /*
+  * Folds a partial sum down to 16 bits, not inverted.
+  */
+static inline uint16_t inet_cksum_fold(uint32_t sum)
+{
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return sum;
+}
+
+static inline uint16_t inet_cksum(const void *buf, size_t len)
+{
+	return ~inet_cksum_fold(inet_cksum_partial(buf, len, 0));
+}
+
+ /*
+  * Updates a stored checksum for a 16 or 32 bit field that changed from 'from' to
+  * 'to', without touching the rest of the data (RFC 1624: HC' = ~(~HC + ~m + m')).
+  * The field values are as stored, in network byte order.
+  */
+static inline uint16_t inet_cksum_update16(uint16_t cksum, uint16_t from, uint16_t to)
+{
+	uint32_t sum = (uint16_t)~cksum;
+
+	sum += (uint16_t)~from;
+	sum += to;
+
+	return ~inet_cksum_fold(sum);
+}
+
+static inline uint16_t inet_cksum_update32(uint16_t cksum, uint32_t from, uint32_t to)
+{
+	uint32_t sum = (uint16_t)~cksum;
+
+	sum += (uint16_t)~(from >> 16);
+	sum += (uint16_t)~from;
+	sum += to >> 16;
+	sum += to & 0xffff;
+
+	return ~inet_cksum_fold(sum);
+}
+
 __END_CDECLS
 
 #endif
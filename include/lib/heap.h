@@ -26,12 +26,24 @@
 #include <stddef.h>
 #include <sys/types.h>
 
+/* size classes served by the per cpu magazines */
+#define HEAP_NUM_SIZE_CLASSES 13
+
+struct heap_class_stats {
+	size_t size;
+	uint cached; /* chunks sitting in magazines */
+	ulong hits;
+	ulong misses;
+};
+
 struct heap_stats {
 	void* heap_start;
 	size_t heap_len;
 	size_t heap_free;
 	size_t heap_max_chunk;
 	size_t heap_low_watermark;
+	size_t heap_cached; /* bytes held in the magazines */
+	struct heap_class_stats size_class[HEAP_NUM_SIZE_CLASSES];
 };
 
 void *heap_alloc(size_t, unsigned int alignment);
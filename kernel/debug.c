@@ -84,6 +84,7 @@ static int cmd_threadstats(int argc, const cmd_args *argv)
 		printf("\treschedules: %lu\n", thread_stats[i].reschedules);
 #if WITH_SMP
 		printf("\treschedule_ipis: %lu\n", thread_stats[i].reschedule_ipis);
+		printf("\tsteals: %lu\n", thread_stats[i].steals);
 #endif
 		printf("\tcontext_switches: %lu\n", thread_stats[i].context_switches);
 		printf("\tpreempts: %lu\n", thread_stats[i].preempts);
@@ -170,69 +171,247 @@ static int cmd_threadload(int argc, const cmd_args *argv)
 
 #if WITH_KERNEL_EVLOG
 
-#include <lib/evlog.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arch/ops.h>
+#include <arch/defines.h>
+#include <kernel/spinlock.h>
 
-static evlog_t kernel_evlog;
+STATIC_ASSERT((KERNEL_EVLOG_LEN & (KERNEL_EVLOG_LEN - 1)) == 0);
+STATIC_ASSERT(sizeof(struct kernel_evlog_record) == 16);
+
+/*
+ * One ring per cpu, so loggers on different cpus never share a cache line or a lock.
+ * A record is written with interrupts off, so each ring has exactly one writer at a
+ * time, and busy lets an export wait out writers on the other cpus.
+ */
+struct kernel_evlog_ring {
+	uint head;
+	volatile bool busy;
+	struct kernel_evlog_record *records;
+} __ALIGNED(CACHE_LINE);
+
+static struct kernel_evlog_ring kernel_evlog_rings[SMP_MAX_CPUS];
 volatile bool kernel_evlog_enable;
 
 void kernel_evlog_init(void)
 {
-	evlog_init(&kernel_evlog, KERNEL_EVLOG_LEN, 4);
+	for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+		kernel_evlog_rings[i].records = calloc(KERNEL_EVLOG_LEN, sizeof(struct kernel_evlog_record));
+	}
 
 	kernel_evlog_enable = true;
 }
 
 void kernel_evlog_add(uintptr_t id, uintptr_t arg0, uintptr_t arg1)
 {
-	if (kernel_evlog_enable) {
-		uint index = evlog_bump_head(&kernel_evlog);
+	spin_lock_saved_state_t state;
+	arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+	uint cpu = arch_curr_cpu_num();
+	struct kernel_evlog_ring *ring = &kernel_evlog_rings[cpu];
+
+	/* announce the write before checking the enable, pairing with kernel_evlog_pause() */
+	ring->busy = true;
+	smp_mb();
+
+	if (likely(kernel_evlog_enable && ring->records)) {
+		struct kernel_evlog_record *r = &ring->records[ring->head & (KERNEL_EVLOG_LEN - 1)];
+
+		r->time = current_time_hires();
+		r->id = id;
+		r->cpu = cpu;
+		r->reserved = 0;
+		r->arg0 = arg0;
+		r->arg1 = arg1;
+		ring->head++;
+	}
+
+	smp_mb();
+	ring->busy = false;
+
+	arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+/*
+ * stop logging and wait for anyone still writing a record, returning the old state.
+ * busy rings are waited on, not skipped: a writer only holds busy for the few stores
+ * of one record with interrupts off, and skipping would drop that cpu's whole ring.
+ */
+static bool kernel_evlog_pause(void)
+{
+	bool enabled = kernel_evlog_enable;
+
+	kernel_evlog_enable = false;
+	smp_mb();
 
-		kernel_evlog.items[index] = (uintptr_t)current_time_hires();
-		kernel_evlog.items[index+1] = (arch_curr_cpu_num() << 16) | id;
-		kernel_evlog.items[index+2] = arg0;
-		kernel_evlog.items[index+3] = arg1;
+	for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+		while (kernel_evlog_rings[i].busy)
+			;
 	}
+
+	return enabled;
 }
 
-#if WITH_LIB_CONSOLE
+static void kernel_evlog_resume(bool enabled)
+{
+	smp_mb();
+	kernel_evlog_enable = enabled;
+}
 
-static void kevdump_cb(const uintptr_t *i)
+/* the oldest record still in a ring and how many there are */
+static uint kernel_evlog_range(const struct kernel_evlog_ring *ring, uint *count)
 {
-	switch (i[1] & 0xffff) {
-		case KERNEL_EVLOG_CONTEXT_SWITCH:
-			printf("%lu.%lu: context switch from %p to %p\n", i[0], i[1] >> 16, (void *)i[2], (void *)i[3]);
-			break;
-		case KERNEL_EVLOG_PREEMPT:
-			printf("%lu.%lu: preempt on thread %p\n", i[0], i[1] >> 16, (void *)i[2]);
-			break;
-		case KERNEL_EVLOG_TIMER_TICK:
-			printf("%lu.%lu: timer tick\n", i[0], i[1] >> 16);
-			break;
-		case KERNEL_EVLOG_TIMER_CALL:
-			printf("%lu.%lu: timer call %p, arg %p\n", i[0], i[1] >> 16, (void *)i[2], (void *)i[3]);
-			break;
-		case KERNEL_EVLOG_IRQ_ENTER:
-			printf("%lu.%lu: irq entry %u\n", i[0], i[1] >> 16, (uint)i[2]);
-			break;
-		case KERNEL_EVLOG_IRQ_EXIT:
-			printf("%lu.%lu: irq exit  %u\n", i[0], i[1] >> 16, (uint)i[2]);
-			break;
-		default:
-			;
+	uint head = ring->head;
+
+	*count = MIN(head, KERNEL_EVLOG_LEN);
+	return head - *count;
+}
+
+void kernel_evlog_clear(void)
+{
+	bool enabled = kernel_evlog_pause();
+
+	for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+		kernel_evlog_rings[i].head = 0;
 	}
+
+	kernel_evlog_resume(enabled);
 }
 
+status_t kernel_evlog_export(kernel_evlog_write_cb write, void *arg)
+{
+	struct kernel_evlog_header header = {
+		.magic = KERNEL_EVLOG_MAGIC,
+		.version = KERNEL_EVLOG_VERSION,
+		.record_size = sizeof(struct kernel_evlog_record),
+		.cpu_count = SMP_MAX_CPUS,
+	};
+	status_t err = NO_ERROR;
+
+	bool enabled = kernel_evlog_pause();
+
+	for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+		const struct kernel_evlog_ring *ring = &kernel_evlog_rings[i];
+		uint count;
+
+		if (!ring->records)
+			continue;
+
+		kernel_evlog_range(ring, &count);
+		header.record_count += count;
+		header.dropped += ring->head - count;
+	}
+	header.now = current_time_hires();
+
+	if (write(arg, &header, sizeof(header)) < 0) {
+		err = ERR_IO;
+		goto done;
+	}
+
+	for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+		const struct kernel_evlog_ring *ring = &kernel_evlog_rings[i];
+		uint count;
+
+		if (!ring->records)
+			continue;
+
+		/* at most two runs, either side of the wrap */
+		uint start = kernel_evlog_range(ring, &count) & (KERNEL_EVLOG_LEN - 1);
+		uint first = MIN(count, KERNEL_EVLOG_LEN - start);
+
+		if ((first > 0 && write(arg, &ring->records[start], first * sizeof(ring->records[0])) < 0) ||
+		        (count > first && write(arg, &ring->records[0], (count - first) * sizeof(ring->records[0])) < 0)) {
+			err = ERR_IO;
+			goto done;
+		}
+	}
+
+done:
+	kernel_evlog_resume(enabled);
+
+	return err;
+}
+
+#if WITH_LIB_CONSOLE
+
+static const char *kernel_evlog_names[] = {
+	[KERNEL_EVLOG_CONTEXT_SWITCH] = "context switch",
+	[KERNEL_EVLOG_PREEMPT] = "preempt",
+	[KERNEL_EVLOG_TIMER_TICK] = "timer tick",
+	[KERNEL_EVLOG_TIMER_CALL] = "timer call",
+	[KERNEL_EVLOG_IRQ_ENTER] = "irq entry",
+	[KERNEL_EVLOG_IRQ_EXIT] = "irq exit",
+	[KERNEL_EVLOG_HEAP_ALLOC] = "heap alloc",
+	[KERNEL_EVLOG_HEAP_FREE] = "heap free",
+	[KERNEL_EVLOG_BIO_READ_BEGIN] = "bio read",
+	[KERNEL_EVLOG_BIO_READ_END] = "bio read done",
+	[KERNEL_EVLOG_BIO_WRITE_BEGIN] = "bio write",
+	[KERNEL_EVLOG_BIO_WRITE_END] = "bio write done",
+	[KERNEL_EVLOG_BIO_SUBMIT] = "bio request",
+	[KERNEL_EVLOG_BIO_COMPLETE] = "bio request done",
+	[KERNEL_EVLOG_NET_RX] = "net rx",
+	[KERNEL_EVLOG_NET_TX] = "net tx",
+};
+
 void kernel_evlog_dump(void)
 {
-	kernel_evlog_enable = false;
-	evlog_dump(&kernel_evlog, &kevdump_cb);
-	kernel_evlog_enable = true;
+	bool enabled = kernel_evlog_pause();
+
+	for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+		const struct kernel_evlog_ring *ring = &kernel_evlog_rings[i];
+		uint count;
+
+		if (!ring->records)
+			continue;
+
+		uint start = kernel_evlog_range(ring, &count);
+		for (uint n = 0; n < count; n++) {
+			const struct kernel_evlog_record *r = &ring->records[(start + n) & (KERNEL_EVLOG_LEN - 1)];
+			const char *name = (r->id < countof(kernel_evlog_names)) ? kernel_evlog_names[r->id] : NULL;
+
+			printf("%u.%u: %s (%u) 0x%x 0x%x\n", r->time, r->cpu, name ? name : "unknown", r->id,
+			       r->arg0, r->arg1);
+		}
+	}
+
+	kernel_evlog_resume(enabled);
+}
+
+/* the binary export as hex, for a host tool to turn back into bytes off a serial log */
+static int kevexport_cb(void *arg, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	while (len > 0) {
+		size_t line = MIN(len, 32);
+
+		printf("KEVLOG ");
+		for (size_t i = 0; i < line; i++)
+			printf("%02x", p[i]);
+		printf("\n");
+
+		p += line;
+		len -= line;
+	}
+
+	return 0;
 }
 
 static int cmd_kevlog(int argc, const cmd_args *argv)
 {
-	printf("kernel event log:\n");
-	kernel_evlog_dump();
+	if (argc < 2) {
+		printf("kernel event log:\n");
+		kernel_evlog_dump();
+	} else if (!strcmp(argv[1].str, "export")) {
+		kernel_evlog_export(&kevexport_cb, NULL);
+		printf("KEVLOG END\n");
+	} else if (!strcmp(argv[1].str, "clear")) {
+		kernel_evlog_clear();
+	} else {
+		printf("usage: %s [export|clear]\n", argv[0].str);
+		return ERR_INVALID_ARGS;
+	}
 
 	return NO_ERROR;
 }
@@ -71,14 +71,16 @@ void event_destroy(event_t *e)
 {
 	DEBUG_ASSERT(e->magic == EVENT_MAGIC);
 
-	THREAD_LOCK(state);
+	spin_lock_saved_state_t state;
+	arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+	spin_lock(&e->wait.lock);
 
 	e->magic = 0;
-	e->signalled = false;
+	e->state = 0;
 	e->flags = 0;
 	wait_queue_destroy(&e->wait, true);
 
-	THREAD_UNLOCK(state);
+	arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
 }
 
 /**
@@ -102,20 +104,49 @@ status_t event_wait_timeout(event_t *e, lk_time_t timeout)
 
 	DEBUG_ASSERT(e->magic == EVENT_MAGIC);
 
-	THREAD_LOCK(state);
+	/* already signalled, fall through without the queue lock */
+	int s = e->state;
+	while (s & EVENT_STATE_SIGNALLED) {
+		if (!(e->flags & EVENT_FLAG_AUTOUNSIGNAL)) {
+			smp_mb();
+			return NO_ERROR;
+		}
+
+		/* autounsignal flag lets one thread fall through before unsignalling */
+		int old = atomic_cmpxchg(&e->state, s, s & ~EVENT_STATE_SIGNALLED);
+		if (old == s) {
+			smp_mb();
+			return NO_ERROR;
+		}
+		s = old;
+	}
+
+	spin_lock_saved_state_t state;
+	arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+	spin_lock(&e->wait.lock);
 
-	if (e->signalled) {
+	/* flag that we're here first, so a signal can no longer skip the wait queue */
+	if (atomic_or(&e->state, EVENT_STATE_WAITERS) & EVENT_STATE_SIGNALLED) {
 		/* signalled, we're going to fall through */
 		if (e->flags & EVENT_FLAG_AUTOUNSIGNAL) {
-			/* autounsignal flag lets one thread fall through before unsignalling */
-			e->signalled = false;
+			atomic_and(&e->state, ~EVENT_STATE_SIGNALLED);
 		}
+		if (e->wait.count == 0)
+			atomic_and(&e->state, ~EVENT_STATE_WAITERS);
+		spin_unlock(&e->wait.lock);
 	} else {
 		/* unsignalled, block here */
 		ret = wait_queue_block(&e->wait, timeout);
+		if (ret == ERR_TIMED_OUT) {
+			/* a timed out waiter is still using the event, so it can't have been freed */
+			spin_lock(&e->wait.lock);
+			if (e->wait.count == 0)
+				atomic_and(&e->state, ~EVENT_STATE_WAITERS);
+			spin_unlock(&e->wait.lock);
+		}
 	}
 
-	THREAD_UNLOCK(state);
+	arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
 
 	return ret;
 }
@@ -141,27 +172,55 @@ status_t event_signal(event_t *e, bool reschedule)
 {
 	DEBUG_ASSERT(e->magic == EVENT_MAGIC);
 
-	THREAD_LOCK(state);
+	smp_mb();
 
-	if (!e->signalled) {
-		if (e->flags & EVENT_FLAG_AUTOUNSIGNAL) {
-			/* try to release one thread and leave unsignalled if successful */
-			if (wait_queue_wake_one(&e->wait, reschedule, NO_ERROR) <= 0) {
-				/*
-				 * if we didn't actually find a thread to wake up, go to
-				 * signalled state and let the next call to event_wait
-				 * unsignal the event.
-				 */
-				e->signalled = true;
-			}
-		} else {
-			/* release all threads and remain signalled */
-			e->signalled = true;
-			wait_queue_wake_all(&e->wait, reschedule, NO_ERROR);
-		}
+	/* nobody waiting, just set the signalled state */
+	int s = e->state;
+	while (!(s & EVENT_STATE_WAITERS)) {
+		if (s & EVENT_STATE_SIGNALLED)
+			return NO_ERROR;
+
+		int old = atomic_cmpxchg(&e->state, s, s | EVENT_STATE_SIGNALLED);
+		if (old == s)
+			return NO_ERROR;
+		s = old;
+	}
+
+	spin_lock_saved_state_t state;
+	arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+	spin_lock(&e->wait.lock);
+
+	/*
+	 * the waiters flag is cleared before waking, the woken threads may destroy the
+	 * event. no new waiter can show up while we hold the queue lock, and the wake
+	 * drops it, so it has to come last.
+	 */
+	if (e->state & EVENT_STATE_SIGNALLED) {
+		if (e->wait.count == 0)
+			atomic_and(&e->state, ~EVENT_STATE_WAITERS);
+		spin_unlock(&e->wait.lock);
+	} else if (e->wait.count == 0) {
+		/*
+		 * the waiters all timed out, go to signalled state and let the next
+		 * call to event_wait unsignal the event if it's autounsignal.
+		 */
+		atomic_or(&e->state, EVENT_STATE_SIGNALLED);
+		atomic_and(&e->state, ~EVENT_STATE_WAITERS);
+		spin_unlock(&e->wait.lock);
+	} else if (e->flags & EVENT_FLAG_AUTOUNSIGNAL) {
+		if (e->wait.count == 1)
+			atomic_and(&e->state, ~EVENT_STATE_WAITERS);
+
+		/* release one thread and leave unsignalled */
+		wait_queue_wake_one(&e->wait, reschedule, NO_ERROR);
+	} else {
+		/* release all threads and remain signalled */
+		atomic_or(&e->state, EVENT_STATE_SIGNALLED);
+		atomic_and(&e->state, ~EVENT_STATE_WAITERS);
+		wait_queue_wake_all(&e->wait, reschedule, NO_ERROR);
 	}
 
-	THREAD_UNLOCK(state);
+	arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
 
 	return NO_ERROR;
 }
@@ -182,7 +241,7 @@ status_t event_unsignal(event_t *e)
 {
 	DEBUG_ASSERT(e->magic == EVENT_MAGIC);
 
-	e->signalled = false;
+	atomic_and(&e->state, ~EVENT_STATE_SIGNALLED);
 
 	return NO_ERROR;
 }
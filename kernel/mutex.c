@@ -35,6 +35,12 @@
 #include <assert.h>
 #include <err.h>
 #include <kernel/thread.h>
+#include <platform.h>
+
+/* times to poll a mutex held by a thread running on another cpu before blocking */
+#ifndef MUTEX_SPIN_COUNT
+#define MUTEX_SPIN_COUNT 1000
+#endif
 
 /**
  * @brief  Initialize a mutex_t
@@ -60,11 +66,13 @@ void mutex_destroy(mutex_t *m)
 		      get_current_thread(), get_current_thread()->name, m, m->holder, m->holder->name);
 #endif
 
-	THREAD_LOCK(state);
+	spin_lock_saved_state_t state;
+	arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+	spin_lock(&m->wait.lock);
 	m->magic = 0;
-	m->count = 0;
+	m->state = MUTEX_FREE;
 	wait_queue_destroy(&m->wait, true);
-	THREAD_UNLOCK(state);
+	arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
 }
 
 /**
@@ -77,6 +85,97 @@ void mutex_destroy(mutex_t *m)
  * @return  NO_ERROR on success, ERR_TIMED_OUT on timeout,
  * other values on error
  */
+#if WITH_SMP
+/*
+ * poll the mutex while its holder is running on another cpu, on the theory that it
+ * will be released sooner than a block and wake would take. the holder may change or
+ * exit underneath us, but thread structures stay mapped so reading one is just a stale hint.
+ */
+static bool mutex_spin(mutex_t *m)
+{
+	for (uint i = 0; i < MUTEX_SPIN_COUNT; i++) {
+		int state = m->state;
+		if (state == MUTEX_FREE) {
+			if (atomic_cmpxchg(&m->state, MUTEX_FREE, MUTEX_HELD) == MUTEX_FREE)
+				return true;
+			continue;
+		}
+
+		/* others are already asleep on it, get in line */
+		if (state == MUTEX_CONTENDED)
+			return false;
+
+		CF;
+		thread_t *holder = m->holder;
+		if (holder && (holder->state != THREAD_RUNNING || holder->curr_cpu == (int)arch_curr_cpu_num()))
+			return false;
+	}
+
+	return false;
+}
+#endif
+
+static status_t mutex_acquire_contended(mutex_t *m, lk_time_t timeout)
+{
+	if (timeout == 0)
+		return ERR_TIMED_OUT;
+
+#if WITH_SMP
+	if (mutex_spin(m))
+		return NO_ERROR;
+#endif
+
+	lk_time_t start = current_time();
+	for (;;) {
+		/*
+		 * mark it contended so the release knows to wake someone. if it was free in
+		 * the meantime we now hold it, pessimistically marked contended.
+		 */
+		if (atomic_swap(&m->state, MUTEX_CONTENDED) == MUTEX_FREE)
+			return NO_ERROR;
+
+		lk_time_t wait_time = INFINITE_TIME;
+		if (timeout != INFINITE_TIME) {
+			lk_time_t elapsed = current_time() - start;
+			if (elapsed >= timeout)
+				return ERR_TIMED_OUT;
+			wait_time = timeout - elapsed;
+		}
+
+		/* release frees the mutex before taking the queue lock to wake, so look again under it */
+		status_t ret = NO_ERROR;
+		spin_lock_saved_state_t state;
+		arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+		spin_lock(&m->wait.lock);
+		if (m->state == MUTEX_CONTENDED)
+			ret = wait_queue_block(&m->wait, wait_time);
+		else
+			spin_unlock(&m->wait.lock);
+		arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+		/*
+		 * a timeout leaves the mutex marked contended, which only costs the holder
+		 * a wasted trip through the slow path. any other error means it was destroyed.
+		 */
+		if (unlikely(ret < NO_ERROR))
+			return ret;
+
+		/* woken, race everyone else for it */
+	}
+}
+
+/**
+ * @brief  Mutex wait with timeout
+ *
+ * This function waits up to \a timeout ms for the mutex to become available.
+ * Timeout may be zero, in which case this function returns immediately if
+ * the mutex is not free.
+ *
+ * An uncontended acquire is a single compare and swap.
+ *
+ * @return  NO_ERROR on success, ERR_TIMED_OUT on timeout,
+ * other values on error
+ */
 status_t mutex_acquire_timeout(mutex_t *m, lk_time_t timeout)
 {
 	DEBUG_ASSERT(m->magic == MUTEX_MAGIC);
@@ -87,33 +186,16 @@ status_t mutex_acquire_timeout(mutex_t *m, lk_time_t timeout)
 		      get_current_thread(), get_current_thread()->name, m);
 #endif
 
-	THREAD_LOCK(state);
-
-	status_t ret = NO_ERROR;
-	if (unlikely(++m->count > 1)) {
-		ret = wait_queue_block(&m->wait, timeout);
-		if (unlikely(ret < NO_ERROR)) {
-			/* if the acquisition timed out, back out the acquire and exit */
-			if (likely(ret == ERR_TIMED_OUT)) {
-				/*
-				 * race: the mutex may have been destroyed after the timeout,
-				 * but before we got scheduled again which makes messing with the
-				 * count variable dangerous.
-				 */
-				m->count--;
-			}
-			/* if there was a general error, it may have been destroyed out from
-			 * underneath us, so just exit (which is really an invalid state anyway)
-			 */
-			goto err;
-		}
+	if (unlikely(atomic_cmpxchg(&m->state, MUTEX_FREE, MUTEX_HELD) != MUTEX_FREE)) {
+		status_t ret = mutex_acquire_contended(m, timeout);
+		if (ret < NO_ERROR)
+			return ret;
 	}
 
+	smp_mb();
 	m->holder = get_current_thread();
 
-err:
-	THREAD_UNLOCK(state);
-	return ret;
+	return NO_ERROR;
 }
 
 /**
@@ -130,16 +212,22 @@ status_t mutex_release(mutex_t *m)
 	}
 #endif
 
-	THREAD_LOCK(state);
-
 	m->holder = 0;
+	smp_mb();
 
-	if (unlikely(--m->count >= 1)) {
-		/* release a thread */
-		wait_queue_wake_one(&m->wait, true, NO_ERROR);
-	}
+	/* nobody waiting, we're done */
+	if (likely(atomic_cmpxchg(&m->state, MUTEX_HELD, MUTEX_FREE) == MUTEX_HELD))
+		return NO_ERROR;
+
+	/* free it and wake a waiter to go after it */
+	atomic_swap(&m->state, MUTEX_FREE);
+
+	spin_lock_saved_state_t state;
+	arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+	spin_lock(&m->wait.lock);
+	wait_queue_wake_one(&m->wait, true, NO_ERROR);
+	arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
 
-	THREAD_UNLOCK(state);
 	return NO_ERROR;
 }
 
@@ -15,6 +15,7 @@ MODULE_SRCS := \
 	$(LOCAL_DIR)/thread.c \
 	$(LOCAL_DIR)/timer.c \
 	$(LOCAL_DIR)/semaphore.c \
+	$(LOCAL_DIR)/spinlock.c \
 	$(LOCAL_DIR)/mp.c
 
 ifeq ($(WITH_KERNEL_VM),1)
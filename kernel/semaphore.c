@@ -26,72 +26,123 @@ void sem_init(semaphore_t *sem, unsigned int value)
 
 void sem_destroy(semaphore_t *sem)
 {
-	THREAD_LOCK(state);
+	spin_lock_saved_state_t state;
+	arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+	spin_lock(&sem->wait.lock);
 	sem->count = 0;
 	wait_queue_destroy(&sem->wait, true);
-	THREAD_UNLOCK(state);
+	arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+/*
+ * the count is the number of resources available less the number of threads waiting,
+ * so it's only negative when someone is waiting. posting to and taking from a
+ * semaphore nobody waits on is a compare and swap on the count, without the queue lock.
+ */
+static bool sem_trydown(semaphore_t *sem)
+{
+	int count = sem->count;
+
+	while (count > 0) {
+		int old = atomic_cmpxchg(&sem->count, count, count - 1);
+		if (old == count) {
+			smp_mb();
+			return true;
+		}
+		count = old;
+	}
+
+	return false;
 }
 
 status_t sem_post(semaphore_t *sem, bool resched)
 {
-	status_t ret = NO_ERROR;
-	THREAD_LOCK(state);
+	smp_mb();
+
+	int count = sem->count;
+	while (count >= 0) {
+		int old = atomic_cmpxchg(&sem->count, count, count + 1);
+		if (old == count)
+			return NO_ERROR;
+		count = old;
+	}
+
+	spin_lock_saved_state_t state;
+	arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+	spin_lock(&sem->wait.lock);
 
 	/*
 	 * If the count is or was negative then a thread is waiting for a resource, otherwise
 	 * it's safe to just increase the count available with no downsides
 	 */
-	if (unlikely(++sem->count <= 0))
+	if (unlikely(atomic_add(&sem->count, 1) < 0))
 		wait_queue_wake_one(&sem->wait, resched, NO_ERROR);
+	else
+		spin_unlock(&sem->wait.lock);
 
-	THREAD_UNLOCK(state);
-	return ret;
+	arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+	return NO_ERROR;
 }
 
 status_t sem_wait(semaphore_t *sem)
 {
 	status_t ret = NO_ERROR;
-	THREAD_LOCK(state);
+
+	if (likely(sem_trydown(sem)))
+		return NO_ERROR;
+
+	spin_lock_saved_state_t state;
+	arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+	spin_lock(&sem->wait.lock);
 
 	/*
 	 * If there are no resources available then we need to
 	 * sit in the wait queue until sem_post adds some.
 	 */
-	if (unlikely(--sem->count < 0))
+	if (unlikely(atomic_add(&sem->count, -1) <= 0))
 		ret = wait_queue_block(&sem->wait, INFINITE_TIME);
+	else
+		spin_unlock(&sem->wait.lock);
 
-	THREAD_UNLOCK(state);
+	arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
 	return ret;
 }
 
 status_t sem_trywait(semaphore_t *sem)
 {
-	status_t ret = NO_ERROR;
-	THREAD_LOCK(state);
-
-	if (unlikely(sem->count <= 0))
-		ret = ERR_NOT_READY;
-	else
-		sem->count--;
-
-	THREAD_UNLOCK(state);
-	return ret;
+	return sem_trydown(sem) ? NO_ERROR : ERR_NOT_READY;
 }
 
 status_t sem_timedwait(semaphore_t *sem, lk_time_t timeout)
 {
 	status_t ret = NO_ERROR;
-	THREAD_LOCK(state);
 
-	if (unlikely(--sem->count < 0)) {
+	if (likely(sem_trydown(sem)))
+		return NO_ERROR;
+
+	spin_lock_saved_state_t state;
+	arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+	spin_lock(&sem->wait.lock);
+
+	if (unlikely(atomic_add(&sem->count, -1) <= 0)) {
 		ret = wait_queue_block(&sem->wait, timeout);
-		if (ret < NO_ERROR) {
-			if (ret == ERR_TIMED_OUT) {
-				sem->count++;
-			}
+		if (ret == ERR_TIMED_OUT) {
+			/*
+			 * give back the count. a post that arrived between the timeout and now saw
+			 * our decrement and went looking for a waiter to wake, which may have been
+			 * nobody; if there's a resource and someone is waiting, hand it over.
+			 */
+			spin_lock(&sem->wait.lock);
+			int count = atomic_add(&sem->count, 1) + 1;
+			if (sem->wait.count > 0 && count + sem->wait.count > 0)
+				wait_queue_wake_one(&sem->wait, false, NO_ERROR);
+			else
+				spin_unlock(&sem->wait.lock);
 		}
+	} else {
+		spin_unlock(&sem->wait.lock);
 	}
 
-	THREAD_UNLOCK(state);
+	arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
 	return ret;
 }
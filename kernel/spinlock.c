@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <kernel/spinlock.h>
+
+#include <debug.h>
+#include <err.h>
+#include <stdio.h>
+#include <string.h>
+#include <compiler.h>
+#include <arch/ops.h>
+
+#if KERNEL_SPINLOCK_STATS
+
+#if WITH_LIB_CONSOLE
+#include <lib/console.h>
+#endif
+
+/* log2 of the number of locks that can be registered */
+#ifndef KERNEL_SPINLOCK_STATS_BITS
+#define KERNEL_SPINLOCK_STATS_BITS 6
+#endif
+#define STATS_TABLE_SIZE (1U << KERNEL_SPINLOCK_STATS_BITS)
+#define STATS_TABLE_MASK (STATS_TABLE_SIZE - 1)
+
+struct spin_lock_stats {
+	spin_lock_t *lock;
+	const char *name;
+
+	uint64_t acquisitions;
+	uint64_t contended;
+
+	/* cycles spent waiting, only counted for contended acquisitions */
+	uint64_t spin_cycles;
+	uint32_t max_spin_cycles;
+};
+
+/*
+ * open addressed on the lock's address. entries are never removed, so a
+ * lookup can run without a lock, racing only with a register publishing a
+ * new entry.
+ */
+static struct spin_lock_stats stats_table[STATS_TABLE_SIZE];
+static spin_lock_t stats_register_lock;
+
+static uint stats_hash(spin_lock_t *lock)
+{
+	return ((uint32_t)((uintptr_t)lock / sizeof(spin_lock_t)) * 2654435761U) >> (32 - KERNEL_SPINLOCK_STATS_BITS);
+}
+
+static struct spin_lock_stats *stats_lookup(spin_lock_t *lock)
+{
+	uint i = stats_hash(lock);
+
+	for (uint n = 0; n < STATS_TABLE_SIZE; n++, i = (i + 1) & STATS_TABLE_MASK) {
+		spin_lock_t *l = __atomic_load_n(&stats_table[i].lock, __ATOMIC_ACQUIRE);
+
+		if (l == lock)
+			return &stats_table[i];
+		if (!l)
+			break;
+	}
+
+	return NULL;
+}
+
+status_t spin_lock_stats_register(spin_lock_t *lock, const char *name)
+{
+	status_t err = ERR_NO_MEMORY;
+	spin_lock_saved_state_t state;
+
+	arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+	_spin_lock(&stats_register_lock);
+
+	uint i = stats_hash(lock);
+	for (uint n = 0; n < STATS_TABLE_SIZE; n++, i = (i + 1) & STATS_TABLE_MASK) {
+		struct spin_lock_stats *s = &stats_table[i];
+
+		if (s->lock == lock) {
+			s->name = name;
+			err = NO_ERROR;
+			break;
+		}
+		if (!s->lock) {
+			s->name = name;
+			__atomic_store_n(&s->lock, lock, __ATOMIC_RELEASE);
+			err = NO_ERROR;
+			break;
+		}
+	}
+
+	_spin_unlock(&stats_register_lock);
+	arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+	if (err < 0)
+		dprintf(INFO, "spinlock stats: no room to register '%s'\n", name);
+
+	return err;
+}
+
+/* called with the lock held, which serializes the updates to its counters */
+static void stats_account(struct spin_lock_stats *s, bool contended, uint32_t cycles)
+{
+	s->acquisitions++;
+	if (contended) {
+		s->contended++;
+		s->spin_cycles += cycles;
+		if (cycles > s->max_spin_cycles)
+			s->max_spin_cycles = cycles;
+	}
+}
+
+void spin_lock_stats_lock(spin_lock_t *lock)
+{
+	struct spin_lock_stats *s = stats_lookup(lock);
+
+	if (!s) {
+		_spin_lock(lock);
+		return;
+	}
+
+	if (_spin_trylock(lock) == 0) {
+		stats_account(s, false, 0);
+		return;
+	}
+
+	uint32_t start = arch_cycle_count();
+	_spin_lock(lock);
+	stats_account(s, true, arch_cycle_count() - start);
+}
+
+int spin_lock_stats_trylock(spin_lock_t *lock)
+{
+	int ret = _spin_trylock(lock);
+
+	if (ret == 0) {
+		struct spin_lock_stats *s = stats_lookup(lock);
+		if (s)
+			stats_account(s, false, 0);
+	}
+
+	return ret;
+}
+
+#if WITH_LIB_CONSOLE
+
+static int cmd_spinlocks(int argc, const cmd_args *argv)
+{
+	bool reset = (argc >= 2 && !strcmp(argv[1].str, "reset"));
+
+	if (argc >= 2 && !reset) {
+		printf("usage: %s [reset]\n", argv[0].str);
+		return ERR_INVALID_ARGS;
+	}
+
+	printf("%-20s %-18s %12s %12s %8s %12s %12s\n",
+	       "name", "lock", "acquired", "contended", "%", "avg spin", "max spin");
+
+	for (uint i = 0; i < STATS_TABLE_SIZE; i++) {
+		struct spin_lock_stats *s = &stats_table[i];
+		spin_lock_t *lock = __atomic_load_n(&s->lock, __ATOMIC_ACQUIRE);
+
+		if (!lock)
+			continue;
+
+		/* read without taking the lock, the numbers may be a little torn */
+		uint64_t acquisitions = s->acquisitions;
+		uint64_t contended = s->contended;
+		uint64_t spin_cycles = s->spin_cycles;
+		uint32_t max_spin_cycles = s->max_spin_cycles;
+
+		uint64_t permille = acquisitions ? contended * 1000 / acquisitions : 0;
+		uint64_t avg = contended ? spin_cycles / contended : 0;
+
+		printf("%-20s %-18p %12llu %12llu %4llu.%llu%% %12llu %12u\n",
+		       s->name, lock,
+		       (unsigned long long)acquisitions, (unsigned long long)contended,
+		       (unsigned long long)(permille / 10), (unsigned long long)(permille % 10),
+		       (unsigned long long)avg, max_spin_cycles);
+
+		if (reset) {
+			s->acquisitions = 0;
+			s->contended = 0;
+			s->spin_cycles = 0;
+			s->max_spin_cycles = 0;
+		}
+	}
+
+	return 0;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("spinlocks", "dump spin lock contention statistics", &cmd_spinlocks)
+STATIC_COMMAND_END(spinlock);
+
+#endif
+
+#endif
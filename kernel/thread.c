@@ -60,12 +60,21 @@ static struct list_node thread_list;
 /* master thread spinlock */
 spin_lock_t thread_lock = SPIN_LOCK_INITIAL_VALUE;
 
-/* the run queue */
-static struct list_node run_queue[NUM_PRIORITIES];
-static uint32_t run_queue_bitmap;
+/* per cpu run queues. they're still only touched with thread_lock held, which
+ * serializes every wakeup and reschedule across cpus just as before. splitting them
+ * buys a per cpu bitmap, no skipping over other cpus' pinned threads and idle
+ * time stealing, not less lock contention. */
+struct run_queue {
+	uint32_t bitmap;
+	uint stealable; /* number of queued threads that are not pinned to this cpu */
+	int curr_priority; /* priority of the thread running on this cpu, read unlocked as a hint */
+	struct list_node queue[NUM_PRIORITIES];
+} __CPU_ALIGN;
+
+static struct run_queue run_queues[SMP_MAX_CPUS];
 
 /* make sure the bitmap is large enough to cover our number of priorities */
-STATIC_ASSERT(NUM_PRIORITIES <= sizeof(run_queue_bitmap) * 8);
+STATIC_ASSERT(NUM_PRIORITIES <= sizeof(run_queues[0].bitmap) * 8);
 
 /* the idle thread(s) (statically allocated) */
 static thread_t idle_threads[SMP_MAX_CPUS];
@@ -73,28 +82,72 @@ static thread_t idle_threads[SMP_MAX_CPUS];
 /* local routines */
 static void thread_resched(void);
 static void idle_thread_routine(void) __NO_RETURN;
+static status_t wait_queue_block_locked(wait_queue_t *wait, lk_time_t timeout);
+static int wait_queue_wake_all_locked(wait_queue_t *wait, status_t wait_queue_error);
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
 /* preemption timer */
 static timer_t preempt_timer[SMP_MAX_CPUS];
-#endif
 
-/* run queue manipulation */
-static void insert_in_run_queue_head(thread_t *t)
+static enum handler_return thread_preempt_timer_tick(timer_t *t, lk_time_t now, void *arg)
 {
-#if THREAD_CHECKS
-	ASSERT(t->magic == THREAD_MAGIC);
-	ASSERT(t->state == THREAD_READY);
-	ASSERT(!list_in_list(&t->queue_node));
-	ASSERT(arch_ints_disabled());
-	ASSERT(spin_lock_held(&thread_lock));
+	return thread_timer_tick();
+}
 #endif
 
-	list_add_head(&run_queue[t->priority], &t->queue_node);
-	run_queue_bitmap |= (1<<t->priority);
+/* pick the cpu whose run queue a thread that is becoming ready should go on */
+static uint thread_select_cpu(thread_t *t)
+{
+	/* pinned threads only ever live in their own cpu's queue */
+	if (t->pinned_cpu >= 0)
+		return t->pinned_cpu;
+
+#if WITH_SMP
+	uint local_cpu = arch_curr_cpu_num();
+
+	/* the running thread going back into a queue stays local */
+	if (t == get_current_thread())
+		return local_cpu;
+
+	/* look for an idle cpu with nothing queued up already, preferring the
+	 * one the thread last ran on, then this one */
+	mp_cpu_mask_t idle = mp_get_idle_mask() & mp.active_cpus;
+	for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+		if (run_queues[i].bitmap != 0)
+			idle &= ~(1U << i);
+	}
+	if (idle) {
+		if (t->last_cpu >= 0 && (idle & (1U << t->last_cpu)))
+			return t->last_cpu;
+		if (idle & (1U << local_cpu))
+			return local_cpu;
+		return __builtin_ctz(idle);
+	}
+
+	/* everyone is busy. if some cpu is running something less important, queue it
+	 * there so the reschedule ipi that follows preempts it. cpus running real time
+	 * threads don't take reschedule ipis, so leave them be. */
+	mp_cpu_mask_t busy = mp.active_cpus & ~mp.realtime_cpus;
+	uint target = local_cpu;
+	int lowest = run_queues[local_cpu].curr_priority;
+	for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+		if ((busy & (1U << i)) && run_queues[i].curr_priority < lowest) {
+			lowest = run_queues[i].curr_priority;
+			target = i;
+		}
+	}
+	if (lowest < t->priority)
+		return target;
+
+	/* nothing to preempt, queue it here and let idle time stealing balance it out */
+	return local_cpu;
+#else
+	return 0;
+#endif
 }
 
-static void insert_in_run_queue_tail(thread_t *t)
+/* run queue manipulation, returns the mask of the cpu the thread was queued on */
+static mp_cpu_mask_t insert_in_run_queue(thread_t *t, bool head)
 {
 #if THREAD_CHECKS
 	ASSERT(t->magic == THREAD_MAGIC);
@@ -104,8 +157,59 @@ static void insert_in_run_queue_tail(thread_t *t)
 	ASSERT(spin_lock_held(&thread_lock));
 #endif
 
-	list_add_tail(&run_queue[t->priority], &t->queue_node);
-	run_queue_bitmap |= (1<<t->priority);
+	uint cpu = thread_select_cpu(t);
+	struct run_queue *rq = &run_queues[cpu];
+
+	if (head)
+		list_add_head(&rq->queue[t->priority], &t->queue_node);
+	else
+		list_add_tail(&rq->queue[t->priority], &t->queue_node);
+	rq->bitmap |= (1U << t->priority);
+	if (t->pinned_cpu < 0)
+		rq->stealable++;
+
+	return 1U << cpu;
+}
+
+static mp_cpu_mask_t insert_in_run_queue_head(thread_t *t)
+{
+	return insert_in_run_queue(t, true);
+}
+
+static mp_cpu_mask_t insert_in_run_queue_tail(thread_t *t)
+{
+	return insert_in_run_queue(t, false);
+}
+
+/* pull the highest priority thread off of a run queue, skipping pinned threads
+ * if stealing on behalf of another cpu. thread_lock should be held. */
+static thread_t *run_queue_pop(struct run_queue *rq, bool stealing)
+{
+	uint32_t local_bitmap = rq->bitmap;
+	thread_t *t;
+	int next_queue;
+
+	while (local_bitmap) {
+		next_queue = HIGHEST_PRIORITY - __builtin_clz(local_bitmap) - (32 - NUM_PRIORITIES);
+
+		/* everything in our own queue is runnable here, so the local case
+		 * always takes the head of the first nonempty list */
+		list_for_every_entry(&rq->queue[next_queue], t, thread_t, queue_node) {
+			if (!stealing || t->pinned_cpu < 0) {
+				list_delete(&t->queue_node);
+
+				if (list_is_empty(&rq->queue[next_queue]))
+					rq->bitmap &= ~(1U << next_queue);
+				if (t->pinned_cpu < 0)
+					rq->stealable--;
+
+				return t;
+			}
+		}
+
+		local_bitmap &= ~(1U << next_queue);
+	}
+	return NULL;
 }
 
 static void init_thread_struct(thread_t *t, const char *name)
@@ -113,6 +217,7 @@ static void init_thread_struct(thread_t *t, const char *name)
 	memset(t, 0, sizeof(thread_t));
 	t->magic = THREAD_MAGIC;
 	t->pinned_cpu = -1;
+	t->last_cpu = -1;
 	strlcpy(t->name, name, sizeof(t->name));
 }
 
@@ -267,14 +372,15 @@ status_t thread_resume(thread_t *t)
 #endif
 
 	bool resched = false;
+	mp_cpu_mask_t target = 0;
 	THREAD_LOCK(state);
 	if (t->state == THREAD_SUSPENDED) {
 		t->state = THREAD_READY;
-		insert_in_run_queue_head(t);
+		target = insert_in_run_queue_head(t);
 		resched = true;
 	}
 
-	mp_reschedule(MP_CPU_ALL_BUT_LOCAL, 0);
+	mp_reschedule(target, 0);
 
 	THREAD_UNLOCK(state);
 
@@ -295,25 +401,31 @@ status_t thread_detach_and_resume(thread_t *t)
 
 status_t thread_join(thread_t *t, int *retcode, lk_time_t timeout)
 {
+	spin_lock_saved_state_t state;
+
 #if THREAD_CHECKS
 	ASSERT(t->magic == THREAD_MAGIC);
 #endif
 
-	THREAD_LOCK(state);
+	spin_lock_irqsave(&t->retcode_wait_queue.lock, state);
+	spin_lock(&thread_lock);
 
 	if (t->flags & THREAD_FLAG_DETACHED) {
 		/* the thread is detached, go ahead and exit */
-		THREAD_UNLOCK(state);
+		spin_unlock(&thread_lock);
+		spin_unlock_irqrestore(&t->retcode_wait_queue.lock, state);
 		return ERR_THREAD_DETACHED;
 	}
 
-	/* wait for the thread to die */
+	/* wait for the thread to die, this drops the queue lock either way */
 	if (t->state != THREAD_DEATH) {
-		status_t err = wait_queue_block(&t->retcode_wait_queue, timeout);
+		status_t err = wait_queue_block_locked(&t->retcode_wait_queue, timeout);
 		if (err < 0) {
 			THREAD_UNLOCK(state);
 			return err;
 		}
+	} else {
+		spin_unlock(&t->retcode_wait_queue.lock);
 	}
 
 #if THREAD_CHECKS
@@ -351,20 +463,24 @@ status_t thread_detach(thread_t *t)
 	ASSERT(t->magic == THREAD_MAGIC);
 #endif
 
-	THREAD_LOCK(state);
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&t->retcode_wait_queue.lock, state);
+	spin_lock(&thread_lock);
 
 	/* if another thread is blocked inside thread_join() on this thread,
 	 * wake them up with a specific return code */
-	wait_queue_wake_all(&t->retcode_wait_queue, false, ERR_THREAD_DETACHED);
+	wait_queue_wake_all_locked(&t->retcode_wait_queue, ERR_THREAD_DETACHED);
 
 	/* if it's already dead, then just do what join would have and exit */
 	if (t->state == THREAD_DEATH) {
 		t->flags &= ~THREAD_FLAG_DETACHED; /* makes sure thread_join continues */
-		THREAD_UNLOCK(state);
+		spin_unlock(&thread_lock);
+		spin_unlock_irqrestore(&t->retcode_wait_queue.lock, state);
 		return thread_join(t, NULL, 0);
 	} else {
 		t->flags |= THREAD_FLAG_DETACHED;
-		THREAD_UNLOCK(state);
+		spin_unlock(&thread_lock);
+		spin_unlock_irqrestore(&t->retcode_wait_queue.lock, state);
 		return NO_ERROR;
 	}
 }
@@ -388,7 +504,9 @@ void thread_exit(int retcode)
 
 //	dprintf("thread_exit: current %p\n", current_thread);
 
-	THREAD_LOCK(state);
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&current_thread->retcode_wait_queue.lock, state);
+	spin_lock(&thread_lock);
 
 	/* enter the dead state */
 	current_thread->state = THREAD_DEATH;
@@ -396,6 +514,9 @@ void thread_exit(int retcode)
 
 	/* if we're detached, then do our teardown here */
 	if (current_thread->flags & THREAD_FLAG_DETACHED) {
+		/* nobody can join us, and the queue goes with the structure */
+		spin_unlock(&current_thread->retcode_wait_queue.lock);
+
 		/* remove it from the master thread list */
 		list_delete(&current_thread->thread_list_node);
 
@@ -410,7 +531,10 @@ void thread_exit(int retcode)
 			heap_delayed_free(current_thread);
 	} else {
 		/* signal if anyone is waiting */
-		wait_queue_wake_all(&current_thread->retcode_wait_queue, false, 0);
+		wait_queue_wake_all_locked(&current_thread->retcode_wait_queue, 0);
+
+		/* joiners still need thread_lock, which isn't released until we're switched out */
+		spin_unlock(&current_thread->retcode_wait_queue.lock);
 	}
 
 	/* reschedule */
@@ -425,30 +549,47 @@ static void idle_thread_routine(void)
 		arch_idle();
 }
 
-static thread_t *get_top_thread(int cpu)
+#if WITH_SMP
+/* our run queue is empty, so try to pull work over from another cpu */
+static thread_t *steal_thread(uint cpu)
 {
-	thread_t *newthread;
-	uint32_t local_run_queue_bitmap = run_queue_bitmap;
-	int next_queue;
+	mp_cpu_mask_t active = mp.active_cpus;
+	thread_t *t;
 
-	while (local_run_queue_bitmap) {
-		next_queue = HIGHEST_PRIORITY - __builtin_clz(local_run_queue_bitmap) - (32 - NUM_PRIORITIES);
+	for (uint i = 1; i < SMP_MAX_CPUS; i++) {
+		uint victim = (cpu + i) % SMP_MAX_CPUS;
+		struct run_queue *rq = &run_queues[victim];
 
-		list_for_every_entry(&run_queue[next_queue], newthread, thread_t, queue_node) {
-			if (newthread->pinned_cpu < 0 || newthread->pinned_cpu == cpu) {
-				list_delete(&newthread->queue_node);
+		if (!(active & (1U << victim)) || rq->stealable == 0)
+			continue;
 
-				if (list_is_empty(&run_queue[next_queue]))
-					run_queue_bitmap &= ~(1<<next_queue);
+		t = run_queue_pop(rq, true);
 
-				return newthread;
-			}
+		if (t) {
+			THREAD_STATS_INC(steals);
+			return t;
 		}
-
-		local_run_queue_bitmap &= ~(1<<next_queue);
 	}
+
 	return NULL;
 }
+#endif
+
+static thread_t *get_top_thread(uint cpu)
+{
+	struct run_queue *rq = &run_queues[cpu];
+	thread_t *t = NULL;
+
+	if (rq->bitmap)
+		t = run_queue_pop(rq, false);
+
+#if WITH_SMP
+	if (!t)
+		t = steal_thread(cpu);
+#endif
+
+	return t;
+}
 
 /**
  * @brief  Cause another thread to be executed.
@@ -487,6 +628,7 @@ void thread_resched(void)
 #endif
 
 	newthread->state = THREAD_RUNNING;
+	run_queues[cpu].curr_priority = newthread->priority;
 
 	oldthread = current_thread;
 
@@ -501,6 +643,7 @@ void thread_resched(void)
 	/* mark the cpu ownership of the threads */
 	oldthread->curr_cpu = -1;
 	newthread->curr_cpu = cpu;
+	newthread->last_cpu = cpu;
 
 	if (thread_is_idle(newthread)) {
 		mp_set_cpu_idle(cpu);
@@ -514,6 +657,16 @@ void thread_resched(void)
 		mp_set_cpu_non_realtime(cpu);
 	}
 
+#if WITH_SMP
+	/* if we're leaving work behind in our queue that another cpu could be
+	 * running, poke an idle one so it comes and steals it */
+	if (run_queues[cpu].stealable > 0) {
+		mp_cpu_mask_t idle = mp_get_idle_mask() & ~(1U << cpu);
+		if (idle)
+			mp_reschedule(1U << __builtin_ctz(idle), 0);
+	}
+#endif
+
 #if THREAD_STATS
 	THREAD_STATS_INC(context_switches);
 
@@ -546,7 +699,7 @@ void thread_resched(void)
 		dprintf(ALWAYS, "arch_context_switch: start preempt, cpu %d, old %p (%s), new %p (%s)\n",
 			cpu, oldthread, oldthread->name, newthread, newthread->name);
 #endif
-		timer_set_periodic(&preempt_timer[cpu], 10, (timer_callback)thread_timer_tick, NULL);
+		timer_set_periodic(&preempt_timer[cpu], 10, &thread_preempt_timer_tick, NULL);
 	}
 #endif
 
@@ -683,8 +836,7 @@ void thread_unblock(thread_t *t, bool resched)
 #endif
 
 	t->state = THREAD_READY;
-	insert_in_run_queue_head(t);
-	mp_reschedule(MP_CPU_ALL_BUT_LOCAL, 0);
+	mp_reschedule(insert_in_run_queue_head(t), 0);
 	if (resched)
 		thread_resched();
 }
@@ -717,7 +869,7 @@ static enum handler_return thread_sleep_handler(timer_t *timer, lk_time_t now, v
 	THREAD_LOCK(state);
 
 	t->state = THREAD_READY;
-	insert_in_run_queue_head(t);
+	mp_reschedule(insert_in_run_queue_head(t), 0);
 
 	THREAD_UNLOCK(state);
 
@@ -766,9 +918,13 @@ void thread_init_early(void)
 
 	DEBUG_ASSERT(arch_curr_cpu_num() == 0);
 
+	spin_lock_stats_register(&thread_lock, "thread");
+
 	/* initialize the run queues */
-	for (i=0; i < NUM_PRIORITIES; i++)
-		list_initialize(&run_queue[i]);
+	for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+		for (i=0; i < NUM_PRIORITIES; i++)
+			list_initialize(&run_queues[cpu].queue[i]);
+	}
 
 	/* initialize the thread list */
 	list_initialize(&thread_list);
@@ -976,42 +1132,45 @@ void wait_queue_init(wait_queue_t *wait)
 static enum handler_return wait_queue_timeout_handler(timer_t *timer, lk_time_t now, void *arg)
 {
 	thread_t *thread = (thread_t *)arg;
+	wait_queue_t *wait;
 
 #if THREAD_CHECKS
 	ASSERT(thread->magic == THREAD_MAGIC);
 #endif
 
-	spin_lock(&thread_lock);
+	/*
+	 * queue locks nest outside thread_lock, so only try for this one and back off if
+	 * a waker holds it. blocking_wait_queue only changes under both locks, and the
+	 * queue can't go away while the thread is still blocked on it.
+	 */
+	for (;;) {
+		spin_lock(&thread_lock);
+
+		wait = thread->blocking_wait_queue;
+		if (thread->state != THREAD_BLOCKED || !wait) {
+			spin_unlock(&thread_lock);
+			return INT_NO_RESCHEDULE;
+		}
 
-	enum handler_return ret = INT_NO_RESCHEDULE;
-	if (thread_unblock_from_wait_queue(thread, ERR_TIMED_OUT) >= NO_ERROR) {
-		ret = INT_RESCHEDULE;
+		if (spin_trylock(&wait->lock) == 0)
+			break;
+
+		spin_unlock(&thread_lock);
 	}
 
+	thread_unblock_from_wait_queue(thread, ERR_TIMED_OUT);
+
+	spin_unlock(&wait->lock);
 	spin_unlock(&thread_lock);
 
-	return ret;
+	return INT_RESCHEDULE;
 }
 
-/**
- * @brief  Block until a wait queue is notified.
- *
- * This function puts the current thread at the end of a wait
- * queue and then blocks until some other thread wakes the queue
- * up again.
- *
- * @param  wait     The wait queue to enter
- * @param  timeout  The maximum time, in ms, to wait
- *
- * If the timeout is zero, this function returns immediately with
- * ERR_TIMED_OUT.  If the timeout is INFINITE_TIME, this function
- * waits indefinitely.  Otherwise, this function returns with
- * ERR_TIMED_OUT at the end of the timeout period.
- *
- * @return ERR_TIMED_OUT on timeout, else returns the return
- * value specified when the queue was woken by wait_queue_wake_one().
+/*
+ * block on a wait queue with both its lock and thread_lock held. the queue lock is
+ * released once the thread is marked blocked and thread_lock is held on return.
  */
-status_t wait_queue_block(wait_queue_t *wait, lk_time_t timeout)
+static status_t wait_queue_block_locked(wait_queue_t *wait, lk_time_t timeout)
 {
 	timer_t timer;
 
@@ -1021,11 +1180,14 @@ status_t wait_queue_block(wait_queue_t *wait, lk_time_t timeout)
 	ASSERT(wait->magic == WAIT_QUEUE_MAGIC);
 	ASSERT(current_thread->state == THREAD_RUNNING);
 	ASSERT(arch_ints_disabled());
+	ASSERT(spin_lock_held(&wait->lock));
 	ASSERT(spin_lock_held(&thread_lock));
 #endif
 
-	if (timeout == 0)
+	if (timeout == 0) {
+		spin_unlock(&wait->lock);
 		return ERR_TIMED_OUT;
+	}
 
 	list_add_tail(&wait->list, &current_thread->queue_node);
 	wait->count++;
@@ -1039,6 +1201,9 @@ status_t wait_queue_block(wait_queue_t *wait, lk_time_t timeout)
 		timer_set_oneshot(&timer, timeout, wait_queue_timeout_handler, (void *)current_thread);
 	}
 
+	/* wakers need thread_lock to touch us, so nobody can see us half blocked */
+	spin_unlock(&wait->lock);
+
 	thread_resched();
 
 	/* we don't really know if the timer fired or not, so it's better safe to try to cancel it */
@@ -1049,6 +1214,110 @@ status_t wait_queue_block(wait_queue_t *wait, lk_time_t timeout)
 	return current_thread->wait_queue_block_ret;
 }
 
+/**
+ * @brief  Block until a wait queue is notified.
+ *
+ * This function puts the current thread at the end of a wait
+ * queue and then blocks until some other thread wakes the queue
+ * up again.
+ *
+ * @param  wait     The wait queue to enter
+ * @param  timeout  The maximum time, in ms, to wait
+ *
+ * If the timeout is zero, this function returns immediately with
+ * ERR_TIMED_OUT.  If the timeout is INFINITE_TIME, this function
+ * waits indefinitely.  Otherwise, this function returns with
+ * ERR_TIMED_OUT at the end of the timeout period.
+ *
+ * The caller holds the queue's lock, which is released by the time
+ * this returns.
+ *
+ * @return ERR_TIMED_OUT on timeout, else returns the return
+ * value specified when the queue was woken by wait_queue_wake_one().
+ */
+status_t wait_queue_block(wait_queue_t *wait, lk_time_t timeout)
+{
+	status_t ret;
+
+#if THREAD_CHECKS
+	ASSERT(wait->magic == WAIT_QUEUE_MAGIC);
+	ASSERT(arch_ints_disabled());
+	ASSERT(spin_lock_held(&wait->lock));
+#endif
+
+	if (timeout == 0) {
+		spin_unlock(&wait->lock);
+		return ERR_TIMED_OUT;
+	}
+
+	spin_lock(&thread_lock);
+	ret = wait_queue_block_locked(wait, timeout);
+	spin_unlock(&thread_lock);
+
+	return ret;
+}
+
+/* pull the head of the queue and make it runnable, both locks held */
+static thread_t *wait_queue_wake_head_locked(wait_queue_t *wait, status_t wait_queue_error, mp_cpu_mask_t *target)
+{
+	thread_t *t;
+
+	t = list_remove_head_type(&wait->list, thread_t, queue_node);
+	if (t) {
+		wait->count--;
+#if THREAD_CHECKS
+		ASSERT(t->state == THREAD_BLOCKED);
+#endif
+		t->state = THREAD_READY;
+		t->wait_queue_block_ret = wait_queue_error;
+		t->blocking_wait_queue = NULL;
+
+		*target |= insert_in_run_queue_head(t);
+	}
+
+	return t;
+}
+
+/* wake everything on the queue with both its lock and thread_lock held, never reschedules */
+static int wait_queue_wake_all_locked(wait_queue_t *wait, status_t wait_queue_error)
+{
+	int ret = 0;
+	mp_cpu_mask_t target = 0;
+
+#if THREAD_CHECKS
+	ASSERT(wait->magic == WAIT_QUEUE_MAGIC);
+	ASSERT(arch_ints_disabled());
+	ASSERT(spin_lock_held(&wait->lock));
+	ASSERT(spin_lock_held(&thread_lock));
+#endif
+
+	/* pop all the threads off the wait queue into the run queue */
+	while (wait_queue_wake_head_locked(wait, wait_queue_error, &target))
+		ret++;
+
+#if THREAD_CHECKS
+	ASSERT(wait->count == 0);
+#endif
+
+	if (ret > 0)
+		mp_reschedule(target, 0);
+
+	return ret;
+}
+
+/*
+ * drop both locks after a wake, switching to whatever was woken first if asked to.
+ * the queue lock can't be held across a context switch and the woken threads may
+ * free the queue as soon as it's released, so it's never taken again here.
+ */
+static void wait_queue_wake_finish(wait_queue_t *wait, bool reschedule)
+{
+	spin_unlock(&wait->lock);
+	if (reschedule)
+		thread_resched();
+	spin_unlock(&thread_lock);
+}
+
 /**
  * @brief  Wake up one thread sleeping on a wait queue
  *
@@ -1056,6 +1325,9 @@ status_t wait_queue_block(wait_queue_t *wait, lk_time_t timeout)
  * makes it executable.  The new thread will be placed at the head of the
  * run queue.
  *
+ * The caller holds the queue's lock, which is released by the time
+ * this returns.
+ *
  * @param wait  The wait queue to wake
  * @param reschedule  If true, the newly-woken thread will run immediately.
  * @param wait_queue_error  The return value which the new thread will receive
@@ -1065,45 +1337,37 @@ status_t wait_queue_block(wait_queue_t *wait, lk_time_t timeout)
  */
 int wait_queue_wake_one(wait_queue_t *wait, bool reschedule, status_t wait_queue_error)
 {
-	thread_t *t;
-	int ret = 0;
+	mp_cpu_mask_t target = 0;
 
 	thread_t *current_thread = get_current_thread();
 
 #if THREAD_CHECKS
 	ASSERT(wait->magic == WAIT_QUEUE_MAGIC);
 	ASSERT(arch_ints_disabled());
-	ASSERT(spin_lock_held(&thread_lock));
+	ASSERT(spin_lock_held(&wait->lock));
 #endif
 
-	t = list_remove_head_type(&wait->list, thread_t, queue_node);
-	if (t) {
-		wait->count--;
-#if THREAD_CHECKS
-		ASSERT(t->state == THREAD_BLOCKED);
-#endif
-		t->state = THREAD_READY;
-		t->wait_queue_block_ret = wait_queue_error;
-		t->blocking_wait_queue = NULL;
+	if (wait->count == 0) {
+		spin_unlock(&wait->lock);
+		return 0;
+	}
 
-		/* if we're instructed to reschedule, stick the current thread on the head
-		 * of the run queue first, so that the newly awakened thread gets a chance to run
-		 * before the current one, but the current one doesn't get unnecessarilly punished.
-		 */
-		if (reschedule) {
-			current_thread->state = THREAD_READY;
-			insert_in_run_queue_head(current_thread);
-		}
-		insert_in_run_queue_head(t);
-		mp_reschedule(MP_CPU_ALL_BUT_LOCAL, 0);
-		if (reschedule) {
-			thread_resched();
-		}
-		ret = 1;
+	spin_lock(&thread_lock);
 
+	/* if we're instructed to reschedule, stick the current thread on the head
+	 * of the run queue first, so that the newly awakened thread gets a chance to run
+	 * before the current one, but the current one doesn't get unnecessarilly punished.
+	 */
+	if (reschedule) {
+		current_thread->state = THREAD_READY;
+		insert_in_run_queue_head(current_thread);
 	}
+	wait_queue_wake_head_locked(wait, wait_queue_error, &target);
+	mp_reschedule(target, 0);
 
-	return ret;
+	wait_queue_wake_finish(wait, reschedule);
+
+	return 1;
 }
 
 
@@ -1114,6 +1378,9 @@ int wait_queue_wake_one(wait_queue_t *wait, bool reschedule, status_t wait_queue
  * makes them executable.  The new threads will be placed at the head of the
  * run queue.
  *
+ * The caller holds the queue's lock, which is released by the time
+ * this returns.
+ *
  * @param wait  The wait queue to wake
  * @param reschedule  If true, the newly-woken threads will run immediately.
  * @param wait_queue_error  The return value which the new thread will receive
@@ -1123,18 +1390,24 @@ int wait_queue_wake_one(wait_queue_t *wait, bool reschedule, status_t wait_queue
  */
 int wait_queue_wake_all(wait_queue_t *wait, bool reschedule, status_t wait_queue_error)
 {
-	thread_t *t;
-	int ret = 0;
+	int ret;
 
 	thread_t *current_thread = get_current_thread();
 
 #if THREAD_CHECKS
 	ASSERT(wait->magic == WAIT_QUEUE_MAGIC);
 	ASSERT(arch_ints_disabled());
-	ASSERT(spin_lock_held(&thread_lock));
+	ASSERT(spin_lock_held(&wait->lock));
 #endif
 
-	if (reschedule && wait->count > 0) {
+	if (wait->count == 0) {
+		spin_unlock(&wait->lock);
+		return 0;
+	}
+
+	spin_lock(&thread_lock);
+
+	if (reschedule) {
 		/* if we're instructed to reschedule, stick the current thread on the head
 		 * of the run queue first, so that the newly awakened threads get a chance to run
 		 * before the current one, but the current one doesn't get unnecessarilly punished.
@@ -1143,30 +1416,9 @@ int wait_queue_wake_all(wait_queue_t *wait, bool reschedule, status_t wait_queue
 		insert_in_run_queue_head(current_thread);
 	}
 
-	/* pop all the threads off the wait queue into the run queue */
-	while ((t = list_remove_head_type(&wait->list, thread_t, queue_node))) {
-		wait->count--;
-#if THREAD_CHECKS
-		ASSERT(t->state == THREAD_BLOCKED);
-#endif
-		t->state = THREAD_READY;
-		t->wait_queue_block_ret = wait_queue_error;
-		t->blocking_wait_queue = NULL;
-
-		insert_in_run_queue_head(t);
-		ret++;
-	}
-
-#if THREAD_CHECKS
-	ASSERT(wait->count == 0);
-#endif
+	ret = wait_queue_wake_all_locked(wait, wait_queue_error);
 
-	if (ret > 0) {
-		mp_reschedule(MP_CPU_ALL_BUT_LOCAL, 0);
-		if (reschedule) {
-			thread_resched();
-		}
-	}
+	wait_queue_wake_finish(wait, reschedule);
 
 	return ret;
 }
@@ -1175,16 +1427,35 @@ int wait_queue_wake_all(wait_queue_t *wait, bool reschedule, status_t wait_queue
  * @brief  Free all resources allocated in wait_queue_init()
  *
  * If any threads were waiting on this queue, they are all woken.
+ * The caller holds the queue's lock, which is released by the time
+ * this returns.
  */
 void wait_queue_destroy(wait_queue_t *wait, bool reschedule)
 {
 #if THREAD_CHECKS
 	ASSERT(wait->magic == WAIT_QUEUE_MAGIC);
 	ASSERT(arch_ints_disabled());
-	ASSERT(spin_lock_held(&thread_lock));
+	ASSERT(spin_lock_held(&wait->lock));
 #endif
-	wait_queue_wake_all(wait, reschedule, ERR_OBJECT_DESTROYED);
+	if (wait->count == 0) {
+		wait->magic = 0;
+		spin_unlock(&wait->lock);
+		return;
+	}
+
+	thread_t *current_thread = get_current_thread();
+
+	spin_lock(&thread_lock);
+
+	if (reschedule) {
+		current_thread->state = THREAD_READY;
+		insert_in_run_queue_head(current_thread);
+	}
+
+	wait_queue_wake_all_locked(wait, ERR_OBJECT_DESTROYED);
 	wait->magic = 0;
+
+	wait_queue_wake_finish(wait, reschedule);
 }
 
 /**
@@ -1213,6 +1484,7 @@ status_t thread_unblock_from_wait_queue(thread_t *t, status_t wait_queue_error)
 #if THREAD_CHECKS
 	ASSERT(t->blocking_wait_queue != NULL);
 	ASSERT(t->blocking_wait_queue->magic == WAIT_QUEUE_MAGIC);
+	ASSERT(spin_lock_held(&t->blocking_wait_queue->lock));
 	ASSERT(list_in_list(&t->queue_node));
 #endif
 
@@ -1221,8 +1493,7 @@ status_t thread_unblock_from_wait_queue(thread_t *t, status_t wait_queue_error)
 	t->blocking_wait_queue = NULL;
 	t->state = THREAD_READY;
 	t->wait_queue_block_ret = wait_queue_error;
-	insert_in_run_queue_head(t);
-	mp_reschedule(MP_CPU_ALL_BUT_LOCAL, 0);
+	mp_reschedule(insert_in_run_queue_head(t), 0);
 
 	return NO_ERROR;
 }
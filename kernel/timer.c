@@ -47,10 +47,49 @@
 
 #define LOCAL_TRACE 0
 
-spin_lock_t timer_lock;
+/*
+ * Each cpu keeps its pending timers in a hierarchical timing wheel. Level 0 has
+ * one slot per ms, and each level above it has slots that cover a full rotation
+ * of the level below. A timer goes in the lowest level that can hold its
+ * deadline and gets cascaded down a level whenever the wheel reaches the start
+ * of its slot, so arming and canceling a timer is O(1).
+ *
+ * Deadlines further out than the top level can cover are parked in the last
+ * slot it can reach and re-inserted when cascaded.
+ */
+#ifndef TIMER_WHEEL_BITS
+#define TIMER_WHEEL_BITS 6
+#endif
+#ifndef TIMER_WHEEL_LEVELS
+#define TIMER_WHEEL_LEVELS 5
+#endif
+#define TIMER_WHEEL_SIZE (1U << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SIZE - 1)
+
+STATIC_ASSERT(TIMER_WHEEL_SIZE <= 64);
+STATIC_ASSERT(TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS < 32);
+
+/* how late (in ms) a timer may fire so it can share a hardware timer
+ * reprogram with a deadline that is already programmed */
+#ifndef TIMER_SLACK
+#define TIMER_SLACK 1
+#endif
 
 struct timer_state {
-	struct list_node timer_queue;
+	spin_lock_t lock;
+
+	/* next tick the wheel has yet to process */
+	lk_time_t base;
+	uint count;
+
+#if PLATFORM_HAS_DYNAMIC_TIMER
+	bool hw_armed;
+	lk_time_t hw_deadline;
+#endif
+
+	/* bitmap of nonempty slots per level */
+	uint64_t bitmap[TIMER_WHEEL_LEVELS];
+	struct list_node wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE];
 } __CPU_ALIGN;
 
 static struct timer_state timers[SMP_MAX_CPUS];
@@ -65,30 +104,137 @@ void timer_initialize(timer_t *timer)
 	*timer = (timer_t)TIMER_INITIAL_VALUE(*timer);
 }
 
-static void insert_timer_in_queue(uint cpu, timer_t *timer)
+static void insert_timer_in_wheel(struct timer_state *ts, timer_t *timer)
 {
-	timer_t *entry;
+	lk_time_t expires = timer->scheduled_time;
+	lk_time_t delta;
+	uint level;
 
 	DEBUG_ASSERT(arch_ints_disabled());
+	DEBUG_ASSERT(spin_lock_held(&ts->lock));
+
+	LTRACEF("timer %p, cpu %u, scheduled %u, periodic %u\n", timer, timer->cpu, timer->scheduled_time, timer->periodic_time);
+
+	/* anything already due goes in the next slot to be processed */
+	if (TIME_LT(expires, ts->base))
+		expires = ts->base;
+	delta = expires - ts->base;
+
+	for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++) {
+		if (delta < (1U << (TIMER_WHEEL_BITS * (level + 1))))
+			break;
+	}
+
+	/* too far out for the wheel, it'll get cascaded and re-inserted */
+	if (delta >= (1U << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)))
+		expires = ts->base + (1U << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+
+	uint slot = (expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+
+	list_add_tail(&ts->wheel[level][slot], &timer->node);
+	ts->bitmap[level] |= 1ULL << slot;
+	ts->count++;
+}
+
+static void remove_timer_from_wheel(struct timer_state *ts, timer_t *timer)
+{
+	DEBUG_ASSERT(spin_lock_held(&ts->lock));
+
+	/* if we're the only entry in our slot, our neighbor is the slot's list head,
+	 * which tells us which bit to clear */
+	struct list_node *head = timer->node.next;
+	bool last = (head == timer->node.prev);
+
+	list_delete(&timer->node);
+	ts->count--;
+
+	if (last) {
+		uint index = head - &ts->wheel[0][0];
+		ts->bitmap[index / TIMER_WHEEL_SIZE] &= ~(1ULL << (index % TIMER_WHEEL_SIZE));
+	}
+}
+
+/* move every timer out of an upper level slot into the levels below it */
+static void cascade_slot(struct timer_state *ts, uint level, uint slot)
+{
+	struct list_node list = LIST_INITIAL_VALUE(list);
+	timer_t *timer;
+
+	/* splice the slot off onto a local list first, since a timer that is still
+	 * out of range may land right back in the same slot */
+	while ((timer = list_remove_head_type(&ts->wheel[level][slot], timer_t, node))) {
+		list_add_tail(&list, &timer->node);
+		ts->count--;
+	}
+	ts->bitmap[level] &= ~(1ULL << slot);
+
+	while ((timer = list_remove_head_type(&list, timer_t, node)))
+		insert_timer_in_wheel(ts, timer);
+}
+
+/* find the next tick at which the wheel has work to do, either firing timers
+ * out of the first level or cascading a slot of one of the upper levels */
+static lk_time_t wheel_next_event(struct timer_state *ts)
+{
+	lk_time_t next = ts->base + (1U << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS));
+
+	for (uint level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+		uint64_t bitmap = ts->bitmap[level];
+		if (!bitmap)
+			continue;
+
+		/* the first tick at or after base that starts a slot at this level */
+		uint shift = TIMER_WHEEL_BITS * level;
+		lk_time_t block = (ts->base + (1U << shift) - 1) >> shift;
+		uint index = block & TIMER_WHEEL_MASK;
+
+		/* rotate the bitmap so bit 0 is that slot and find the next one in use */
+		if (index != 0)
+			bitmap = (bitmap >> index) | (bitmap << (TIMER_WHEEL_SIZE - index));
+#if TIMER_WHEEL_BITS < 6
+		bitmap &= (1ULL << TIMER_WHEEL_SIZE) - 1;
+#endif
 
-	LTRACEF("timer %p, cpu %u, scheduled %lu, periodic %lu\n", timer, cpu, timer->scheduled_time, timer->periodic_time);
+		lk_time_t t = (block + __builtin_ctzll(bitmap)) << shift;
+		if (TIME_LT(t, next))
+			next = t;
+	}
+
+	return next;
+}
 
-	list_for_every_entry(&timers[cpu].timer_queue, entry, timer_t, node) {
-		if (TIME_GT(entry->scheduled_time, timer->scheduled_time)) {
-			list_add_before(&entry->node, &timer->node);
-			return;
+#if PLATFORM_HAS_DYNAMIC_TIMER
+/* reprogram this cpu's hardware timer if the wheel now has something due before
+ * the deadline currently programmed, give or take TIMER_SLACK */
+static void update_platform_timer(struct timer_state *ts, lk_time_t now)
+{
+	if (ts->count == 0) {
+		if (ts->hw_armed) {
+			LTRACEF("clearing old hw timer, nothing in the wheel\n");
+			platform_stop_timer();
+			ts->hw_armed = false;
 		}
+		return;
 	}
 
-	/* walked off the end of the list */
-	list_add_tail(&timers[cpu].timer_queue, &timer->node);
+	lk_time_t next = wheel_next_event(ts);
+	if (ts->hw_armed && TIME_LTE(ts->hw_deadline, next + TIMER_SLACK))
+		return;
+
+	lk_time_t delay = TIME_GT(next, now) ? next - now : 0;
+
+	LTRACEF("setting new timer for %u msecs\n", (uint)delay);
+	ts->hw_armed = true;
+	ts->hw_deadline = now + delay;
+	platform_set_oneshot_timer(timer_tick, NULL, delay);
 }
+#endif
 
 static void timer_set(timer_t *timer, lk_time_t delay, lk_time_t period, timer_callback callback, void *arg)
 {
 	lk_time_t now;
 
-	LTRACEF("timer %p, delay %lu, period %lu, callback %p, arg %p\n", timer, delay, period, callback, arg);
+	LTRACEF("timer %p, delay %u, period %u, callback %p, arg %p\n", timer, delay, period, callback, arg);
 
 	DEBUG_ASSERT(timer->magic == TIMER_MAGIC);
 
@@ -96,29 +242,34 @@ static void timer_set(timer_t *timer, lk_time_t delay, lk_time_t period, timer_c
 		panic("timer %p already in list\n", timer);
 	}
 
+	spin_lock_saved_state_t state;
+	arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+	uint cpu = arch_curr_cpu_num();
+	struct timer_state *ts = &timers[cpu];
+
+	spin_lock(&ts->lock);
+
 	now = current_time();
 	timer->scheduled_time = now + delay;
 	timer->periodic_time = period;
 	timer->callback = callback;
 	timer->arg = arg;
+	timer->cpu = cpu;
 
-	LTRACEF("scheduled time %lu\n", timer->scheduled_time);
+	LTRACEF("scheduled time %u\n", timer->scheduled_time);
 
-	spin_lock_saved_state_t state;
-	spin_lock_irqsave(&timer_lock, state);
+	/* an empty wheel can be moved right up to the present */
+	if (ts->count == 0)
+		ts->base = now;
 
-	uint cpu = arch_curr_cpu_num();
-	insert_timer_in_queue(cpu, timer);
+	insert_timer_in_wheel(ts, timer);
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
-	if (list_peek_head_type(&timers[cpu].timer_queue, timer_t, node) == timer) {
-		/* we just modified the head of the timer queue */
-		LTRACEF("setting new timer for %u msecs\n", (uint)delay);
-		platform_set_oneshot_timer(timer_tick, NULL, delay);
-	}
+	update_platform_timer(ts, now);
 #endif
 
-	spin_unlock_irqrestore(&timer_lock, state);
+	spin_unlock_restore(&ts->lock, state, SPIN_LOCK_FLAG_INTERRUPTS);
 }
 
 /**
@@ -171,16 +322,21 @@ void timer_cancel(timer_t *timer)
 	DEBUG_ASSERT(timer->magic == TIMER_MAGIC);
 
 	spin_lock_saved_state_t state;
-	spin_lock_irqsave(&timer_lock, state);
+	struct timer_state *ts;
 
-#if PLATFORM_HAS_DYNAMIC_TIMER
-	uint cpu = arch_curr_cpu_num();
-
-	timer_t *oldhead = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
-#endif
+	/* lock the wheel of the cpu the timer was last queued on, making sure it
+	 * didn't get moved out from under us while we were acquiring it */
+	for (;;) {
+		uint cpu = *(volatile uint *)&timer->cpu;
+		ts = &timers[cpu];
+		spin_lock_irqsave(&ts->lock, state);
+		if (timer->cpu == cpu)
+			break;
+		spin_unlock_irqrestore(&ts->lock, state);
+	}
 
 	if (list_in_list(&timer->node))
-		list_delete(&timer->node);
+		remove_timer_from_wheel(ts, timer);
 
 	/* to keep it from being reinserted into the queue if called from
 	 * periodic timer callback.
@@ -190,26 +346,13 @@ void timer_cancel(timer_t *timer)
 	timer->arg = NULL;
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
-	/* see if we've just modified the head of the timer queue */
-	timer_t *newhead = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
-	if (newhead == NULL) {
-		LTRACEF("clearing old hw timer, nothing in the queue\n");
-		platform_stop_timer();
-	} else if (newhead != oldhead) {
-		lk_time_t delay;
-		lk_time_t now = current_time();
-
-		if (TIME_LT(newhead->scheduled_time, now))
-			delay = 0;
-		else
-			delay = newhead->scheduled_time - now;
-
-		LTRACEF("setting new timer to %u\n", (uint) delay);
-		platform_set_oneshot_timer(timer_tick, NULL, delay);
-	}
+	/* the hardware timer is left alone unless the wheel just went empty, an
+	 * early wakeup just reprograms it for whatever is next */
+	if (ts->count == 0 && ts == &timers[arch_curr_cpu_num()])
+		update_platform_timer(ts, current_time());
 #endif
 
-	spin_unlock_irqrestore(&timer_lock, state);
+	spin_unlock_irqrestore(&ts->lock, state);
 }
 
 /* called at interrupt time to process any pending timers */
@@ -224,70 +367,83 @@ static enum handler_return timer_tick(void *arg, lk_time_t now)
 //	KEVLOG_TIMER_TICK(); // enable only if necessary
 
 	uint cpu = arch_curr_cpu_num();
+	struct timer_state *ts = &timers[cpu];
 
-	LTRACEF("cpu %u now %lu, sp %p\n", cpu, now, __GET_FRAME());
+	LTRACEF("cpu %u now %u, sp %p\n", cpu, now, __GET_FRAME());
 
-	spin_lock(&timer_lock);
+	spin_lock(&ts->lock);
 
-	for (;;) {
-		/* see if there's an event to process */
-		timer = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
-		if (likely(timer == 0))
-			break;
-		LTRACEF("next item on timer queue %p at %lu now %lu (%p, arg %p)\n", timer, timer->scheduled_time, now, timer->callback, timer->arg);
-		if (likely(TIME_LT(now, timer->scheduled_time)))
+#if PLATFORM_HAS_DYNAMIC_TIMER
+	ts->hw_armed = false;
+#endif
+
+	while (TIME_LTE(ts->base, now)) {
+		/* skip over any stretch of the wheel with nothing to do */
+		lk_time_t next = (ts->count > 0) ? wheel_next_event(ts) : now + 1;
+		if (TIME_GT(next, now)) {
+			ts->base = now + 1;
 			break;
+		}
+		if (TIME_GT(next, ts->base))
+			ts->base = next;
+
+		/* cascade any upper level slots that start on this tick */
+		for (uint level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+			uint shift = TIMER_WHEEL_BITS * level;
+			if (ts->base & ((1U << shift) - 1))
+				break;
+			cascade_slot(ts, level, (ts->base >> shift) & TIMER_WHEEL_MASK);
+		}
+
+		/* fire everything in the first level slot for this tick */
+		struct list_node *slot = &ts->wheel[0][ts->base & TIMER_WHEEL_MASK];
+		while ((timer = list_peek_head_type(slot, timer_t, node))) {
+			LTRACEF("next item on timer wheel %p at %u now %u (%p, arg %p)\n", timer, timer->scheduled_time, now, timer->callback, timer->arg);
 
-		/* process it */
-		LTRACEF("timer %p\n", timer);
-		DEBUG_ASSERT(timer && timer->magic == TIMER_MAGIC);
-		list_delete(&timer->node);
+			/* process it */
+			LTRACEF("timer %p\n", timer);
+			DEBUG_ASSERT(timer && timer->magic == TIMER_MAGIC);
+			remove_timer_from_wheel(ts, timer);
 
-		/* we pulled it off the list, release the list lock to handle it */
-		spin_unlock(&timer_lock);
+			/* we pulled it off the wheel, release the lock to handle it */
+			spin_unlock(&ts->lock);
 
-		LTRACEF("dequeued timer %p, scheduled %lu periodic %lu\n", timer, timer->scheduled_time, timer->periodic_time);
+			LTRACEF("dequeued timer %p, scheduled %u periodic %u\n", timer, timer->scheduled_time, timer->periodic_time);
 
-		THREAD_STATS_INC(timers);
+			THREAD_STATS_INC(timers);
 
-		bool periodic = timer->periodic_time > 0;
+			bool periodic = timer->periodic_time > 0;
 
-		LTRACEF("timer %p firing callback %p, arg %p\n", timer, timer->callback, timer->arg);
-		KEVLOG_TIMER_CALL(timer->callback, timer->arg);
-		if (timer->callback(timer, now, timer->arg) == INT_RESCHEDULE)
-			ret = INT_RESCHEDULE;
+			LTRACEF("timer %p firing callback %p, arg %p\n", timer, timer->callback, timer->arg);
+			KEVLOG_TIMER_CALL(timer->callback, timer->arg);
+			if (timer->callback(timer, now, timer->arg) == INT_RESCHEDULE)
+				ret = INT_RESCHEDULE;
 
-		/* it may have been requeued or periodic, grab the lock so we can safely inspect it */
-		spin_lock(&timer_lock);
+			/* it may have been requeued or periodic, grab the lock so we can safely inspect it */
+			spin_lock(&ts->lock);
 
-		/* if it was a periodic timer and it hasn't been requeued
-		 * by the callback put it back in the list
-		 */
-		if (periodic && !list_in_list(&timer->node) && timer->periodic_time > 0) {
-			LTRACEF("periodic timer, period %u\n", (uint)timer->periodic_time);
-			timer->scheduled_time = now + timer->periodic_time;
-			insert_timer_in_queue(cpu, timer);
+			/* if it was a periodic timer and it hasn't been requeued
+			 * by the callback put it back in the wheel
+			 */
+			if (periodic && !list_in_list(&timer->node) && timer->periodic_time > 0) {
+				LTRACEF("periodic timer, period %u\n", (uint)timer->periodic_time);
+				timer->scheduled_time = now + timer->periodic_time;
+				insert_timer_in_wheel(ts, timer);
+			}
 		}
+
+		ts->base++;
 	}
 
 #if PLATFORM_HAS_DYNAMIC_TIMER
 	/* reset the timer to the next event */
-	timer = list_peek_head_type(&timers[cpu].timer_queue, timer_t, node);
-	if (timer) {
-		/* has to be the case or it would have fired already */
-		DEBUG_ASSERT(TIME_GT(timer->scheduled_time, now));
+	update_platform_timer(ts, now);
 
-		lk_time_t delay = timer->scheduled_time - now;
-
-		LTRACEF("setting new timer for %u msecs for event %p\n", (uint)delay, timer);
-		platform_set_oneshot_timer(timer_tick, NULL, delay);
-	}
-
-	/* we're done manipulating the timer queue */
-	spin_unlock(&timer_lock);
+	/* we're done manipulating the timer wheel */
+	spin_unlock(&ts->lock);
 #else
 	/* release the timer lock before calling the tick handler */
-	spin_unlock(&timer_lock);
+	spin_unlock(&ts->lock);
 
 	/* let the scheduler have a shot to do quantum expiration, etc */
 	/* in case of dynamic timer, the scheduler will set up a periodic timer */
@@ -300,9 +456,16 @@ static enum handler_return timer_tick(void *arg, lk_time_t now)
 
 void timer_init(void)
 {
-	timer_lock = SPIN_LOCK_INITIAL_VALUE;
+	lk_time_t now = current_time();
+
 	for (uint i = 0; i < SMP_MAX_CPUS; i++) {
-		list_initialize(&timers[i].timer_queue);
+		spin_lock_init(&timers[i].lock);
+		spin_lock_stats_register(&timers[i].lock, "timer");
+		timers[i].base = now;
+		for (uint level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+			for (uint slot = 0; slot < TIMER_WHEEL_SIZE; slot++)
+				list_initialize(&timers[i].wheel[level][slot]);
+		}
 	}
 #if !PLATFORM_HAS_DYNAMIC_TIMER
 	/* register for a periodic timer tick */
@@ -311,4 +474,3 @@ void timer_init(void)
 }
 
 /* vim: set noexpandtab */
-
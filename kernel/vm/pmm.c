@@ -32,12 +32,36 @@
 #include <pow2.h>
 #include <lib/console.h>
 #include <kernel/mutex.h>
+#include <kernel/spinlock.h>
 
 #define LOCAL_TRACE 0
 
 static struct list_node arena_list = LIST_INITIAL_VALUE(arena_list);
 static mutex_t lock = MUTEX_INITIAL_VALUE(lock);
 
+/* per cpu cache of single free pages from kmap arenas, so the common page table
+ * and kpage allocations don't have to go through the global lock.
+ * cached pages stay marked VM_PAGE_FLAG_NONFREE, so to the arenas they look
+ * allocated until they are drained back under the pmm lock.
+ * lock order is the pmm lock, then a cpu's cache lock.
+ */
+#ifndef PMM_PCP_HIGH
+#define PMM_PCP_HIGH 64
+#endif
+#ifndef PMM_PCP_BATCH
+#define PMM_PCP_BATCH 16
+#endif
+
+struct pmm_pcp {
+    spin_lock_t lock;
+    uint count;
+    ulong hits;
+    ulong misses;
+    vm_page_t *pages[PMM_PCP_HIGH];
+} __CPU_ALIGN;
+
+static struct pmm_pcp pmm_pcp[SMP_MAX_CPUS];
+
 #define PAGE_BELONGS_TO_ARENA(page, arena) \
     (((uintptr_t)(page) >= (uintptr_t)(arena)->page_array) && \
      ((uintptr_t)(page) < ((uintptr_t)(arena)->page_array + (arena)->size / PAGE_SIZE * sizeof(vm_page_t))))
@@ -48,6 +72,9 @@ static mutex_t lock = MUTEX_INITIAL_VALUE(lock);
 #define ADDRESS_IN_ARENA(address, arena) \
     ((address) >= (arena)->base && (address) <= (arena)->base + (arena)->size - 1)
 
+#define ARENA_MATCHES_FLAGS(arena, flags) \
+    ((arena)->flags != PMM_ARENA_FLAG_RESERVED && ((flags) & PMM_ARENA_FLAG_ANY || (arena)->flags & (flags)))
+
 paddr_t page_to_address(const vm_page_t *page)
 {
     pmm_arena_t *a;
@@ -71,9 +98,351 @@ vm_page_t *address_to_page(paddr_t addr)
     return NULL;
 }
 
+static pmm_arena_t *page_to_arena(const vm_page_t *page)
+{
+    pmm_arena_t *a;
+    list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+        if (PAGE_BELONGS_TO_ARENA(page, a))
+            return a;
+    }
+    return NULL;
+}
+
+/*
+ * buddy allocator
+ *
+ * Each arena keeps a free list per order. A free block of order n is 1 << n pages,
+ * aligned on a 1 << n page boundary in physical address space (not relative to the
+ * arena base), so blocks satisfy alignment requests up to their size. Only the head
+ * page of a free block is on a list; it carries VM_PAGE_FLAG_BUDDY and the order.
+ * All pages in a free block have VM_PAGE_FLAG_NONFREE clear.
+ *
+ * These all assume the pmm lock is held and don't touch the arena's free_count.
+ */
+static inline size_t arena_page_count(const pmm_arena_t *a)
+{
+    return a->size / PAGE_SIZE;
+}
+
+static inline paddr_t arena_pfn(const pmm_arena_t *a, size_t index)
+{
+    return (a->base / PAGE_SIZE) + index;
+}
+
+/* largest order a block starting at index can be, given alignment and pages remaining */
+static uint buddy_max_order(const pmm_arena_t *a, size_t index, size_t count)
+{
+    paddr_t pfn = arena_pfn(a, index);
+    uint order = 0;
+
+    while (order + 1 < PMM_MAX_ORDER &&
+           (pfn & ((1UL << (order + 1)) - 1)) == 0 &&
+           (1UL << (order + 1)) <= count)
+        order++;
+
+    return order;
+}
+
+static void buddy_add_block(pmm_arena_t *a, size_t index, uint order)
+{
+    vm_page_t *page = &a->page_array[index];
+
+    DEBUG_ASSERT(order < PMM_MAX_ORDER);
+    DEBUG_ASSERT((arena_pfn(a, index) & ((1UL << order) - 1)) == 0);
+    DEBUG_ASSERT(index + (1UL << order) <= arena_page_count(a));
+
+    page->flags |= VM_PAGE_FLAG_BUDDY;
+    page->order = order;
+    list_add_head(&a->free_list[order], &page->node);
+}
+
+static void buddy_remove_block(pmm_arena_t *a, vm_page_t *page)
+{
+    DEBUG_ASSERT(page->flags & VM_PAGE_FLAG_BUDDY);
+
+    list_delete(&page->node);
+    page->flags &= ~VM_PAGE_FLAG_BUDDY;
+}
+
+/* free a block, merging it with its buddy for as long as the buddy is free too */
+static void buddy_free_block(pmm_arena_t *a, size_t index, uint order)
+{
+    size_t page_count = arena_page_count(a);
+
+    while (order + 1 < PMM_MAX_ORDER) {
+        size_t buddy;
+        if (arena_pfn(a, index) & (1UL << order)) {
+            if (index < (1UL << order))
+                break;
+            buddy = index - (1UL << order);
+        } else {
+            buddy = index + (1UL << order);
+            if (buddy + (1UL << order) > page_count)
+                break;
+        }
+
+        vm_page_t *b = &a->page_array[buddy];
+        if (!(b->flags & VM_PAGE_FLAG_BUDDY) || b->order != order)
+            break;
+
+        buddy_remove_block(a, b);
+        index = MIN(index, buddy);
+        order++;
+    }
+
+    buddy_add_block(a, index, order);
+}
+
+/* free an arbitrary run of pages as the largest aligned blocks that fit */
+static void buddy_free_run(pmm_arena_t *a, size_t index, size_t count)
+{
+    while (count > 0) {
+        uint order = buddy_max_order(a, index, count);
+
+        buddy_free_block(a, index, order);
+        index += 1UL << order;
+        count -= 1UL << order;
+    }
+}
+
+/* pull a block of at least the passed order off the free lists and split it down.
+ * if top is set, keep the highest addressed piece of the split. */
+static vm_page_t *buddy_alloc_block(pmm_arena_t *a, vm_page_t *head, uint order, bool top)
+{
+    size_t index = head - a->page_array;
+    uint o = head->order;
+
+    DEBUG_ASSERT(o >= order);
+
+    buddy_remove_block(a, head);
+    while (o > order) {
+        o--;
+        if (top) {
+            buddy_add_block(a, index, o);
+            index += 1UL << o;
+        } else {
+            buddy_add_block(a, index + (1UL << o), o);
+        }
+    }
+
+    return &a->page_array[index];
+}
+
+/* find a free block of at least the passed order. with top set, find the highest
+ * addressed one, otherwise whatever is on the smallest list that fits. */
+static vm_page_t *buddy_find_block(pmm_arena_t *a, uint order, bool top)
+{
+    vm_page_t *best = NULL;
+
+    for (uint o = order; o < PMM_MAX_ORDER; o++) {
+        vm_page_t *page;
+        list_for_every_entry(&a->free_list[o], page, vm_page_t, node) {
+            if (!top)
+                return page;
+            if (!best || page > best)
+                best = page;
+        }
+    }
+
+    return best;
+}
+
+/* carve a single page out of whatever free block contains it.
+ * returns false if the page isn't on a free list. */
+static bool buddy_take_page(pmm_arena_t *a, size_t index)
+{
+    paddr_t pfn = arena_pfn(a, index);
+
+    for (uint o = 0; o < PMM_MAX_ORDER; o++) {
+        size_t offset = pfn & ((1UL << o) - 1);
+        if (offset > index)
+            break;
+
+        vm_page_t *head = &a->page_array[index - offset];
+        if (!(head->flags & VM_PAGE_FLAG_BUDDY))
+            continue;
+        if (offset >= (1UL << head->order))
+            return false;
+
+        /* split the block in half until only the page we want is left */
+        size_t h = index - offset;
+        uint order = head->order;
+        buddy_remove_block(a, head);
+        while (order > 0) {
+            order--;
+            if (index < h + (1UL << order)) {
+                buddy_add_block(a, h + (1UL << order), order);
+            } else {
+                buddy_add_block(a, h, order);
+                h += 1UL << order;
+            }
+        }
+        return true;
+    }
+
+    return false;
+}
+
+/* mark a run of pages pulled off the free lists as allocated */
+static void pmm_mark_allocated(pmm_arena_t *a, size_t index, size_t count, struct list_node *list)
+{
+    for (size_t i = index; i < index + count; i++) {
+        vm_page_t *p = &a->page_array[i];
+        DEBUG_ASSERT(!(p->flags & (VM_PAGE_FLAG_NONFREE | VM_PAGE_FLAG_BUDDY)));
+
+        p->flags |= VM_PAGE_FLAG_NONFREE;
+        p->type = VM_PAGE_TYPE_UNKNOWN;
+        if (i == index)
+            p->alloc_count = count;
+
+        if (list)
+            list_add_tail(list, &p->node);
+    }
+
+    a->free_count -= count;
+}
+
+/* per cpu page cache */
+static vm_page_t *pmm_pcp_alloc(void)
+{
+    vm_page_t *page = NULL;
+
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    struct pmm_pcp *pcp = &pmm_pcp[arch_curr_cpu_num()];
+    spin_lock(&pcp->lock);
+    if (likely(pcp->count > 0)) {
+        page = pcp->pages[--pcp->count];
+        pcp->hits++;
+    } else {
+        pcp->misses++;
+    }
+    spin_unlock(&pcp->lock);
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    return page;
+}
+
+/* grab a batch of pages from the first kmap arena that has them and stuff them in
+ * the current cpu's cache. returns one of them to the caller, already marked allocated. */
+static vm_page_t *pmm_pcp_refill(void)
+{
+    vm_page_t *pages[PMM_PCP_BATCH];
+    uint count = 0;
+    pmm_arena_t *a;
+
+    mutex_acquire(&lock);
+
+    list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+        if (!(a->flags & PMM_ARENA_FLAG_KMAP))
+            continue;
+
+        while (count < PMM_PCP_BATCH) {
+            vm_page_t *head = buddy_find_block(a, 0, false);
+            if (!head)
+                break;
+            pages[count] = buddy_alloc_block(a, head, 0, false);
+            pages[count]->flags |= VM_PAGE_FLAG_NONFREE;
+            count++;
+            a->free_count--;
+        }
+        if (count > 0)
+            break;
+    }
+
+    if (count == 0) {
+        mutex_release(&lock);
+        return NULL;
+    }
+
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    struct pmm_pcp *pcp = &pmm_pcp[arch_curr_cpu_num()];
+    uint i;
+    spin_lock(&pcp->lock);
+    for (i = 1; i < count && pcp->count < PMM_PCP_HIGH; i++)
+        pcp->pages[pcp->count++] = pages[i];
+    spin_unlock(&pcp->lock);
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    /* someone else filled the cache while we were at it */
+    for (; i < count; i++) {
+        pages[i]->flags &= ~VM_PAGE_FLAG_NONFREE;
+        buddy_free_block(a, pages[i] - a->page_array, 0);
+        a->free_count++;
+    }
+
+    mutex_release(&lock);
+
+    return pages[0];
+}
+
+/* stash a page being freed in the current cpu's cache, still marked allocated. if the
+ * cache is full, half of it is handed back in the flush list to go back to the arenas. */
+static bool pmm_pcp_free(const pmm_arena_t *a, vm_page_t *page, struct list_node *flush)
+{
+    if (!(a->flags & PMM_ARENA_FLAG_KMAP))
+        return false;
+
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    struct pmm_pcp *pcp = &pmm_pcp[arch_curr_cpu_num()];
+    spin_lock(&pcp->lock);
+    if (unlikely(pcp->count >= PMM_PCP_HIGH)) {
+        while (pcp->count > PMM_PCP_HIGH / 2) {
+            vm_page_t *p = pcp->pages[--pcp->count];
+            list_add_tail(flush, &p->node);
+        }
+    }
+    pcp->pages[pcp->count++] = page;
+    spin_unlock(&pcp->lock);
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    return true;
+}
+
+/* return every cpu's cached pages to the arenas so they can be coalesced.
+ * called with the pmm lock held, returns the number of pages drained. */
+static uint pmm_pcp_drain_locked(void)
+{
+    uint drained = 0;
+
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        struct pmm_pcp *pcp = &pmm_pcp[cpu];
+        vm_page_t *pages[PMM_PCP_HIGH];
+        uint count;
+
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&pcp->lock, state);
+        count = pcp->count;
+        memcpy(pages, pcp->pages, count * sizeof(vm_page_t *));
+        pcp->count = 0;
+        spin_unlock_irqrestore(&pcp->lock, state);
+
+        for (uint i = 0; i < count; i++) {
+            pmm_arena_t *a = page_to_arena(pages[i]);
+            DEBUG_ASSERT(a);
+            DEBUG_ASSERT(pages[i]->flags & VM_PAGE_FLAG_NONFREE);
+
+            pages[i]->flags &= ~VM_PAGE_FLAG_NONFREE;
+            buddy_free_block(a, pages[i] - a->page_array, 0);
+            a->free_count++;
+        }
+        drained += count;
+    }
+
+    return drained;
+}
+
 status_t pmm_add_arena(pmm_arena_t *arena)
 {
-    LTRACEF("arena %p name '%s' base 0x%lx size 0x%x\n", arena, arena->name, arena->base, arena->size);
+    LTRACEF("arena %p name '%s' base 0x%lx size 0x%zx\n", arena, arena->name, arena->base, arena->size);
 
     DEBUG_ASSERT(IS_PAGE_ALIGNED(arena->base));
     DEBUG_ASSERT(IS_PAGE_ALIGNED(arena->size));
@@ -95,7 +464,8 @@ done_add:
 
     /* zero out some of the structure */
     arena->free_count = 0;
-    list_initialize(&arena->free_list);
+    for (uint i = 0; i < PMM_MAX_ORDER; i++)
+        list_initialize(&arena->free_list[i]);
 
     /* allocate an array of pages to back this one */
     size_t page_count = arena->size / PAGE_SIZE;
@@ -104,13 +474,13 @@ done_add:
     /* initialize all of the pages */
     memset(arena->page_array, 0, page_count * sizeof(vm_page_t));
 
-    /* add them to the free list */
-    for (size_t i = 0; i < page_count; i++) {
-        vm_page_t *p = &arena->page_array[i];
-
-        list_add_tail(&arena->free_list, &p->node);
+    /* add them to the free lists as the largest aligned blocks that fit */
+    for (size_t i = 0; i < page_count; ) {
+        uint order = buddy_max_order(arena, i, page_count - i);
 
-        arena->free_count++;
+        buddy_add_block(arena, i, order);
+        arena->free_count += 1UL << order;
+        i += 1UL << order;
     }
 
     return NO_ERROR;
@@ -120,34 +490,59 @@ uint pmm_alloc_pages(uint count, struct list_node *list)
 {
     LTRACEF("count %u\n", count);
 
-    /* list must be initialized prior to calling this */
-    DEBUG_ASSERT(list);
-
     uint allocated = 0;
     if (count == 0)
         return 0;
 
+    /* single pages come out of the per cpu cache if possible */
+    if (count == 1) {
+        vm_page_t *page = pmm_pcp_alloc();
+        if (!page)
+            page = pmm_pcp_refill();
+        if (page) {
+            page->type = VM_PAGE_TYPE_UNKNOWN;
+            page->alloc_count = 1;
+            list_add_tail(list, &page->node);
+            return 1;
+        }
+    }
+
     mutex_acquire(&lock);
 
-    /* walk the arenas in order, allocating as many pages as we can from each */
+    bool drained = false;
+retry:;
+    /* walk the arenas in order, allocating as many pages as we can from each,
+     * grabbing the largest blocks that don't overshoot what's left */
     pmm_arena_t *a;
     list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
         while (allocated < count) {
-            vm_page_t *page = list_remove_head_type(&a->free_list, vm_page_t, node);
-            if (!page)
-                goto done;
+            uint order = MIN(log2_uint(count - allocated), PMM_MAX_ORDER - 1U);
+            vm_page_t *head = NULL;
+
+            for (;;) {
+                head = buddy_find_block(a, order, false);
+                if (head || order == 0)
+                    break;
+                order--;
+            }
+            if (!head)
+                break;
 
-            a->free_count--;
+            head = buddy_alloc_block(a, head, order, false);
+            pmm_mark_allocated(a, head - a->page_array, 1UL << order, list);
+            allocated += 1U << order;
+        }
 
-            page->flags |= VM_PAGE_FLAG_NONFREE;
-            page->type = VM_PAGE_TYPE_UNKNOWN;
-            list_add_tail(list, &page->node);
+        if (allocated == count)
+            break;
+    }
 
-            allocated++;
-        }
+    if (allocated < count && !drained) {
+        drained = true;
+        if (pmm_pcp_drain_locked() > 0)
+            goto retry;
     }
 
-done:
     mutex_release(&lock);
     return allocated;
 }
@@ -156,8 +551,6 @@ uint pmm_alloc_range(paddr_t address, uint count, struct list_node *list)
 {
     LTRACEF("address 0x%lx, count %u\n", address, count);
 
-    DEBUG_ASSERT(list);
-
     uint allocated = 0;
     if (count == 0)
         return 0;
@@ -167,6 +560,7 @@ uint pmm_alloc_range(paddr_t address, uint count, struct list_node *list)
     mutex_acquire(&lock);
 
     /* walk through the arenas, looking to see if the physical page belongs to it */
+    bool drained = false;
     pmm_arena_t *a;
     list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
         while (allocated < count && ADDRESS_IN_ARENA(address, a)) {
@@ -176,20 +570,22 @@ uint pmm_alloc_range(paddr_t address, uint count, struct list_node *list)
 
             vm_page_t *page = &a->page_array[index];
             if (page->flags & VM_PAGE_FLAG_NONFREE) {
-                /* we hit an allocated page */
-                break;
+                /* we hit an allocated page, or one sitting in a per cpu cache */
+                if (drained)
+                    break;
+                drained = true;
+                if (pmm_pcp_drain_locked() == 0)
+                    break;
+                continue;
             }
 
-            DEBUG_ASSERT(list_in_list(&page->node));
+            if (!buddy_take_page(a, index))
+                break;
 
-            list_delete(&page->node);
-            page->flags |= VM_PAGE_FLAG_NONFREE;
-            page->type = VM_PAGE_TYPE_UNKNOWN;
-            if(allocated==0)
+            pmm_mark_allocated(a, index, 1, list);
+            if (allocated == 0)
                 page->alloc_count = count;
-            list_add_tail(list, &page->node);
 
-            a->free_count--;
             allocated++;
             address += PAGE_SIZE;
         }
@@ -206,11 +602,11 @@ uint pmm_free(struct list_node *list)
 {
     LTRACEF("list %p\n", list);
 
-    DEBUG_ASSERT(list);
-
-    mutex_acquire(&lock);
-
+    struct list_node flush = LIST_INITIAL_VALUE(flush);
     uint count = 0;
+
+    /* single pages from kmap arenas go in the per cpu cache, the rest go back to
+     * their arena along with anything the cache wants to get rid of */
     while (!list_is_empty(list)) {
         vm_page_t *page = list_remove_head_type(list, vm_page_t, node);
 
@@ -218,17 +614,28 @@ uint pmm_free(struct list_node *list)
         DEBUG_ASSERT(page->flags & VM_PAGE_FLAG_NONFREE);
 
         /* see which arena this page belongs to and add it */
-        pmm_arena_t *a;
-        list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
-            if (PAGE_BELONGS_TO_ARENA(page, a)) {
-                page->flags &= ~VM_PAGE_FLAG_NONFREE;
+        pmm_arena_t *a = page_to_arena(page);
+        if (!a)
+            continue;
 
-                list_add_head(&a->free_list, &page->node);
-                a->free_count++;
-                count++;
-                break;
-            }
-        }
+        if (!pmm_pcp_free(a, page, &flush))
+            list_add_tail(&flush, &page->node);
+        count++;
+    }
+
+    if (list_is_empty(&flush))
+        return count;
+
+    mutex_acquire(&lock);
+
+    vm_page_t *page;
+    while ((page = list_remove_head_type(&flush, vm_page_t, node))) {
+        pmm_arena_t *a = page_to_arena(page);
+
+        DEBUG_ASSERT(page->flags & VM_PAGE_FLAG_NONFREE);
+        page->flags &= ~VM_PAGE_FLAG_NONFREE;
+        buddy_free_block(a, page - a->page_array, 0);
+        a->free_count++;
     }
 
     mutex_release(&lock);
@@ -250,8 +657,19 @@ void *pmm_alloc_kpages(uint count, struct list_node *list)
 {
     LTRACEF("count %u\n", count);
 
-    // XXX do fast path for single page
-
+    /* fast path for single pages, the per cpu cache only holds kmap pages */
+    if (count == 1) {
+        vm_page_t *page = pmm_pcp_alloc();
+        if (!page)
+            page = pmm_pcp_refill();
+        if (page) {
+            page->type = VM_PAGE_TYPE_UNKNOWN;
+            page->alloc_count = 1;
+            if (list)
+                list_add_tail(list, &page->node);
+            return paddr_to_kvaddr(page_to_address(page));
+        }
+    }
 
     paddr_t pa;
     uint alloc_count = pmm_alloc_contiguous(count, PAGE_SIZE_SHIFT, &pa, list, PMM_ARENA_FLAG_KMAP);
@@ -359,208 +777,195 @@ void pmm_set_type_ptr(void* ptr, uint32_t type) {
     }
 }
 
-static int compare_arena(const void* _a, const void* _b)
+/* linear search of an arena for a run of free pages, used when a request is too big
+ * for a buddy block or the free space is too fragmented to have one.
+ * returns the starting page index or -1. */
+static ssize_t pmm_find_run(const pmm_arena_t *a, uint count, uint8_t alignment_log2, bool top)
 {
-    const pmm_arena_t* a = *((const pmm_arena_t**)_a);
-    const pmm_arena_t* b = *((const pmm_arena_t**)_b);
+    /* calculate the starting offset into this arena, based on the
+     * base address of the arena to handle the case where the arena
+     * is not aligned on the same boundary requested.
+     */
+    paddr_t rounded_base = ROUNDUP(a->base, 1UL << alignment_log2);
+    if (rounded_base < a->base || rounded_base > a->base + a->size - 1)
+        return -1;
+
+    ssize_t aligned_offset = (rounded_base - a->base) / PAGE_SIZE;
+    ssize_t page_count = arena_page_count(a);
+    size_t align = 1UL << (alignment_log2 - PAGE_SIZE_SHIFT);
 
-    if(a->base < b->base)
+    if (page_count - aligned_offset < (ssize_t)count)
         return -1;
-    else if(a->base > b->base)
-        return 1;
-    //if(a->base == b->base)
-    else
-        return 0;
+
+    if (!top) {
+        ssize_t start = aligned_offset;
+        while (start + (ssize_t)count <= page_count) {
+            uint i;
+            for (i = 0; i < count; i++) {
+                if (!page_is_free(&a->page_array[start + i]))
+                    break;
+            }
+            if (i == count)
+                return start;
+
+            /* this run is broken, start over at the next alignment boundary past it */
+            start = ROUNDUP(start - aligned_offset + i + 1, align) + aligned_offset;
+        }
+    } else {
+        ssize_t start = ROUNDDOWN(page_count - count - aligned_offset, align) + aligned_offset;
+        while (start >= aligned_offset) {
+            uint i;
+            for (i = count; i > 0; i--) {
+                if (!page_is_free(&a->page_array[start + i - 1]))
+                    break;
+            }
+            if (i == 0)
+                return start;
+
+            /* the run has to end below the page that broke it */
+            ssize_t end = start + i - 1;
+            if (end - aligned_offset < (ssize_t)count)
+                break;
+            start = ROUNDDOWN(end - count - aligned_offset, align) + aligned_offset;
+        }
+    }
+
+    return -1;
 }
 
-static uint get_arenas_sorted(pmm_arena_t*** arenas_out)
+/* take a block of order out of the arena and allocate a run of count pages at the
+ * bottom or top of it, giving the rest back. */
+static size_t pmm_alloc_run_from_block(pmm_arena_t *a, vm_page_t *head, uint order,
+                                       uint count, uint8_t alignment_log2, bool top)
 {
-    size_t num_arenas = list_length(&arena_list);
-    pmm_arena_t** arenas = malloc(num_arenas*sizeof(pmm_arena_t*));
-    ASSERT(arenas);
+    size_t index = buddy_alloc_block(a, head, order, top) - a->page_array;
+    size_t block_size = 1UL << order;
+    size_t start = index;
 
-    uint32_t c = 0;
-    pmm_arena_t *a;
-    list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
-        arenas[c++] = a;
-    }
-    ASSERT(c==num_arenas);
+    if (top)
+        start += ROUNDDOWN(block_size - count, 1UL << (alignment_log2 - PAGE_SIZE_SHIFT));
 
-    qsort(arenas, num_arenas, sizeof(*arenas), compare_arena);
+    buddy_free_run(a, index, start - index);
+    buddy_free_run(a, start + count, index + block_size - (start + count));
 
-    *arenas_out = arenas;
-    return num_arenas;
+    return start;
 }
 
-uint pmm_alloc_contiguous_maxaddr(uint count, uint8_t alignment_log2, paddr_t *pa, struct list_node *list, uint flags)
+static uint pmm_alloc_contiguous_etc(uint count, uint8_t alignment_log2, paddr_t *pa,
+                                     struct list_node *list, uint flags, bool top)
 {
-    LTRACEF("count %u, align %u\n", count, alignment_log2);
+    LTRACEF("count %u, align %u, top %d\n", count, alignment_log2, top);
 
     if (count == 0)
         return 0;
     if (alignment_log2 < PAGE_SIZE_SHIFT)
         alignment_log2 = PAGE_SIZE_SHIFT;
 
-    mutex_acquire(&lock);
-
-    // get sorted list of arenas
-    pmm_arena_t** arenas = NULL;
-    uint num_arenas = get_arenas_sorted(&arenas);
-
-    for(int i=num_arenas-1; i>=0; i--) {
-        pmm_arena_t *a = arenas[i];
-
-        if (a->flags != PMM_ARENA_FLAG_RESERVED && (flags & PMM_ARENA_FLAG_ANY || a->flags & flags)) {
-            /* walk the list starting at alignment boundaries.
-            * calculate the starting offset into this arena, based on the
-            * base address of the arena to handle the case where the arena
-            * is not aligned on the same boundary requested.
-            */
-            paddr_t rounded_base = ROUNDUP(a->base, 1UL << alignment_log2);
-            if (rounded_base < a->base || rounded_base > a->base + a->size - 1)
-                continue;
+    /* a buddy block of this order is big enough and aligned enough */
+    uint order = log2_uint(count) + (ispow2(count) ? 0 : 1);
+    order = MAX(order, (uint)(alignment_log2 - PAGE_SIZE_SHIFT));
 
-            uint aligned_offset = (rounded_base - a->base) / PAGE_SIZE;
-            uint arena_end = a->size / PAGE_SIZE;
-            uint end = arena_end;
-            LTRACEF("starting search at aligned offset %u\n", end);
-            LTRACEF("arena base 0x%lx size %zu\n", a->base, a->size);
-
-retry:
-            /* search while we're still within the arena and have a chance of finding a slot
-            (start + count < end of arena) */
-            while ((end >= aligned_offset) &&
-                   ((end - aligned_offset) >= count)) {
-                vm_page_t *p = &a->page_array[end];
-                for (uint i = 0; i < count; i++) {
-                    if (p->flags & VM_PAGE_FLAG_NONFREE) {
-                        /* this run is broken, break out of the inner loop.
-                        * start over at the next alignment boundary
-                        */
-                        end = ROUNDDOWN(end - i - 1, 1UL << (alignment_log2 - PAGE_SIZE_SHIFT)) + aligned_offset;
-                        goto retry;
-                    }
-                    p--;
-                }
+    pmm_arena_t *a;
+    pmm_arena_t *found = NULL;
+    size_t start = 0;
 
-                /* we found a run */
-                LTRACEF("found run from pn %u to %u\n", end - count, end);
+    mutex_acquire(&lock);
 
+    if (order < PMM_MAX_ORDER) {
+        for (int pass = 0; pass < 2 && !found; pass++) {
+            /* cached pages may be keeping buddies from merging, push them back and try again */
+            if (pass > 0 && pmm_pcp_drain_locked() == 0)
+                break;
 
-                /* remove the pages from the run out of the free list */
-                for (uint i = end - count; i < end; i++) {
-                    p = &a->page_array[i];
-                    DEBUG_ASSERT(!(p->flags & VM_PAGE_FLAG_NONFREE));
-                    DEBUG_ASSERT(list_in_list(&p->node));
+            vm_page_t *best = NULL;
+            list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+                if (!ARENA_MATCHES_FLAGS(a, flags))
+                    continue;
 
-                    list_delete(&p->node);
-                    p->flags |= VM_PAGE_FLAG_NONFREE;
-                    p->type = VM_PAGE_TYPE_UNKNOWN;
-                    if(i==(end-count))
-                        p->alloc_count = count;
-                    a->free_count--;
+                vm_page_t *head = buddy_find_block(a, order, top);
+                if (!head)
+                    continue;
 
-                    if (list)
-                        list_add_tail(list, &p->node);
+                if (!top) {
+                    found = a;
+                    best = head;
+                    break;
+                }
+                if (!found || page_to_address(head) > page_to_address(best)) {
+                    found = a;
+                    best = head;
                 }
-
-                if (pa)
-                    *pa = a->base + (end-count) * PAGE_SIZE;
-
-                mutex_release(&lock);
-
-                return count;
             }
+
+            if (found)
+                start = pmm_alloc_run_from_block(found, best, order, count, alignment_log2, top);
         }
     }
 
-    // free arenas
-    free(arenas);
-
-    mutex_release(&lock);
-
-    return 0;
-}
-
-uint pmm_alloc_contiguous(uint count, uint8_t alignment_log2, paddr_t *pa, struct list_node *list, uint flags)
-{
-    LTRACEF("count %u, align %u\n", count, alignment_log2);
-
-    if (count == 0)
-        return 0;
-    if (alignment_log2 < PAGE_SIZE_SHIFT)
-        alignment_log2 = PAGE_SIZE_SHIFT;
-
-    mutex_acquire(&lock);
+    if (!found) {
+        /* too big for a buddy block, or nothing aligned is free. fall back to searching
+         * the page arrays for a run, which can straddle blocks. */
+        pmm_pcp_drain_locked();
 
-    pmm_arena_t *a;
-    list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
-        if (a->flags != PMM_ARENA_FLAG_RESERVED && (flags & PMM_ARENA_FLAG_ANY || a->flags & flags)) {
-            /* walk the list starting at alignment boundaries.
-             * calculate the starting offset into this arena, based on the
-             * base address of the arena to handle the case where the arena
-             * is not aligned on the same boundary requested.
-             */
-            paddr_t rounded_base = ROUNDUP(a->base, 1UL << alignment_log2);
-            if (rounded_base < a->base || rounded_base > a->base + a->size - 1)
+        paddr_t best_pa = 0;
+        list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+            if (!ARENA_MATCHES_FLAGS(a, flags))
                 continue;
 
-            uint aligned_offset = (rounded_base - a->base) / PAGE_SIZE;
-            uint start = aligned_offset;
-            LTRACEF("starting search at aligned offset %u\n", start);
-            LTRACEF("arena base 0x%lx size %zu\n", a->base, a->size);
-
-retry:
-            /* search while we're still within the arena and have a chance of finding a slot
-               (start + count < end of arena) */
-            while ((start < a->size / PAGE_SIZE) &&
-                   ((start + count) <= a->size / PAGE_SIZE)) {
-                vm_page_t *p = &a->page_array[start];
-                for (uint i = 0; i < count; i++) {
-                    if (p->flags & VM_PAGE_FLAG_NONFREE) {
-                        /* this run is broken, break out of the inner loop.
-                         * start over at the next alignment boundary
-                         */
-                        start = ROUNDUP(start - aligned_offset + i + 1, 1UL << (alignment_log2 - PAGE_SIZE_SHIFT)) + aligned_offset;
-                        goto retry;
-                    }
-                    p++;
-                }
+            ssize_t run = pmm_find_run(a, count, alignment_log2, top);
+            if (run < 0)
+                continue;
 
-                /* we found a run */
-                LTRACEF("found run from pn %u to %u\n", start, start + count);
+            paddr_t run_pa = a->base + run * PAGE_SIZE;
+            if (!found || run_pa > best_pa) {
+                found = a;
+                start = run;
+                best_pa = run_pa;
+            }
+            if (!top)
+                break;
+        }
 
-                /* remove the pages from the run out of the free list */
-                for (uint i = start; i < start + count; i++) {
-                    p = &a->page_array[i];
-                    DEBUG_ASSERT(!(p->flags & VM_PAGE_FLAG_NONFREE));
-                    DEBUG_ASSERT(list_in_list(&p->node));
+        if (found) {
+            for (size_t i = start; i < start + count; i++) {
+                if (buddy_take_page(found, i))
+                    continue;
 
-                    list_delete(&p->node);
-                    p->flags |= VM_PAGE_FLAG_NONFREE;
-                    p->type = VM_PAGE_TYPE_UNKNOWN;
-                    if(i==start)
-                        p->alloc_count = count;
-                    a->free_count--;
+                /* the run isn't really free, give back what we took and fail */
+                TRACEF("page %zu in run from pn %zu is not free\n", i, start);
+                buddy_free_run(found, start, i - start);
+                found = NULL;
+                break;
+            }
+        }
+    }
 
-                    if (list)
-                        list_add_tail(list, &p->node);
-                }
+    if (!found) {
+        mutex_release(&lock);
+        LTRACEF("couldn't find run\n");
+        return 0;
+    }
 
-                if (pa)
-                    *pa = a->base + start * PAGE_SIZE;
+    LTRACEF("found run from pn %zu to %zu\n", start, start + count);
 
-                mutex_release(&lock);
+    pmm_mark_allocated(found, start, count, list);
 
-                return count;
-            }
-        }
-    }
+    if (pa)
+        *pa = found->base + start * PAGE_SIZE;
 
     mutex_release(&lock);
 
-    LTRACEF("couldn't find run\n");
-    return 0;
+    return count;
+}
+
+uint pmm_alloc_contiguous_maxaddr(uint count, uint8_t alignment_log2, paddr_t *pa, struct list_node *list, uint flags)
+{
+    return pmm_alloc_contiguous_etc(count, alignment_log2, pa, list, flags, true);
+}
+
+uint pmm_alloc_contiguous(uint count, uint8_t alignment_log2, paddr_t *pa, struct list_node *list, uint flags)
+{
+    return pmm_alloc_contiguous_etc(count, alignment_log2, pa, list, flags, false);
 }
 
 uint64_t pmm_get_free_space(void)
@@ -627,12 +1032,16 @@ static void dump_page(const vm_page_t *page)
     printf("page %p: address 0x%lx flags 0x%x\n", page, page_to_address(page), page->flags);
 }
 
-static void dump_arena(const pmm_arena_t *arena, bool dump_pages)
+static void dump_arena(pmm_arena_t *arena, bool dump_pages)
 {
-    printf("arena %p: name '%s' base 0x%lx size 0x%x priority %u flags 0x%x\n",
+    printf("arena %p: name '%s' base 0x%lx size 0x%zx priority %u flags 0x%x\n",
            arena, arena->name, arena->base, arena->size, arena->priority, arena->flags);
     printf("\tpage_array %p, free_count %zu\n",
            arena->page_array, arena->free_count);
+    printf("\tfree blocks by order:");
+    for (uint o = 0; o < PMM_MAX_ORDER; o++)
+        printf(" %zu", list_length(&arena->free_list[o]));
+    printf("\n");
 
     /* dump all of the pages */
     if (dump_pages) {
@@ -662,6 +1071,43 @@ static void dump_arena(const pmm_arena_t *arena, bool dump_pages)
     }
 }
 
+/* free block histogram per arena, plus what's sitting in the per cpu caches */
+static void dump_fragmentation(void)
+{
+    mutex_acquire(&lock);
+
+    pmm_arena_t *a;
+    list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+        printf("arena '%s': base 0x%lx size 0x%zx, free pages %zu\n",
+               a->name, a->base, a->size, a->free_count);
+        printf("\torder %6s %8s %8s %6s\n", "size", "blocks", "pages", "free%");
+
+        int largest = -1;
+        for (uint o = 0; o < PMM_MAX_ORDER; o++) {
+            size_t blocks = list_length(&a->free_list[o]);
+            size_t pages = blocks << o;
+            if (blocks > 0)
+                largest = o;
+
+            printf("\t%5u %5zuK %8zu %8zu %5zu%%\n", o, ((size_t)PAGE_SIZE << o) / 1024, blocks, pages,
+                   a->free_count ? pages * 100 / a->free_count : 0);
+        }
+
+        if (largest >= 0)
+            printf("\tlargest free block %zu pages\n", (size_t)1 << largest);
+        else
+            printf("\tno free blocks\n");
+    }
+
+    printf("per cpu page caches:\n");
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        printf("\tcpu %u: cached %u, hits %lu, misses %lu\n", cpu,
+               pmm_pcp[cpu].count, pmm_pcp[cpu].hits, pmm_pcp[cpu].misses);
+    }
+
+    mutex_release(&lock);
+}
+
 static int cmd_pmm(int argc, const cmd_args *argv)
 {
     if (argc < 2) {
@@ -671,6 +1117,7 @@ usage:
         printf("usage:\n");
         printf("%s arenas\n", argv[0].str);
         printf("%s free_space\n", argv[0].str);
+        printf("%s frag\n", argv[0].str);
         printf("%s alloc <count>\n", argv[0].str);
         printf("%s alloc_range <address> <count>\n", argv[0].str);
         printf("%s alloc_kpages <count>\n", argv[0].str);
@@ -689,6 +1136,8 @@ usage:
         }
     } else if (!strcmp(argv[1].str, "free_space")) {
         printf("free space: %llu\n", pmm_get_free_space());
+    } else if (!strcmp(argv[1].str, "frag")) {
+        dump_fragmentation();
     } else if (!strcmp(argv[1].str, "alloc")) {
         if (argc < 3) goto notenoughargs;
 
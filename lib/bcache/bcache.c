@@ -27,67 +27,274 @@
 #include <sys/types.h>
 #include <debug.h>
 #include <trace.h>
+#include <err.h>
+#include <arch/ops.h>
+#include <kernel/thread.h>
+#include <kernel/event.h>
+#include <kernel/mutex.h>
+#include <kernel/spinlock.h>
 #include <lib/bcache.h>
 #include <lib/bio.h>
 
 #define LOCAL_TRACE 0
 
+/* number of independently locked pieces of the cache */
+#ifndef BCACHE_SHARDS
+#define BCACHE_SHARDS 4
+#endif
+
+/* fewest blocks worth giving a shard of its own */
+#ifndef BCACHE_MIN_SHARD_BLOCKS
+#define BCACHE_MIN_SHARD_BLOCKS 32
+#endif
+
+/* largest sequential read-ahead, in blocks. runs of this many blocks always land
+ * in the same shard so a read-ahead never has to touch two of them. */
+#ifndef BCACHE_READAHEAD_MAX
+#define BCACHE_READAHEAD_MAX 16
+#endif
+
+/* how often the write-back thread looks for dirty blocks, in ms. 0 disables the
+ * thread and dirty blocks are only written on eviction or bcache_flush(). */
+#ifndef BCACHE_WRITEBACK_INTERVAL
+#define BCACHE_WRITEBACK_INTERVAL 1000
+#endif
+
+/* most dirty blocks written back in one batch */
+#define BCACHE_WRITEBACK_BATCH 16
+
 struct bcache_block {
+	/* hash chain while valid, shard free list while not */
 	struct list_node node;
 	bnum_t blocknum;
 	int ref_count;
+	bool valid;
 	bool is_dirty;
+	bool accessed; /* CLOCK reference bit */
 	void *ptr;
 };
 
 struct bcache_stats {
 	uint32_t hits;
-	uint32_t depth;
 	uint32_t misses;
 	uint32_t reads;
+	uint32_t readahead;
 	uint32_t writes;
+	uint32_t writeback;
+};
+
+struct bcache_shard {
+	mutex_t lock;
+
+	uint count;
+	uint dirty;
+	uint hand;
+	struct bcache_block *blocks;
+
+	uint hash_mask;
+	struct list_node *hash;
+	struct list_node free_list;
+
+	struct bcache_stats stats;
+
+	/* in flight fills, only touched with the lock held */
+	bio_request_t reqs[BCACHE_READAHEAD_MAX];
 };
 
 struct bcache {
 	bdev_t *dev;
 	size_t block_size;
+	bnum_t block_count;
 	int count;
-	struct bcache_stats stats;
 
-	struct list_node free_list;
-	struct list_node lru_list;
+	uint shard_count;
+	struct bcache_shard *shards;
+
+	/* sequential read detection */
+	spin_lock_t ra_lock;
+	bnum_t ra_next;
+	uint ra_window;
+	uint ra_max;
+
+	/* write-back */
+	mutex_t wb_lock;
+	bio_request_t wb_reqs[BCACHE_WRITEBACK_BATCH];
+	thread_t *wb_thread;
+	event_t wb_event;
+	volatile bool wb_stop;
+};
 
-	struct bcache_block *blocks;
+/* a group of single block requests waited on together */
+struct bcache_batch {
+	volatile int pending;
+	event_t done;
 };
 
+static void bcache_writeback(struct bcache *cache, bool all);
+
+static struct bcache_shard *get_shard(struct bcache *cache, bnum_t blocknum)
+{
+	return &cache->shards[(blocknum / BCACHE_READAHEAD_MAX) % cache->shard_count];
+}
+
+static struct list_node *hash_bucket(struct bcache_shard *shard, bnum_t blocknum)
+{
+	uint32_t hash = blocknum * 0x9e3779b1;
+
+	return &shard->hash[(hash ^ (hash >> 16)) & shard->hash_mask];
+}
+
+static int writeback_thread(void *arg)
+{
+	struct bcache *cache = arg;
+
+	while (!cache->wb_stop) {
+		event_wait_timeout(&cache->wb_event, BCACHE_WRITEBACK_INTERVAL);
+		if (cache->wb_stop)
+			break;
+
+		bcache_writeback(cache, false);
+	}
+
+	return 0;
+}
+
 bcache_t bcache_create(bdev_t *dev, size_t block_size, int block_count)
 {
 	struct bcache *cache;
 
-	cache = malloc(sizeof(struct bcache));
+	DEBUG_ASSERT(block_count > 0);
+
+	cache = calloc(1, sizeof(struct bcache));
+	if (!cache)
+		return NULL;
 
 	cache->dev = dev;
 	cache->block_size = block_size;
+	cache->block_count = dev->size / block_size;
 	cache->count = block_count;
-	memset(&cache->stats, 0, sizeof(cache->stats));
-
-	list_initialize(&cache->free_list);
-	list_initialize(&cache->lru_list);
-
-	cache->blocks = malloc(sizeof(struct bcache_block) * block_count);
-	int i;
-	for (i=0; i < block_count; i++) {
-		cache->blocks[i].ref_count = 0;
-		cache->blocks[i].is_dirty = false;
-		cache->blocks[i].ptr = malloc(block_size);
-		// add to the free list
-		list_add_head(&cache->free_list, &cache->blocks[i].node);
+
+	cache->shard_count = MIN(BCACHE_SHARDS, block_count / BCACHE_MIN_SHARD_BLOCKS);
+	cache->shard_count = MAX(cache->shard_count, 1U);
+	cache->shards = calloc(cache->shard_count, sizeof(struct bcache_shard));
+	if (!cache->shards)
+		goto err;
+
+	for (uint s = 0; s < cache->shard_count; s++) {
+		struct bcache_shard *shard = &cache->shards[s];
+		uint count = block_count / cache->shard_count;
+		if (s < block_count % cache->shard_count)
+			count++;
+
+		mutex_init(&shard->lock);
+		list_initialize(&shard->free_list);
+
+		uint buckets = 1;
+		while (buckets < count)
+			buckets <<= 1;
+		shard->hash_mask = buckets - 1;
+		shard->hash = malloc(buckets * sizeof(struct list_node));
+		if (!shard->hash)
+			goto err;
+		for (uint i = 0; i < buckets; i++)
+			list_initialize(&shard->hash[i]);
+
+		shard->blocks = calloc(count, sizeof(struct bcache_block));
+		if (!shard->blocks)
+			goto err;
+		shard->count = count;
+		for (uint i = 0; i < count; i++) {
+			shard->blocks[i].ptr = malloc(block_size);
+			if (!shard->blocks[i].ptr)
+				goto err;
+			// add to the free list
+			list_add_tail(&shard->free_list, &shard->blocks[i].node);
+		}
 	}
 
+	/* don't let a read-ahead push out more than a quarter of a shard */
+	cache->ra_max = MIN(BCACHE_READAHEAD_MAX, cache->shards[cache->shard_count - 1].count / 4);
+	cache->ra_max = MAX(cache->ra_max, 1U);
+	spin_lock_init(&cache->ra_lock);
+
+	mutex_init(&cache->wb_lock);
+	event_init(&cache->wb_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+#if BCACHE_WRITEBACK_INTERVAL > 0
+	cache->wb_thread = thread_create("bcache writeback", &writeback_thread, cache,
+	                                 LOW_PRIORITY, DEFAULT_STACK_SIZE);
+	if (cache->wb_thread)
+		thread_resume(cache->wb_thread);
+#endif
+
+	LTRACEF("cache %p: %d blocks in %u shards, read-ahead %u\n", cache, block_count,
+	        cache->shard_count, cache->ra_max);
+
 	return (bcache_t)cache;
+
+err:
+	if (cache->shards) {
+		for (uint s = 0; s < cache->shard_count; s++) {
+			struct bcache_shard *shard = &cache->shards[s];
+			if (shard->blocks) {
+				for (uint i = 0; i < shard->count; i++)
+					free(shard->blocks[i].ptr);
+			}
+			free(shard->blocks);
+			free(shard->hash);
+		}
+		free(cache->shards);
+	}
+	free(cache);
+	return NULL;
 }
 
-static int flush_block(struct bcache *cache, struct bcache_block *block)
+static void batch_callback(bio_request_t *req)
+{
+	struct bcache_batch *batch = req->cookie;
+
+	if (atomic_add(&batch->pending, -1) == 1)
+		event_signal(&batch->done, false);
+}
+
+/* read or write a set of blocks, one request each, and wait for all of them. the
+ * requests go in under a plug so the bio layer can merge neighbours into a single
+ * transfer. per block results are left in reqs[i].result. */
+static void bcache_block_io(struct bcache *cache, uint op, struct bcache_block **blocks,
+                            uint count, bio_request_t *reqs)
+{
+	bdev_t *dev = cache->dev;
+
+	/* blocks that don't line up with device blocks go through the byte interface */
+	if (cache->block_size % dev->block_size != 0) {
+		for (uint i = 0; i < count; i++) {
+			off_t offset = (off_t)blocks[i]->blocknum * cache->block_size;
+			if (op == BIO_OP_READ)
+				reqs[i].result = bio_read(dev, blocks[i]->ptr, offset, cache->block_size);
+			else
+				reqs[i].result = bio_write(dev, blocks[i]->ptr, offset, cache->block_size);
+		}
+		return;
+	}
+
+	uint dev_blocks = cache->block_size >> dev->block_shift;
+	struct bcache_batch batch;
+
+	batch.pending = count;
+	event_init(&batch.done, false, 0);
+
+	bio_plug(dev);
+	for (uint i = 0; i < count; i++) {
+		bio_request_init(&reqs[i], op, blocks[i]->blocknum * dev_blocks, dev_blocks,
+		                 blocks[i]->ptr, &batch_callback, &batch);
+		bio_submit_request(dev, &reqs[i]);
+	}
+	bio_unplug(dev);
+
+	event_wait(&batch.done);
+	event_destroy(&batch.done);
+}
+
+static int flush_block(struct bcache *cache, struct bcache_shard *shard, struct bcache_block *block)
 {
 	int rc;
 
@@ -98,168 +305,300 @@ static int flush_block(struct bcache *cache, struct bcache_block *block)
 		goto exit;
 
 	block->is_dirty = false;
-	cache->stats.writes++;
+	shard->dirty--;
+	shard->stats.writes++;
 	rc = 0;
 exit:
 	return (rc);
 }
 
+static void set_dirty(struct bcache *cache, struct bcache_shard *shard, struct bcache_block *block)
+{
+	if (block->is_dirty)
+		return;
+
+	block->is_dirty = true;
+	shard->dirty++;
+
+	/* get write-back going before eviction has to do it synchronously */
+	if (shard->dirty > shard->count / 2)
+		event_signal(&cache->wb_event, false);
+}
+
 void bcache_destroy(bcache_t _cache)
 {
 	struct bcache *cache = _cache;
-	int i;
 
-	for (i=0; i < cache->count; i++) {
-		DEBUG_ASSERT(cache->blocks[i].ref_count == 0);
+	if (cache->wb_thread) {
+		cache->wb_stop = true;
+		event_signal(&cache->wb_event, true);
+		thread_join(cache->wb_thread, NULL, INFINITE_TIME);
+	}
+
+	bcache_flush(cache);
+
+	for (uint s = 0; s < cache->shard_count; s++) {
+		struct bcache_shard *shard = &cache->shards[s];
+
+		for (uint i = 0; i < shard->count; i++) {
+			struct bcache_block *block = &shard->blocks[i];
+
+			DEBUG_ASSERT(block->ref_count == 0);
+
+			if (block->is_dirty)
+				printf("warning: freeing dirty block %u\n", block->blocknum);
 
-		if (cache->blocks[i].is_dirty)
-			printf("warning: freeing dirty block %u\n",
-			       cache->blocks[i].blocknum);
+			free(block->ptr);
+		}
 
-		free(cache->blocks[i].ptr);
+		mutex_destroy(&shard->lock);
+		free(shard->blocks);
+		free(shard->hash);
 	}
 
+	event_destroy(&cache->wb_event);
+	mutex_destroy(&cache->wb_lock);
+	free(cache->shards);
 	free(cache);
 }
 
-/* find a block if it's already present */
-static struct bcache_block *find_block(struct bcache *cache, uint blocknum)
+static struct bcache_block *lookup_block(struct bcache_shard *shard, uint blocknum)
 {
-	uint32_t depth = 0;
 	struct bcache_block *block;
 
-	LTRACEF("num %u\n", blocknum);
-
-	block = NULL;
-	list_for_every_entry(&cache->lru_list, block, struct bcache_block, node) {
-		LTRACEF("looking at entry %p, num %u\n", block, block->blocknum);
-		depth++;
-
-		if (block->blocknum == blocknum) {
-			list_delete(&block->node);
-			list_add_tail(&cache->lru_list, &block->node);
-			cache->stats.hits++;
-			cache->stats.depth += depth;
+	list_for_every_entry(hash_bucket(shard, blocknum), block, struct bcache_block, node) {
+		if (block->blocknum == blocknum)
 			return block;
-		}
 	}
 
-	cache->stats.misses++;
 	return NULL;
 }
 
-/* allocate a new block */
-static struct bcache_block *alloc_block(struct bcache *cache)
+/* find a block if it's already present. called with the shard locked. */
+static struct bcache_block *find_block(struct bcache_shard *shard, uint blocknum)
+{
+	LTRACEF("num %u\n", blocknum);
+
+	struct bcache_block *block = lookup_block(shard, blocknum);
+	if (block)
+		block->accessed = true;
+
+	return block;
+}
+
+/* take a block out of the cache for reuse, using the CLOCK algorithm. clean blocks
+ * are preferred. a dirty one is only written out and taken if allow_dirty is set
+ * and there isn't anything else. called with the shard locked. */
+static struct bcache_block *alloc_block(struct bcache *cache, struct bcache_shard *shard, bool allow_dirty)
 {
-	int err;
 	struct bcache_block *block;
+	struct bcache_block *dirty = NULL;
 
 	/* pop one off the free list if it's present */
-	block = list_remove_head_type(&cache->free_list, struct bcache_block, node);
+	block = list_remove_head_type(&shard->free_list, struct bcache_block, node);
 	if (block) {
-		block->ref_count = 0;
-		list_add_tail(&cache->lru_list, &block->node);
 		LTRACEF("found block %p on free list\n", block);
 		return block;
 	}
 
-	/* walk the lru, looking for a free block */
-	list_for_every_entry(&cache->lru_list, block, struct bcache_block, node) {
-		LTRACEF("looking at %p, num %u\n", block, block->blocknum);
-		if (block->ref_count == 0) {
-			if (block->is_dirty) {
-				err = flush_block(cache, block);
-				if (err)
-					return NULL;
-			}
+	/* two trips around clears every reference bit */
+	for (uint i = 0; i < shard->count * 2; i++) {
+		block = &shard->blocks[shard->hand];
+		shard->hand = (shard->hand + 1) % shard->count;
 
-			// add it to the tail of the lru
-			list_delete(&block->node);
-			list_add_tail(&cache->lru_list, &block->node);
-			return block;
+		if (!block->valid || block->ref_count > 0)
+			continue;
+		if (block->accessed) {
+			block->accessed = false;
+			continue;
 		}
+		if (block->is_dirty) {
+			if (!dirty)
+				dirty = block;
+			continue;
+		}
+		goto found;
 	}
 
-	return NULL;
+	if (!allow_dirty || !dirty)
+		return NULL;
+
+	block = dirty;
+	if (flush_block(cache, shard, block))
+		return NULL;
+	event_signal(&cache->wb_event, false);
+
+found:
+	LTRACEF("evicting %p, num %u\n", block, block->blocknum);
+	list_delete(&block->node);
+	block->valid = false;
+	return block;
 }
 
-static struct bcache_block *find_or_fill_block(struct bcache *cache, uint blocknum)
+static void insert_block(struct bcache_shard *shard, struct bcache_block *block, bnum_t blocknum)
 {
-	int err;
+	block->blocknum = blocknum;
+	block->valid = true;
+	block->accessed = true;
+	list_add_head(hash_bucket(shard, blocknum), &block->node);
+}
+
+/* how many blocks to read on a miss at blocknum. sequential misses double the
+ * window, anything else resets it. */
+static uint readahead_window(struct bcache *cache, bnum_t blocknum)
+{
+	spin_lock_saved_state_t state;
+	uint window;
+
+	spin_lock_irqsave(&cache->ra_lock, state);
+	if (blocknum == cache->ra_next && cache->ra_window > 0)
+		window = MIN(MAX(cache->ra_window * 2, 4U), cache->ra_max);
+	else
+		window = 1;
+
+	/* stay inside the shard's run of blocks and the device */
+	window = MIN(window, BCACHE_READAHEAD_MAX - (blocknum % BCACHE_READAHEAD_MAX));
+	if (blocknum < cache->block_count)
+		window = MIN(window, cache->block_count - blocknum);
+
+	cache->ra_next = blocknum + window;
+	cache->ra_window = window;
+	spin_unlock_irqrestore(&cache->ra_lock, state);
+
+	return window;
+}
+
+/* called with the shard locked */
+static struct bcache_block *find_or_fill_block(struct bcache *cache, struct bcache_shard *shard, uint blocknum)
+{
+	struct bcache_block *blocks[BCACHE_READAHEAD_MAX];
 
 	LTRACEF("block %u\n", blocknum);
 
 	/* see if it's already in the cache */
-	struct bcache_block *block = find_block(cache, blocknum);
-	if (block == NULL) {
-		LTRACEF("wasn't allocated\n");
+	struct bcache_block *block = find_block(shard, blocknum);
+	if (block) {
+		shard->stats.hits++;
+		return block;
+	}
+
+	shard->stats.misses++;
+
+	LTRACEF("wasn't allocated\n");
+
+	/* allocate the block we were asked for, and clean ones for any read-ahead */
+	uint window = readahead_window(cache, blocknum);
+	uint count = 0;
+	while (count < window) {
+		if (count > 0 && lookup_block(shard, blocknum + count))
+			break;
+
+		block = alloc_block(cache, shard, count == 0);
+		if (!block)
+			break;
 
-		/* allocate a new block and fill it */
-		block = alloc_block(cache);
-		DEBUG_ASSERT(block);
+		/* hold it so alloc_block doesn't hand it out again */
+		block->blocknum = blocknum + count;
+		block->ref_count = 1;
+		blocks[count++] = block;
+	}
+
+	if (count == 0)
+		return NULL;
+
+	LTRACEF("reading %u blocks at %u\n", count, blocknum);
+
+	bcache_block_io(cache, BIO_OP_READ, blocks, count, shard->reqs);
+
+	for (uint i = 0; i < count; i++) {
+		block = blocks[i];
+		block->ref_count = 0;
 
-		LTRACEF("wasn't allocated, new block %p\n", block);
+		if (shard->reqs[i].result != (ssize_t)cache->block_size) {
+			/* put it back on the free list */
+			list_add_tail(&shard->free_list, &block->node);
+			continue;
+		}
 
-		block->blocknum = blocknum;
-		err = bio_read(cache->dev, block->ptr, (off_t)blocknum * cache->block_size, cache->block_size);
-		if (err < 0) {
-			/* free the block, return an error */
-			list_add_tail(&cache->free_list, &block->node);
-			return NULL;
+		insert_block(shard, block, blocknum + i);
+		shard->stats.reads++;
+		if (i > 0) {
+			/* it has to earn its reference bit */
+			block->accessed = false;
+			shard->stats.readahead++;
 		}
+	}
 
-		cache->stats.reads++;
+	if (!blocks[0]->valid) {
+		/* error */
+		return NULL;
 	}
 
-	DEBUG_ASSERT(block->blocknum == blocknum);
+	DEBUG_ASSERT(blocks[0]->blocknum == blocknum);
 
-	return block;
+	return blocks[0];
 }
 
 int bcache_read_block(bcache_t _cache, void *buf, uint blocknum)
 {
 	struct bcache *cache = _cache;
+	struct bcache_shard *shard = get_shard(cache, blocknum);
+	int err = 0;
 
 	LTRACEF("buf %p, blocknum %u\n", buf, blocknum);
 
-	struct bcache_block *block = find_or_fill_block(cache, blocknum);
+	mutex_acquire(&shard->lock);
+
+	struct bcache_block *block = find_or_fill_block(cache, shard, blocknum);
 	if (block == NULL) {
 		/* error */
-		return -1;
+		err = -1;
+	} else {
+		memcpy(buf, block->ptr, cache->block_size);
 	}
 
-	memcpy(buf, block->ptr, cache->block_size);
-	return 0;
+	mutex_release(&shard->lock);
+
+	return err;
 }
 
 int bcache_get_block(bcache_t _cache, void **ptr, uint blocknum)
 {
 	struct bcache *cache = _cache;
+	struct bcache_shard *shard = get_shard(cache, blocknum);
+	int err = 0;
 
 	LTRACEF("ptr %p, blocknum %u\n", ptr, blocknum);
 
 	DEBUG_ASSERT(ptr);
 
-	struct bcache_block *block = find_or_fill_block(cache, blocknum);
+	mutex_acquire(&shard->lock);
+
+	struct bcache_block *block = find_or_fill_block(cache, shard, blocknum);
 	if (block == NULL) {
 		/* error */
-		return -1;
+		err = -1;
+	} else {
+		/* increment the ref count to keep it from being freed */
+		block->ref_count++;
+		*ptr = block->ptr;
 	}
 
-	/* increment the ref count to keep it from being freed */
-	block->ref_count++;
-	*ptr = block->ptr;
+	mutex_release(&shard->lock);
 
-	return 0;
+	return err;
 }
 
 int bcache_put_block(bcache_t _cache, uint blocknum)
 {
 	struct bcache *cache = _cache;
+	struct bcache_shard *shard = get_shard(cache, blocknum);
 
 	LTRACEF("blocknum %u\n", blocknum);
 
-	struct bcache_block *block = find_block(cache, blocknum);
+	mutex_acquire(&shard->lock);
+
+	struct bcache_block *block = find_block(shard, blocknum);
 
 	/* be pretty hard on the caller for now */
 	DEBUG_ASSERT(block);
@@ -267,6 +606,8 @@ int bcache_put_block(bcache_t _cache, uint blocknum)
 
 	block->ref_count--;
 
+	mutex_release(&shard->lock);
+
 	return 0;
 }
 
@@ -274,17 +615,21 @@ int bcache_mark_block_dirty(bcache_t priv, uint blocknum)
 {
 	int err;
 	struct bcache *cache = priv;
+	struct bcache_shard *shard = get_shard(cache, blocknum);
 	struct bcache_block *block;
 
-	block = find_block(cache, blocknum);
+	mutex_acquire(&shard->lock);
+
+	block = find_block(shard, blocknum);
 	if (!block) {
 		err = -1;
 		goto exit;
 	}
 
-	block->is_dirty = true;
+	set_dirty(cache, shard, block);
 	err = 0;
 exit:
+	mutex_release(&shard->lock);
 	return (err);
 }
 
@@ -292,59 +637,151 @@ int bcache_zero_block(bcache_t priv, uint blocknum)
 {
 	int err;
 	struct bcache *cache = priv;
+	struct bcache_shard *shard = get_shard(cache, blocknum);
 	struct bcache_block *block;
 
-	block = find_block(cache, blocknum);
+	mutex_acquire(&shard->lock);
+
+	block = find_block(shard, blocknum);
 	if (!block) {
-		block = alloc_block(cache);
+		block = alloc_block(cache, shard, true);
 		if (!block) {
 			err = -1;
 			goto exit;
 		}
 
-		block->blocknum = blocknum;
+		insert_block(shard, block, blocknum);
 	}
 
 	memset(block->ptr, 0, cache->block_size);
-	block->is_dirty = true;
+	set_dirty(cache, shard, block);
 	err = 0;
 exit:
+	mutex_release(&shard->lock);
 	return (err);
 }
 
+/* write dirty blocks back in batches, with the shard unlocked while the writes are
+ * in flight. blocks are held and marked clean for the duration, anything dirtied
+ * again in the meantime goes out on a later pass. the background thread leaves
+ * blocks that are in use alone. returns the number of failed writes. */
+static int bcache_writeback_shard(struct bcache *cache, struct bcache_shard *shard, bool all)
+{
+	struct bcache_block *blocks[BCACHE_WRITEBACK_BATCH];
+	int errors = 0;
+	uint next = 0;
+
+	while (next < shard->count) {
+		uint count = 0;
+
+		mutex_acquire(&shard->lock);
+		for (; next < shard->count && count < BCACHE_WRITEBACK_BATCH; next++) {
+			struct bcache_block *block = &shard->blocks[next];
+			if (!block->valid || !block->is_dirty || (!all && block->ref_count > 0))
+				continue;
+
+			/* keep the batch in block order so neighbours merge */
+			uint i = count++;
+			while (i > 0 && blocks[i - 1]->blocknum > block->blocknum) {
+				blocks[i] = blocks[i - 1];
+				i--;
+			}
+			blocks[i] = block;
+
+			block->ref_count++;
+			block->is_dirty = false;
+			shard->dirty--;
+		}
+		mutex_release(&shard->lock);
+
+		if (count == 0)
+			break;
+
+		bcache_block_io(cache, BIO_OP_WRITE, blocks, count, cache->wb_reqs);
+
+		mutex_acquire(&shard->lock);
+		for (uint i = 0; i < count; i++) {
+			struct bcache_block *block = blocks[i];
+
+			block->ref_count--;
+			if (cache->wb_reqs[i].result != (ssize_t)cache->block_size) {
+				if (!block->is_dirty) {
+					block->is_dirty = true;
+					shard->dirty++;
+				}
+				errors++;
+				continue;
+			}
+
+			shard->stats.writes++;
+			if (!all)
+				shard->stats.writeback++;
+		}
+		mutex_release(&shard->lock);
+	}
+
+	return errors;
+}
+
+static void bcache_writeback(struct bcache *cache, bool all)
+{
+	mutex_acquire(&cache->wb_lock);
+	for (uint s = 0; s < cache->shard_count; s++) {
+		if (bcache_writeback_shard(cache, &cache->shards[s], all))
+			break;
+	}
+	mutex_release(&cache->wb_lock);
+}
+
 int bcache_flush(bcache_t priv)
 {
-	int err;
+	int err = 0;
 	struct bcache *cache = priv;
-	struct bcache_block *block;
 
-	list_for_every_entry(&cache->lru_list, block, struct bcache_block, node) {
-		if (block->is_dirty) {
-			err = flush_block(cache, block);
-			if (err)
-				goto exit;
+	mutex_acquire(&cache->wb_lock);
+	for (uint s = 0; s < cache->shard_count; s++) {
+		if (bcache_writeback_shard(cache, &cache->shards[s], true)) {
+			err = -1;
+			break;
 		}
 	}
+	mutex_release(&cache->wb_lock);
 
-	err = 0;
-exit:
 	return (err);
 }
 
 void bcache_dump(bcache_t priv, const char *name)
 {
 	uint32_t finds;
+	uint32_t dirty = 0;
 	struct bcache *cache = priv;
+	struct bcache_stats stats;
+
+	memset(&stats, 0, sizeof(stats));
+	for (uint s = 0; s < cache->shard_count; s++) {
+		struct bcache_shard *shard = &cache->shards[s];
+
+		stats.hits += shard->stats.hits;
+		stats.misses += shard->stats.misses;
+		stats.reads += shard->stats.reads;
+		stats.readahead += shard->stats.readahead;
+		stats.writes += shard->stats.writes;
+		stats.writeback += shard->stats.writeback;
+		dirty += shard->dirty;
+	}
 
-	finds = cache->stats.hits + cache->stats.misses;
+	finds = stats.hits + stats.misses;
 
-	printf("%s: hits=%u(%u%%) depth=%u misses=%u(%u%%) reads=%u writes=%u\n",
+	printf("%s: shards=%u hits=%u(%u%%) misses=%u(%u%%) reads=%u readahead=%u writes=%u writeback=%u dirty=%u\n",
 	       name,
-	       cache->stats.hits,
-	       finds ? (cache->stats.hits * 100) / finds : 0,
-	       cache->stats.hits ? cache->stats.depth / cache->stats.hits : 0,
-	       cache->stats.misses,
-	       finds ? (cache->stats.misses * 100) / finds : 0,
-	       cache->stats.reads,
-	       cache->stats.writes);
+	       cache->shard_count,
+	       stats.hits,
+	       finds ? (stats.hits * 100) / finds : 0,
+	       stats.misses,
+	       finds ? (stats.misses * 100) / finds : 0,
+	       stats.reads,
+	       stats.readahead,
+	       stats.writes,
+	       stats.writeback,
+	       dirty);
 }
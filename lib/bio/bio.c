@@ -29,7 +29,10 @@
 #include <list.h>
 #include <pow2.h>
 #include <lib/bio.h>
+#include <kernel/debug.h>
 #include <kernel/mutex.h>
+#include <kernel/event.h>
+#include <kernel/spinlock.h>
 #include <lk/init.h>
 
 #define LOCAL_TRACE 0
@@ -277,6 +280,308 @@ uint bio_trim_block_range(const bdev_t *dev, bnum_t block, uint count)
 	return count;
 }
 
+/*
+ * request queue
+ *
+ * Requests are remapped down to the device that owns the queue (subdevices
+ * just offset into their parent), then either handed straight to the driver or
+ * parked on the pending list while the device is plugged or has queue_depth
+ * requests outstanding. A request that lands on the pending list can be merged
+ * into the most recently queued one if they're the same operation and their
+ * block ranges are adjacent. Only the tail is considered so nothing gets
+ * reordered around an overlapping request.
+ */
+static bdev_t *bio_queue_dev(bdev_t *dev)
+{
+	while (dev->is_subdev)
+		dev = ((subdev_t *)dev)->parent;
+
+	return dev;
+}
+
+void bio_request_init(bio_request_t *req, uint op, bnum_t block, uint count, void *buf,
+                      void (*callback)(bio_request_t *), void *cookie)
+{
+	list_clear_node(&req->node);
+	req->dev = NULL;
+	req->op = op;
+	req->block = block;
+	req->count = count;
+	req->buf = buf;
+	req->callback = callback;
+	req->cookie = cookie;
+	req->result = 0;
+	req->merge_next = NULL;
+	req->merge_blocks = count;
+	req->merge_segments = 1;
+}
+
+/* try to fold req into the last pending request, called with the queue locked */
+static bool bio_try_merge(bdev_t *dev, bio_request_t *req)
+{
+	if (req->op != BIO_OP_READ && req->op != BIO_OP_WRITE)
+		return false;
+
+	bio_request_t *tail = list_peek_tail_type(&dev->queue.pending, bio_request_t, node);
+	if (!tail || tail->op != req->op)
+		return false;
+
+	if (dev->max_request_blocks && tail->merge_blocks + req->count > dev->max_request_blocks)
+		return false;
+	if (dev->max_segments && tail->merge_segments + 1 > dev->max_segments)
+		return false;
+
+	if (tail->block + tail->merge_blocks == req->block) {
+		/* back merge, tack it on the end of the chain */
+		bio_request_t *last = tail;
+		while (last->merge_next)
+			last = last->merge_next;
+		last->merge_next = req;
+		tail->merge_blocks += req->count;
+		tail->merge_segments++;
+	} else if (req->block + req->count == tail->block) {
+		/* front merge, the new request becomes the head of the chain */
+		req->merge_next = tail;
+		req->merge_blocks = tail->merge_blocks + req->count;
+		req->merge_segments = tail->merge_segments + 1;
+		list_add_before(&tail->node, &req->node);
+		list_delete(&tail->node);
+	} else {
+		return false;
+	}
+
+	dev->queue.merged++;
+	return true;
+}
+
+/* run a request chain through the synchronous block hooks */
+static void bio_default_submit(bdev_t *dev, bio_request_t *req)
+{
+	ssize_t result = 0;
+
+	switch (req->op) {
+		case BIO_OP_READ:
+		case BIO_OP_WRITE:
+			for (bio_request_t *r = req; r; ) {
+				/* one call for each run of requests with contiguous buffers */
+				uint8_t *buf = r->buf;
+				bnum_t block = r->block;
+				uint count = r->count;
+				for (r = r->merge_next; r && r->buf == buf + ((size_t)count << dev->block_shift); r = r->merge_next)
+					count += r->count;
+
+				ssize_t err;
+				if (req->op == BIO_OP_READ)
+					err = dev->read_block(dev, buf, block, count);
+				else
+					err = dev->write_block(dev, buf, block, count);
+				if (err < 0) {
+					result = err;
+					break;
+				}
+				result += err;
+				if ((size_t)err < ((size_t)count << dev->block_shift))
+					break;
+			}
+			break;
+		case BIO_OP_DISCARD:
+			/* the default erase writes zeros through the queue, which would recurse */
+			if (dev->erase == bio_default_erase) {
+				result = ERR_NOT_SUPPORTED;
+				break;
+			}
+			result = dev->erase(dev, (off_t)req->block << dev->block_shift,
+			                    (size_t)req->count << dev->block_shift);
+			break;
+		case BIO_OP_FLUSH:
+			/* synchronous devices don't cache writes */
+			break;
+		default:
+			result = ERR_NOT_SUPPORTED;
+	}
+
+	bio_complete_request(req, result);
+}
+
+/* hand pending requests to the driver until it's full. only one thread at a time
+ * runs this per device, anyone else who finds it busy leaves their request for it. */
+static void bio_dispatch(bdev_t *dev)
+{
+	struct bio_queue *q = &dev->queue;
+	spin_lock_saved_state_t state;
+
+	spin_lock_irqsave(&q->lock, state);
+	if (q->dispatching) {
+		spin_unlock_irqrestore(&q->lock, state);
+		return;
+	}
+	q->dispatching = true;
+
+	while (!q->plugged && q->inflight < dev->queue_depth) {
+		bio_request_t *req = list_peek_head_type(&q->pending, bio_request_t, node);
+		if (!req)
+			break;
+
+		/* a flush has to cover everything issued before it, let the driver drain first */
+		if (req->op == BIO_OP_FLUSH && q->inflight > 0)
+			break;
+
+		list_delete(&req->node);
+		q->inflight++;
+		q->dispatched++;
+		spin_unlock_irqrestore(&q->lock, state);
+
+		if (dev->submit) {
+			status_t err = dev->submit(dev, req);
+			if (err < 0)
+				bio_complete_request(req, err);
+		} else {
+			bio_default_submit(dev, req);
+		}
+
+		spin_lock_irqsave(&q->lock, state);
+	}
+
+	q->dispatching = false;
+	spin_unlock_irqrestore(&q->lock, state);
+}
+
+void bio_submit_request(bdev_t *dev, bio_request_t *req)
+{
+	LTRACEF("dev '%s', req %p, op %u, block %u, count %u\n", dev->name, req, req->op, req->block, req->count);
+
+	DEBUG_ASSERT(dev->ref > 0);
+	DEBUG_ASSERT(req->callback);
+
+	/* range check */
+	if (req->op != BIO_OP_FLUSH) {
+		req->count = bio_trim_block_range(dev, req->block, req->count);
+		req->merge_blocks = req->count;
+	}
+
+	/* pass it down to the device with the queue */
+	while (dev->is_subdev) {
+		subdev_t *subdev = (subdev_t *)dev;
+
+		if (req->op != BIO_OP_FLUSH)
+			req->block += subdev->offset;
+		dev = subdev->parent;
+	}
+	req->dev = dev;
+
+	KEVLOG_BIO_SUBMIT(req, req->op);
+
+	struct bio_queue *q = &dev->queue;
+	spin_lock_saved_state_t state;
+
+	spin_lock_irqsave(&q->lock, state);
+	q->submitted++;
+
+	if (req->count == 0 && req->op != BIO_OP_FLUSH) {
+		q->inflight++;
+		spin_unlock_irqrestore(&q->lock, state);
+		bio_complete_request(req, 0);
+		return;
+	}
+
+	/* synchronous drivers can run in the caller's context, which keeps
+	 * concurrent callers from serializing behind the dispatch loop */
+	if (!dev->submit && !q->plugged) {
+		q->inflight++;
+		q->dispatched++;
+		spin_unlock_irqrestore(&q->lock, state);
+		bio_default_submit(dev, req);
+		return;
+	}
+
+	if (!bio_try_merge(dev, req))
+		list_add_tail(&q->pending, &req->node);
+	spin_unlock_irqrestore(&q->lock, state);
+
+	bio_dispatch(dev);
+}
+
+void bio_complete_request(bio_request_t *req, ssize_t result)
+{
+	bdev_t *dev = req->dev;
+	struct bio_queue *q = &dev->queue;
+
+	LTRACEF("dev '%s', req %p, result %ld\n", dev->name, req, (long)result);
+	KEVLOG_BIO_COMPLETE(req, result);
+
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&q->lock, state);
+	DEBUG_ASSERT(q->inflight > 0);
+	q->inflight--;
+	spin_unlock_irqrestore(&q->lock, state);
+
+	/* split the result across the merged requests, in block order */
+	while (req) {
+		bio_request_t *next = req->merge_next;
+		size_t len = (size_t)req->count << dev->block_shift;
+
+		if (result < 0) {
+			req->result = result;
+		} else {
+			req->result = MIN((size_t)result, len);
+			result -= req->result;
+		}
+		req->merge_next = NULL;
+		req->merge_blocks = req->count;
+		req->merge_segments = 1;
+
+		/* the request may be gone once the callback returns */
+		req->callback(req);
+		req = next;
+	}
+
+	bio_dispatch(dev);
+}
+
+void bio_plug(bdev_t *dev)
+{
+	dev = bio_queue_dev(dev);
+
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&dev->queue.lock, state);
+	dev->queue.plugged++;
+	spin_unlock_irqrestore(&dev->queue.lock, state);
+}
+
+void bio_unplug(bdev_t *dev)
+{
+	dev = bio_queue_dev(dev);
+
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&dev->queue.lock, state);
+	DEBUG_ASSERT(dev->queue.plugged > 0);
+	dev->queue.plugged--;
+	spin_unlock_irqrestore(&dev->queue.lock, state);
+
+	bio_dispatch(dev);
+}
+
+static void bio_sync_callback(bio_request_t *req)
+{
+	event_signal((event_t *)req->cookie, false);
+}
+
+/* submit a request and wait for it, the path all of the blocking block calls take */
+ssize_t bio_sync_request(bdev_t *dev, uint op, bnum_t block, uint count, void *buf)
+{
+	event_t event;
+	bio_request_t req;
+
+	event_init(&event, false, 0);
+	bio_request_init(&req, op, block, count, buf, bio_sync_callback, &event);
+
+	bio_submit_request(dev, &req);
+	event_wait(&event);
+	event_destroy(&event);
+
+	return req.result;
+}
+
 bdev_t *bio_open(const char *name)
 {
 	bdev_t *bdev = NULL;
@@ -347,7 +652,11 @@ ssize_t bio_read(bdev_t *dev, void *buf, off_t offset, size_t len)
 	if (len == 0)
 		return 0;
 
-	return dev->read(dev, buf, offset, len);
+	KEVLOG_BIO_READ_BEGIN(dev, len);
+	ssize_t ret = dev->read(dev, buf, offset, len);
+	KEVLOG_BIO_READ_END(dev, ret);
+
+	return ret;
 }
 
 ssize_t bio_read_block(bdev_t *dev, void *buf, bnum_t block, uint count)
@@ -361,7 +670,7 @@ ssize_t bio_read_block(bdev_t *dev, void *buf, bnum_t block, uint count)
 	if (count == 0)
 		return 0;
 
-	return dev->read_block(dev, buf, block, count);
+	return bio_sync_request(dev, BIO_OP_READ, block, count, buf);
 }
 
 ssize_t bio_write(bdev_t *dev, const void *buf, off_t offset, size_t len)
@@ -375,7 +684,11 @@ ssize_t bio_write(bdev_t *dev, const void *buf, off_t offset, size_t len)
 	if (len == 0)
 		return 0;
 
-	return dev->write(dev, buf, offset, len);
+	KEVLOG_BIO_WRITE_BEGIN(dev, len);
+	ssize_t ret = dev->write(dev, buf, offset, len);
+	KEVLOG_BIO_WRITE_END(dev, ret);
+
+	return ret;
 }
 
 ssize_t bio_write_block(bdev_t *dev, const void *buf, bnum_t block, uint count)
@@ -389,7 +702,7 @@ ssize_t bio_write_block(bdev_t *dev, const void *buf, bnum_t block, uint count)
 	if (count == 0)
 		return 0;
 
-	return dev->write_block(dev, buf, block, count);
+	return bio_sync_request(dev, BIO_OP_WRITE, block, count, (void *)buf);
 }
 
 ssize_t bio_erase(bdev_t *dev, off_t offset, size_t len)
@@ -406,6 +719,15 @@ ssize_t bio_erase(bdev_t *dev, off_t offset, size_t len)
 	return dev->erase(dev, offset, len);
 }
 
+ssize_t bio_flush(bdev_t *dev)
+{
+	LTRACEF("dev '%s'\n", dev->name);
+
+	DEBUG_ASSERT(dev->ref > 0);
+
+	return bio_sync_request(dev, BIO_OP_FLUSH, 0, 0, NULL);
+}
+
 int bio_ioctl(bdev_t *dev, int request, void *argp)
 {
 	LTRACEF("dev '%s', request %08x, argp %p\n", dev->name, request, argp);
@@ -443,6 +765,16 @@ void bio_initialize_bdev(bdev_t *dev, const char *name, size_t block_size, bnum_
 	dev->write_block = bio_default_write_block;
 	dev->erase = bio_default_erase;
 	dev->close = NULL;
+
+	/* no async driver, requests are handed to the block hooks one at a time */
+	dev->submit = NULL;
+	dev->queue_depth = 1;
+	dev->max_request_blocks = 0;
+	dev->max_segments = 0;
+
+	memset(&dev->queue, 0, sizeof(dev->queue));
+	spin_lock_init(&dev->queue.lock);
+	list_initialize(&dev->queue.pending);
 }
 
 void bio_register_device(bdev_t *dev)
@@ -479,6 +811,11 @@ void bio_dump_devices(void)
 	mutex_acquire(&bdevs->lock);
 	list_for_every_entry(&bdevs->list, entry, bdev_t, node) {
 		printf("\t%s, size %lld, bsize %zd, ref %d, label %s, subdev=%d\n", entry->name, entry->size, entry->block_size, entry->ref, entry->label, entry->is_subdev);
+		if (!entry->is_subdev) {
+			printf("\t\tqueue depth %u, inflight %u, submitted %lu, merged %lu, dispatched %lu\n",
+			       entry->queue_depth, entry->queue.inflight, entry->queue.submitted,
+			       entry->queue.merged, entry->queue.dispatched);
+		}
 	}
 	mutex_release(&bdevs->lock);
 }
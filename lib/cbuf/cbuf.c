@@ -106,8 +106,8 @@ size_t cbuf_write(cbuf_t *cbuf, const void *_buf, size_t len, bool canreschedule
     spin_unlock_irqrestore(&cbuf->lock, state);
 
     // XXX convert to only rescheduling if 
-    if (canreschedule)
-        thread_preempt();
+	if (canreschedule)
+		thread_preempt();
 
 	return pos;
 }
@@ -163,8 +163,8 @@ retry:
     spin_unlock_irqrestore(&cbuf->lock, state);
 
     // we apparently blocked but raced with another thread and found no data, retry
-    if (block && ret == 0)
-        goto retry;
+	if (block && ret == 0)
+		goto retry;
 
 	return ret;
 }
@@ -221,8 +221,8 @@ retry:
 
     spin_unlock_irqrestore(&cbuf->lock, state);
 
-    if (block && ret == 0)
-        goto retry;
+	if (block && ret == 0)
+		goto retry;
 
 	return ret;
 }
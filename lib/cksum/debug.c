@@ -28,10 +28,13 @@
 #include <stdio.h>
 #include <kernel/thread.h>
 #include <platform.h>
+#include <string.h>
 #include <lib/cksum.h>
 
 #include <lib/console.h>
 
+#include "inet_cksum_priv.h"
+
 static int cmd_crc16(int argc, const cmd_args *argv);
 static int cmd_crc32(int argc, const cmd_args *argv);
 static int cmd_adler32(int argc, const cmd_args *argv);
@@ -93,6 +96,60 @@ static int cmd_adler32(int argc, const cmd_args *argv)
 	return 0;
 }
 
+static void cksum_bench_report(const char *name, const char *op, lk_bigtime_t t, uint64_t bytes, uint16_t sum)
+{
+	if (t == 0)
+		t = 1;
+
+	/* bytes per usec is MB/s */
+	uint64_t mbps = bytes / t;
+
+	printf("inet %-8s %-5s: %llu usecs, %llu.%02llu GB/s (sum 0x%04hx)\n", name, op, t,
+	       mbps / 1000, (mbps % 1000) / 10, sum);
+}
+
+/* the internet checksum, each implementation summing and copy-summing, against memcpy */
+static void cksum_bench_inet(uint8_t *buf, size_t size, int iter)
+{
+	uint8_t *dst = malloc(size);
+	if (!dst)
+		return;
+
+	for (size_t i = 0; i < size; i++)
+		buf[i] = i * 7;
+
+	uint64_t bytes = (uint64_t)size * iter;
+	lk_bigtime_t t;
+
+	t = current_time_hires();
+	for (int i = 0; i < iter; i++) {
+		memcpy(dst, buf, size);
+	}
+	t = current_time_hires() - t;
+	cksum_bench_report("memcpy", "copy", t, bytes, 0);
+
+	for (size_t n = 0; n < inet_cksum_impl_count; n++) {
+		const struct inet_cksum_impl *impl = &inet_cksum_impls[n];
+		uint32_t sum = 0;
+
+		t = current_time_hires();
+		for (int i = 0; i < iter; i++) {
+			sum = impl->partial(buf, size, 0);
+		}
+		t = current_time_hires() - t;
+		cksum_bench_report(impl->name, "sum", t, bytes, inet_cksum_fold(sum));
+
+		t = current_time_hires();
+		for (int i = 0; i < iter; i++) {
+			sum = impl->copy(dst, buf, size, 0);
+		}
+		t = current_time_hires() - t;
+		cksum_bench_report(impl->name, "copy", t, bytes, inet_cksum_fold(sum));
+	}
+
+	free(dst);
+}
+
 static int cmd_cksum_bench(int argc, const cmd_args *argv)
 {
 #define BUFSIZE 0x1000
@@ -122,6 +179,9 @@ static int cmd_cksum_bench(int argc, const cmd_args *argv)
 	t = current_time_hires() - t;
 
 	printf("took %llu usecs to adler32 %d bytes (%lld bytes/sec)\n", t, BUFSIZE * ITER, (BUFSIZE * ITER) * 1000000ULL / t);
+	thread_sleep(500);
+
+	cksum_bench_inet(buf, BUFSIZE, ITER);
 
 	free(buf);
 	return 0;
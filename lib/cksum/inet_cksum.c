@@ -0,0 +1,349 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <compiler.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <arch/ops.h>
+#include <kernel/spinlock.h>
+#include <lib/cksum.h>
+
+#include "inet_cksum_priv.h"
+
+#if ARCH_ARM64
+/* the kernel is built without fp, so the loops are in assembly (arm64/inet_cksum.S) */
+uint64_t inet_cksum_neon_sum(const void *src, size_t blocks);
+uint64_t inet_cksum_neon_copy(void *dst, const void *src, size_t blocks);
+#define INET_CKSUM_SIMD "neon"
+#elif ARCH_ARM && ARM_WITH_NEON
+#include <arm_neon.h>
+#define INET_CKSUM_SIMD "neon"
+#elif ARCH_X86_64
+#include <emmintrin.h>
+#define INET_CKSUM_SIMD "sse2"
+#endif
+
+/* below this the vector setup isn't worth it */
+#ifndef INET_CKSUM_SIMD_MIN
+#define INET_CKSUM_SIMD_MIN 256
+#endif
+
+/* the most summed per trip into the vector loop, bounding the time spent with interrupts off */
+#ifndef INET_CKSUM_SIMD_CHUNK
+#define INET_CKSUM_SIMD_CHUNK 4096
+#endif
+
+/* whole 64 byte blocks, and few enough of them that the 32 bit lanes can't overflow */
+STATIC_ASSERT((INET_CKSUM_SIMD_CHUNK % 64) == 0 && INET_CKSUM_SIMD_CHUNK <= 65536);
+
+static inline uint32_t fold64(uint64_t acc)
+{
+	acc = (acc & 0xffffffff) + (acc >> 32);
+	acc = (acc & 0xffffffff) + (acc >> 32);
+	return acc;
+}
+
+/* a lone byte at position 0 or 1 of a 16 bit word */
+static inline uint32_t byte_word(uint8_t b, int pos)
+{
+	union {
+		uint8_t b[2];
+		uint16_t w;
+	} u = { .b = { 0, 0 } };
+
+	u.b[pos] = b;
+	return u.w;
+}
+
+/* 32 bit loads into a 64 bit accumulator, so there are no carries to chase in the loop */
+static uint32_t inet_cksum_partial_generic(const void *_buf, size_t len, uint32_t sum)
+{
+	const uint8_t *buf = _buf;
+	uint64_t acc = 0;
+
+	if (len == 0)
+		return sum;
+
+	/* on an odd address every byte is summed one place over and the result swapped back */
+	bool odd = (uintptr_t)buf & 1;
+	if (odd) {
+		acc += byte_word(*buf++, 1);
+		len--;
+	}
+	if (((uintptr_t)buf & 2) && len >= 2) {
+		acc += *(const uint16_t *)buf;
+		buf += 2;
+		len -= 2;
+	}
+
+	const uint32_t *p = (const uint32_t *)buf;
+	while (len >= 32) {
+		acc += (uint64_t)p[0] + p[1] + p[2] + p[3];
+		acc += (uint64_t)p[4] + p[5] + p[6] + p[7];
+		p += 8;
+		len -= 32;
+	}
+	while (len >= 4) {
+		acc += *p++;
+		len -= 4;
+	}
+
+	buf = (const uint8_t *)p;
+	if (len >= 2) {
+		acc += *(const uint16_t *)buf;
+		buf += 2;
+		len -= 2;
+	}
+	if (len)
+		acc += byte_word(*buf, 0);
+
+	return inet_cksum_block_add(sum, fold64(acc), odd);
+}
+
+static uint32_t inet_cksum_copy_generic(void *_dst, const void *_src, size_t len, uint32_t sum)
+{
+	uint8_t *dst = _dst;
+	const uint8_t *src = _src;
+
+	/* the word loop needs both sides aligned alike, otherwise copy and sum separately */
+	if (((uintptr_t)dst ^ (uintptr_t)src) & 3) {
+		memcpy(dst, src, len);
+		return inet_cksum_partial_generic(dst, len, sum);
+	}
+
+	size_t head = MIN(len, (size_t)(-(uintptr_t)src & 3));
+	memcpy(dst, src, head);
+	sum = inet_cksum_partial_generic(src, head, sum);
+
+	const uint32_t *s = (const uint32_t *)(src + head);
+	uint32_t *d = (uint32_t *)(dst + head);
+	size_t words = (len - head) / 4;
+	uint64_t acc = 0;
+	size_t i = 0;
+	for (; i + 4 <= words; i += 4) {
+		uint32_t w0 = s[i], w1 = s[i + 1], w2 = s[i + 2], w3 = s[i + 3];
+		d[i] = w0;
+		d[i + 1] = w1;
+		d[i + 2] = w2;
+		d[i + 3] = w3;
+		acc += (uint64_t)w0 + w1 + w2 + w3;
+	}
+	for (; i < words; i++) {
+		d[i] = s[i];
+		acc += s[i];
+	}
+	sum = inet_cksum_block_add(sum, fold64(acc), head);
+
+	size_t done = head + words * 4;
+	memcpy(dst + done, src + done, len - done);
+	return inet_cksum_block_add(sum, inet_cksum_partial_generic(src + done, len - done, 0), done);
+}
+
+#ifdef INET_CKSUM_SIMD
+
+/*
+ * Sum (and optionally copy) len bytes 64 at a time, leaving the tail to the generic
+ * code. The data is taken as words from its first byte whatever its alignment, so
+ * there is no odd address swap. The 16 bit words are widened into 32 bit lanes,
+ * which a chunk can't overflow, and those into 64 bit lanes once per chunk.
+ */
+static inline __ALWAYS_INLINE uint32_t simd_sum(uint8_t *dst, const uint8_t *src, size_t len,
+		uint32_t sum, bool copy)
+{
+	size_t blocks = len / 64;
+	uint64_t acc;
+
+#if ARCH_ARM64
+	if (copy)
+		acc = inet_cksum_neon_copy(dst, src, blocks);
+	else
+		acc = inet_cksum_neon_sum(src, blocks);
+	src += blocks * 64;
+	dst += blocks * 64;
+#elif ARCH_X86_64
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i mask = _mm_set1_epi32(0xffff);
+	__m128i lo = zero, hi = zero;
+
+	for (size_t i = 0; i < blocks; i++) {
+		for (int j = 0; j < 4; j++) {
+			__m128i v = _mm_loadu_si128((const __m128i *)src + j);
+			if (copy)
+				_mm_storeu_si128((__m128i *)dst + j, v);
+			lo = _mm_add_epi32(lo, _mm_and_si128(v, mask));
+			hi = _mm_add_epi32(hi, _mm_srli_epi32(v, 16));
+		}
+		src += 64;
+		dst += 64;
+	}
+
+	__m128i acc64 = _mm_add_epi64(_mm_unpacklo_epi32(lo, zero), _mm_unpackhi_epi32(lo, zero));
+	acc64 = _mm_add_epi64(acc64, _mm_unpacklo_epi32(hi, zero));
+	acc64 = _mm_add_epi64(acc64, _mm_unpackhi_epi32(hi, zero));
+
+	uint64_t lanes[2];
+	_mm_storeu_si128((__m128i *)lanes, acc64);
+	acc = lanes[0] + lanes[1];
+#else
+	uint32x4_t acc32 = vdupq_n_u32(0);
+
+	for (size_t i = 0; i < blocks; i++) {
+		uint8x16_t v0 = vld1q_u8(src);
+		uint8x16_t v1 = vld1q_u8(src + 16);
+		uint8x16_t v2 = vld1q_u8(src + 32);
+		uint8x16_t v3 = vld1q_u8(src + 48);
+		if (copy) {
+			vst1q_u8(dst, v0);
+			vst1q_u8(dst + 16, v1);
+			vst1q_u8(dst + 32, v2);
+			vst1q_u8(dst + 48, v3);
+		}
+		acc32 = vpadalq_u16(acc32, vreinterpretq_u16_u8(v0));
+		acc32 = vpadalq_u16(acc32, vreinterpretq_u16_u8(v1));
+		acc32 = vpadalq_u16(acc32, vreinterpretq_u16_u8(v2));
+		acc32 = vpadalq_u16(acc32, vreinterpretq_u16_u8(v3));
+		src += 64;
+		dst += 64;
+	}
+
+	uint64x2_t acc64 = vpaddlq_u32(acc32);
+	acc = vgetq_lane_u64(acc64, 0) + vgetq_lane_u64(acc64, 1);
+#endif
+
+	sum = inet_cksum_add(sum, fold64(acc));
+
+	len -= blocks * 64;
+	if (copy) {
+		memcpy(dst, src, len);
+		return inet_cksum_partial_generic(dst, len, sum);
+	}
+	return inet_cksum_partial_generic(src, len, sum);
+}
+
+/*
+ * The arm fpu is switched lazily per thread but faults in an irq handler. Elsewhere the
+ * vector registers aren't saved across a context switch, so the loops run with
+ * interrupts off a chunk at a time. Nothing else on arm64 touches them, so it is fine
+ * in any context there; x86-64 code does, so stay out of irq handlers and the like.
+ */
+static inline bool simd_usable(void)
+{
+#if ARCH_ARM
+	return !arch_in_int_handler();
+#elif ARCH_ARM64
+	return true;
+#else
+	return !arch_ints_disabled();
+#endif
+}
+
+static inline spin_lock_saved_state_t simd_begin(void)
+{
+	spin_lock_saved_state_t state = 0;
+#if !ARCH_ARM
+	arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+#endif
+	return state;
+}
+
+static inline void simd_end(spin_lock_saved_state_t state)
+{
+#if !ARCH_ARM
+	arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+#endif
+}
+
+static uint32_t inet_cksum_partial_simd(const void *_buf, size_t len, uint32_t sum)
+{
+	const uint8_t *buf = _buf;
+
+	if (!simd_usable())
+		return inet_cksum_partial_generic(buf, len, sum);
+
+	/* chunks are a multiple of 64 bytes, so every one starts on an even offset */
+	while (len > 0) {
+		size_t chunk = MIN(len, INET_CKSUM_SIMD_CHUNK);
+
+		spin_lock_saved_state_t state = simd_begin();
+		sum = simd_sum(NULL, buf, chunk, sum, false);
+		simd_end(state);
+
+		buf += chunk;
+		len -= chunk;
+	}
+
+	return sum;
+}
+
+static uint32_t inet_cksum_copy_simd(void *_dst, const void *_src, size_t len, uint32_t sum)
+{
+	uint8_t *dst = _dst;
+	const uint8_t *src = _src;
+
+	if (!simd_usable())
+		return inet_cksum_copy_generic(dst, src, len, sum);
+
+	while (len > 0) {
+		size_t chunk = MIN(len, INET_CKSUM_SIMD_CHUNK);
+
+		spin_lock_saved_state_t state = simd_begin();
+		sum = simd_sum(dst, src, chunk, sum, true);
+		simd_end(state);
+
+		dst += chunk;
+		src += chunk;
+		len -= chunk;
+	}
+
+	return sum;
+}
+
+#endif
+
+const struct inet_cksum_impl inet_cksum_impls[] = {
+	{ "generic", &inet_cksum_partial_generic, &inet_cksum_copy_generic },
+#ifdef INET_CKSUM_SIMD
+	{ INET_CKSUM_SIMD, &inet_cksum_partial_simd, &inet_cksum_copy_simd },
+#endif
+};
+
+const size_t inet_cksum_impl_count = countof(inet_cksum_impls);
+
+uint32_t inet_cksum_partial(const void *buf, size_t len, uint32_t sum)
+{
+#ifdef INET_CKSUM_SIMD
+	if (len >= INET_CKSUM_SIMD_MIN)
+		return inet_cksum_partial_simd(buf, len, sum);
+#endif
+	return inet_cksum_partial_generic(buf, len, sum);
+}
+
+uint32_t inet_cksum_copy(void *dst, const void *src, size_t len, uint32_t sum)
+{
+#ifdef INET_CKSUM_SIMD
+	if (len >= INET_CKSUM_SIMD_MIN)
+		return inet_cksum_copy_simd(dst, src, len, sum);
+#endif
+	return inet_cksum_copy_generic(dst, src, len, sum);
+}
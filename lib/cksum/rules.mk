@@ -10,7 +10,13 @@ endif
 
 MODULE_SRCS += \
 	$(LOCAL_DIR)/crc16.c \
-	$(LOCAL_DIR)/debug.c
+	$(LOCAL_DIR)/debug.c \
+	$(LOCAL_DIR)/inet_cksum.c
+
+ifeq ($(ARCH),arm64)
+MODULE_SRCS += \
+	$(LOCAL_DIR)/arm64/inet_cksum.S
+endif
 
 MODULE_CFLAGS += -Wno-strict-prototypes
 
@@ -46,7 +46,7 @@ static int ext2_dir_lookup(ext2_t *ext2, struct ext2_inode *dir_inode, const cha
 	file_blocknum = 0;
 	for (;;) {
 		/* read in the offset */
-		err = ext2_read_inode(ext2, dir_inode, buf, file_blocknum * EXT2_BLOCK_SIZE(ext2->sb), EXT2_BLOCK_SIZE(ext2->sb));
+		err = ext2_read_inode(ext2, dir_inode, NULL, buf, file_blocknum * EXT2_BLOCK_SIZE(ext2->sb), EXT2_BLOCK_SIZE(ext2->sb));
 		if (err <= 0) {
 			free(buf);
 			return -1;
@@ -65,7 +65,9 @@ static int ext2_dir_lookup(ext2_t *ext2, struct ext2_inode *dir_inode, const cha
 			if (LE16(ent->rec_len) == 0)
 				break;
 
-			if (ent->name_len == namelen && memcmp(name, ent->name, ent->name_len) == 0) {
+			/* skip unused entries, including ext4's checksum tails */
+			if (LE32(ent->inode) != 0 &&
+			        ent->name_len == namelen && memcmp(name, ent->name, ent->name_len) == 0) {
 				// match
 				*inum = LE32(ent->inode);
 				LTRACEF("match: inode %d\n", *inum);
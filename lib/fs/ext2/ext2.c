@@ -24,6 +24,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <debug.h>
+#include <err.h>
 #include <trace.h>
 #include <lib/fs/ext2.h>
 #include "ext2_priv.h"
@@ -71,6 +72,10 @@ static void endian_swap_superblock(struct ext2_super_block *sb)
 	LE32SWAP(sb->s_last_orphan);
 	LE32SWAP(sb->s_default_mount_opts);
 	LE32SWAP(sb->s_first_meta_bg);
+
+	/* ext4 */
+	LE16SWAP(sb->s_desc_size);
+	LE32SWAP(sb->s_blocks_count_hi);
 }
 
 static void endian_swap_inode(struct ext2_inode *inode)
@@ -108,13 +113,48 @@ static void endian_swap_group_desc(struct ext2_group_desc *gd)
 	LE16SWAP(gd->bg_used_dirs_count);
 }
 
+static bool is_power_of(uint32_t n, uint32_t base)
+{
+	while (n > 1 && n % base == 0)
+		n /= base;
+	return n == 1;
+}
+
+/* does the group carry a backup of the superblock? with sparse_super only groups
+ * 0, 1 and powers of 3, 5 and 7 do. */
+static bool ext2_group_has_super(ext2_t *ext2, uint32_t group)
+{
+	if (group <= 1 || !(ext2->sb.s_feature_ro_compat & EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER))
+		return true;
+
+	return is_power_of(group, 3) || is_power_of(group, 5) || is_power_of(group, 7);
+}
+
+/* where the nth block of group descriptors lives. normally the table is contiguous after
+ * the superblock, with meta_bg each block past s_first_meta_bg is at the start of the first
+ * group of the meta group it describes, after that group's superblock backup. */
+static blocknum_t ext2_group_desc_block(ext2_t *ext2, size_t desc_size, uint32_t n)
+{
+	if (!(ext2->sb.s_feature_incompat & EXT2_FEATURE_INCOMPAT_META_BG) ||
+	        n < ext2->sb.s_first_meta_bg)
+		return ext2->sb.s_first_data_block + 1 + n;
+
+	uint32_t group = n * (EXT2_BLOCK_SIZE(ext2->sb) / desc_size);
+
+	return ext2->sb.s_first_data_block + group * ext2->sb.s_blocks_per_group +
+	       (ext2_group_has_super(ext2, group) ? 1 : 0);
+}
+
 int ext2_mount(bdev_t *dev, fscookie *cookie)
 {
 	int err;
+	uint8_t *desc = NULL;
 
 	LTRACEF("dev %p\n", dev);
 
-	ext2_t *ext2 = malloc(sizeof(ext2_t));
+	ext2_t *ext2 = calloc(1, sizeof(ext2_t));
+	if (!ext2)
+		return ERR_NO_MEMORY;
 	ext2->dev = dev;
 
 	err = bio_read(dev, &ext2->sb, 1024, sizeof(struct ext2_super_block));
@@ -126,11 +166,12 @@ int ext2_mount(bdev_t *dev, fscookie *cookie)
 	/* see if the superblock is good */
 	if (ext2->sb.s_magic != EXT2_SUPER_MAGIC) {
 		err = -1;
-		return err;
+		goto err;
 	}
 
 	/* calculate group count, rounded up */
-	ext2->s_group_count = (ext2->sb.s_blocks_count + ext2->sb.s_blocks_per_group - 1) / ext2->sb.s_blocks_per_group;
+	ext2->s_group_count = (ext2->sb.s_blocks_count - ext2->sb.s_first_data_block +
+	                       ext2->sb.s_blocks_per_group - 1) / ext2->sb.s_blocks_per_group;
 
 	/* print some info */
 	LTRACEF("rev level %d\n", ext2->sb.s_rev_level);
@@ -138,6 +179,7 @@ int ext2_mount(bdev_t *dev, fscookie *cookie)
 	LTRACEF("incompat features 0x%x\n", ext2->sb.s_feature_incompat);
 	LTRACEF("ro compat features 0x%x\n", ext2->sb.s_feature_ro_compat);
 	LTRACEF("block size %d\n", EXT2_BLOCK_SIZE(ext2->sb));
+	LTRACEF("group desc size %d\n", EXT2_DESC_SIZE(ext2->sb));
 	LTRACEF("inode size %d\n", EXT2_INODE_SIZE(ext2->sb));
 	LTRACEF("block count %d\n", ext2->sb.s_blocks_count);
 	LTRACEF("blocks per group %d\n", ext2->sb.s_blocks_per_group);
@@ -147,28 +189,63 @@ int ext2_mount(bdev_t *dev, fscookie *cookie)
 	/* we only support dynamic revs */
 	if (ext2->sb.s_rev_level > EXT2_DYNAMIC_REV) {
 		err = -2;
-		return err;
+		goto err;
 	}
 
-	/* make sure it doesn't have any ro features we don't support */
-	if (ext2->sb.s_feature_ro_compat & ~(EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER|EXT2_FEATURE_RO_COMPAT_LARGE_FILE)) {
+	/* make sure it doesn't have any features we don't support. ro compat features
+	 * only matter to writers, so they're all fine. a journal that needs replaying
+	 * (RECOVER) is refused, we'd see stale metadata without it. */
+	if (ext2->sb.s_feature_incompat & EXT2_FEATURE_INCOMPAT_UNSUPPORTED) {
 		err = -3;
-		return err;
+		goto err;
 	}
 
-	/* read in all the group descriptors */
+	/* 64bit file systems have bigger group descriptors. we still only handle block
+	 * numbers that fit in 32 bits. */
+	size_t desc_size = EXT2_DESC_SIZE(ext2->sb);
+	if (ext2->sb.s_feature_incompat & EXT4_FEATURE_INCOMPAT_64BIT) {
+		if (desc_size < EXT4_MIN_DESC_SIZE_64BIT || desc_size > EXT2_BLOCK_SIZE(ext2->sb) ||
+		        ext2->sb.s_blocks_count_hi != 0) {
+			err = -5;
+			goto err;
+		}
+	}
+
+	/* read in all the group descriptors a block at a time, since with meta_bg they
+	 * are scattered across the disk */
+	size_t block_size = EXT2_BLOCK_SIZE(ext2->sb);
+	uint32_t desc_per_block = block_size / desc_size;
+	uint32_t desc_blocks = (ext2->s_group_count + desc_per_block - 1) / desc_per_block;
+
+	desc = malloc(desc_blocks * block_size);
 	ext2->gd = malloc(sizeof(struct ext2_group_desc) * ext2->s_group_count);
-	err = bio_read(ext2->dev, (void *)ext2->gd,
-	               (EXT2_BLOCK_SIZE(ext2->sb) == 4096) ? 4096 : 2048,
-	               sizeof(struct ext2_group_desc) * ext2->s_group_count);
-	if (err < 0) {
-		err = -4;
-		return err;
+	if (!desc || !ext2->gd) {
+		err = ERR_NO_MEMORY;
+		goto err;
+	}
+
+	for (uint32_t n = 0; n < desc_blocks; n++) {
+		blocknum_t bnum = ext2_group_desc_block(ext2, desc_size, n);
+
+		LTRACEF("group desc block %u at %u\n", n, bnum);
+		err = bio_read(ext2->dev, desc + n * block_size, (off_t)bnum * block_size, block_size);
+		if (err < 0) {
+			err = -4;
+			goto err;
+		}
 	}
 
 	int i;
 	for (i=0; i < ext2->s_group_count; i++) {
+		memcpy(&ext2->gd[i], desc + i * desc_size, sizeof(struct ext2_group_desc));
 		endian_swap_group_desc(&ext2->gd[i]);
+
+		if (desc_size >= EXT4_MIN_DESC_SIZE_64BIT &&
+		        ((struct ext4_group_desc *)(desc + i * desc_size))->bg_inode_table_hi != 0) {
+			err = -5;
+			goto err;
+		}
+
 		LTRACEF("group %d:\n", i);
 		LTRACEF("\tblock bitmap %d\n", ext2->gd[i].bg_block_bitmap);
 		LTRACEF("\tinode bitmap %d\n", ext2->gd[i].bg_inode_bitmap);
@@ -177,6 +254,8 @@ int ext2_mount(bdev_t *dev, fscookie *cookie)
 		LTRACEF("\tfree inodes %d\n", ext2->gd[i].bg_free_inodes_count);
 		LTRACEF("\tused dirs %d\n", ext2->gd[i].bg_used_dirs_count);
 	}
+	free(desc);
+	desc = NULL;
 
 	/* initialize the block cache */
 	ext2->cache = bcache_create(ext2->dev, EXT2_BLOCK_SIZE(ext2->sb), 4);
@@ -195,6 +274,10 @@ int ext2_mount(bdev_t *dev, fscookie *cookie)
 err:
 	LTRACEF("exiting with err code %d\n", err);
 
+	if (ext2->cache)
+		bcache_destroy(ext2->cache);
+	free(desc);
+	free(ext2->gd);
 	free(ext2);
 	return err;
 }
@@ -42,16 +42,22 @@ typedef struct {
 	struct ext2_inode root_inode;
 } ext2_t;
 
-struct cache_block {
-	blocknum_t num;
-	void *ptr;
+/* private copy of the last indirect block table or extent leaf used to map file
+ * blocks, so sequential lookups don't walk the indirect chain or extent tree every time */
+struct ext2_block_map {
+	uint32_t level;     // indirection level of the table, or EXT2_MAP_EXTENT_LEAF
+	uint first;         // first file block the table covers
+	uint end;           // first file block past it
+	void *table;        // NULL if nothing is cached
 };
 
+#define EXT2_MAP_EXTENT_LEAF 0xff
+
 /* open file handle */
 typedef struct {
 	ext2_t *ext2;
 
-	struct cache_block ind_cache[3]; // cache of indirect blocks as they're scanned
+	struct ext2_block_map map;
 	struct ext2_inode inode;
 } ext2_file_t;
 
@@ -65,7 +71,7 @@ int ext2_get_block(ext2_t *ext2, void **ptr, blocknum_t bnum);
 int ext2_put_block(ext2_t *ext2, blocknum_t bnum);
 
 off_t ext2_file_len(ext2_t *ext2, struct ext2_inode *inode);
-int ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *buf, off_t offset, size_t len);
+int ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, struct ext2_block_map *map, void *buf, off_t offset, size_t len);
 int ext2_read_link(ext2_t *ext2, struct ext2_inode *inode, char *str, size_t len);
 
 /* mode stuff */
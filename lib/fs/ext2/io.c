@@ -143,8 +143,10 @@ error:
 	return err;
 }
 
-/* translate a file block to a physical block */
-static blocknum_t file_block_to_fs_block(ext2_t *ext2, struct ext2_inode *inode, uint fileblock)
+/* translate a file block to a physical block. if map is passed, the final indirect
+ * table is kept in it, so the next lookup in the same table doesn't have to walk the
+ * indirect chain. */
+static blocknum_t file_block_to_fs_block(ext2_t *ext2, struct ext2_inode *inode, struct ext2_block_map *map, uint fileblock)
 {
 	int err;
 	blocknum_t block;
@@ -153,13 +155,17 @@ static blocknum_t file_block_to_fs_block(ext2_t *ext2, struct ext2_inode *inode,
 
 	uint32_t pos[4];
 	uint32_t level = 0;
-	ext2_calculate_block_pointer_pos(ext2, fileblock, &level, pos);
+	if (ext2_calculate_block_pointer_pos(ext2, fileblock, &level, pos) < 0)
+		return 0;
 
 	LTRACEF("level %d, pos 0x%x 0x%x 0x%x 0x%x\n", level, pos[0], pos[1], pos[2], pos[3]);
 
 	if (level == 0) {
 		/* direct block, just return it directly */
 		block = LE32(inode->i_block[fileblock]);
+	} else if (map && map->table && map->level == level && fileblock >= map->first && fileblock < map->end) {
+		/* same table as last time */
+		block = LE32(((blocknum_t *)map->table)[pos[level]]);
 	} else {
 		/* at least one level of indirection, get a pointer to the final indirect block table and dereference it */
 		blocknum_t *ind_table;
@@ -172,6 +178,18 @@ static blocknum_t file_block_to_fs_block(ext2_t *ext2, struct ext2_inode *inode,
 		block = LE32(ind_table[pos[level]]);
 		LTRACEF("block %u, indirect_block %u\n", block, phys_block);
 
+		/* hang on to a copy of the table */
+		if (map) {
+			if (!map->table)
+				map->table = malloc(EXT2_BLOCK_SIZE(ext2->sb));
+			if (map->table) {
+				memcpy(map->table, ind_table, EXT2_BLOCK_SIZE(ext2->sb));
+				map->level = level;
+				map->first = fileblock - pos[level];
+				map->end = map->first + EXT2_ADDR_PER_BLOCK(ext2->sb);
+			}
+		}
+
 		/* release the ref on the cache block */
 		ext2_put_block(ext2, phys_block);
 	}
@@ -181,11 +199,183 @@ static blocknum_t file_block_to_fs_block(ext2_t *ext2, struct ext2_inode *inode,
 	return block;
 }
 
-int ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *_buf, off_t offset, size_t len)
+static bool ext4_extent_header_valid(const struct ext4_extent_header *eh, size_t size)
+{
+	return LE16(eh->eh_magic) == EXT4_EXT_MAGIC &&
+	       LE16(eh->eh_entries) <= LE16(eh->eh_max) &&
+	       sizeof(*eh) + LE16(eh->eh_max) * sizeof(struct ext4_extent) <= size;
+}
+
+/* index of the last entry in a node starting at or before fileblock, -1 if there isn't one.
+ * index entries and extents are the same size and both start with the logical block. */
+static int ext4_extent_search(const struct ext4_extent_header *eh, uint fileblock)
+{
+	const struct ext4_extent *ent = (const struct ext4_extent *)(eh + 1);
+	int lo = 0;
+	int hi = LE16(eh->eh_entries) - 1;
+	int found = -1;
+
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+		if (LE32(ent[mid].ee_block) <= fileblock) {
+			found = mid;
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+
+	return found;
+}
+
+/* map a file block through the inode's extent tree. returns the physical block, or 0
+ * for a hole, and how many of the following blocks up to max are mapped the same way. */
+static blocknum_t ext4_map_extent(ext2_t *ext2, struct ext2_inode *inode, struct ext2_block_map *map,
+                                  uint fileblock, uint max, uint *count)
+{
+	const struct ext4_extent_header *eh;
+	blocknum_t node_block = 0;
+	uint first = 0;
+	uint end = ~0U;
+	blocknum_t block = 0;
+
+	*count = 1;
+
+	if (map && map->table && map->level == EXT2_MAP_EXTENT_LEAF &&
+	        fileblock >= map->first && fileblock < map->end) {
+		/* same leaf as last time */
+		eh = map->table;
+		first = map->first;
+		end = map->end;
+	} else {
+		/* walk down from the root in the inode */
+		eh = (const struct ext4_extent_header *)inode->i_block;
+		if (!ext4_extent_header_valid(eh, sizeof(inode->i_block)))
+			goto error;
+
+		uint depth = LE16(eh->eh_depth);
+		if (depth > EXT4_EXT_MAX_DEPTH)
+			goto error;
+
+		while (depth > 0) {
+			const struct ext4_extent_idx *idx = (const struct ext4_extent_idx *)(eh + 1);
+			int i = ext4_extent_search(eh, fileblock);
+
+			if (i < 0) {
+				/* before anything the tree maps */
+				if (LE16(eh->eh_entries) > 0)
+					*count = MIN(max, LE32(idx[0].ei_block) - fileblock);
+				goto done;
+			}
+
+			first = LE32(idx[i].ei_block);
+			if (i + 1 < LE16(eh->eh_entries))
+				end = LE32(idx[i + 1].ei_block);
+
+			if (LE16(idx[i].ei_leaf_hi) != 0)
+				goto error;
+
+			if (node_block)
+				ext2_put_block(ext2, node_block);
+			node_block = LE32(idx[i].ei_leaf_lo);
+
+			void *ptr;
+			if (ext2_get_block(ext2, &ptr, node_block) < 0) {
+				node_block = 0;
+				goto error;
+			}
+			eh = ptr;
+
+			if (!ext4_extent_header_valid(eh, EXT2_BLOCK_SIZE(ext2->sb)) ||
+			        LE16(eh->eh_depth) != --depth)
+				goto error;
+		}
+
+		/* hang on to a copy of the leaf */
+		if (map && node_block) {
+			if (map->table && map->level != EXT2_MAP_EXTENT_LEAF) {
+				free(map->table);
+				map->table = NULL;
+			}
+			if (!map->table)
+				map->table = malloc(EXT2_BLOCK_SIZE(ext2->sb));
+			if (map->table) {
+				memcpy(map->table, eh, EXT2_BLOCK_SIZE(ext2->sb));
+				map->level = EXT2_MAP_EXTENT_LEAF;
+				map->first = first;
+				map->end = end;
+			}
+		}
+	}
+
+	/* find the extent in the leaf */
+	const struct ext4_extent *ext = (const struct ext4_extent *)(eh + 1);
+	int i = ext4_extent_search(eh, fileblock);
+	uint next = (i + 1 < LE16(eh->eh_entries)) ? LE32(ext[i + 1].ee_block) : end;
+
+	if (i >= 0) {
+		uint start = LE32(ext[i].ee_block);
+		uint len = LE16(ext[i].ee_len);
+		bool unwritten = len > EXT4_EXT_INIT_MAX_LEN;
+		if (unwritten)
+			len -= EXT4_EXT_INIT_MAX_LEN;
+
+		if (fileblock - start < len) {
+			if (LE16(ext[i].ee_start_hi) != 0)
+				goto error;
+
+			*count = MIN(max, start + len - fileblock);
+			if (!unwritten)
+				block = LE32(ext[i].ee_start_lo) + (fileblock - start);
+			goto done;
+		}
+	}
+
+	/* hole up to the next extent */
+	*count = MIN(max, next - fileblock);
+	goto done;
+
+error:
+	LTRACEF("bad extent tree in inode %p, fileblock %u\n", inode, fileblock);
+	*count = 1;
+	block = 0;
+
+done:
+	if (node_block)
+		ext2_put_block(ext2, node_block);
+
+	LTRACEF("fileblock %u -> %u, count %u\n", fileblock, block, *count);
+
+	return block;
+}
+
+/* map a run of up to max file blocks starting at fileblock that are either physically
+ * contiguous or all holes. returns the first physical block, or 0 for holes. */
+static blocknum_t ext2_map_blocks(ext2_t *ext2, struct ext2_inode *inode, struct ext2_block_map *map,
+                                  uint fileblock, uint max, uint *count)
+{
+	if (inode->i_flags & EXT4_EXTENTS_FL)
+		return ext4_map_extent(ext2, inode, map, fileblock, max, count);
+
+	blocknum_t block = file_block_to_fs_block(ext2, inode, map, fileblock);
+	uint n = 1;
+	while (n < max) {
+		blocknum_t next = file_block_to_fs_block(ext2, inode, map, fileblock + n);
+		if (block == 0 ? next != 0 : next != block + n)
+			break;
+		n++;
+	}
+
+	*count = n;
+	return block;
+}
+
+int ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, struct ext2_block_map *map, void *_buf, off_t offset, size_t len)
 {
 	int err = 0;
 	int bytes_read = 0;
 	uint8_t *buf = _buf;
+	struct ext2_block_map local_map = { 0 };
 
 	/* calculate the file size */
 	off_t file_size = ext2_file_len(ext2, inode);
@@ -200,6 +390,10 @@ int ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *_buf, off_t of
 	if (len == 0)
 		return 0;
 
+	/* without a map from the caller, still avoid rewalking the indirect chain for this read */
+	if (!map)
+		map = &local_map;
+
 	/* calculate the starting file block */
 	uint file_block = offset / EXT2_BLOCK_SIZE(ext2->sb);
 
@@ -208,7 +402,8 @@ int ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *_buf, off_t of
 		uint8_t temp[EXT2_BLOCK_SIZE(ext2->sb)];
 
 		/* calculate the block and read it */
-		blocknum_t phys_block = file_block_to_fs_block(ext2, inode, file_block);
+		uint count;
+		blocknum_t phys_block = ext2_map_blocks(ext2, inode, map, file_block, 1, &count);
 		if (phys_block == 0) {
 			memset(temp, 0, EXT2_BLOCK_SIZE(ext2->sb));
 		} else {
@@ -227,29 +422,44 @@ int ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *_buf, off_t of
 		buf += tocopy;
 	}
 
-	/* handle middle blocks */
+	/* handle middle blocks. physically contiguous runs, whole extents if the file has
+	 * them, are read in one go straight into the caller's buffer. the cache only gets in
+	 * the way of bulk file data. */
 	while (len >= EXT2_BLOCK_SIZE(ext2->sb)) {
-		/* calculate the block and read it */
-		blocknum_t phys_block = file_block_to_fs_block(ext2, inode, file_block);
+		uint max_blocks = len / EXT2_BLOCK_SIZE(ext2->sb);
+
+		/* calculate the block and see how far the run goes */
+		uint count;
+		blocknum_t phys_block = ext2_map_blocks(ext2, inode, map, file_block, max_blocks, &count);
+
+		size_t run_len = (size_t)count * EXT2_BLOCK_SIZE(ext2->sb);
 		if (phys_block == 0) {
-			memset(buf, 0, EXT2_BLOCK_SIZE(ext2->sb));
+			/* hole */
+			memset(buf, 0, run_len);
 		} else {
-			ext2_read_block(ext2, buf, phys_block);
+			LTRACEF("run of %u blocks at %u\n", count, phys_block);
+
+			ssize_t ret = bio_read(ext2->dev, buf, (off_t)phys_block * EXT2_BLOCK_SIZE(ext2->sb), run_len);
+			if (ret < 0) {
+				err = ret;
+				break;
+			}
 		}
 
 		/* increment our stuff */
-		file_block++;
-		len -= EXT2_BLOCK_SIZE(ext2->sb);
-		bytes_read += EXT2_BLOCK_SIZE(ext2->sb);
-		buf += EXT2_BLOCK_SIZE(ext2->sb);
+		file_block += count;
+		len -= run_len;
+		bytes_read += run_len;
+		buf += run_len;
 	}
 
 	/* handle partial last block */
-	if (len > 0) {
+	if (err >= 0 && len > 0) {
 		uint8_t temp[EXT2_BLOCK_SIZE(ext2->sb)];
 
 		/* calculate the block and read it */
-		blocknum_t phys_block = file_block_to_fs_block(ext2, inode, file_block);
+		uint count;
+		blocknum_t phys_block = ext2_map_blocks(ext2, inode, map, file_block, 1, &count);
 		if (phys_block == 0) {
 			memset(temp, 0, EXT2_BLOCK_SIZE(ext2->sb));
 		} else {
@@ -263,6 +473,8 @@ int ext2_read_inode(ext2_t *ext2, struct ext2_inode *inode, void *_buf, off_t of
 		bytes_read += len;
 	}
 
+	free(local_map.table);
+
 	LTRACEF("err %d, bytes_read %d\n", err, bytes_read);
 
 	return (err < 0) ? err : bytes_read;
@@ -30,6 +30,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <kernel/debug.h>
 #include <kernel/thread.h>
 #include <kernel/mutex.h>
 #include <kernel/spinlock.h>
@@ -75,6 +76,20 @@ uintptr_t _heap_end = (uintptr_t)&_end_of_ram;
 #define HEAP_LEN ((uintptr_t)_heap_end - HEAP_START)
 #endif
 
+/* small allocations are served out of per cpu magazines of preallocated chunks
+ * that sit in front of the free list, so they don't need the heap lock. each cpu's
+ * magazines have their own spinlock so an allocation running out of memory can
+ * pull back what the other cpus are holding. */
+#ifndef HEAP_MAGAZINES
+#define HEAP_MAGAZINES (WITH_KERNEL_VM && !DEBUG_HEAP)
+#endif
+
+/* max number of chunks a magazine holds, scaled down for the bigger size classes */
+#ifndef HEAP_MAGAZINE_SIZE
+#define HEAP_MAGAZINE_SIZE 32
+#endif
+#define HEAP_MAGAZINE_BYTES (16 * 1024)
+
 struct free_heap_chunk {
 	struct list_node node;
 	size_t len;
@@ -109,6 +124,31 @@ struct alloc_struct_begin {
 
 static ssize_t heap_grow(size_t len);
 
+#if HEAP_MAGAZINES
+/* usable size of each size class */
+static const size_t heap_size_classes[HEAP_NUM_SIZE_CLASSES] = {
+	16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 1024, 2048, 4096,
+};
+
+struct heap_magazine {
+	uint count;
+	uint capacity;
+	struct free_heap_chunk *chunks[HEAP_MAGAZINE_SIZE];
+};
+
+struct heap_percpu {
+	spin_lock_t lock;
+	struct heap_magazine mag[HEAP_NUM_SIZE_CLASSES];
+	ulong hits[HEAP_NUM_SIZE_CLASSES];
+	ulong misses[HEAP_NUM_SIZE_CLASSES];
+} __CPU_ALIGN;
+
+static struct heap_percpu heap_percpu[SMP_MAX_CPUS];
+
+static void heap_magazine_dump(void);
+static bool heap_magazine_drain_all(void);
+#endif
+
 static void dump_free_chunk(struct free_heap_chunk *chunk)
 {
 	dprintf(INFO, "\t\tbase %p, end 0x%lx, len 0x%zx\n", chunk, (vaddr_t)chunk + chunk->len, chunk->len);
@@ -135,6 +175,10 @@ static void heap_dump(void)
 		dump_free_chunk(chunk);
 	}
 	spin_unlock_irqrestore(&theheap.delayed_free_lock, state);
+
+#if HEAP_MAGAZINES
+	heap_magazine_dump();
+#endif
 }
 
 static void heap_test(void)
@@ -191,7 +235,8 @@ static void heap_test(void)
 
 // try to insert this free chunk into the free list, consuming the chunk by merging it with
 // nearby ones if possible. Returns base of whatever chunk it became in the list.
-static struct free_heap_chunk *heap_insert_free_chunk(struct free_heap_chunk *chunk)
+// theheap.lock must be held.
+static struct free_heap_chunk *heap_insert_free_chunk_locked(struct free_heap_chunk *chunk)
 {
 #if LK_DEBUGLEVEL > INFO
 	vaddr_t chunk_end = (vaddr_t)chunk + chunk->len;
@@ -202,7 +247,7 @@ static struct free_heap_chunk *heap_insert_free_chunk(struct free_heap_chunk *ch
 	struct free_heap_chunk *next_chunk;
 	struct free_heap_chunk *last_chunk;
 
-	mutex_acquire(&theheap.lock);
+	DEBUG_ASSERT(is_mutex_held(&theheap.lock));
 
 	theheap.remaining += chunk->len;
 
@@ -248,6 +293,13 @@ try_merge:
 		}
 	}
 
+	return chunk;
+}
+
+static struct free_heap_chunk *heap_insert_free_chunk(struct free_heap_chunk *chunk)
+{
+	mutex_acquire(&theheap.lock);
+	chunk = heap_insert_free_chunk_locked(chunk);
 	mutex_release(&theheap.lock);
 
 	return chunk;
@@ -289,12 +341,323 @@ static void heap_free_delayed_list(void)
 	}
 }
 
+// carve a chunk of at least size bytes off the first free chunk that fits, splitting
+// off whatever is left over. theheap.lock must be held.
+static struct free_heap_chunk *heap_carve_chunk(size_t size)
+{
+	struct free_heap_chunk *chunk;
+
+	DEBUG_ASSERT(is_mutex_held(&theheap.lock));
+
+	// walk through the list
+	list_for_every_entry(&theheap.free_list, chunk, struct free_heap_chunk, node) {
+		DEBUG_ASSERT((chunk->len % sizeof(void *)) == 0); // len should always be a multiple of pointer size
+
+		// is it big enough to service our allocation?
+		if (chunk->len >= size) {
+			// remove it from the list
+			struct list_node *next_node = list_next(&theheap.free_list, &chunk->node);
+			list_delete(&chunk->node);
+
+			if (chunk->len > size + sizeof(struct free_heap_chunk)) {
+				// there's enough space in this chunk to create a new one after the allocation
+				struct free_heap_chunk *newchunk = heap_create_free_chunk((uint8_t *)chunk + size, chunk->len - size, true);
+
+				// truncate this chunk
+				chunk->len -= chunk->len - size;
+
+				// add the new one where chunk used to be
+				if (next_node)
+					list_add_before(next_node, &newchunk->node);
+				else
+					list_add_tail(&theheap.free_list, &newchunk->node);
+			}
+
+			// the allocated size is actually the length of this chunk, not the size requested
+			DEBUG_ASSERT(chunk->len >= size);
+
+			theheap.remaining -= chunk->len;
+
+			if (theheap.remaining < theheap.low_watermark) {
+				theheap.low_watermark = theheap.remaining;
+			}
+
+			return chunk;
+		}
+	}
+
+	return NULL;
+}
+
+// build the allocation header in front of the returned pointer
+static void *heap_setup_alloc(struct free_heap_chunk *chunk, unsigned int alignment, size_t original_size)
+{
+	void *ptr = chunk;
+	size_t size = chunk->len;
+
+#if DEBUG_HEAP
+	memset(ptr, ALLOC_FILL, size);
+#endif
+
+	ptr = (void *)((addr_t)ptr + sizeof(struct alloc_struct_begin));
+
+	// align the output if requested
+	if (alignment > 0) {
+		ptr = (void *)ROUNDUP((addr_t)ptr, (addr_t)alignment);
+	}
+
+	struct alloc_struct_begin *as = (struct alloc_struct_begin *)ptr;
+	as--;
+#if LK_DEBUGLEVEL > 1
+	as->magic = HEAP_MAGIC;
+#endif
+	as->ptr = (void *)chunk;
+	as->size = size;
+#if DEBUG_HEAP
+	as->padding_start = ((uint8_t *)ptr + original_size);
+	as->padding_size = (((addr_t)chunk + size) - ((addr_t)ptr + original_size));
+//	printf("padding start %p, size %u, chunk %p, size %u\n", as->padding_start, as->padding_size, chunk, size);
+
+	memset(as->padding_start, PADDING_FILL, as->padding_size);
+#endif
+
+	return ptr;
+}
+
+#if HEAP_MAGAZINES
+static size_t heap_class_chunk_size(uint class)
+{
+	return ROUNDUP(heap_size_classes[class] + sizeof(struct alloc_struct_begin), sizeof(void *));
+}
+
+// smallest size class that can hold an allocation of this size, or -1
+static int heap_size_to_class(size_t size)
+{
+	if (size > heap_size_classes[HEAP_NUM_SIZE_CLASSES - 1])
+		return -1;
+
+	for (uint i = 0; i < HEAP_NUM_SIZE_CLASSES; i++) {
+		if (size <= heap_size_classes[i])
+			return i;
+	}
+	return -1;
+}
+
+// size class a freed chunk can be recycled into, or -1 if it's too big to cache
+static int heap_chunk_to_class(size_t len)
+{
+	for (int i = HEAP_NUM_SIZE_CLASSES - 1; i >= 0; i--) {
+		if (len >= heap_class_chunk_size(i)) {
+			/* don't let much bigger chunks get stuck in a small class */
+			if (len - heap_class_chunk_size(i) >= heap_size_classes[i])
+				return -1;
+			return i;
+		}
+	}
+	return -1;
+}
+
+// allocate a batch of chunks for a size class with one trip through the free list,
+// and stuff them in the current cpu's magazine. returns one of them to the caller.
+static struct free_heap_chunk *heap_magazine_refill(uint class)
+{
+	size_t chunk_size = heap_class_chunk_size(class);
+	struct free_heap_chunk *chunk = NULL;
+	uint count = MAX(1U, MIN((uint)HEAP_MAGAZINE_SIZE, (uint)(HEAP_MAGAZINE_BYTES / chunk_size)) / 2);
+	bool drained = false;
+
+#if WITH_KERNEL_VM
+	int retry_count = 0;
+#endif
+retry:
+	mutex_acquire(&theheap.lock);
+	for (; count > 0; count /= 2) {
+		chunk = heap_carve_chunk(chunk_size * count);
+		if (chunk)
+			break;
+	}
+	mutex_release(&theheap.lock);
+
+#if WITH_KERNEL_VM
+	if (chunk == NULL && retry_count == 0) {
+		if (heap_grow(MAX(HEAP_GROW_SIZE, ROUNDUP(chunk_size, PAGE_SIZE))) >= 0) {
+			retry_count++;
+			count = 1;
+			goto retry;
+		}
+	}
+#endif
+	// last resort, the other cpus' magazines may be holding what we need
+	if (chunk == NULL && !drained) {
+		drained = true;
+		if (heap_magazine_drain_all()) {
+			count = 1;
+			goto retry;
+		}
+	}
+	if (!chunk)
+		return NULL;
+
+	// chop it up, the last one gets any slop left over from the carve
+	size_t total = chunk->len;
+	struct free_heap_chunk *chunks[count];
+	for (uint i = 0; i < count; i++) {
+		chunks[i] = (struct free_heap_chunk *)((uint8_t *)chunk + i * chunk_size);
+		chunks[i]->len = (i == count - 1) ? total - i * chunk_size : chunk_size;
+	}
+
+	spin_lock_saved_state_t state;
+	struct heap_percpu *pc = &heap_percpu[arch_curr_cpu_num()];
+	spin_lock_irqsave(&pc->lock, state);
+
+	struct heap_magazine *mag = &pc->mag[class];
+	uint i;
+	for (i = 1; i < count && mag->count < mag->capacity; i++)
+		mag->chunks[mag->count++] = chunks[i];
+
+	spin_unlock_irqrestore(&pc->lock, state);
+
+	// we raced with someone else filling the magazine, give the rest back
+	if (i < count) {
+		mutex_acquire(&theheap.lock);
+		for (; i < count; i++)
+			heap_insert_free_chunk_locked(chunks[i]);
+		mutex_release(&theheap.lock);
+	}
+
+	return chunks[0];
+}
+
+static void *heap_magazine_alloc(uint class)
+{
+	struct free_heap_chunk *chunk = NULL;
+
+	spin_lock_saved_state_t state;
+	struct heap_percpu *pc = &heap_percpu[arch_curr_cpu_num()];
+	spin_lock_irqsave(&pc->lock, state);
+
+	struct heap_magazine *mag = &pc->mag[class];
+	if (likely(mag->count > 0)) {
+		chunk = mag->chunks[--mag->count];
+		pc->hits[class]++;
+	} else {
+		pc->misses[class]++;
+	}
+
+	spin_unlock_irqrestore(&pc->lock, state);
+
+	if (unlikely(!chunk)) {
+		chunk = heap_magazine_refill(class);
+		if (!chunk)
+			return NULL;
+	}
+
+	return heap_setup_alloc(chunk, 0, heap_size_classes[class]);
+}
+
+// try to stash a freed chunk in the current cpu's magazine. if it's full, half of it
+// gets flushed back to the free list in one go.
+static bool heap_magazine_free(struct free_heap_chunk *chunk)
+{
+	int class = heap_chunk_to_class(chunk->len);
+	if (class < 0)
+		return false;
+
+	struct free_heap_chunk *flush[HEAP_MAGAZINE_SIZE / 2];
+	uint flush_count = 0;
+
+	spin_lock_saved_state_t state;
+	struct heap_percpu *pc = &heap_percpu[arch_curr_cpu_num()];
+	spin_lock_irqsave(&pc->lock, state);
+
+	struct heap_magazine *mag = &pc->mag[class];
+	if (unlikely(mag->count >= mag->capacity)) {
+		while (flush_count < mag->capacity / 2)
+			flush[flush_count++] = mag->chunks[--mag->count];
+	}
+	mag->chunks[mag->count++] = chunk;
+
+	spin_unlock_irqrestore(&pc->lock, state);
+
+	if (flush_count > 0) {
+		mutex_acquire(&theheap.lock);
+		for (uint i = 0; i < flush_count; i++)
+			heap_insert_free_chunk_locked(flush[i]);
+		mutex_release(&theheap.lock);
+	}
+
+	return true;
+}
+
+// empty every cpu's magazines back into the free list so the chunks can coalesce
+// with their neighbors. returns true if anything came back.
+static bool heap_magazine_drain_all(void)
+{
+	struct free_heap_chunk *chunks[HEAP_MAGAZINE_SIZE];
+	bool drained = false;
+
+	for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+		struct heap_percpu *pc = &heap_percpu[cpu];
+
+		for (uint class = 0; class < HEAP_NUM_SIZE_CLASSES; class++) {
+			spin_lock_saved_state_t state;
+			spin_lock_irqsave(&pc->lock, state);
+
+			struct heap_magazine *mag = &pc->mag[class];
+			uint count = mag->count;
+			memcpy(chunks, mag->chunks, count * sizeof(chunks[0]));
+			mag->count = 0;
+
+			spin_unlock_irqrestore(&pc->lock, state);
+
+			if (count == 0)
+				continue;
+
+			mutex_acquire(&theheap.lock);
+			for (uint i = 0; i < count; i++)
+				heap_insert_free_chunk_locked(chunks[i]);
+			mutex_release(&theheap.lock);
+			drained = true;
+		}
+	}
+
+	LTRACEF("drained %d\n", drained);
+
+	return drained;
+}
+
+static void heap_magazine_init(void)
+{
+	for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+		spin_lock_init(&heap_percpu[cpu].lock);
+		for (uint class = 0; class < HEAP_NUM_SIZE_CLASSES; class++) {
+			uint capacity = HEAP_MAGAZINE_BYTES / heap_class_chunk_size(class);
+			heap_percpu[cpu].mag[class].capacity = MAX(2U, MIN((uint)HEAP_MAGAZINE_SIZE, capacity));
+		}
+	}
+}
+
+static void heap_magazine_dump(void)
+{
+	dprintf(INFO, "\tmagazines:\n");
+	for (uint class = 0; class < HEAP_NUM_SIZE_CLASSES; class++) {
+		uint cached = 0;
+		ulong hits = 0, misses = 0;
+		for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+			cached += heap_percpu[cpu].mag[class].count;
+			hits += heap_percpu[cpu].hits[class];
+			misses += heap_percpu[cpu].misses[class];
+		}
+		dprintf(INFO, "\t\tsize %4zu: cached %u, hits %lu, misses %lu\n",
+		        heap_size_classes[class], cached, hits, misses);
+	}
+}
+#endif
+
 void *heap_alloc(size_t size, unsigned int alignment)
 {
 	void *ptr;
-#if DEBUG_HEAP
 	size_t original_size = size;
-#endif
 
 	LTRACEF("size %zd, align %d\n", size, alignment);
 
@@ -307,6 +670,19 @@ void *heap_alloc(size_t size, unsigned int alignment)
 	if (alignment & (alignment - 1))
 		return NULL;
 
+#if HEAP_MAGAZINES
+	// small unaligned allocations come out of the per cpu magazines
+	if (alignment == 0) {
+		int class = heap_size_to_class(size);
+		if (class >= 0) {
+			ptr = heap_magazine_alloc(class);
+			LTRACEF("returning ptr %p\n", ptr);
+			KEVLOG_HEAP_ALLOC(ptr, size);
+			return ptr;
+		}
+	}
+#endif
+
 	// we always put a size field + base pointer + magic in front of the allocation
 	size += sizeof(struct alloc_struct_begin);
 #if DEBUG_HEAP
@@ -333,82 +709,20 @@ void *heap_alloc(size_t size, unsigned int alignment)
 
 #if WITH_KERNEL_VM
 	int retry_count = 0;
-retry:
 #endif
-	mutex_acquire(&theheap.lock);
-
-	// walk through the list
-	ptr = NULL;
-	struct free_heap_chunk *chunk;
-	list_for_every_entry(&theheap.free_list, chunk, struct free_heap_chunk, node) {
-		DEBUG_ASSERT((chunk->len % sizeof(void *)) == 0); // len should always be a multiple of pointer size
-
-		// is it big enough to service our allocation?
-		if (chunk->len >= size) {
-			ptr = chunk;
-
-			// remove it from the list
-			struct list_node *next_node = list_next(&theheap.free_list, &chunk->node);
-			list_delete(&chunk->node);
-
-			if (chunk->len > size + sizeof(struct free_heap_chunk)) {
-				// there's enough space in this chunk to create a new one after the allocation
-				struct free_heap_chunk *newchunk = heap_create_free_chunk((uint8_t *)ptr + size, chunk->len - size, true);
-
-				// truncate this chunk
-				chunk->len -= chunk->len - size;
-
-				// add the new one where chunk used to be
-				if (next_node)
-					list_add_before(next_node, &newchunk->node);
-				else
-					list_add_tail(&theheap.free_list, &newchunk->node);
-			}
-
-			// the allocated size is actually the length of this chunk, not the size requested
-			DEBUG_ASSERT(chunk->len >= size);
-			size = chunk->len;
-
-#if DEBUG_HEAP
-			memset(ptr, ALLOC_FILL, size);
-#endif
-
-			ptr = (void *)((addr_t)ptr + sizeof(struct alloc_struct_begin));
-
-			// align the output if requested
-			if (alignment > 0) {
-				ptr = (void *)ROUNDUP((addr_t)ptr, (addr_t)alignment);
-			}
-
-			struct alloc_struct_begin *as = (struct alloc_struct_begin *)ptr;
-			as--;
-#if LK_DEBUGLEVEL > 1
-			as->magic = HEAP_MAGIC;
+#if HEAP_MAGAZINES
+	bool drained = false;
 #endif
-			as->ptr = (void *)chunk;
-			as->size = size;
-			theheap.remaining -= size;
-
-			if (theheap.remaining < theheap.low_watermark) {
-				theheap.low_watermark = theheap.remaining;
-			}
-#if DEBUG_HEAP
-			as->padding_start = ((uint8_t *)ptr + original_size);
-			as->padding_size = (((addr_t)chunk + size) - ((addr_t)ptr + original_size));
-//			printf("padding start %p, size %u, chunk %p, size %u\n", as->padding_start, as->padding_size, chunk, size);
-
-			memset(as->padding_start, PADDING_FILL, as->padding_size);
+#if WITH_KERNEL_VM || HEAP_MAGAZINES
+retry:
 #endif
-
-			break;
-		}
-	}
-
+	mutex_acquire(&theheap.lock);
+	struct free_heap_chunk *chunk = heap_carve_chunk(size);
 	mutex_release(&theheap.lock);
 
 #if WITH_KERNEL_VM
 	/* try to grow the heap if we can */
-	if (ptr == NULL && retry_count == 0) {
+	if (chunk == NULL && retry_count == 0) {
 		size_t growby = MAX(HEAP_GROW_SIZE, ROUNDUP(size, PAGE_SIZE));
 
 		ssize_t err = heap_grow(growby);
@@ -418,8 +732,19 @@ retry:
 		}
 	}
 #endif
+#if HEAP_MAGAZINES
+	/* chunks cached in the magazines might coalesce into a big enough run */
+	if (chunk == NULL && !drained) {
+		drained = true;
+		if (heap_magazine_drain_all())
+			goto retry;
+	}
+#endif
+
+	ptr = chunk ? heap_setup_alloc(chunk, alignment, original_size) : NULL;
 
 	LTRACEF("returning ptr %p\n", ptr);
+	KEVLOG_HEAP_ALLOC(ptr, original_size);
 
 	return ptr;
 }
@@ -430,6 +755,7 @@ void heap_free(void *ptr)
 		return;
 
 	LTRACEF("ptr %p\n", ptr);
+	KEVLOG_HEAP_FREE(ptr);
 
 	// check for the old allocation structure
 	struct alloc_struct_begin *as = (struct alloc_struct_begin *)ptr;
@@ -455,7 +781,12 @@ void heap_free(void *ptr)
 	LTRACEF("allocation was %zd bytes long at ptr %p\n", as->size, as->ptr);
 
 	// looks good, create a free chunk and add it to the pool
-	heap_insert_free_chunk(heap_create_free_chunk(as->ptr, as->size, true));
+	struct free_heap_chunk *chunk = heap_create_free_chunk(as->ptr, as->size, true);
+#if HEAP_MAGAZINES
+	if (heap_magazine_free(chunk))
+		return;
+#endif
+	heap_insert_free_chunk(chunk);
 }
 
 void heap_delayed_free(void *ptr)
@@ -506,6 +837,28 @@ void heap_get_stats(struct heap_stats *ptr)
 	ptr->heap_low_watermark = theheap.low_watermark;
 
 	mutex_release(&theheap.lock);
+
+	ptr->heap_cached = 0;
+	for (uint class = 0; class < HEAP_NUM_SIZE_CLASSES; class++) {
+		struct heap_class_stats *cs = &ptr->size_class[class];
+
+		memset(cs, 0, sizeof(*cs));
+#if HEAP_MAGAZINES
+		cs->size = heap_size_classes[class];
+		for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+			struct heap_magazine *mag = &heap_percpu[cpu].mag[class];
+
+			spin_lock_saved_state_t state;
+			spin_lock_irqsave(&heap_percpu[cpu].lock, state);
+			cs->cached += mag->count;
+			cs->hits += heap_percpu[cpu].hits[class];
+			cs->misses += heap_percpu[cpu].misses[class];
+			for (uint i = 0; i < mag->count; i++)
+				ptr->heap_cached += mag->chunks[i]->len;
+			spin_unlock_irqrestore(&heap_percpu[cpu].lock, state);
+		}
+#endif
+	}
 }
 
 static ssize_t heap_grow(size_t size)
@@ -549,6 +902,11 @@ void heap_init(void)
 	// initialize the delayed free list
 	list_initialize(&theheap.delayed_free_list);
 	spin_lock_init(&theheap.delayed_free_lock);
+	spin_lock_stats_register(&theheap.delayed_free_lock, "heap delayed free");
+
+#if HEAP_MAGAZINES
+	heap_magazine_init();
+#endif
 
 	// set the heap range
 #if WITH_KERNEL_VM
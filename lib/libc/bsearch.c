@@ -75,7 +75,7 @@ bsearch(const void *key, const void *base0, size_t nmemb, size_t size,
 		p = base + (lim >> 1) * size;
 		cmp = (*compar)(key, p);
 		if (cmp == 0)
-			return __UNCONST(p);
+			return (void *)(uintptr_t)p;
 		if (cmp > 0) {	/* key > p: move right */
 			base = (const char *)p + size;
 			lim--;
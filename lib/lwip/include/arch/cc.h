@@ -45,7 +45,10 @@ typedef intptr_t mem_ptr_t;
 #define X32_F "x"
 #define SZT_F "zu"
 
-#define LWIP_CHKSUM_ALGORITHM 2
+/* share the internet checksum in lib/cksum rather than lwip's own */
+#include <lib/cksum.h>
+#define LWIP_CHKSUM(dataptr, len) inet_cksum_fold(inet_cksum_partial(dataptr, len, 0))
+#define LWIP_CHKSUM_COPY(dst, src, len) inet_cksum_fold(inet_cksum_copy(dst, src, len, 0))
 
 #define LWIP_PLATFORM_DIAG(x) do {} while (0)
 #define LWIP_PLATFORM_ASSERT(x) do {} while (0)
@@ -3,6 +3,7 @@ LOCAL_DIR := $(GET_LOCAL_DIR)
 MODULE := $(LOCAL_DIR)
 
 MODULE_DEPS := \
+	lib/cksum \
 
 GLOBAL_INCLUDES += \
 	$(LOCAL_DIR)/include \
@@ -20,7 +20,7 @@ static int sys_thread_func(void *arg)
 	struct sys_thread *st = arg;
 	DEBUG_ASSERT(st);
 
-	tls_set(0, (uint32_t) st);
+	tls_set(TLS_ENTRY_LWIP, (uintptr_t)st);
 
 	st->func(st->arg);
 
@@ -28,6 +28,10 @@
 #include <malloc.h>
 #include <stdio.h>
 #include <trace.h>
+#include <assert.h>
+#include <err.h>
+#include <kernel/mutex.h>
+#include <platform.h>
 
 typedef union {
     uint32_t u;
@@ -35,32 +39,197 @@ typedef union {
 } ipv4_t;
 
 #define LOCAL_TRACE 0
-static struct list_node arp_list;
+
+/* buckets in the arp table, a power of two */
+#ifndef ARP_HASH_SIZE
+#define ARP_HASH_SIZE 32
+#endif
+
+/* most addresses the table tracks, resolved or not. when it's full the least
+ * recently used resolved entry makes room for a new one */
+#ifndef ARP_MAX_ENTRIES
+#define ARP_MAX_ENTRIES 256
+#endif
+
+/* frames held per unresolved address. beyond this the oldest one is dropped */
+#ifndef ARP_MAX_PENDING
+#define ARP_MAX_PENDING 16
+#endif
+
+/* how often a request is resent (ms), and how many times before giving up */
+#ifndef ARP_RETRY_INTERVAL
+#define ARP_RETRY_INTERVAL 250
+#endif
+#ifndef ARP_MAX_RETRIES
+#define ARP_MAX_RETRIES 4
+#endif
+
+STATIC_ASSERT((ARP_HASH_SIZE & (ARP_HASH_SIZE - 1)) == 0);
+
+/* an address we've seen or asked about. unresolved entries hold the frames waiting
+ * on them and go away again if nobody answers, resolved ones stay until they are
+ * evicted to make room. */
 typedef struct {
     struct list_node node;
     uint32_t addr;
     uint8_t mac[6];
+    bool resolved;
+    lk_time_t last_used;
+    uint retries;
+    struct list_node pending;
+    uint pending_count;
+    net_timer_t timer;
 } arp_entry_t;
 
+static struct list_node arp_table[ARP_HASH_SIZE];
+static uint arp_entry_count;
+static mutex_t arp_lock = MUTEX_INITIAL_VALUE(arp_lock);
+
+static inline uint arp_hash(uint32_t addr)
+{
+    return (addr ^ (addr >> 8) ^ (addr >> 16) ^ (addr >> 24)) & (ARP_HASH_SIZE - 1);
+}
+
 void arp_cache_init(void)
 {
-    list_initialize(&arp_list);
+    for (uint i = 0; i < ARP_HASH_SIZE; i++)
+        list_initialize(&arp_table[i]);
+}
+
+static arp_entry_t *arp_find_locked(uint32_t addr)
+{
+    arp_entry_t *arp;
+
+    DEBUG_ASSERT(is_mutex_held(&arp_lock));
+
+    list_for_every_entry(&arp_table[arp_hash(addr)], arp, arp_entry_t, node) {
+        if (arp->addr == addr)
+            return arp;
+    }
+
+    return NULL;
 }
 
-static inline void mru_update(struct list_node *entry)
+/* drop the resolved entry that went unused the longest. unresolved ones are left
+ * alone, they hold frames and time out by themselves. */
+static arp_entry_t *arp_evict_locked(void)
 {
-    if (arp_list.next == entry)
+    arp_entry_t *arp;
+    arp_entry_t *oldest = NULL;
+    lk_time_t now = current_time();
+
+    DEBUG_ASSERT(is_mutex_held(&arp_lock));
+
+    for (uint bucket = 0; bucket < ARP_HASH_SIZE; bucket++) {
+        list_for_every_entry(&arp_table[bucket], arp, arp_entry_t, node) {
+            if (!arp->resolved)
+                continue;
+            if (!oldest || now - arp->last_used > now - oldest->last_used)
+                oldest = arp;
+        }
+    }
+
+    if (oldest) {
+        LTRACEF("evicting 0x%x\n", oldest->addr);
+        list_delete(&oldest->node);
+        arp_entry_count--;
+    }
+
+    return oldest;
+}
+
+static arp_entry_t *arp_create_locked(uint32_t addr)
+{
+    DEBUG_ASSERT(is_mutex_held(&arp_lock));
+
+    arp_entry_t *arp = NULL;
+    if (arp_entry_count >= ARP_MAX_ENTRIES) {
+        arp = arp_evict_locked();
+        if (arp == NULL)
+            return NULL;
+        memset(arp, 0, sizeof(*arp));
+    } else {
+        arp = calloc(1, sizeof(arp_entry_t));
+        if (arp == NULL)
+            return NULL;
+    }
+
+    arp->addr = addr;
+    arp->last_used = current_time();
+    list_initialize(&arp->pending);
+    list_add_head(&arp_table[arp_hash(addr)], &arp->node);
+    arp_entry_count++;
+
+    return arp;
+}
+
+/* move an entry's waiting frames onto list, to be dealt with after dropping the lock */
+static void arp_take_pending_locked(arp_entry_t *arp, struct list_node *list)
+{
+    pktbuf_t *p;
+    while ((p = list_remove_head_type(&arp->pending, pktbuf_t, list)))
+        list_add_tail(list, &p->list);
+    arp->pending_count = 0;
+}
+
+/* hand frames that were waiting on an address to the driver */
+static void arp_flush_pending(struct list_node *list, const uint8_t mac[6])
+{
+    pktbuf_t *p;
+    while ((p = list_remove_head_type(list, pktbuf_t, list))) {
+        struct eth_hdr *eth = (struct eth_hdr *)p->data;
+        memcpy(eth->dst_mac, mac, sizeof(eth->dst_mac));
+        minip_tx_handler(p);
+    }
+}
+
+static void arp_drop_pending(struct list_node *list)
+{
+    pktbuf_t *p;
+    while ((p = list_remove_head_type(list, pktbuf_t, list)))
+        pktbuf_free(p);
+}
+
+static void arp_retry_timeout(void *_arp)
+{
+    arp_entry_t *arp = _arp;
+    struct list_node dropped = LIST_INITIAL_VALUE(dropped);
+
+    mutex_acquire(&arp_lock);
+
+    /* the reply may have raced with the timer firing */
+    if (arp->resolved) {
+        mutex_release(&arp_lock);
         return;
+    }
+
+    if (++arp->retries <= ARP_MAX_RETRIES) {
+        uint32_t addr = arp->addr;
+        net_timer_set(&arp->timer, &arp_retry_timeout, arp, ARP_RETRY_INTERVAL);
+        mutex_release(&arp_lock);
 
-    list_delete(entry);
-    list_add_head(&arp_list, entry);
+        send_arp_request(addr);
+        return;
+    }
+
+    /* nobody home, give up on everything queued for it */
+    LTRACEF("giving up on 0x%x, dropping %u frames\n", arp->addr, arp->pending_count);
+
+    list_delete(&arp->node);
+    arp_entry_count--;
+    arp_take_pending_locked(arp, &dropped);
+
+    mutex_release(&arp_lock);
+
+    arp_drop_pending(&dropped);
+    free(arp);
 }
 
 void arp_cache_update(uint32_t addr, const uint8_t mac[6])
 {
     arp_entry_t *arp;
     ipv4_t ip;
-    bool found = false;
+    struct list_node ready = LIST_INITIAL_VALUE(ready);
 
     ip.u = addr;
 
@@ -69,47 +238,99 @@ void arp_cache_update(uint32_t addr, const uint8_t mac[6])
         return;
     }
 
-    /* If the entry is in the cache update the address and move
-     * it to head */
-    list_for_every_entry(&arp_list, arp, arp_entry_t, node) {
-        if (arp->addr == addr) {
-            arp->addr = addr;
-            mru_update(&arp->node);
-            found = true;
-            break;
-        }
-    }
+    mutex_acquire(&arp_lock);
 
-    if (!found) {
+    arp = arp_find_locked(addr);
+    if (!arp) {
         LTRACEF("Adding %u.%u.%u.%u -> %02x:%02x:%02x%02x:%02x:%02x to cache\n",
             ip.b[0], ip.b[1], ip.b[2], ip.b[3],
             mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
-        arp = malloc(sizeof(arp_entry_t));
+        arp = arp_create_locked(addr);
         if (arp == NULL) {
+            mutex_release(&arp_lock);
             return;
         }
+    }
 
-        arp->addr = addr;
-        memcpy(arp->mac, mac, sizeof(arp->mac));
-        list_add_head(&arp_list, &arp->node);
+    memcpy(arp->mac, mac, sizeof(arp->mac));
+    arp->last_used = current_time();
+    if (!arp->resolved) {
+        arp->resolved = true;
+        net_timer_cancel(&arp->timer);
+
+        arp_take_pending_locked(arp, &ready);
     }
+
+    mutex_release(&arp_lock);
+
+    arp_flush_pending(&ready, mac);
 }
 
-/* Looks up and returns a MAC address based on the provided ip addr */
-uint8_t *arp_cache_lookup(uint32_t addr)
+/* Looks up the MAC address for the provided ip addr, copying it to mac if it's
+ * resolved. Entries can be evicted, so the address is copied out under the lock. */
+bool arp_cache_lookup(uint32_t addr, uint8_t mac[6])
 {
     arp_entry_t *arp;
+    bool found = false;
+
+    mutex_acquire(&arp_lock);
+    arp = arp_find_locked(addr);
+    if (arp && arp->resolved) {
+        if (mac)
+            memcpy(mac, arp->mac, sizeof(arp->mac));
+        arp->last_used = current_time();
+        found = true;
+    }
+    mutex_release(&arp_lock);
+
+    return found;
+}
 
-    /* If the entry is in the cache update the address and move
-     * it to head */
-    list_for_every_entry(&arp_list, arp, arp_entry_t, node) {
-        if (arp->addr == addr) {
-            mru_update(&arp->node);
-            return arp->mac;
+status_t arp_send(pktbuf_t *p, uint32_t addr)
+{
+    struct eth_hdr *eth = (struct eth_hdr *)p->data;
+    pktbuf_t *dropped = NULL;
+    bool request = false;
+
+    mutex_acquire(&arp_lock);
+
+    arp_entry_t *arp = arp_find_locked(addr);
+    if (arp && arp->resolved) {
+        memcpy(eth->dst_mac, arp->mac, sizeof(eth->dst_mac));
+        arp->last_used = current_time();
+        mutex_release(&arp_lock);
+
+        return minip_tx_handler(p);
+    }
+
+    if (!arp) {
+        arp = arp_create_locked(addr);
+        if (!arp) {
+            mutex_release(&arp_lock);
+            pktbuf_free(p);
+            return ERR_NO_MEMORY;
         }
+
+        net_timer_set(&arp->timer, &arp_retry_timeout, arp, ARP_RETRY_INTERVAL);
+        request = true;
     }
 
-    return NULL;
+    /* park the frame until the reply shows up */
+    if (arp->pending_count >= ARP_MAX_PENDING) {
+        dropped = list_remove_head_type(&arp->pending, pktbuf_t, list);
+        arp->pending_count--;
+    }
+    list_add_tail(&arp->pending, &p->list);
+    arp->pending_count++;
+
+    mutex_release(&arp_lock);
+
+    if (dropped)
+        pktbuf_free(dropped);
+    if (request)
+        send_arp_request(addr);
+
+    return NO_ERROR;
 }
 
 void arp_cache_dump(void)
@@ -117,17 +338,28 @@ void arp_cache_dump(void)
     int i = 0;
     arp_entry_t *arp;
 
-    if (!list_is_empty(&arp_list)) {
-            list_for_every_entry(&arp_list, arp, arp_entry_t, node) {
-            ipv4_t ip;
-            ip.u = arp->addr;
-            printf("%2d: %u.%u.%u.%u -> %02x:%02x:%02x:%02x:%02x:%02x\n",
-                i++, ip.b[0], ip.b[1], ip.b[2], ip.b[3],
-                arp->mac[0], arp->mac[1], arp->mac[2], arp->mac[3], arp->mac[4], arp->mac[5]);
+    mutex_acquire(&arp_lock);
+
+    if (arp_entry_count > 0) {
+        for (uint bucket = 0; bucket < ARP_HASH_SIZE; bucket++) {
+            list_for_every_entry(&arp_table[bucket], arp, arp_entry_t, node) {
+                ipv4_t ip;
+                ip.u = arp->addr;
+                if (arp->resolved) {
+                    printf("%2d: %u.%u.%u.%u -> %02x:%02x:%02x:%02x:%02x:%02x\n",
+                        i++, ip.b[0], ip.b[1], ip.b[2], ip.b[3],
+                        arp->mac[0], arp->mac[1], arp->mac[2], arp->mac[3], arp->mac[4], arp->mac[5]);
+                } else {
+                    printf("%2d: %u.%u.%u.%u -> (incomplete, %u retries, %u frames waiting)\n",
+                        i++, ip.b[0], ip.b[1], ip.b[2], ip.b[3], arp->retries, arp->pending_count);
+                }
             }
+        }
     } else {
         printf("The arp table is empty\n");
     }
+
+    mutex_release(&arp_lock);
 }
 
 // vim: set ts=4 sw=4 expandtab:
@@ -34,6 +34,13 @@
 #define IPV4_SPLIT(a) (a & 0xFF), ((a >> 8) & 0xFF), ((a >> 16) & 0xFF), ((a >> 24) & 0xFF)
 #define IPV4_BCAST (0xFFFFFFFF)
 #define IPV4_NONE (0)
+#define IPV4_LOOPBACK IPV4(127, 0, 0, 1)
+
+/* anything in 127.0.0.0/8 never leaves the machine */
+static inline bool minip_is_loopback(uint32_t addr)
+{
+    return (addr & 0xff) == 127;
+}
 
 typedef int (*tx_func_t)(pktbuf_t *p);
 typedef void (*udp_callback_t)(void *data, size_t len,
@@ -81,13 +88,37 @@ typedef struct tcp_socket tcp_socket_t;
 
 status_t tcp_open_listen(tcp_socket_t **handle, uint16_t port);
 status_t tcp_accept_timeout(tcp_socket_t *listen_socket, tcp_socket_t **accept_socket, lk_time_t timeout);
+/* set the rx/tx buffer sizes of sockets accepted from a listen socket, 0 leaves one unchanged */
+status_t tcp_set_buffer_sizes(tcp_socket_t *socket, size_t rx_size, size_t tx_size);
 status_t tcp_close(tcp_socket_t *socket);
 ssize_t tcp_read(tcp_socket_t *socket, void *buf, size_t len);
 ssize_t tcp_write(tcp_socket_t *socket, const void *buf, size_t len);
 
+/* zero copy writes. the memory is not copied into the socket, segments reference
+ * it directly, so it must stay untouched until the peer has acked all of it and
+ * the driver has let go of the last segment sent from it. then the callback runs
+ * with NO_ERROR (or with an error if the connection went away first). it runs
+ * from whatever frees that last segment, possibly a driver's interrupt handler,
+ * so it must not block or call back into the socket. */
+typedef void (*tcp_write_callback_t)(void *arg, const void *buf, size_t len, status_t err);
+status_t tcp_write_zerocopy(tcp_socket_t *socket, const void *buf, size_t len, tcp_write_callback_t callback, void *arg);
+
+/* send the payload of a pktbuf chain by reference. it is freed once it has all
+ * been acked. on success the socket owns p. */
+status_t tcp_write_pktbuf(tcp_socket_t *socket, pktbuf_t *p);
+
 static inline status_t tcp_accept(tcp_socket_t *listen_socket, tcp_socket_t **accept_socket)
 {
     return tcp_accept_timeout(listen_socket, accept_socket, INFINITE_TIME);
 }
 
+/* actively open a connection to addr:port. 0 for a buffer size uses the default. */
+status_t tcp_connect_etc(tcp_socket_t **handle, uint32_t addr, uint16_t port,
+                         size_t rx_size, size_t tx_size, lk_time_t timeout);
+
+static inline status_t tcp_connect(tcp_socket_t **handle, uint32_t addr, uint16_t port)
+{
+    return tcp_connect_etc(handle, addr, port, 0, 0, INFINITE_TIME);
+}
+
 // vim: set ts=4 sw=4 expandtab:
@@ -28,22 +28,46 @@
 #include <list.h>
 
 #define PKTBUF_SIZE 2048
-#define PKTBUF_BUF_SIZE 1984
+#define PKTBUF_HDR_SIZE 128
+#define PKTBUF_BUF_SIZE (PKTBUF_SIZE - PKTBUF_HDR_SIZE)
 #define PKTBUF_MAX_DATA 1536
 #define PKTBUF_MAX_HDR (PKTBUF_BUF_SIZE - PKTBUF_MAX_DATA)
 
+struct pktbuf;
+struct pktbuf_slab;
+
+// called once the last reference to external storage is gone, err is
+// whatever the owner left in the pktbuf's status. may run in any context
+// a pktbuf can be freed from, including interrupt handlers.
+typedef void (*pktbuf_free_callback_t)(void *arg, const void *buf, size_t len, status_t err);
+
+// a packet is a chain of segments linked through next, the first of
+// which owns the rest. pool segments carry PKTBUF_BUF_SIZE bytes of
+// storage right behind the header; header only segments point at
+// storage lent by someone else, either another pktbuf (a clone) or
+// arbitrary memory with a callback to give it back (external).
 typedef struct pktbuf {
 	struct list_node list;
+	struct pktbuf *next;
 	u8 *data;
 	u32 dlen;
-	u32 phys_base;
-	u32 rsv0;
-	u32 rsv1;
-	u32 rsv2;
-	u8 buffer[PKTBUF_BUF_SIZE];
+	u32 blen;
+	u8 *buffer;
+	paddr_t phys_base;
+	u32 flags;
+	volatile int ref;
+	status_t status;
+
+	struct pktbuf *parent;
+	pktbuf_free_callback_t free_cb;
+	void *free_arg;
+	struct pktbuf_slab *slab;
 } pktbuf_t;
 
-static inline u32 pktbuf_data_phys(pktbuf_t *p) {
+#define PKTBUF_FLAG_HDR_ONLY (1 << 0)  // no storage of its own
+#define PKTBUF_FLAG_EXTERNAL (1 << 1)  // storage is lent memory, not a pool buffer
+
+static inline paddr_t pktbuf_data_phys(pktbuf_t *p) {
 	return p->phys_base + (p->data - p->buffer);
 }
 
@@ -54,15 +78,57 @@ static inline u32 pktbuf_avail_head(pktbuf_t *p) {
 
 // number of bytes available for _append or _append_data
 static inline u32 pktbuf_avail_tail(pktbuf_t *p) {
-	return PKTBUF_BUF_SIZE - (p->data - p->buffer) - p->dlen;
+	return p->blen - (p->data - p->buffer) - p->dlen;
+}
+
+// total number of bytes in a chain
+static inline size_t pktbuf_chain_len(const pktbuf_t *p) {
+	size_t len = 0;
+	for (; p; p = p->next)
+		len += p->dlen;
+	return len;
+}
+
+// number of non empty segments in a chain
+static inline uint pktbuf_chain_segments(const pktbuf_t *p) {
+	uint count = 0;
+	for (; p; p = p->next)
+		count += p->dlen ? 1 : 0;
+	return count;
 }
 
-// allocate packet buffer from buffer pool
+// allocate packet buffer from buffer pool, growing the pool if it is
+// empty and blocking if it can't grow any more
 pktbuf_t *pktbuf_alloc(void);
 
-// return packet buffer to buffer pool
+// allocate a header only segment wrapping memory owned by the caller.
+// the memory must be physically contiguous if it is going to be handed
+// to a dma engine, and stays untouched until cb runs. thread context.
+pktbuf_t *pktbuf_alloc_external(const void *buf, size_t len, pktbuf_free_callback_t cb, void *arg);
+
+// allocate a header only segment sharing len bytes of p's data starting
+// at offset. p (just that segment) is kept alive until the clone is freed.
+// thread context.
+pktbuf_t *pktbuf_clone(pktbuf_t *p, size_t offset, size_t len);
+
+// drop a reference to every segment of a chain, returning the ones that
+// hit zero to the buffer pool
 void pktbuf_free(pktbuf_t *p);
 
+// hang seg (and anything chained to it) off the end of p's chain.
+// p takes over the caller's reference.
+void pktbuf_chain(pktbuf_t *p, pktbuf_t *seg);
+
+// copy len bytes of a chain starting at offset out to buf, returns the
+// number of bytes copied
+size_t pktbuf_copy_out(const pktbuf_t *p, size_t offset, void *buf, size_t len);
+
+// collapse a chain into a single pool buffer with at least headroom bytes
+// free in front of the data. returns p if it already is one, otherwise a
+// new packet with p freed. NULL (with p untouched) if it doesn't fit or no
+// buffer could be had.
+pktbuf_t *pktbuf_linearize(pktbuf_t *p, size_t headroom);
+
 // extend buffer by sz bytes, copied from data
 void pktbuf_append_data(pktbuf_t *p, const void *data, size_t sz);
 
@@ -80,12 +146,15 @@ void *pktbuf_prepend(pktbuf_t *p, size_t sz);
 // or NULL if there were not enough bytes to consume
 void *pktbuf_consume(pktbuf_t *p, size_t sz);
 
-// remove sz bytes from the end of the pktbuf
+// remove sz bytes from the end of the chain
 void pktbuf_consume_tail(pktbuf_t *p, size_t sz);
 
 // create a new packet buffer from raw memory and add
 // it to the free pool
-void pktbuf_create(void *ptr, u32 phys, size_t size);
+void pktbuf_create(void *ptr, paddr_t phys, size_t size);
+
+// print buffer pool statistics
+void pktbuf_dump(void);
 
 #endif
 
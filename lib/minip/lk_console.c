@@ -41,6 +41,12 @@ minip_usage:
         printf("mi [c]onfig <ip addr> <port>    set default dest to <ip addr>:<port>\n");
         printf("mi [s]tatus                     print ip status\n");
         printf("mi [t]est <cnt>                 send <cnt> test packets to the configured dest\n");
+        printf("mi tcp                          dump tcp sockets with congestion and rtt state\n");
+        printf("mi pktbuf                       dump packet buffer pool stats\n");
+    } else if (!strcmp(argv[1].str, "tcp")) {
+        tcp_dump_sockets();
+    } else if (!strcmp(argv[1].str, "pktbuf")) {
+        pktbuf_dump();
     } else {
         switch(argv[1].str[0]) {
 
@@ -69,7 +75,7 @@ minip_usage:
                 memcpy(&fd.addr, ip, 4);
                 fd.port = argv[3].u;
 
-                if (arp_cache_lookup(fd.addr) == NULL) {
+                if (!arp_cache_lookup(fd.addr, NULL)) {
                     send_arp_request(fd.addr);
                 }
 
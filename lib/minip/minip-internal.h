@@ -109,18 +109,25 @@ enum {
 
 void arp_cache_init(void);
 void arp_cache_update(uint32_t addr, const uint8_t mac[6]);
-uint8_t *arp_cache_lookup(uint32_t addr);
+bool arp_cache_lookup(uint32_t addr, uint8_t mac[6]);
 void arp_cache_dump(void);
 
-uint16_t rfc1701_chksum(const uint8_t *buf, size_t len);
+/* send an ethernet frame (everything but the destination mac filled in) to the host
+ * at addr. if it isn't resolved yet the frame waits for the arp reply, and is dropped
+ * if none comes. takes ownership of p. */
+status_t arp_send(pktbuf_t *p, uint32_t addr);
+
+extern tx_func_t minip_tx_handler;
+
 uint16_t rfc768_chksum(struct ipv4_hdr *ipv4, struct udp_hdr *udp);
-uint16_t ones_sum16(uint32_t sum, const void *_buf, int len);
 
 int send_arp_request(uint32_t addr);
 
 status_t minip_ipv4_send(pktbuf_t *p, uint32_t dest_addr, uint8_t proto);
 
+void tcp_init(void);
 void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip);
+void tcp_dump_sockets(void);
 
 // timers
 typedef void (*net_timer_callback_t)(void *);
@@ -30,9 +30,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <trace.h>
+#include <err.h>
 #include <malloc.h>
 #include <list.h>
+#include <lib/cksum.h>
+#include <kernel/debug.h>
 #include <kernel/mutex.h>
+#include <kernel/event.h>
+#include <kernel/thread.h>
 
 struct udp_listener {
     struct list_node list;
@@ -58,7 +63,16 @@ static uint8_t bcast_mac[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
 
 static char minip_hostname[32] = "";
 
-static mutex_t tx_mutex;
+/* packets addressed to ourselves are queued here and fed back into the receive
+ * path from a thread, so a sender never re-enters the stack holding its own locks */
+#ifndef MINIP_LOOPBACK_QUEUE_LEN
+#define MINIP_LOOPBACK_QUEUE_LEN 16
+#endif
+
+static struct list_node loopback_queue = LIST_INITIAL_VALUE(loopback_queue);
+static uint loopback_queue_len;
+static mutex_t loopback_lock = MUTEX_INITIAL_VALUE(loopback_lock);
+static event_t loopback_event = EVENT_INITIAL_VALUE(loopback_event, false, EVENT_FLAG_AUTOUNSIGNAL);
 
 void minip_set_hostname(const char *name) {
     size_t len = strlen(name);
@@ -114,6 +128,53 @@ void minip_set_ipaddr(const uint32_t addr) {
     compute_broadcast_address();
 }
 
+static int loopback_thread(void *arg)
+{
+    for (;;) {
+        event_wait(&loopback_event);
+
+        for (;;) {
+            mutex_acquire(&loopback_lock);
+            pktbuf_t *p = list_remove_head_type(&loopback_queue, pktbuf_t, list);
+            if (p)
+                loopback_queue_len--;
+            mutex_release(&loopback_lock);
+
+            if (!p)
+                break;
+
+            minip_rx_driver_callback(p);
+            pktbuf_free(p);
+        }
+    }
+
+    return 0;
+}
+
+static void loopback_init(void)
+{
+    thread_detach_and_resume(thread_create("minip loopback", &loopback_thread, NULL, DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
+}
+
+static void loopback_send(pktbuf_t *p)
+{
+    mutex_acquire(&loopback_lock);
+
+    /* drop when full, like any other interface would */
+    if (loopback_queue_len >= MINIP_LOOPBACK_QUEUE_LEN) {
+        mutex_release(&loopback_lock);
+        pktbuf_free(p);
+        return;
+    }
+
+    list_add_tail(&loopback_queue, &p->list);
+    loopback_queue_len++;
+
+    mutex_release(&loopback_lock);
+
+    event_signal(&loopback_event, false);
+}
+
 /* This function is called by minip to send packets */
 tx_func_t minip_tx_handler;
 void *minip_tx_arg;
@@ -129,9 +190,10 @@ void minip_init(tx_func_t tx_handler, void *tx_arg,
     minip_gateway = gateway;
     compute_broadcast_address();
 
-    mutex_init(&tx_mutex);
     arp_cache_init();
     net_timer_init();
+    tcp_init();
+    loopback_init();
 }
 
 uint16_t ipv4_payload_len(struct ipv4_hdr *pkt)
@@ -146,7 +208,7 @@ static void fill_in_mac_header(struct eth_hdr *pkt, uint8_t *dst, uint16_t type)
     pkt->type = htons(type);
 }
 
-static void fill_in_ipv4_header(struct ipv4_hdr *ipv4, uint32_t dst, uint8_t proto, uint16_t len)
+static void fill_in_ipv4_header(struct ipv4_hdr *ipv4, uint32_t src, uint32_t dst, uint8_t proto, uint16_t len)
 {
     ipv4->ver_ihl       = 0x45;
     ipv4->dscp_ecn      = 0;
@@ -156,11 +218,11 @@ static void fill_in_ipv4_header(struct ipv4_hdr *ipv4, uint32_t dst, uint8_t pro
     ipv4->ttl           = 64;
     ipv4->proto         = proto;
     ipv4->dst_addr      = dst;
-    ipv4->src_addr      = minip_ip;
+    ipv4->src_addr      = src;
 
     /* This may be unnecessary if the controller supports checksum offloading */
     ipv4->chksum = 0;
-    ipv4->chksum = rfc1701_chksum((uint8_t *) ipv4, sizeof(struct ipv4_hdr));
+    ipv4->chksum = inet_cksum(ipv4, sizeof(struct ipv4_hdr));
 }
 
 int send_arp_request(uint32_t addr)
@@ -191,48 +253,48 @@ int send_arp_request(uint32_t addr)
     return 0;
 }
 
-status_t minip_ipv4_send(pktbuf_t *p, uint32_t dest_addr, uint8_t proto)
+/* hosts off our subnet are reached through the gateway, if there is one */
+static uint32_t minip_next_hop(uint32_t dest_addr)
 {
-    status_t ret = 0;
-    size_t data_len = p->dlen;
-    uint8_t *dst_mac;
+    if (minip_gateway != IPV4_NONE && ((dest_addr ^ minip_ip) & minip_netmask) != 0)
+        return minip_gateway;
 
-    struct ipv4_hdr *ip = pktbuf_prepend(p, sizeof(struct ipv4_hdr));
-    struct eth_hdr *eth = pktbuf_prepend(p, sizeof(struct eth_hdr));
+    return dest_addr;
+}
 
-    mutex_acquire(&tx_mutex);
+/* send an ipv4 frame with everything but the destination mac filled in. unicast
+ * frames go through the arp layer, which holds them until the next hop resolves. */
+static status_t minip_send_ipv4_frame(pktbuf_t *p, uint32_t dest_addr)
+{
+    struct eth_hdr *eth = (struct eth_hdr *)p->data;
 
     if (dest_addr == IPV4_BCAST || dest_addr == minip_broadcast) {
-        dst_mac = bcast_mac;
-        goto ready;
+        memcpy(eth->dst_mac, bcast_mac, sizeof(eth->dst_mac));
+        return minip_tx_handler(p);
     }
 
-    /* If we're missing an address in the cache send out a request periodically for a bit */
-    dst_mac = arp_cache_lookup(dest_addr);
-    if (!dst_mac) {
-        send_arp_request(dest_addr);
-        // TODO: Add a timeout here rather than an arbitrary iteration limit
-        for (int i = 50000; i > 0; i--) {
-            if ((dst_mac = arp_cache_lookup(dest_addr)) != NULL) {
-                break;
-            }
-        }
+    return arp_send(p, minip_next_hop(dest_addr));
+}
 
-        if (dst_mac == NULL) {
-            ret = -1;
-            goto err;
-        }
-    }
+status_t minip_ipv4_send(pktbuf_t *p, uint32_t dest_addr, uint8_t proto)
+{
+    size_t data_len = pktbuf_chain_len(p);
 
-ready:
-    fill_in_mac_header(eth, dst_mac, ETH_TYPE_IPV4);
-    fill_in_ipv4_header(ip, dest_addr, proto, data_len);
+    KEVLOG_NET_TX(dest_addr, data_len);
 
-    minip_tx_handler(p);
+    struct ipv4_hdr *ip = pktbuf_prepend(p, sizeof(struct ipv4_hdr));
+    struct eth_hdr *eth = pktbuf_prepend(p, sizeof(struct eth_hdr));
+
+    /* the destination mac is our own for loopback, otherwise it's filled in once resolved */
+    fill_in_mac_header(eth, minip_mac, ETH_TYPE_IPV4);
+    fill_in_ipv4_header(ip, minip_is_loopback(dest_addr) ? dest_addr : minip_ip, dest_addr, proto, data_len);
+
+    if (minip_is_loopback(dest_addr) || (minip_ip != IPV4_NONE && dest_addr == minip_ip)) {
+        loopback_send(p);
+        return NO_ERROR;
+    }
 
-err:
-    mutex_release(&tx_mutex);
-    return ret;
+    return minip_send_ipv4_frame(p, dest_addr);
 }
 
 int minip_udp_send(const void *buf, size_t len, uint32_t addr,
@@ -242,8 +304,6 @@ int minip_udp_send(const void *buf, size_t len, uint32_t addr,
     struct eth_hdr *eth;
     struct ipv4_hdr *ip;
     struct udp_hdr *udp;
-    uint8_t *dst_mac;
-    int ret = 0;
 
     if ((p = pktbuf_alloc()) == NULL) {
         return -1;
@@ -255,49 +315,20 @@ int minip_udp_send(const void *buf, size_t len, uint32_t addr,
     memset(p->data, 0, p->dlen);
     pktbuf_append_data(p, buf, len);
 
-    mutex_acquire(&tx_mutex);
-
-    if (addr == IPV4_BCAST) {
-        dst_mac = bcast_mac;
-        goto ready;
-    }
-
-    /* If we're missing an address in the cache send out a request periodically for a bit */
-    dst_mac = arp_cache_lookup(addr);
-    if (!dst_mac) {
-        send_arp_request(addr);
-        // TODO: Add a timeout here rather than an arbitrary iteration limit
-        for (int i = 50000; i > 0; i--) {
-            if ((dst_mac = arp_cache_lookup(addr)) != NULL) {
-                break;
-            }
-        }
-
-        if (dst_mac == NULL) {
-            ret = -1;
-            goto err;
-        }
-    }
-
-ready:
     udp->src_port   = htons(srcport);
     udp->dst_port  = htons(dstport);
     udp->len        = htons(sizeof(struct udp_hdr) + len);
     udp->chksum     = 0;
     memcpy(udp->data, buf, len);
 
-    fill_in_mac_header(eth, dst_mac, ETH_TYPE_IPV4);
-    fill_in_ipv4_header(ip, addr, IP_PROTO_UDP, len + sizeof(struct udp_hdr));
+    fill_in_mac_header(eth, minip_mac, ETH_TYPE_IPV4);
+    fill_in_ipv4_header(ip, minip_ip, addr, IP_PROTO_UDP, len + sizeof(struct udp_hdr));
 
 #if (MINIP_USE_UDP_CHECKSUM != 0)
     udp->chksum = rfc768_chksum(ip, udp);
 #endif
 
-    minip_tx_handler(p);
-
-err:
-    mutex_release(&tx_mutex);
-    return ret;
+    return minip_send_ipv4_frame(p, addr);
 }
 
 /* Swap the dst/src ip addresses and send an ICMP ECHO REPLY with the same payload.
@@ -323,16 +354,19 @@ void send_ping_reply(uint32_t ipaddr, struct icmp_pkt *req, size_t reqdatalen)
 
     len = sizeof(struct icmp_pkt) + reqdatalen;
 
-    fill_in_mac_header(eth, arp_cache_lookup(ipaddr), ETH_TYPE_IPV4);
-    fill_in_ipv4_header(ip, ipaddr, IP_PROTO_ICMP, len);
+    /* the destination mac is filled in by the arp layer */
+    fill_in_mac_header(eth, minip_mac, ETH_TYPE_IPV4);
+    fill_in_ipv4_header(ip, minip_ip, ipaddr, IP_PROTO_ICMP, len);
 
     icmp->type = ICMP_ECHO_REPLY;
     icmp->code = 0;
     memcpy(icmp->hdr_data, req->hdr_data, sizeof(icmp->hdr_data));
-    icmp->chksum = 0;
-    icmp->chksum = rfc1701_chksum((uint8_t *) icmp, len);
 
-    minip_tx_handler(p);
+    /* only the type/code word differs from the request, so patch its checksum rather
+     * than summing the payload again */
+    icmp->chksum = inet_cksum_update16(req->chksum, *(const uint16_t *)req, *(const uint16_t *)icmp);
+
+    minip_send_ipv4_frame(p, ipaddr);
 }
 
 static void dump_ipv4_addr(uint32_t addr)
@@ -380,21 +414,22 @@ __NO_INLINE static void handle_ipv4_packet(pktbuf_t *p, const uint8_t *src_mac)
     }
 
     /* compute checksum */
-    if (rfc1701_chksum((void *)ip, header_len) != 0) {
+    if (inet_cksum(ip, header_len) != 0) {
         /* bad checksum */
         //LTRACEF("REJECT: bad checksum\n");
         return;
     }
 
     /* is the pkt_buf large enough to hold the length the header says the packet is? */
-    if (htons(ip->len) > p->dlen) {
-        //LTRACEF("REJECT: packet exceeds size of buffer (header %d, dlen %d)\n", htons(ip->len), p->dlen);
+    size_t len = pktbuf_chain_len(p);
+    if (htons(ip->len) > len) {
+        //LTRACEF("REJECT: packet exceeds size of buffer (header %d, len %d)\n", htons(ip->len), len);
         return;
     }
 
     /* trim any excess bytes at the end of the packet */
-    if (p->dlen > htons(ip->len)) {
-        pktbuf_consume_tail(p, p->dlen - htons(ip->len));
+    if (len > htons(ip->len)) {
+        pktbuf_consume_tail(p, len - htons(ip->len));
     }
 
     /* remove the header from the front of the packet_buf  */
@@ -402,17 +437,27 @@ __NO_INLINE static void handle_ipv4_packet(pktbuf_t *p, const uint8_t *src_mac)
         return;
     }
 
-    /* the packet is good, we can use it to populate our arp cache */
-    arp_cache_update(ip->src_addr, src_mac);
+    /* the packet is good, we can use it to populate our arp cache. only for
+     * senders on our subnet, anything else came through a router and would
+     * just fill the table with the router's mac. */
+    if (minip_ip != IPV4_NONE && ((ip->src_addr ^ minip_ip) & minip_netmask) == 0)
+        arp_cache_update(ip->src_addr, src_mac);
 
     /* see if it's for us */
     if (ip->dst_addr != IPV4_BCAST) {
-        if (minip_ip != IPV4_NONE && ip->dst_addr != minip_ip && ip->dst_addr != minip_broadcast) {
+        if (minip_ip != IPV4_NONE && ip->dst_addr != minip_ip && ip->dst_addr != minip_broadcast &&
+            !minip_is_loopback(ip->dst_addr)) {
             //LTRACEF("REJECT: for another host\n");
             return;
         }
     }
 
+    /* only tcp knows how to walk a chained payload */
+    if (p->next && ip->proto != IP_PROTO_TCP) {
+        //LTRACEF("REJECT: chained packet\n");
+        return;
+    }
+
     /* We only handle UDP and ECHO REQUEST */
     switch (ip->proto) {
         case IP_PROTO_ICMP: {
@@ -469,6 +514,11 @@ __NO_INLINE static int handle_arp_pkt(pktbuf_t *p)
             struct arp_pkt *rarp;
 
             if (memcmp(&arp->tpa, &minip_ip, sizeof(minip_ip)) == 0) {
+                /* whoever asks for us is about to talk to us, remember them */
+                uint32_t addr;
+                memcpy(&addr, &arp->spa, sizeof(addr)); // unaligned word
+                arp_cache_update(addr, arp->sha);
+
                 if ((rp = pktbuf_alloc()) == NULL) {
                     break;
                 }
@@ -510,6 +560,8 @@ void minip_rx_driver_callback(pktbuf_t *p)
 {
     struct eth_hdr *eth;
 
+    KEVLOG_NET_RX(p, p->dlen);
+
     if ((eth = (void*) pktbuf_consume(p, sizeof(struct eth_hdr))) == NULL) {
         return;
     }
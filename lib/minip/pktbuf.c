@@ -25,54 +25,516 @@
 #include <trace.h>
 #include <printf.h>
 #include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <err.h>
 
+#include <arch/ops.h>
 #include <kernel/thread.h>
-#include <kernel/semaphore.h>
+#include <kernel/mutex.h>
+#include <kernel/event.h>
 #include <kernel/spinlock.h>
 #include <lib/pktbuf.h>
+#include <lk/init.h>
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+#endif
 
+#define LOCAL_TRACE 0
+
+// buffers each cpu keeps in front of the shared free list
+#ifndef PKTBUF_CACHE_SIZE
+#define PKTBUF_CACHE_SIZE 16
+#endif
+
+// buffers carved out of the heap at a time when the pool runs dry
+#ifndef PKTBUF_GROW_COUNT
+#define PKTBUF_GROW_COUNT 16
+#endif
+
+// limit on how many buffers the pool grows by on top of what drivers created
+#ifndef PKTBUF_GROW_MAX
+#define PKTBUF_GROW_MAX 512
+#endif
+
+// grown slabs are given back once the pool has gone this long (ms) without running dry
+#ifndef PKTBUF_SHRINK_INTERVAL
+#define PKTBUF_SHRINK_INTERVAL 2000
+#endif
+
+// header only segments are allocated this many at a time, and never given back
+#ifndef PKTBUF_HDR_GROW_COUNT
+#define PKTBUF_HDR_GROW_COUNT 32
+#endif
+
+STATIC_ASSERT(sizeof(pktbuf_t) <= PKTBUF_HDR_SIZE);
+
+// a run of buffers the pool grew by
+struct pktbuf_slab {
+	struct list_node node;
+	void *base;
+	uint count;
+	uint free; // how many of them are on the shared free list
+};
+
+// each cpu only touches its own cache, the lock is for draining them all
+// from elsewhere. lock order is a cache's lock, then the pool lock.
+struct pktbuf_cache {
+	spin_lock_t lock;
+	uint count;
+	pktbuf_t *bufs[PKTBUF_CACHE_SIZE];
+	ulong hits;
+	ulong misses;
+};
+
+static struct pktbuf_cache pb_cache[SMP_MAX_CPUS];
+
+// the shared free list. buffers drivers created go on the front and grown
+// ones on the back, so the slabs drain and can be given back.
 static struct list_node pb_freelist = LIST_INITIAL_VALUE(pb_freelist);
-static semaphore_t pb_sem = SEMAPHORE_INITIAL_VALUE(pb_sem, 0);
+static struct list_node pb_slab_list = LIST_INITIAL_VALUE(pb_slab_list);
+static struct list_node pb_hdr_freelist = LIST_INITIAL_VALUE(pb_hdr_freelist);
 static spin_lock_t lock;
+static uint pb_free_count;
+static uint pb_total;
+static uint pb_grown;
+static uint pb_hdr_total;
+static bool pb_busy; // ran dry since the last shrink pass
+static ulong pb_grows;
+static ulong pb_shrinks;
+static ulong pb_waits;
+
+static mutex_t pb_grow_lock = MUTEX_INITIAL_VALUE(pb_grow_lock);
+static event_t pb_free_event = EVENT_INITIAL_VALUE(pb_free_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+static volatile int pb_waiters;
+static thread_t *pb_reaper;
+
+static paddr_t pktbuf_virt_to_phys(const void *ptr) {
+#if WITH_KERNEL_VM
+	return kvaddr_to_paddr((void *)ptr);
+#else
+	return (paddr_t)ptr;
+#endif
+}
+
+static void pktbuf_put_locked(pktbuf_t *p) {
+	if (p->slab) {
+		list_add_tail(&pb_freelist, &p->list);
+		p->slab->free++;
+	} else {
+		list_add_head(&pb_freelist, &p->list);
+	}
+	pb_free_count++;
+}
+
+static pktbuf_t *pktbuf_get_locked(void) {
+	pktbuf_t *p = list_remove_head_type(&pb_freelist, pktbuf_t, list);
+	if (p) {
+		pb_free_count--;
+		if (p->slab)
+			p->slab->free--;
+	}
+	return p;
+}
 
-void pktbuf_create(void *ptr, u32 phys, size_t size) {
+// set up the pool header at the front of PKTBUF_SIZE bytes of raw memory
+static pktbuf_t *pktbuf_init_pool(void *ptr, paddr_t phys, struct pktbuf_slab *slab) {
 	pktbuf_t *p = ptr;
+
+	p->buffer = (u8 *)ptr + PKTBUF_HDR_SIZE;
+	p->blen = PKTBUF_BUF_SIZE;
+	p->phys_base = phys + PKTBUF_HDR_SIZE;
+	p->flags = 0;
+	p->slab = slab;
+
+	return p;
+}
+
+void pktbuf_create(void *ptr, paddr_t phys, size_t size) {
 	if (size != PKTBUF_SIZE) {
 		panic("pktbuf_create: invalid size %d\n", size);
 	}
 
-	p->phys_base = phys + __offsetof(pktbuf_t, buffer);
-	p->rsv0 = 0;
-	p->rsv1 = 0;
-	p->rsv2 = 0;
-	list_add_tail(&pb_freelist, &(p->list));
-	sem_post(&pb_sem, false);
+	pktbuf_t *p = pktbuf_init_pool(ptr, phys, NULL);
+
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&lock, state);
+	pktbuf_put_locked(p);
+	pb_total++;
+	spin_unlock_irqrestore(&lock, state);
+
+	if (pb_waiters)
+		event_signal(&pb_free_event, false);
 }
 
-pktbuf_t *pktbuf_alloc(void) {
+// take a buffer from the current cpu's cache, refilling half of it
+// from the shared list in one go when it's empty
+static pktbuf_t *pktbuf_cache_alloc(void) {
+	pktbuf_t *p = NULL;
+
 	spin_lock_saved_state_t state;
+	arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
 
-	pktbuf_t *p;
+	struct pktbuf_cache *c = &pb_cache[arch_curr_cpu_num()];
+	spin_lock(&c->lock);
+	if (likely(c->count > 0)) {
+		p = c->bufs[--c->count];
+		c->hits++;
+	} else {
+		c->misses++;
+
+		spin_lock(&lock);
+		p = pktbuf_get_locked();
+		if (p) {
+			pktbuf_t *extra;
+			while (c->count < PKTBUF_CACHE_SIZE / 2 && (extra = pktbuf_get_locked()))
+				c->bufs[c->count++] = extra;
+		} else {
+			pb_busy = true;
+		}
+		spin_unlock(&lock);
+	}
+	spin_unlock(&c->lock);
+
+	arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+	return p;
+}
+
+// stash a buffer in the current cpu's cache. if it's full half of it goes
+// back to the shared list, and all of it does if anyone is waiting there.
+static void pktbuf_cache_free(pktbuf_t *p) {
+	spin_lock_saved_state_t state;
+	arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+	struct pktbuf_cache *c = &pb_cache[arch_curr_cpu_num()];
+	spin_lock(&c->lock);
+
+	// read under the cache lock, so a waiter either sees this buffer when it
+	// drains the caches or we see it waiting
+	bool waiters = pb_waiters > 0;
+	if (likely(c->count < PKTBUF_CACHE_SIZE && !waiters)) {
+		c->bufs[c->count++] = p;
+	} else {
+		uint keep = waiters ? 0 : PKTBUF_CACHE_SIZE / 2;
+
+		spin_lock(&lock);
+		pktbuf_put_locked(p);
+		while (c->count > keep)
+			pktbuf_put_locked(c->bufs[--c->count]);
+		spin_unlock(&lock);
+	}
+	spin_unlock(&c->lock);
+
+	arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+	if (waiters)
+		event_signal(&pb_free_event, false);
+}
+
+// move every cpu's cached buffers to the shared list
+static void pktbuf_cache_drain_all(void) {
+	for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+		struct pktbuf_cache *c = &pb_cache[cpu];
+
+		spin_lock_saved_state_t state;
+		spin_lock_irqsave(&c->lock, state);
+		if (c->count > 0) {
+			spin_lock(&lock);
+			while (c->count > 0)
+				pktbuf_put_locked(c->bufs[--c->count]);
+			spin_unlock(&lock);
+		}
+		spin_unlock_irqrestore(&c->lock, state);
+	}
+}
+
+// give back grown slabs that are entirely free, if the pool hasn't run dry lately
+static void pktbuf_shrink(void) {
+	struct list_node dead = LIST_INITIAL_VALUE(dead);
+	struct pktbuf_slab *slab, *temp;
+
+	// buffers sitting in the per cpu caches would keep their slabs alive
+	if (!pb_busy)
+		pktbuf_cache_drain_all();
+
+	spin_lock_saved_state_t state;
+	spin_lock_irqsave(&lock, state);
+
+	if (!pb_busy) {
+		list_for_every_entry_safe(&pb_slab_list, slab, temp, struct pktbuf_slab, node) {
+			if (slab->free != slab->count)
+				continue;
+
+			for (uint i = 0; i < slab->count; i++) {
+				pktbuf_t *p = (pktbuf_t *)((u8 *)slab->base + i * PKTBUF_SIZE);
+				list_delete(&p->list);
+			}
+			pb_free_count -= slab->count;
+			pb_total -= slab->count;
+			pb_grown -= slab->count;
+			pb_shrinks++;
+
+			list_delete(&slab->node);
+			list_add_tail(&dead, &slab->node);
+		}
+	}
+	pb_busy = false;
+
+	spin_unlock_irqrestore(&lock, state);
+
+	while ((slab = list_remove_head_type(&dead, struct pktbuf_slab, node))) {
+		LTRACEF("freeing slab %p, %u buffers\n", slab->base, slab->count);
+		free(slab->base);
+		free(slab);
+	}
+}
+
+static int pktbuf_reaper_thread(void *arg) {
+	for (;;) {
+		thread_sleep(PKTBUF_SHRINK_INTERVAL);
+		pktbuf_shrink();
+	}
+
+	return 0;
+}
 
-	sem_wait(&pb_sem);
+// add a slab of buffers from the heap to the pool. called with pb_grow_lock held.
+static status_t pktbuf_grow(void) {
+	DEBUG_ASSERT(is_mutex_held(&pb_grow_lock));
+
+	if (pb_grown + PKTBUF_GROW_COUNT > PKTBUF_GROW_MAX)
+		return ERR_NO_MEMORY;
+
+	struct pktbuf_slab *slab = malloc(sizeof(*slab));
+	if (!slab)
+		return ERR_NO_MEMORY;
+
+	// aligning to the buffer size keeps each one inside a page, so it's
+	// physically contiguous even if the slab as a whole isn't
+	slab->base = memalign(PKTBUF_SIZE, PKTBUF_GROW_COUNT * PKTBUF_SIZE);
+	if (!slab->base) {
+		free(slab);
+		return ERR_NO_MEMORY;
+	}
+	slab->count = PKTBUF_GROW_COUNT;
+	slab->free = 0;
+
+	LTRACEF("growing pool by %u buffers at %p\n", slab->count, slab->base);
+
+	spin_lock_saved_state_t state;
 	spin_lock_irqsave(&lock, state);
-	p = list_remove_head_type(&pb_freelist, pktbuf_t, list);
+	list_add_tail(&pb_slab_list, &slab->node);
+	for (uint i = 0; i < slab->count; i++) {
+		void *ptr = (u8 *)slab->base + i * PKTBUF_SIZE;
+		pktbuf_put_locked(pktbuf_init_pool(ptr, pktbuf_virt_to_phys(ptr), slab));
+	}
+	pb_total += slab->count;
+	pb_grown += slab->count;
+	pb_grows++;
 	spin_unlock_irqrestore(&lock, state);
-	if (!p)
-		return NULL;
 
+	if (!pb_reaper) {
+		pb_reaper = thread_create("pktbuf reaper", &pktbuf_reaper_thread, NULL, LOW_PRIORITY, DEFAULT_STACK_SIZE);
+		if (pb_reaper)
+			thread_detach_and_resume(pb_reaper);
+	}
+
+	return NO_ERROR;
+}
+
+static void pktbuf_reset(pktbuf_t *p) {
+	p->next = NULL;
+	p->ref = 1;
+	p->status = NO_ERROR;
+	p->parent = NULL;
+	p->free_cb = NULL;
+	p->free_arg = NULL;
+}
+
+pktbuf_t *pktbuf_alloc(void) {
+	pktbuf_t *p;
+
+	for (;;) {
+		if ((p = pktbuf_cache_alloc()))
+			break;
+
+		// grow the pool, unless someone else just did
+		mutex_acquire(&pb_grow_lock);
+		p = pktbuf_cache_alloc();
+		status_t err = p ? NO_ERROR : pktbuf_grow();
+		mutex_release(&pb_grow_lock);
+		if (p)
+			break;
+		if (err >= 0)
+			continue;
+
+		// out of room to grow, wait for a buffer to come back. the waiter count
+		// makes frees skip the per cpu caches so they show up on the shared list.
+		// frees that got in before it went up may have left buffers in their
+		// cpu's cache, so pull those onto the shared list before looking again.
+		atomic_add(&pb_waiters, 1);
+		pb_waits++;
+		pktbuf_cache_drain_all();
+		p = pktbuf_cache_alloc();
+		if (!p)
+			event_wait(&pb_free_event);
+		atomic_add(&pb_waiters, -1);
+		if (p)
+			break;
+	}
+
+	pktbuf_reset(p);
 	p->data = p->buffer + PKTBUF_MAX_HDR;
 	p->dlen = 0;
 	return p;
 }
 
-void pktbuf_free(pktbuf_t *p) {
+static pktbuf_t *pktbuf_hdr_alloc(void) {
 	spin_lock_saved_state_t state;
+
 	spin_lock_irqsave(&lock, state);
-	list_add_tail(&pb_freelist, &(p->list));
+	pktbuf_t *p = list_remove_head_type(&pb_hdr_freelist, pktbuf_t, list);
 	spin_unlock_irqrestore(&lock, state);
 
-	sem_post(&pb_sem, true);
+	if (!p) {
+		pktbuf_t *hdrs = malloc(PKTBUF_HDR_GROW_COUNT * sizeof(pktbuf_t));
+		if (!hdrs)
+			return NULL;
+
+		spin_lock_irqsave(&lock, state);
+		for (uint i = 1; i < PKTBUF_HDR_GROW_COUNT; i++)
+			list_add_tail(&pb_hdr_freelist, &hdrs[i].list);
+		pb_hdr_total += PKTBUF_HDR_GROW_COUNT;
+		spin_unlock_irqrestore(&lock, state);
+
+		p = &hdrs[0];
+	}
+
+	pktbuf_reset(p);
+	p->flags = PKTBUF_FLAG_HDR_ONLY;
+	p->slab = NULL;
+	return p;
+}
+
+pktbuf_t *pktbuf_alloc_external(const void *buf, size_t len, pktbuf_free_callback_t cb, void *arg) {
+	DEBUG_ASSERT(buf || len == 0);
+
+	pktbuf_t *p = pktbuf_hdr_alloc();
+	if (!p)
+		return NULL;
+
+	p->flags |= PKTBUF_FLAG_EXTERNAL;
+	p->buffer = p->data = (u8 *)buf;
+	p->blen = p->dlen = len;
+	p->phys_base = pktbuf_virt_to_phys(buf);
+	p->free_cb = cb;
+	p->free_arg = arg;
+
+	return p;
+}
+
+pktbuf_t *pktbuf_clone(pktbuf_t *p, size_t offset, size_t len) {
+	DEBUG_ASSERT(offset + len <= p->dlen);
+
+	pktbuf_t *c = pktbuf_hdr_alloc();
+	if (!c)
+		return NULL;
+
+	c->flags |= p->flags & PKTBUF_FLAG_EXTERNAL;
+	c->buffer = c->data = p->data + offset;
+	c->blen = c->dlen = len;
+	// lent memory is only known to be contiguous within a page
+	if (p->flags & PKTBUF_FLAG_EXTERNAL)
+		c->phys_base = pktbuf_virt_to_phys(c->data);
+	else
+		c->phys_base = pktbuf_data_phys(p) + offset;
+
+	atomic_add(&p->ref, 1);
+	c->parent = p;
+
+	return c;
+}
+
+static void pktbuf_put(pktbuf_t *p);
+
+static void pktbuf_release(pktbuf_t *p) {
+	spin_lock_saved_state_t state;
+	pktbuf_t *parent = p->parent;
+
+	if (p->free_cb)
+		p->free_cb(p->free_arg, p->buffer, p->blen, p->status);
+
+	if (p->flags & PKTBUF_FLAG_HDR_ONLY) {
+		spin_lock_irqsave(&lock, state);
+		list_add_head(&pb_hdr_freelist, &p->list);
+		spin_unlock_irqrestore(&lock, state);
+	} else {
+		pktbuf_cache_free(p);
+	}
+
+	if (parent)
+		pktbuf_put(parent);
+}
+
+// drop a reference to a single segment
+static void pktbuf_put(pktbuf_t *p) {
+	DEBUG_ASSERT(p->ref > 0);
+
+	if (atomic_add(&p->ref, -1) == 1)
+		pktbuf_release(p);
+}
+
+void pktbuf_free(pktbuf_t *p) {
+	while (p) {
+		pktbuf_t *next = p->next;
+		pktbuf_put(p);
+		p = next;
+	}
+}
+
+void pktbuf_chain(pktbuf_t *p, pktbuf_t *seg) {
+	while (p->next)
+		p = p->next;
+	p->next = seg;
+}
+
+size_t pktbuf_copy_out(const pktbuf_t *p, size_t offset, void *buf, size_t len) {
+	size_t copied = 0;
+
+	for (; p && copied < len; p = p->next) {
+		if (offset >= p->dlen) {
+			offset -= p->dlen;
+			continue;
+		}
+
+		size_t tocopy = MIN(len - copied, p->dlen - offset);
+		memcpy((u8 *)buf + copied, p->data + offset, tocopy);
+		copied += tocopy;
+		offset = 0;
+	}
+
+	return copied;
+}
+
+pktbuf_t *pktbuf_linearize(pktbuf_t *p, size_t headroom) {
+	if (!p->next && !(p->flags & PKTBUF_FLAG_HDR_ONLY) && pktbuf_avail_head(p) >= headroom)
+		return p;
+
+	size_t len = pktbuf_chain_len(p);
+	if (len + headroom > PKTBUF_BUF_SIZE)
+		return NULL;
+
+	pktbuf_t *n = pktbuf_alloc();
+	if (!n)
+		return NULL;
+
+	// keep as much headroom as there was, as far as it fits, but at least what was asked for
+	n->data = n->buffer + MAX(headroom, MIN(pktbuf_avail_head(p), PKTBUF_BUF_SIZE - len));
+	n->dlen = pktbuf_copy_out(p, 0, n->data, len);
+
+	pktbuf_free(p);
+	return n;
 }
 
 void pktbuf_append_data(pktbuf_t *p, const void *data, size_t sz) {
@@ -120,12 +582,43 @@ void *pktbuf_consume(pktbuf_t *p, size_t sz) {
 }
 
 void pktbuf_consume_tail(pktbuf_t *p, size_t sz) {
-	if (sz > p->dlen) {
-		p->dlen = 0;
-		return;
+	size_t len = pktbuf_chain_len(p);
+	size_t keep = (sz > len) ? 0 : len - sz;
+
+	for (; p; p = p->next) {
+		if (p->dlen > keep)
+			p->dlen = keep;
+		keep -= p->dlen;
 	}
+}
 
-	p->dlen -= sz;
+void pktbuf_dump(void) {
+	spin_lock_saved_state_t state;
+	uint cached = 0;
+	ulong hits = 0, misses = 0;
+
+	for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+		cached += pb_cache[cpu].count;
+		hits += pb_cache[cpu].hits;
+		misses += pb_cache[cpu].misses;
+	}
+
+	spin_lock_irqsave(&lock, state);
+	uint total = pb_total, grown = pb_grown, free_count = pb_free_count, hdrs = pb_hdr_total;
+	spin_unlock_irqrestore(&lock, state);
+
+	printf("pktbuf pool: %u buffers (%u grown), %u free, %u cached on cpus\n",
+	       total, grown, free_count, cached);
+	printf("\tcache hits %lu misses %lu, grows %lu shrinks %lu, waits %lu, %u header only segments\n",
+	       hits, misses, pb_grows, pb_shrinks, pb_waits, hdrs);
 }
 
+#if KERNEL_SPINLOCK_STATS
+static void pktbuf_init_stats(uint level) {
+	spin_lock_stats_register(&lock, "pktbuf");
+}
+
+LK_INIT_HOOK(pktbuf_stats, &pktbuf_init_stats, LK_INIT_LEVEL_HEAP);
+#endif
+
 // vim: set noexpandtab:
@@ -32,9 +32,12 @@
 #include <sys/types.h>
 #include <lib/console.h>
 #include <lib/cbuf.h>
+#include <lib/cksum.h>
 #include <kernel/mutex.h>
 #include <kernel/semaphore.h>
 #include <arch/ops.h>
+#include <platform.h>
+#include <pow2.h>
 
 #define LOCAL_TRACE 0
 
@@ -59,11 +62,54 @@ typedef struct tcp_pseudo_header {
     uint16_t tcp_length;
 } __PACKED tcp_pseudo_header_t;
 
-typedef struct tcp_mss_option {
-    uint8_t kind; /* 0x2 */
-    uint8_t len;  /* 0x4 */
-    uint16_t mss;
-} __PACKED tcp_mss_option_t;
+enum {
+    TCP_OPTION_END = 0,
+    TCP_OPTION_NOP = 1,
+    TCP_OPTION_MSS = 2,
+    TCP_OPTION_WSCALE = 3,
+    TCP_OPTION_SACK_PERMITTED = 4,
+    TCP_OPTION_SACK = 5,
+};
+
+#define TCP_MAX_WSCALE (14)
+#define TCP_MAX_SACK_BLOCKS (4) // as many as fit in the option space with room to spare
+#define TCP_SACK_SCOREBOARD (8) // sacked ranges remembered on the tx side
+
+/* a range of sequence space, right edge exclusive */
+struct tcp_sack_block {
+    uint32_t left;
+    uint32_t right;
+};
+
+/* options parsed out of an incoming segment */
+typedef struct tcp_options {
+    uint16_t mss; // 0 if not present
+    int wscale;   // -1 if not present
+    bool sack_permitted;
+    uint sack_count;
+    struct tcp_sack_block sack[TCP_MAX_SACK_BLOCKS];
+} tcp_options_t;
+
+/* a run of the transmit stream. the data lives either in the socket's tx ring or in
+ * memory lent to us by the caller, which stays untouched until the peer acks it. */
+typedef struct tcp_tx_chunk {
+    struct list_node node;
+    uint32_t len;         // bytes not acked yet
+    uint32_t ring_pos;    // free running ring offset of the first unacked byte, for ring chunks
+    const uint8_t *data;  // first unacked byte of lent memory, NULL for ring chunks
+
+    /* single pktbuf segment wrapping lent memory. segments in flight hold clones of it,
+     * so it is only given back once both the peer and the driver are done with it. */
+    pktbuf_t *pkt;
+} tcp_tx_chunk_t;
+
+/* a segment received ahead of a hole, waiting to be put in the rx buffer */
+struct tcp_ooo_segment {
+    struct list_node node;
+    uint32_t sequence;
+    uint32_t len;
+    uint8_t data[];
+};
 
 typedef enum tcp_state {
     STATE_CLOSED,
@@ -88,8 +134,27 @@ typedef enum tcp_flags {
     PKT_URG = 32
 } tcp_flags_t;
 
+/* congestion control state */
+typedef enum tcp_ca_state {
+    TCP_CA_OPEN,     // slow start or congestion avoidance
+    TCP_CA_RECOVERY, // fast recovery after three duplicate acks
+    TCP_CA_LOSS,     // resending after a retransmit timeout
+} tcp_ca_state_t;
+
+struct tcp_stats {
+    uint32_t tx_segments;
+    uint32_t retransmits;      // segments sent again, for any reason
+    uint32_t fast_retransmits; // times we entered fast recovery
+    uint32_t timeouts;         // retransmit timer expirations with data outstanding
+    uint32_t dup_acks;
+    uint32_t rtt_samples;
+};
+
+struct tcp_hash_bucket;
+
 typedef struct tcp_socket {
     struct list_node node;
+    struct tcp_hash_bucket *bucket; // hash bucket we're linked into, if any
 
     mutex_t lock;
     volatile int ref;
@@ -101,9 +166,11 @@ typedef struct tcp_socket {
     uint16_t remote_port;
 
     uint32_t mss;
+    bool sack_ok; // both sides agreed to selective acks
 
     /* rx */
-    uint32_t rx_win_size;
+    uint32_t rx_win_size; // size of the rx buffer
+    uint8_t  rx_wscale;   // shift applied to windows we advertise
     uint32_t rx_win_low;
     uint32_t rx_win_high;
     uint8_t  *rx_buffer_raw;
@@ -111,16 +178,43 @@ typedef struct tcp_socket {
     event_t  rx_event;
     int      rx_full_mss_count; // number of packets we have received in a row with a full mss
     net_timer_t ack_delay_timer;
+    struct list_node rx_ooo_list; // out of order segments, sorted and not overlapping
+    uint     rx_ooo_count;
+    uint32_t rx_ooo_last; // sequence of the newest out of order segment
 
     /* tx */
     uint32_t tx_win_low;  // low side of the acked window
     uint32_t tx_win_high; // tx_win_low + their advertised window size
     uint32_t tx_highest_seq; // highest sequence we have txed them
-    uint8_t  *tx_buffer;  // our outgoing buffer
-    uint32_t tx_buffer_size; // size of tx_buffer
-    uint32_t tx_buffer_offset; // offset into the buffer to append new data to
+    uint8_t  *tx_ring;       // ring that tcp_write() copies into
+    uint32_t tx_buffer_size; // size of tx_ring, a power of 2
+    uint32_t tx_ring_head;   // free running offset tcp_write() appends at
+    uint32_t tx_ring_tail;   // free running offset of the oldest unacked byte in the ring
+    struct list_node tx_chunk_list; // the stream from tx_win_low on, in sequence order
+    uint32_t tx_queued;      // bytes in tx_chunk_list, sent or not
+    uint8_t  tx_wscale;   // shift applied to windows they advertise
     event_t  tx_event;
     net_timer_t retransmit_timer;
+    struct tcp_sack_block tx_sacked[TCP_SACK_SCOREBOARD]; // ranges they've selectively acked, sorted
+    uint     tx_sacked_count;
+
+    /* round trip estimation (RFC 6298), in ms */
+    uint32_t srtt;        // smoothed rtt, scaled by 8
+    uint32_t rttvar;      // rtt variance, scaled by 4
+    uint32_t rto;         // current retransmit timeout, including backoff
+    bool     rtt_timing;  // a segment is being timed
+    uint32_t rtt_seq;     // sequence of the timed segment
+    lk_time_t rtt_start;
+
+    /* congestion control (RFC 5681, NewReno per RFC 6582) */
+    tcp_ca_state_t ca_state;
+    uint32_t cwnd;
+    uint32_t ssthresh;
+    uint32_t recover;     // tx_highest_seq when recovery started
+    uint32_t high_rxt;    // end of the last hole resent in this recovery (RFC 6675 HighRxt)
+    uint     dup_ack_count;
+
+    struct tcp_stats stats;
 
     /* listen accept */
     semaphore_t accept_sem;
@@ -130,11 +224,43 @@ typedef struct tcp_socket {
 } tcp_socket_t;
 
 #define DEFAULT_MSS (1460)
-#define DEFAULT_RX_WINDOW_SIZE (4096)
-#define DEFAULT_TX_BUFFER_SIZE (4096)
 
-#define RETRANSMIT_TIMEOUT (50)
+/* per socket buffer sizes, can be changed with tcp_set_buffer_sizes() */
+#ifndef TCP_DEFAULT_RX_BUFFER_SIZE
+#define TCP_DEFAULT_RX_BUFFER_SIZE (4096)
+#endif
+#ifndef TCP_DEFAULT_TX_BUFFER_SIZE
+#define TCP_DEFAULT_TX_BUFFER_SIZE (4096)
+#endif
+#ifndef TCP_MAX_BUFFER_SIZE
+#define TCP_MAX_BUFFER_SIZE (4*1024*1024)
+#endif
+
+/* most out of order segments held per socket */
+#ifndef TCP_MAX_OOO_SEGMENTS
+#define TCP_MAX_OOO_SEGMENTS (64)
+#endif
+
+/* retransmit timeout bounds, in ms. RFC 6298 asks for a 1 second floor, which is
+ * far too conservative for the local networks this stack usually talks over. */
+#ifndef TCP_INITIAL_RTO
+#define TCP_INITIAL_RTO (1000)
+#endif
+#ifndef TCP_MIN_RTO
+#define TCP_MIN_RTO (200)
+#endif
+#ifndef TCP_MAX_RTO
+#define TCP_MAX_RTO (60000)
+#endif
+#define TCP_DUP_ACK_THRESHOLD (3)
+
+/* local ports handed out by tcp_connect() */
+#define TCP_EPHEMERAL_PORT_BASE (49152)
+#define TCP_EPHEMERAL_PORT_COUNT (65536 - TCP_EPHEMERAL_PORT_BASE)
+
+#ifndef DELAYED_ACK_TIMEOUT
 #define DELAYED_ACK_TIMEOUT (50)
+#endif
 #define TIME_WAIT_TIMEOUT (60000) // 1 minute
 
 #define DO_TCP_CHECKSUM (true)
@@ -144,20 +270,56 @@ typedef struct tcp_socket {
 #define SEQUENCE_GT(a, b) ((int32_t)((a) - (b)) > 0)
 #define SEQUENCE_LT(a, b) ((int32_t)((a) - (b)) < 0)
 
-static mutex_t tcp_socket_list_lock = MUTEX_INITIAL_VALUE(tcp_socket_list_lock);
-static struct list_node tcp_socket_list = LIST_INITIAL_VALUE(tcp_socket_list);
+/* number of buckets in the connection (4-tuple) hash, must be a power of 2 */
+#ifndef TCP_HASH_BUCKETS
+#define TCP_HASH_BUCKETS (64)
+#endif
+
+/* number of buckets in the listen (local port) hash, must be a power of 2 */
+#ifndef TCP_LISTEN_BUCKETS
+#define TCP_LISTEN_BUCKETS (16)
+#endif
+
+STATIC_ASSERT((TCP_HASH_BUCKETS & (TCP_HASH_BUCKETS - 1)) == 0);
+STATIC_ASSERT((TCP_LISTEN_BUCKETS & (TCP_LISTEN_BUCKETS - 1)) == 0);
+
+/*
+ * Sockets are kept in one of two hash tables: sockets in LISTEN state are
+ * hashed by local port only, everything else by the full 4-tuple. Each bucket
+ * has its own lock, so lookups for unrelated connections don't contend.
+ * Lock order is socket lock, then bucket lock.
+ */
+struct tcp_hash_bucket {
+    mutex_t lock;
+    struct list_node list;
+};
+
+static struct tcp_hash_bucket tcp_conn_hash[TCP_HASH_BUCKETS];
+static struct tcp_hash_bucket tcp_listen_hash[TCP_LISTEN_BUCKETS];
+static uint32_t tcp_hash_seed;
+static volatile int tcp_next_ephemeral_port;
 
 /* local routines */
 static tcp_socket_t *lookup_socket(ipv4_addr remote_ip, ipv4_addr local_ip, uint16_t remote_port, uint16_t local_port);
 static void add_socket_to_list(tcp_socket_t *s);
 static void remove_socket_from_list(tcp_socket_t *s);
-static tcp_socket_t *create_tcp_socket(bool alloc_buffers);
+static tcp_socket_t *create_tcp_socket(bool alloc_buffers, uint32_t rx_size, uint32_t tx_size);
 static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip, uint16_t src_port, const void *buf,
     size_t len, tcp_flags_t flags, const void *options, size_t options_length, uint32_t ack, uint32_t sequence, uint16_t window_size);
+static status_t tcp_send_pkt(pktbuf_t *p, ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip, uint16_t src_port,
+    tcp_flags_t flags, const void *options, size_t options_length, uint32_t ack, uint32_t sequence, uint16_t window_size,
+    uint32_t payload_sum);
 static status_t tcp_socket_send(tcp_socket_t *s, const void *data, size_t len, tcp_flags_t flags, const void *options, size_t options_length, uint32_t sequence);
-static void handle_data(tcp_socket_t *s, const void *data, size_t len, uint32_t sequence);
+static status_t tcp_socket_send_pkt(tcp_socket_t *s, pktbuf_t *p, tcp_flags_t flags, const void *options, size_t options_length,
+    uint32_t sequence, uint32_t payload_sum);
+static status_t tcp_send_segment(tcp_socket_t *s, uint32_t sequence, uint32_t len);
+static void tcp_tx_flush(tcp_socket_t *s, status_t err);
+static void handle_data(tcp_socket_t *s, const pktbuf_t *p, uint32_t sequence);
 static void send_ack(tcp_socket_t *s);
-static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size);
+static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size, const tcp_options_t *opts, size_t data_len);
+static ssize_t tcp_write_pending_data(tcp_socket_t *s);
+static void tcp_rtt_sample(tcp_socket_t *s, uint32_t rtt);
+static void tcp_ca_init(tcp_socket_t *s);
 static void handle_retransmit_timeout(void *_s);
 static void handle_time_wait_timeout(void *_s);
 static void handle_delayed_ack_timeout(void *_s);
@@ -165,11 +327,20 @@ static void tcp_remote_close(tcp_socket_t *s);
 static void tcp_wakeup_waiters(tcp_socket_t *s);
 static void inc_socket_ref(tcp_socket_t *s);
 static bool dec_socket_ref(tcp_socket_t *s);
+static void tcp_ooo_flush(tcp_socket_t *s);
 
-static uint16_t cksum_pheader(const tcp_pseudo_header_t *pheader, const void *buf, size_t len)
+/* checksum a whole received chain */
+static uint16_t cksum_pheader(const tcp_pseudo_header_t *pheader, const pktbuf_t *p)
 {
-    uint16_t checksum = ones_sum16(0, pheader, sizeof(*pheader));
-    return ~ones_sum16(checksum, buf, len);
+    uint32_t sum = inet_cksum_partial(pheader, sizeof(*pheader), 0);
+    size_t offset = 0;
+
+    for (; p; p = p->next) {
+        sum = inet_cksum_block_add(sum, inet_cksum_partial(p->data, p->dlen, 0), offset);
+        offset += p->dlen;
+    }
+
+    return ~inet_cksum_fold(sum);
 }
 
 __NO_INLINE static void dump_tcp_header(const tcp_header_t *header)
@@ -203,90 +374,225 @@ static const char *tcp_state_to_string(tcp_state_t state)
     }
 }
 
+static const char *tcp_ca_state_to_string(tcp_ca_state_t state)
+{
+    switch (state) {
+        case TCP_CA_OPEN: return "open";
+        case TCP_CA_RECOVERY: return "recovery";
+        case TCP_CA_LOSS: return "loss";
+        default: return "unknown";
+    }
+}
+
 static void dump_socket(tcp_socket_t *s)
 {
     printf("socket %p: state %d (%s), local 0x%x:%hu, remote 0x%x:%hu, ref %d\n",
             s, s->state, tcp_state_to_string(s->state),
             s->local_ip, s->local_port, s->remote_ip, s->remote_port, s->ref);
+    printf("\tmss %u, wscale rx %u tx %u, sack %d, rx buf %u, tx buf %u\n",
+            s->mss, s->rx_wscale, s->tx_wscale, s->sack_ok, s->rx_win_size, s->tx_buffer_size);
     if (s->state == STATE_ESTABLISHED || s->state == STATE_CLOSE_WAIT) {
         printf("\trx: wsize %u wlo %u whi %u (%u)\n",
                 s->rx_win_size, s->rx_win_low, s->rx_win_high,
                 s->rx_win_high - s->rx_win_low);
-        printf("\ttx: wlo %u whi %u (%u) highest_seq %u (%u) bufsize %u bufoff %u\n",
+        printf("\ttx: wlo %u whi %u (%u) highest_seq %u (%u) bufsize %u ring used %u queued %u\n",
                 s->tx_win_low, s->tx_win_high, s->tx_win_high - s->tx_win_low,
                 s->tx_highest_seq, s->tx_highest_seq - s->tx_win_low,
-                s->tx_buffer_size, s->tx_buffer_offset);
+                s->tx_buffer_size, s->tx_ring_head - s->tx_ring_tail, s->tx_queued);
+        printf("\tout of order segments %u, sacked ranges %u\n", s->rx_ooo_count, s->tx_sacked_count);
+        printf("\tcc: %s cwnd %u ssthresh %u, rtt %u var %u rto %u\n",
+                tcp_ca_state_to_string(s->ca_state), s->cwnd, s->ssthresh,
+                s->srtt >> 3, s->rttvar >> 2, s->rto);
+        printf("\tstats: tx segs %u, retransmits %u, fast retransmits %u, timeouts %u, dup acks %u, rtt samples %u\n",
+                s->stats.tx_segments, s->stats.retransmits, s->stats.fast_retransmits,
+                s->stats.timeouts, s->stats.dup_acks, s->stats.rtt_samples);
     }
 }
 
+static inline uint32_t tcp_hash_mix(uint32_t h)
+{
+    h ^= h >> 16;
+    h *= 0x7feb352d;
+    h ^= h >> 15;
+    h *= 0x846ca68b;
+    h ^= h >> 16;
+    return h;
+}
+
+static struct tcp_hash_bucket *conn_bucket(ipv4_addr remote_ip, ipv4_addr local_ip, uint16_t remote_port, uint16_t local_port)
+{
+    uint32_t h = tcp_hash_mix(local_ip ^ tcp_hash_seed);
+    h = tcp_hash_mix(h ^ remote_ip);
+    h = tcp_hash_mix(h ^ (((uint32_t)remote_port << 16) | local_port));
+
+    return &tcp_conn_hash[h & (TCP_HASH_BUCKETS - 1)];
+}
+
+static struct tcp_hash_bucket *listen_bucket(uint16_t local_port)
+{
+    return &tcp_listen_hash[tcp_hash_mix(local_port ^ tcp_hash_seed) & (TCP_LISTEN_BUCKETS - 1)];
+}
+
+/* find a listening socket on a port, bucket lock must be held */
+static tcp_socket_t *lookup_listen_socket_locked(struct tcp_hash_bucket *b, uint16_t local_port)
+{
+    DEBUG_ASSERT(is_mutex_held(&b->lock));
+
+    tcp_socket_t *s;
+    list_for_every_entry(&b->list, s, tcp_socket_t, node) {
+        if (s->state == STATE_LISTEN && s->local_port == local_port)
+            return s;
+    }
+
+    return NULL;
+}
+
 static tcp_socket_t *lookup_socket(ipv4_addr remote_ip, ipv4_addr local_ip, uint16_t remote_port, uint16_t local_port)
 {
     LTRACEF("remote ip 0x%x local ip 0x%x remote port %u local port %u\n", remote_ip, local_ip, remote_port, local_port);
 
-    mutex_acquire(&tcp_socket_list_lock);
+    /* look for a full 4-tuple match first */
+    struct tcp_hash_bucket *b = conn_bucket(remote_ip, local_ip, remote_port, local_port);
 
-    /* XXX replace with something faster, like a hash table */
-    tcp_socket_t *s = NULL;
-    list_for_every_entry(&tcp_socket_list, s, tcp_socket_t, node) {
-        if (s->state == STATE_CLOSED || s->state == STATE_LISTEN) {
-            continue;
-        } else {
-            /* full check */
-            if (s->remote_ip == remote_ip &&
-                s->local_ip == local_ip &&
-                s->remote_port == remote_port &&
-                s->local_port == local_port) {
-                goto out;
-            }
-        }
-    }
+    mutex_acquire(&b->lock);
 
-    /* walk the list again, looking only for listen matches */
-    list_for_every_entry(&tcp_socket_list, s, tcp_socket_t, node) {
-        if (s->state == STATE_LISTEN) {
-            /* sockets in listen state only care about local port */
-            if (s->local_port == local_port) {
-                goto out;
-            }
+    tcp_socket_t *s;
+    list_for_every_entry(&b->list, s, tcp_socket_t, node) {
+        if (s->state != STATE_CLOSED &&
+            s->remote_ip == remote_ip &&
+            s->local_ip == local_ip &&
+            s->remote_port == remote_port &&
+            s->local_port == local_port) {
+            /* bump the ref before returning it */
+            inc_socket_ref(s);
+            mutex_release(&b->lock);
+            return s;
         }
     }
 
-    /* fall through case returns null */
-    s = NULL;
+    mutex_release(&b->lock);
 
-out:
-    /* bump the ref before returning it */
+    /* sockets in listen state only care about local port */
+    b = listen_bucket(local_port);
+
+    mutex_acquire(&b->lock);
+
+    s = lookup_listen_socket_locked(b, local_port);
     if (s)
         inc_socket_ref(s);
 
-    mutex_release(&tcp_socket_list_lock);
+    mutex_release(&b->lock);
 
     return s;
 }
 
+static struct tcp_hash_bucket *socket_bucket(tcp_socket_t *s)
+{
+    if (s->state == STATE_LISTEN)
+        return listen_bucket(s->local_port);
+    else
+        return conn_bucket(s->remote_ip, s->local_ip, s->remote_port, s->local_port);
+}
+
 static void add_socket_to_list(tcp_socket_t *s)
 {
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(s->ref > 0); // we should have implicitly bumped the ref when creating the socket
+    DEBUG_ASSERT(!s->bucket);
+
+    /* the tuple (and listen state) must be set up before the socket is published */
+    struct tcp_hash_bucket *b = socket_bucket(s);
+
+    mutex_acquire(&b->lock);
+
+    s->bucket = b;
+    list_add_head(&b->list, &s->node);
+
+    mutex_release(&b->lock);
+}
+
+/* like add_socket_to_list(), but fails if something is already listening on the port */
+static status_t add_listen_socket_to_list(tcp_socket_t *s)
+{
+    DEBUG_ASSERT(s);
+    DEBUG_ASSERT(s->ref > 0);
+    DEBUG_ASSERT(s->state == STATE_LISTEN);
+    DEBUG_ASSERT(!s->bucket);
+
+    struct tcp_hash_bucket *b = listen_bucket(s->local_port);
+
+    mutex_acquire(&b->lock);
+
+    if (lookup_listen_socket_locked(b, s->local_port)) {
+        mutex_release(&b->lock);
+        return ERR_ALREADY_EXISTS;
+    }
+
+    s->bucket = b;
+    list_add_head(&b->list, &s->node);
+
+    mutex_release(&b->lock);
+
+    return NO_ERROR;
+}
 
-    mutex_acquire(&tcp_socket_list_lock);
+/* publish an actively opened socket under a free ephemeral local port */
+static status_t add_connect_socket_to_list(tcp_socket_t *s)
+{
+    DEBUG_ASSERT(s);
+    DEBUG_ASSERT(s->ref > 0);
+    DEBUG_ASSERT(s->state == STATE_SYN_SENT);
+    DEBUG_ASSERT(!s->bucket);
+
+    for (uint i = 0; i < TCP_EPHEMERAL_PORT_COUNT; i++) {
+        s->local_port = TCP_EPHEMERAL_PORT_BASE +
+            (uint)atomic_add(&tcp_next_ephemeral_port, 1) % TCP_EPHEMERAL_PORT_COUNT;
+
+        struct tcp_hash_bucket *b = socket_bucket(s);
+
+        mutex_acquire(&b->lock);
+
+        bool in_use = false;
+        tcp_socket_t *temp;
+        list_for_every_entry(&b->list, temp, tcp_socket_t, node) {
+            if (temp->remote_ip == s->remote_ip &&
+                temp->local_ip == s->local_ip &&
+                temp->remote_port == s->remote_port &&
+                temp->local_port == s->local_port) {
+                in_use = true;
+                break;
+            }
+        }
+
+        if (!in_use) {
+            s->bucket = b;
+            list_add_head(&b->list, &s->node);
+        }
 
-    list_add_head(&tcp_socket_list, &s->node);
+        mutex_release(&b->lock);
 
-    mutex_release(&tcp_socket_list_lock);
+        if (!in_use)
+            return NO_ERROR;
+    }
+
+    return ERR_NO_RESOURCES;
 }
 
 static void remove_socket_from_list(tcp_socket_t *s)
 {
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(s->ref > 0);
+    DEBUG_ASSERT(s->bucket);
+
+    struct tcp_hash_bucket *b = s->bucket;
 
-    mutex_acquire(&tcp_socket_list_lock);
+    mutex_acquire(&b->lock);
 
     DEBUG_ASSERT(list_in_list(&s->node));
     list_delete(&s->node);
+    s->bucket = NULL;
 
-    mutex_release(&tcp_socket_list_lock);
+    mutex_release(&b->lock);
 }
 
 static void inc_socket_ref(tcp_socket_t *s)
@@ -307,11 +613,13 @@ static bool dec_socket_ref(tcp_socket_t *s)
 
     if (oldval == 1) {
         LTRACEF("destroying socket\n");
+        tcp_ooo_flush(s);
+        tcp_tx_flush(s, ERR_CHANNEL_CLOSED);
         event_destroy(&s->tx_event);
         event_destroy(&s->rx_event);
 
         free(s->rx_buffer_raw);
-        free(s->tx_buffer);
+        free(s->tx_ring);
 
         free(s);
     }
@@ -337,6 +645,456 @@ static void tcp_timer_cancel(tcp_socket_t *s, net_timer_t *timer)
         dec_socket_ref(s);
 }
 
+static uint32_t get_be32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void put_be32(uint8_t *p, uint32_t val)
+{
+    p[0] = val >> 24;
+    p[1] = val >> 16;
+    p[2] = val >> 8;
+    p[3] = val;
+}
+
+static void parse_tcp_options(const uint8_t *opt, size_t len, tcp_options_t *opts)
+{
+    memset(opts, 0, sizeof(*opts));
+    opts->wscale = -1;
+
+    size_t i = 0;
+    while (i < len) {
+        uint8_t kind = opt[i];
+        if (kind == TCP_OPTION_END)
+            break;
+        if (kind == TCP_OPTION_NOP) {
+            i++;
+            continue;
+        }
+
+        /* everything else is kind, length, data */
+        if (i + 1 >= len)
+            break;
+        uint8_t olen = opt[i + 1];
+        if (olen < 2 || i + olen > len)
+            break;
+
+        switch (kind) {
+            case TCP_OPTION_MSS:
+                if (olen == 4)
+                    opts->mss = (opt[i + 2] << 8) | opt[i + 3];
+                break;
+            case TCP_OPTION_WSCALE:
+                if (olen == 3)
+                    opts->wscale = MIN(opt[i + 2], TCP_MAX_WSCALE);
+                break;
+            case TCP_OPTION_SACK_PERMITTED:
+                if (olen == 2)
+                    opts->sack_permitted = true;
+                break;
+            case TCP_OPTION_SACK:
+                for (uint b = 0; b < (olen - 2U) / 8 && opts->sack_count < TCP_MAX_SACK_BLOCKS; b++) {
+                    opts->sack[opts->sack_count].left = get_be32(&opt[i + 2 + b * 8]);
+                    opts->sack[opts->sack_count].right = get_be32(&opt[i + 2 + b * 8 + 4]);
+                    opts->sack_count++;
+                }
+                break;
+        }
+
+        i += olen;
+    }
+}
+
+/* smallest shift that lets a window of this size fit in the 16 bit header field */
+static uint8_t tcp_wscale_for_size(uint32_t size)
+{
+    uint8_t shift = 0;
+    while (shift < TCP_MAX_WSCALE && (size >> shift) > 0xffff)
+        shift++;
+    return shift;
+}
+
+/* stash a segment that arrived ahead of rx_win_low, trimming whatever we already hold */
+static void tcp_ooo_insert(tcp_socket_t *s, const pktbuf_t *p, uint32_t sequence, uint32_t len)
+{
+    DEBUG_ASSERT(is_mutex_held(&s->lock));
+
+    struct tcp_ooo_segment *seg, *temp;
+    struct list_node *insert_before = &s->rx_ooo_list;
+    size_t offset = 0;
+
+    list_for_every_entry_safe(&s->rx_ooo_list, seg, temp, struct tcp_ooo_segment, node) {
+        uint32_t end = sequence + len;
+        uint32_t seg_end = seg->sequence + seg->len;
+
+        if (SEQUENCE_LTE(seg_end, sequence))
+            continue;
+        if (SEQUENCE_GTE(seg->sequence, end)) {
+            insert_before = &seg->node;
+            break;
+        }
+
+        if (SEQUENCE_LTE(seg->sequence, sequence)) {
+            /* it covers our front, maybe all of us */
+            if (SEQUENCE_GTE(seg_end, end))
+                return;
+            offset += seg_end - sequence;
+            len -= seg_end - sequence;
+            sequence = seg_end;
+        } else if (SEQUENCE_LTE(seg_end, end)) {
+            /* we cover all of it */
+            list_delete(&seg->node);
+            s->rx_ooo_count--;
+            free(seg);
+        } else {
+            /* it covers our back */
+            len = seg->sequence - sequence;
+            insert_before = &seg->node;
+            break;
+        }
+    }
+
+    if (len == 0 || s->rx_ooo_count >= TCP_MAX_OOO_SEGMENTS)
+        return;
+
+    seg = malloc(sizeof(*seg) + len);
+    if (!seg)
+        return;
+
+    seg->sequence = sequence;
+    seg->len = len;
+    pktbuf_copy_out(p, offset, seg->data, len);
+
+    list_add_before(insert_before, &seg->node);
+    s->rx_ooo_count++;
+    s->rx_ooo_last = sequence;
+}
+
+/* move whatever out of order data is now contiguous into the rx buffer.
+ * returns true if anything was moved. */
+static bool tcp_ooo_drain(tcp_socket_t *s)
+{
+    DEBUG_ASSERT(is_mutex_held(&s->lock));
+
+    bool moved = false;
+    struct tcp_ooo_segment *seg;
+    while ((seg = list_peek_head_type(&s->rx_ooo_list, struct tcp_ooo_segment, node))) {
+        if (SEQUENCE_GT(seg->sequence, s->rx_win_low))
+            break;
+
+        uint32_t offset = s->rx_win_low - seg->sequence;
+        if (offset < seg->len) {
+            size_t copy_len = MIN(seg->len - offset, cbuf_space_avail(&s->rx_buffer));
+            if (copy_len == 0)
+                break;
+
+            cbuf_write(&s->rx_buffer, seg->data + offset, copy_len, false);
+            s->rx_win_low += copy_len;
+            moved = true;
+
+            if (offset + copy_len < seg->len)
+                break;
+        }
+
+        list_delete(&seg->node);
+        s->rx_ooo_count--;
+        free(seg);
+    }
+
+    return moved;
+}
+
+static void tcp_ooo_flush(tcp_socket_t *s)
+{
+    struct tcp_ooo_segment *seg;
+    while ((seg = list_remove_head_type(&s->rx_ooo_list, struct tcp_ooo_segment, node)))
+        free(seg);
+    s->rx_ooo_count = 0;
+}
+
+static void sack_add_block(struct tcp_sack_block *blocks, uint *count, struct tcp_sack_block b, uint32_t newest)
+{
+    if (SEQUENCE_LTE(b.left, newest) && SEQUENCE_LT(newest, b.right)) {
+        /* the block holding the most recent segment goes first (RFC 2018) */
+        uint n = MIN(*count, TCP_MAX_SACK_BLOCKS - 1U);
+        memmove(&blocks[1], &blocks[0], n * sizeof(b));
+        blocks[0] = b;
+        *count = n + 1;
+    } else if (*count < TCP_MAX_SACK_BLOCKS) {
+        blocks[(*count)++] = b;
+    }
+}
+
+/* build a SACK option describing the out of order queue, returns its length */
+static size_t build_sack_option(tcp_socket_t *s, uint8_t *buf)
+{
+    DEBUG_ASSERT(is_mutex_held(&s->lock));
+
+    if (!s->sack_ok || list_is_empty(&s->rx_ooo_list))
+        return 0;
+
+    struct tcp_sack_block blocks[TCP_MAX_SACK_BLOCKS];
+    struct tcp_sack_block cur = { 0, 0 };
+    uint count = 0;
+    bool have = false;
+
+    struct tcp_ooo_segment *seg;
+    list_for_every_entry(&s->rx_ooo_list, seg, struct tcp_ooo_segment, node) {
+        if (have && cur.right == seg->sequence) {
+            cur.right += seg->len;
+            continue;
+        }
+        if (have)
+            sack_add_block(blocks, &count, cur, s->rx_ooo_last);
+        cur.left = seg->sequence;
+        cur.right = seg->sequence + seg->len;
+        have = true;
+    }
+    if (have)
+        sack_add_block(blocks, &count, cur, s->rx_ooo_last);
+
+    buf[0] = TCP_OPTION_NOP;
+    buf[1] = TCP_OPTION_NOP;
+    buf[2] = TCP_OPTION_SACK;
+    buf[3] = 2 + count * 8;
+    for (uint i = 0; i < count; i++) {
+        put_be32(&buf[4 + i * 8], blocks[i].left);
+        put_be32(&buf[4 + i * 8 + 4], blocks[i].right);
+    }
+
+    return 4 + count * 8;
+}
+
+/* fold a newly sacked range into the sorted scoreboard */
+static void tcp_sack_insert(tcp_socket_t *s, struct tcp_sack_block b)
+{
+    struct tcp_sack_block out[TCP_SACK_SCOREBOARD + 1];
+    uint n = 0;
+    bool placed = false;
+
+    for (uint i = 0; i < s->tx_sacked_count; i++) {
+        struct tcp_sack_block c = s->tx_sacked[i];
+
+        if (SEQUENCE_LT(c.right, b.left)) {
+            out[n++] = c;
+        } else if (placed || SEQUENCE_LT(b.right, c.left)) {
+            if (!placed) {
+                out[n++] = b;
+                placed = true;
+            }
+            out[n++] = c;
+        } else {
+            /* overlapping or touching, merge */
+            if (SEQUENCE_LT(c.left, b.left))
+                b.left = c.left;
+            if (SEQUENCE_GT(c.right, b.right))
+                b.right = c.right;
+        }
+    }
+    if (!placed)
+        out[n++] = b;
+
+    /* if it overflows, forget the highest range */
+    s->tx_sacked_count = MIN(n, (uint)TCP_SACK_SCOREBOARD);
+    memcpy(s->tx_sacked, out, s->tx_sacked_count * sizeof(b));
+}
+
+/* drop what the cumulative ack covers and add any new SACK blocks */
+static void tcp_sack_update(tcp_socket_t *s, const tcp_options_t *opts)
+{
+    DEBUG_ASSERT(is_mutex_held(&s->lock));
+
+    uint j = 0;
+    for (uint i = 0; i < s->tx_sacked_count; i++) {
+        struct tcp_sack_block b = s->tx_sacked[i];
+        if (SEQUENCE_LTE(b.right, s->tx_win_low))
+            continue;
+        if (SEQUENCE_LT(b.left, s->tx_win_low))
+            b.left = s->tx_win_low;
+        s->tx_sacked[j++] = b;
+    }
+    s->tx_sacked_count = j;
+
+    if (!opts || !s->sack_ok)
+        return;
+
+    for (uint i = 0; i < opts->sack_count; i++) {
+        struct tcp_sack_block b = opts->sack[i];
+
+        /* ignore stale blocks and ones for data we never sent */
+        if (!SEQUENCE_LT(b.left, b.right) || SEQUENCE_LTE(b.right, s->tx_win_low) ||
+                SEQUENCE_GT(b.right, s->tx_highest_seq))
+            continue;
+        if (SEQUENCE_LT(b.left, s->tx_win_low))
+            b.left = s->tx_win_low;
+
+        tcp_sack_insert(s, b);
+    }
+}
+
+static void tcp_tx_chunk_release(tcp_tx_chunk_t *c, status_t err)
+{
+    if (c->pkt) {
+        c->pkt->status = err;
+        pktbuf_free(c->pkt);
+    }
+    free(c);
+}
+
+/* copy as much as fits into the tx ring, returns the amount copied */
+static ssize_t tcp_tx_ring_write(tcp_socket_t *s, const uint8_t *buf, size_t len)
+{
+    DEBUG_ASSERT(is_mutex_held(&s->lock));
+
+    uint32_t space = s->tx_buffer_size - (s->tx_ring_head - s->tx_ring_tail);
+    len = MIN(len, space);
+    if (len == 0)
+        return 0;
+
+    /* extend the last chunk if it is in the ring, otherwise start a new one */
+    tcp_tx_chunk_t *c = list_peek_tail_type(&s->tx_chunk_list, tcp_tx_chunk_t, node);
+    if (!c || c->data) {
+        c = calloc(1, sizeof(*c));
+        if (!c)
+            return ERR_NO_MEMORY;
+        c->ring_pos = s->tx_ring_head;
+        list_add_tail(&s->tx_chunk_list, &c->node);
+    }
+
+    uint32_t pos = s->tx_ring_head & (s->tx_buffer_size - 1);
+    size_t first = MIN(len, s->tx_buffer_size - pos);
+    memcpy(s->tx_ring + pos, buf, first);
+    memcpy(s->tx_ring, buf + first, len - first);
+
+    s->tx_ring_head += len;
+    c->len += len;
+    s->tx_queued += len;
+
+    return len;
+}
+
+/* queue memory lent by the caller behind everything else */
+static void tcp_tx_queue_chunk(tcp_socket_t *s, tcp_tx_chunk_t *c)
+{
+    DEBUG_ASSERT(is_mutex_held(&s->lock));
+    DEBUG_ASSERT(c->data && c->len > 0);
+
+    list_add_tail(&s->tx_chunk_list, &c->node);
+    s->tx_queued += c->len;
+}
+
+/* put len bytes of the stream starting at sequence on the end of p. ring data is copied,
+ * lent memory is chained on by reference. the partial checksum of it all is returned in
+ * sum, ring data being summed as it is copied. */
+static status_t tcp_tx_gather(tcp_socket_t *s, uint32_t sequence, uint32_t len, pktbuf_t *p, uint32_t *sum)
+{
+    DEBUG_ASSERT(SEQUENCE_GTE(sequence, s->tx_win_low));
+    DEBUG_ASSERT(sequence - s->tx_win_low + len <= s->tx_queued);
+
+    pktbuf_t *tail = p;
+    uint32_t offset = sequence - s->tx_win_low;
+    uint32_t gathered = 0;
+
+    *sum = 0;
+    tcp_tx_chunk_t *c;
+    list_for_every_entry(&s->tx_chunk_list, c, tcp_tx_chunk_t, node) {
+        if (offset >= c->len) {
+            offset -= c->len;
+            continue;
+        }
+
+        uint32_t todo = MIN(len, c->len - offset);
+        if (c->data) {
+            size_t pkt_offset = c->data + offset - c->pkt->data;
+            for (uint32_t done = 0; done < todo; ) {
+                uint32_t piece = todo - done;
+#if WITH_KERNEL_VM
+                /* lent memory is only known to be physically contiguous within a page */
+                if (c->pkt->flags & PKTBUF_FLAG_EXTERNAL)
+                    piece = MIN(piece, PAGE_SIZE - (((uintptr_t)c->data + offset + done) & (PAGE_SIZE - 1)));
+#endif
+                pktbuf_t *seg = pktbuf_clone(c->pkt, pkt_offset + done, piece);
+                if (!seg)
+                    return ERR_NO_MEMORY;
+
+                pktbuf_chain(tail, seg);
+                tail = seg;
+                *sum = inet_cksum_block_add(*sum, inet_cksum_partial(seg->data, piece, 0), gathered + done);
+                done += piece;
+            }
+        } else {
+            if (pktbuf_avail_tail(tail) < todo) {
+                pktbuf_t *seg = pktbuf_alloc();
+                if (!seg)
+                    return ERR_NO_MEMORY;
+
+                seg->data = seg->buffer;
+                pktbuf_chain(tail, seg);
+                tail = seg;
+            }
+
+            uint8_t *buf = pktbuf_append(tail, todo);
+            uint32_t pos = (c->ring_pos + offset) & (s->tx_buffer_size - 1);
+            uint32_t first = MIN(todo, s->tx_buffer_size - pos);
+            *sum = inet_cksum_block_add(*sum, inet_cksum_copy(buf, s->tx_ring + pos, first, 0), gathered);
+            *sum = inet_cksum_block_add(*sum, inet_cksum_copy(buf + first, s->tx_ring, todo - first, 0),
+                    gathered + first);
+        }
+
+        gathered += todo;
+        len -= todo;
+        offset = 0;
+        if (len == 0)
+            break;
+    }
+
+    return NO_ERROR;
+}
+
+/* the peer acked the front of the stream, advance past it and give back lent memory */
+static void tcp_tx_ack(tcp_socket_t *s, uint32_t acked_len)
+{
+    DEBUG_ASSERT(acked_len <= s->tx_queued);
+
+    s->tx_queued -= acked_len;
+
+    tcp_tx_chunk_t *c, *temp;
+    list_for_every_entry_safe(&s->tx_chunk_list, c, temp, tcp_tx_chunk_t, node) {
+        uint32_t len = MIN(acked_len, c->len);
+
+        c->len -= len;
+        acked_len -= len;
+        if (c->data) {
+            c->data += len;
+        } else {
+            c->ring_pos += len;
+            s->tx_ring_tail += len;
+        }
+
+        if (c->len > 0)
+            break;
+
+        /* keep an empty ring chunk at the end around for the next write */
+        if (!c->data && list_next(&s->tx_chunk_list, &c->node) == NULL)
+            break;
+
+        list_delete(&c->node);
+        tcp_tx_chunk_release(c, NO_ERROR);
+    }
+}
+
+/* drop everything queued, failing any outstanding zero copy writes */
+static void tcp_tx_flush(tcp_socket_t *s, status_t err)
+{
+    tcp_tx_chunk_t *c;
+    while ((c = list_remove_head_type(&s->tx_chunk_list, tcp_tx_chunk_t, node)))
+        tcp_tx_chunk_release(c, err);
+
+    s->tx_queued = 0;
+    s->tx_ring_tail = s->tx_ring_head;
+}
+
 void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
 {
     LTRACEF("p %p (len %zu), src_ip 0x%x, dst_ip 0x%x\n", p, p->dlen, src_ip, dst_ip);
@@ -367,9 +1125,9 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
         pheader.dest_addr = dst_ip;
         pheader.zero = 0;
         pheader.protocol = IP_PROTO_TCP;
-        pheader.tcp_length = htons(p->dlen);
+        pheader.tcp_length = htons(pktbuf_chain_len(p));
 
-        uint16_t checksum = cksum_pheader(&pheader, p->data, p->dlen);
+        uint16_t checksum = cksum_pheader(&pheader, p);
         if(checksum != 0) {
             LTRACEF("REJECT: failed checksum\n");
             return;
@@ -387,9 +1145,12 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
 
     /* get some data from the packet */
     uint8_t packet_flags = header->length_flags & 0x3f;
-    size_t data_len = p->dlen - header_len;
+    size_t data_len = pktbuf_chain_len(p) - header_len;
     uint32_t highest_sequence = header->seq_num + ((data_len > 0) ? (data_len - 1) : 0);
 
+    tcp_options_t opts;
+    parse_tcp_options((const uint8_t *)(header + 1), header_len - MIN(header_len, sizeof(tcp_header_t)), &opts);
+
     /* see if it matches a socket we have */
     tcp_socket_t *s = lookup_socket(src_ip, dst_ip, header->source_port, header->dest_port);
     if (!s) {
@@ -406,6 +1167,10 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
 
     /* check to see if they're resetting us */
     if (packet_flags & PKT_RST) {
+        if (s->state == STATE_SYN_SENT) {
+            /* connection refused, wake up tcp_connect() */
+            sem_post(&s->accept_sem, true);
+        }
         if (s->state != STATE_CLOSED && s->state != STATE_LISTEN) {
             tcp_remote_close(s);
         }
@@ -430,12 +1195,12 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
                 goto done;
 
             /* make a new accept socket */
-            tcp_socket_t *accept_socket = create_tcp_socket(true);
+            tcp_socket_t *accept_socket = create_tcp_socket(true, s->rx_win_size, s->tx_buffer_size);
             if (!accept_socket)
                 goto done;
 
             /* set it up */
-            accept_socket->local_ip = minip_get_ipaddr();
+            accept_socket->local_ip = dst_ip;
             accept_socket->local_port = s->local_port;
             accept_socket->remote_ip = src_ip;
             accept_socket->remote_port = header->source_port;
@@ -453,14 +1218,41 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
             s->accepted = accept_socket;
             sem_post(&s->accept_sem, true);
 
-            /* set up a mss option for sending back */
-            tcp_mss_option_t mss_option;
-            mss_option.kind = 0x2;
-            mss_option.len = 0x4;
-            mss_option.mss = ntohs(s->mss); // XXX make sure we fit in their mss
+            /* negotiate options, only using the ones they offered */
+            uint8_t options[12];
+            size_t options_len = 0;
+
+            if (opts.mss > 0)
+                accept_socket->mss = MIN(accept_socket->mss, opts.mss);
+
+            options[options_len++] = TCP_OPTION_MSS;
+            options[options_len++] = 4;
+            options[options_len++] = s->mss >> 8;
+            options[options_len++] = s->mss;
+
+            if (opts.wscale >= 0) {
+                accept_socket->tx_wscale = opts.wscale;
+                accept_socket->rx_wscale = tcp_wscale_for_size(accept_socket->rx_win_size);
+
+                options[options_len++] = TCP_OPTION_NOP;
+                options[options_len++] = TCP_OPTION_WSCALE;
+                options[options_len++] = 3;
+                options[options_len++] = accept_socket->rx_wscale;
+            }
+
+            if (opts.sack_permitted) {
+                accept_socket->sack_ok = true;
+
+                options[options_len++] = TCP_OPTION_NOP;
+                options[options_len++] = TCP_OPTION_NOP;
+                options[options_len++] = TCP_OPTION_SACK_PERMITTED;
+                options[options_len++] = 2;
+            }
 
             /* send a response */
-            tcp_socket_send(accept_socket, NULL, 0, PKT_ACK|PKT_SYN, &mss_option, sizeof(mss_option),
+            accept_socket->rtt_timing = true;
+            accept_socket->rtt_start = current_time();
+            tcp_socket_send(accept_socket, NULL, 0, PKT_ACK|PKT_SYN, options, options_len,
                 accept_socket->tx_win_low);
 
             /* SYN consumed a sequence */
@@ -482,9 +1274,16 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
                     goto send_reset;
                 }
 
-                s->tx_win_high = s->tx_win_low + header->win_size;
+                s->tx_win_high = s->tx_win_low + ((uint32_t)header->win_size << s->tx_wscale);
                 s->tx_highest_seq = s->tx_win_low;
 
+                /* the SYN-ACK round trip is the first rtt sample */
+                if (s->rtt_timing) {
+                    s->rtt_timing = false;
+                    tcp_rtt_sample(s, current_time() - s->rtt_start);
+                }
+                tcp_ca_init(s);
+
                 s->state = STATE_ESTABLISHED;
             } else {
                 goto send_reset;
@@ -495,12 +1294,12 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
         case STATE_ESTABLISHED:
             if (packet_flags & PKT_ACK) {
                 /* they're acking us */
-                handle_ack(s, header->ack_num, header->win_size);
+                handle_ack(s, header->ack_num, header->win_size, &opts, data_len);
             }
 
             if (data_len > 0) {
                 LTRACEF("new data, len %u\n", data_len);
-                handle_data(s, p->data, p->dlen, header->seq_num);
+                handle_data(s, p, header->seq_num);
             }
 
             if ((packet_flags & PKT_FIN) && SEQUENCE_GTE(s->rx_win_low, highest_sequence)) {
@@ -521,7 +1320,7 @@ void tcp_input(pktbuf_t *p, uint32_t src_ip, uint32_t dst_ip)
         case STATE_CLOSE_WAIT:
             if (packet_flags & PKT_ACK) {
                 /* they're acking us */
-                handle_ack(s, header->ack_num, header->win_size);
+                handle_ack(s, header->ack_num, header->win_size, &opts, data_len);
             }
             if (packet_flags & PKT_FIN) {
                 /* they must have missed our ack, ack them again */
@@ -576,8 +1375,44 @@ fin_wait_2:
             /* /dev/null of packets */
             break;
 
+            /* active connect states */
         case STATE_SYN_SENT:
-            PANIC_UNIMPLEMENTED;
+            if ((packet_flags & (PKT_SYN|PKT_ACK)) != (PKT_SYN|PKT_ACK) || header->ack_num != s->tx_win_low) {
+                /* simultaneous open is not supported */
+                goto send_reset;
+            }
+
+            /* remember their sequence */
+            s->rx_win_low = header->seq_num + 1;
+            s->rx_win_high = s->rx_win_low + s->rx_win_size - 1;
+
+            /* keep only the options they agreed to */
+            if (opts.mss > 0)
+                s->mss = MIN(s->mss, opts.mss);
+            if (opts.wscale >= 0) {
+                s->tx_wscale = opts.wscale;
+            } else {
+                s->rx_wscale = 0;
+            }
+            s->sack_ok = opts.sack_permitted;
+
+            /* the window in a SYN is never scaled */
+            s->tx_win_high = s->tx_win_low + header->win_size;
+            s->tx_highest_seq = s->tx_win_low;
+
+            tcp_timer_cancel(s, &s->retransmit_timer);
+            if (s->rtt_timing) {
+                s->rtt_timing = false;
+                tcp_rtt_sample(s, current_time() - s->rtt_start);
+            }
+            tcp_ca_init(s);
+
+            s->state = STATE_ESTABLISHED;
+            send_ack(s);
+
+            /* wake up tcp_connect() */
+            sem_post(&s->accept_sem, true);
+            break;
     }
 
 done:
@@ -598,13 +1433,31 @@ send_reset:
     }
 }
 
-static void handle_data(tcp_socket_t *s, const void *data, size_t len, uint32_t sequence)
+/* copy len bytes of a received chain starting at offset into the rx buffer */
+static void tcp_rx_copy(tcp_socket_t *s, const pktbuf_t *p, size_t offset, size_t len)
 {
-    LTRACEF("data %p, len %zu, sequence %u\n", data, len, sequence);
+    for (; p && len > 0; p = p->next) {
+        if (offset >= p->dlen) {
+            offset -= p->dlen;
+            continue;
+        }
+
+        size_t tocopy = MIN(len, p->dlen - offset);
+        cbuf_write(&s->rx_buffer, p->data + offset, tocopy, false);
+        len -= tocopy;
+        offset = 0;
+    }
+}
+
+static void handle_data(tcp_socket_t *s, const pktbuf_t *p, uint32_t sequence)
+{
+    size_t len = pktbuf_chain_len(p);
+
+    LTRACEF("p %p, len %zu, sequence %u\n", p, len, sequence);
 
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(is_mutex_held(&s->lock));
-    DEBUG_ASSERT(data);
+    DEBUG_ASSERT(p);
     DEBUG_ASSERT(len > 0);
 
     /* see if it matches our current window */
@@ -613,7 +1466,7 @@ static void handle_data(tcp_socket_t *s, const void *data, size_t len, uint32_t
         /* it intersects the bottom of our window, so it's in order */
 
         /* copy the data we need to our cbuf */
-        size_t offset = sequence - s->rx_win_low;
+        size_t offset = s->rx_win_low - sequence;
         size_t copy_len = MIN(s->rx_win_high - s->rx_win_low, len - offset);
 
         DEBUG_ASSERT(offset < len);
@@ -622,7 +1475,11 @@ static void handle_data(tcp_socket_t *s, const void *data, size_t len, uint32_t
 
         s->rx_win_low += copy_len;
 
-        cbuf_write(&s->rx_buffer, (uint8_t *)data + offset, copy_len, false);
+        tcp_rx_copy(s, p, offset, copy_len);
+
+        /* it may have filled a hole, pull in anything that's now contiguous */
+        bool filled_hole = tcp_ooo_drain(s);
+
         event_signal(&s->rx_event, true);
 
         /* keep a counter if they've been sending a full mss */
@@ -632,27 +1489,51 @@ static void handle_data(tcp_socket_t *s, const void *data, size_t len, uint32_t
             s->rx_full_mss_count = 0;
         }
 
-        /* immediately ack if we're more than halfway into our buffer or they've sent 2 or more full packets */
-        if (s->rx_full_mss_count >= 2 ||
+        /* immediately ack if we're more than halfway into our buffer, they've sent 2 or more full packets,
+         * or we're recovering from a loss */
+        if (filled_hole || !list_is_empty(&s->rx_ooo_list) || s->rx_full_mss_count >= 2 ||
             (int)(s->rx_win_low + s->rx_win_size - s->rx_win_high) > (int)s->rx_win_size / 2) {
             send_ack(s);
             s->rx_full_mss_count = 0;
         } else {
             tcp_timer_set(s, &s->ack_delay_timer, &handle_delayed_ack_timeout, DELAYED_ACK_TIMEOUT);
         }
+    } else if (SEQUENCE_GT(sequence, s->rx_win_low) && SEQUENCE_LT(sequence, s->rx_win_high)) {
+        /* out of order but inside our window, hang on to it until the hole fills */
+        tcp_ooo_insert(s, p, sequence, MIN(len, s->rx_win_high - sequence));
+
+        /* duplicate ack, with SACK blocks telling them what we're holding */
+        send_ack(s);
     } else {
-        // either out of order or completely out of our window, drop
+        // completely out of our window, drop
         // duplicately ack the last thing we really got
         send_ack(s);
     }
 }
 
-static status_t tcp_socket_send(tcp_socket_t *s, const void *data, size_t len, tcp_flags_t flags, 
+static status_t tcp_socket_send(tcp_socket_t *s, const void *data, size_t len, tcp_flags_t flags,
     const void *options, size_t options_length, uint32_t sequence)
+{
+    DEBUG_ASSERT(len == 0 || data);
+
+    pktbuf_t *p = pktbuf_alloc();
+    if (!p)
+        return ERR_NO_MEMORY;
+
+    uint32_t sum = 0;
+    if (len > 0)
+        sum = inet_cksum_copy(pktbuf_append(p, len), data, len, 0);
+
+    return tcp_socket_send_pkt(s, p, flags, options, options_length, sequence, sum);
+}
+
+/* send a segment from the socket, with the payload (if any) already in p and its
+ * partial checksum in payload_sum */
+static status_t tcp_socket_send_pkt(tcp_socket_t *s, pktbuf_t *p, tcp_flags_t flags,
+    const void *options, size_t options_length, uint32_t sequence, uint32_t payload_sum)
 {
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(is_mutex_held(&s->lock));
-    DEBUG_ASSERT(len == 0 || data);
     DEBUG_ASSERT(options_length == 0 || options);
     DEBUG_ASSERT((options_length % 4) == 0);
 
@@ -662,7 +1543,7 @@ static status_t tcp_socket_send(tcp_socket_t *s, const void *data, size_t len, t
     LTRACEF("rx_win_low %u rx_win_size %u read_buf_len %d, new win high %u\n",
         s->rx_win_low, s->rx_win_size, cbuf_space_used(&s->rx_buffer), rx_win_high);
 
-    uint16_t win_size;
+    uint32_t win_size;
     if (SEQUENCE_GTE(rx_win_high, s->rx_win_high)) {
         s->rx_win_high = rx_win_high;
         win_size = rx_win_high - s->rx_win_low;
@@ -672,17 +1553,42 @@ static status_t tcp_socket_send(tcp_socket_t *s, const void *data, size_t len, t
         win_size = s->rx_win_high - s->rx_win_low;
     }
 
+    // the window in a SYN is never scaled
+    win_size >>= (flags & PKT_SYN) ? 0 : s->rx_wscale;
+    win_size = MIN(win_size, 0xffffU);
+
     // we are piggybacking a pending ACK, so clear the delayed ACK timer
     if (flags & PKT_ACK) {
         tcp_timer_cancel(s, &s->ack_delay_timer);
     }
 
-    status_t err = tcp_send(s->remote_ip, s->remote_port, s->local_ip, s->local_port, data, len, flags,
-            options, options_length, (flags & PKT_ACK) ? s->rx_win_low : 0, sequence, win_size);
+    s->stats.tx_segments++;
+
+    status_t err = tcp_send_pkt(p, s->remote_ip, s->remote_port, s->local_ip, s->local_port, flags,
+            options, options_length, (flags & PKT_ACK) ? s->rx_win_low : 0, sequence, win_size, payload_sum);
 
     return err;
 }
 
+/* send len bytes of the tx stream starting at sequence */
+static status_t tcp_send_segment(tcp_socket_t *s, uint32_t sequence, uint32_t len)
+{
+    DEBUG_ASSERT(len > 0 && len <= PKTBUF_MAX_DATA);
+
+    pktbuf_t *p = pktbuf_alloc();
+    if (!p)
+        return ERR_NO_MEMORY;
+
+    uint32_t sum;
+    status_t err = tcp_tx_gather(s, sequence, len, p, &sum);
+    if (err < 0) {
+        pktbuf_free(p);
+        return err;
+    }
+
+    return tcp_socket_send_pkt(s, p, PKT_ACK|PKT_PSH, NULL, 0, sequence, sum);
+}
+
 static void send_ack(tcp_socket_t *s)
 {
     DEBUG_ASSERT(s);
@@ -691,20 +1597,40 @@ static void send_ack(tcp_socket_t *s)
     if (s->state != STATE_ESTABLISHED && s->state != STATE_CLOSE_WAIT && s->state != STATE_FIN_WAIT_2)
         return;
 
-    tcp_socket_send(s, NULL, 0, PKT_ACK, NULL, 0, s->tx_win_low);
+    uint8_t options[4 + TCP_MAX_SACK_BLOCKS * 8];
+    size_t options_len = build_sack_option(s, options);
+
+    tcp_socket_send(s, NULL, 0, PKT_ACK, options_len ? options : NULL, options_len, s->tx_win_low);
 }
 
 static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip, uint16_t src_port, const void *buf,
     size_t len, tcp_flags_t flags, const void *options, size_t options_length, uint32_t ack, uint32_t sequence, uint16_t window_size)
 {
     DEBUG_ASSERT(len == 0 || buf);
-    DEBUG_ASSERT(options_length == 0 || options);
-    DEBUG_ASSERT((options_length % 4) == 0);
 
     pktbuf_t *p = pktbuf_alloc();
     if (!p)
         return ERR_NO_MEMORY;
 
+    /* append the data */
+    uint32_t sum = 0;
+    if (len > 0)
+        sum = inet_cksum_copy(pktbuf_append(p, len), buf, len, 0);
+
+    return tcp_send_pkt(p, dest_ip, dest_port, src_ip, src_port, flags, options, options_length, ack, sequence, window_size,
+            sum);
+}
+
+/* put a tcp header in front of the payload already in p and send it. payload_sum is the
+ * partial checksum of that payload, taken as it was put there. */
+static status_t tcp_send_pkt(pktbuf_t *p, ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip, uint16_t src_port,
+    tcp_flags_t flags, const void *options, size_t options_length, uint32_t ack, uint32_t sequence, uint16_t window_size,
+    uint32_t payload_sum)
+{
+    DEBUG_ASSERT(p);
+    DEBUG_ASSERT(options_length == 0 || options);
+    DEBUG_ASSERT((options_length % 4) == 0);
+
     tcp_header_t *header = pktbuf_prepend(p, sizeof(tcp_header_t) + options_length);
     DEBUG_ASSERT(header);
 
@@ -720,102 +1646,317 @@ static status_t tcp_send(ipv4_addr dest_ip, uint16_t dest_port, ipv4_addr src_ip
     if (options)
         memcpy(header + 1, options, options_length);
 
-    /* append the data */
-    if (len > 0)
-        pktbuf_append_data(p, buf, len);
+    /* compute the checksum */
+    if (DO_TCP_CHECKSUM) {
+        tcp_pseudo_header_t pheader;
+        pheader.source_addr = src_ip;
+        pheader.dest_addr = dest_ip;
+        pheader.zero = 0;
+        pheader.protocol = IP_PROTO_TCP;
+        pheader.tcp_length = htons(pktbuf_chain_len(p));
+
+        /* only the headers are left to sum, both an even number of bytes long */
+        uint32_t sum = inet_cksum_partial(&pheader, sizeof(pheader), payload_sum);
+        sum = inet_cksum_partial(header, sizeof(tcp_header_t) + options_length, sum);
+        header->checksum = ~inet_cksum_fold(sum);
+    }
+
+    if (LOCAL_TRACE) {
+        printf("sending ");
+        dump_tcp_header(header);
+    }
+
+    return minip_ipv4_send(p, dest_ip, IP_PROTO_TCP);
+}
+
+/* fold a round trip sample into the estimator and recompute the rto (RFC 6298 2.2, 2.3).
+ * srtt is kept scaled by 8 and rttvar by 4 so the gains are shifts. */
+static void tcp_rtt_sample(tcp_socket_t *s, uint32_t rtt)
+{
+    DEBUG_ASSERT(is_mutex_held(&s->lock));
+
+    if (s->stats.rtt_samples++ == 0) {
+        s->srtt = rtt << 3;
+        s->rttvar = rtt << 1;
+    } else {
+        int32_t err = (int32_t)rtt - (int32_t)(s->srtt >> 3);
+        s->srtt += err;
+        if (err < 0)
+            err = -err;
+        s->rttvar += err - (s->rttvar >> 2);
+    }
+
+    uint32_t rto = (s->srtt >> 3) + MAX(s->rttvar, 1U);
+    s->rto = MIN(MAX(rto, (uint32_t)TCP_MIN_RTO), (uint32_t)TCP_MAX_RTO);
+
+    LTRACEF("s %p, rtt %u srtt %u rttvar %u rto %u\n", s, rtt, s->srtt >> 3, s->rttvar >> 2, s->rto);
+}
+
+static void tcp_ca_init(tcp_socket_t *s)
+{
+    /* initial window from RFC 3390 */
+    s->cwnd = MIN(4 * s->mss, MAX(2 * s->mss, 4380U));
+    s->ssthresh = TCP_MAX_BUFFER_SIZE;
+    s->ca_state = TCP_CA_OPEN;
+    s->recover = s->tx_win_low;
+    s->high_rxt = s->tx_win_low;
+    s->dup_ack_count = 0;
+}
+
+/* send a range of already transmitted data again */
+static void tcp_resend(tcp_socket_t *s, uint32_t sequence, uint32_t len)
+{
+    DEBUG_ASSERT(SEQUENCE_GTE(sequence, s->tx_win_low));
+    DEBUG_ASSERT(SEQUENCE_LTE(sequence + len, s->tx_highest_seq));
+
+    LTRACEF("s %p, resend seq %u len %u\n", s, sequence, len);
+    tcp_send_segment(s, sequence, len);
+    s->stats.retransmits++;
+
+    /* Karn's algorithm, an ack for a resent segment is ambiguous so it can't be timed */
+    s->rtt_timing = false;
+}
+
+/* estimate of the data still in the network (RFC 6675 SetPipe). holes below the highest
+ * sacked range count as lost unless they have been resent, everything above it is still out. */
+static uint32_t tcp_pipe(tcp_socket_t *s)
+{
+    if (s->tx_sacked_count == 0)
+        return s->tx_highest_seq - s->tx_win_low;
+
+    uint32_t pipe = s->tx_highest_seq - s->tx_sacked[s->tx_sacked_count - 1].right;
+
+    uint32_t sequence = s->tx_win_low;
+    for (uint i = 0; i < s->tx_sacked_count && SEQUENCE_LT(sequence, s->high_rxt); i++) {
+        const struct tcp_sack_block *b = &s->tx_sacked[i];
+        uint32_t end = SEQUENCE_LT(b->left, s->high_rxt) ? b->left : s->high_rxt;
+
+        if (SEQUENCE_GT(end, sequence))
+            pipe += end - sequence;
+        sequence = b->right;
+    }
+
+    return pipe;
+}
+
+/* resend the holes below the highest sacked range, oldest first, for as long as the
+ * congestion window has room for them. a timeout's own resend goes out regardless. */
+static uint32_t tcp_sack_recover(tcp_socket_t *s, bool timeout)
+{
+    DEBUG_ASSERT(s->tx_sacked_count > 0);
+
+    uint32_t pipe = tcp_pipe(s);
+    uint32_t sequence = SEQUENCE_GT(s->high_rxt, s->tx_win_low) ? s->high_rxt : s->tx_win_low;
+    uint32_t sent = 0;
 
-    /* compute the checksum */
-    if (DO_TCP_CHECKSUM) {
-        tcp_pseudo_header_t pheader;
-        pheader.source_addr = src_ip;
-        pheader.dest_addr = dest_ip;
-        pheader.zero = 0;
-        pheader.protocol = IP_PROTO_TCP;
-        pheader.tcp_length = htons(p->dlen);
+    for (uint i = 0; i < s->tx_sacked_count; i++) {
+        const struct tcp_sack_block *b = &s->tx_sacked[i];
+
+        while (SEQUENCE_LT(sequence, b->left)) {
+            uint32_t tosend = MIN(s->mss, b->left - sequence);
 
-        header->checksum = cksum_pheader(&pheader, p->data, p->dlen);
+            if (!(timeout && sent == 0) && pipe + tosend > s->cwnd)
+                return sent;
+
+            tcp_resend(s, sequence, tosend);
+            sequence += tosend;
+            s->high_rxt = sequence;
+            pipe += tosend;
+            sent += tosend;
+        }
+        if (SEQUENCE_LT(sequence, b->right))
+            sequence = b->right;
     }
 
-    if (LOCAL_TRACE) {
-        printf("sending ");
-        dump_tcp_header(header);
+    return sent;
+}
+
+/* grow or deflate the congestion window for new data being acked */
+static void tcp_ca_ack(tcp_socket_t *s, uint32_t sequence, uint32_t acked_len)
+{
+    uint32_t flight = s->tx_highest_seq - s->tx_win_low;
+
+    if (s->ca_state != TCP_CA_OPEN) {
+        if (SEQUENCE_GTE(sequence, s->recover)) {
+            /* full ack, everything that was out when we noticed the loss has arrived */
+            if (s->ca_state == TCP_CA_RECOVERY)
+                s->cwnd = MIN(s->ssthresh, flight + s->mss);
+            s->ca_state = TCP_CA_OPEN;
+            return;
+        }
+
+        /* partial ack, the segment at the new left edge was lost too. with a SACK
+         * scoreboard handle_ack resends the holes as the window allows instead. */
+        if (s->tx_sacked_count == 0)
+            tcp_resend(s, s->tx_win_low, MIN(s->mss, flight));
+
+        if (s->ca_state == TCP_CA_RECOVERY) {
+            /* sack recovery holds cwnd at ssthresh and paces itself with pipe (RFC 6675) */
+            if (s->tx_sacked_count > 0)
+                return;
+
+            /* deflate by what left the network and allow one new segment (RFC 6582 3.2 step 5) */
+            s->cwnd -= MIN(s->cwnd, acked_len);
+            if (acked_len >= s->mss)
+                s->cwnd += s->mss;
+            s->cwnd = MAX(s->cwnd, s->mss);
+            return;
+        }
     }
 
-    return minip_ipv4_send(p, dest_ip, IP_PROTO_TCP);
+    if (s->cwnd < s->ssthresh) {
+        /* slow start, with appropriate byte counting (RFC 3465, L = 1 mss) */
+        s->cwnd += MIN(acked_len, s->mss);
+    } else {
+        /* congestion avoidance, about one mss per round trip */
+        s->cwnd += MAX(s->mss * s->mss / s->cwnd, 1U);
+    }
+    s->cwnd = MIN(s->cwnd, (uint32_t)TCP_MAX_BUFFER_SIZE);
+}
+
+static void tcp_ca_dup_ack(tcp_socket_t *s)
+{
+    s->stats.dup_acks++;
+    s->dup_ack_count++;
+
+    if (s->ca_state == TCP_CA_RECOVERY) {
+        /* each further duplicate means another segment has left the network, which
+         * pipe already accounts for when they're sacking */
+        if (s->tx_sacked_count == 0)
+            s->cwnd += s->mss;
+        return;
+    }
+
+    /* only start a recovery for losses after the last one ended (RFC 6582 3.2 step 2) */
+    if (s->ca_state != TCP_CA_OPEN || s->dup_ack_count != TCP_DUP_ACK_THRESHOLD ||
+            !SEQUENCE_GT(s->tx_win_low, s->recover))
+        return;
+
+    uint32_t flight = s->tx_highest_seq - s->tx_win_low;
+
+    s->ssthresh = MAX(flight / 2, 2 * s->mss);
+    s->recover = s->tx_highest_seq;
+    s->ca_state = TCP_CA_RECOVERY;
+    s->stats.fast_retransmits++;
+
+    tcp_resend(s, s->tx_win_low, MIN(s->mss, flight));
+    s->high_rxt = s->tx_win_low + MIN(s->mss, flight);
+
+    if (s->tx_sacked_count > 0)
+        s->cwnd = s->ssthresh;
+    else
+        s->cwnd = s->ssthresh + TCP_DUP_ACK_THRESHOLD * s->mss;
 }
 
-static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size)
+static void handle_ack(tcp_socket_t *s, uint32_t sequence, uint32_t win_size, const tcp_options_t *opts, size_t data_len)
 {
     LTRACEF("socket %p ack sequence %u, win_size %u\n", s, sequence, win_size);
 
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(is_mutex_held(&s->lock));
 
-    LTRACEF("s %p, tx_win_low %u tx_win_high %u tx_highest_seq %u bufsize %zu offset %zu\n",
-            s, s->tx_win_low, s->tx_win_high, s->tx_highest_seq, s->tx_buffer_size, s->tx_buffer_offset);
-    if (SEQUENCE_LTE(sequence, s->tx_win_low)) {
+    LTRACEF("s %p, tx_win_low %u tx_win_high %u tx_highest_seq %u bufsize %u queued %u\n",
+            s, s->tx_win_low, s->tx_win_high, s->tx_highest_seq, s->tx_buffer_size, s->tx_queued);
+    if (SEQUENCE_LT(sequence, s->tx_win_low)) {
         /* they're acking stuff we've already received an ack for */
         return;
     } else if (SEQUENCE_GT(sequence, s->tx_highest_seq)) {
         /* they're acking stuff we haven't sent */
         return;
-    } else {
-        /* their ack is somewhere in our window */
-        uint32_t acked_len;
+    }
 
-        acked_len = (sequence - s->tx_win_low);
+    tcp_sack_update(s, opts);
 
+    /* their ack is somewhere in our window */
+    uint32_t acked_len = (sequence - s->tx_win_low);
+    uint32_t win_high = sequence + (win_size << s->tx_wscale);
+    if (acked_len > 0) {
         LTRACEF("acked len %u\n", acked_len);
 
-        DEBUG_ASSERT(acked_len <= s->tx_buffer_size);
-        DEBUG_ASSERT(acked_len <= s->tx_buffer_offset);
+        tcp_tx_ack(s, acked_len);
+        s->tx_win_low += acked_len;
+        s->dup_ack_count = 0;
 
-        memmove(s->tx_buffer, s->tx_buffer + acked_len, s->tx_buffer_offset - acked_len);
+        if (s->rtt_timing && SEQUENCE_GT(sequence, s->rtt_seq)) {
+            s->rtt_timing = false;
+            tcp_rtt_sample(s, current_time() - s->rtt_start);
+        }
 
-        s->tx_buffer_offset -= acked_len;
-        s->tx_win_low += acked_len;
-        s->tx_win_high = s->tx_win_low + win_size;
+        tcp_ca_ack(s, sequence, acked_len);
 
         /* cancel or reset our retransmit timer */
         if (s->tx_win_low == s->tx_highest_seq) {
             tcp_timer_cancel(s, &s->retransmit_timer);
         } else {
-            tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, RETRANSMIT_TIMEOUT);
+            tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, s->rto);
         }
 
         /* we have opened the transmit buffer */
         event_signal(&s->tx_event, true);
+    } else if (data_len == 0 && s->tx_highest_seq != s->tx_win_low && win_high == s->tx_win_high) {
+        /* nothing new acked, no data and no window change with data outstanding: a duplicate */
+        tcp_ca_dup_ack(s);
     }
+
+    /* a duplicate ack can still carry a window update */
+    s->tx_win_high = win_high;
+
+    /* in recovery the scoreboard's holes go out ahead of any new data */
+    if (s->ca_state != TCP_CA_OPEN && s->tx_sacked_count > 0)
+        tcp_sack_recover(s, false);
+
+    /* which may let us send more */
+    tcp_write_pending_data(s);
 }
 
 static ssize_t tcp_write_pending_data(tcp_socket_t *s)
 {
-    LTRACEF("s %p, tx_win_low %u tx_win_high %u tx_highest_seq %u bufsize %zu offset %zu\n",
-            s, s->tx_win_low, s->tx_win_high, s->tx_highest_seq, s->tx_buffer_size, s->tx_buffer_offset);
+    LTRACEF("s %p, tx_win_low %u tx_win_high %u tx_highest_seq %u bufsize %u queued %u\n",
+            s, s->tx_win_low, s->tx_win_high, s->tx_highest_seq, s->tx_buffer_size, s->tx_queued);
 
     DEBUG_ASSERT(s);
     DEBUG_ASSERT(is_mutex_held(&s->lock));
     DEBUG_ASSERT(s->tx_buffer_size > 0);
-    DEBUG_ASSERT(s->tx_buffer_offset <= s->tx_buffer_size);
 
     /* do we have any new data to send? */
     uint32_t outstanding = (s->tx_highest_seq - s->tx_win_low);
-    uint32_t pending = s->tx_buffer_offset - outstanding;
+    uint32_t pending = s->tx_queued - outstanding;
     LTRACEF("outstanding %u, pending %u\n", outstanding, pending);
 
+    /* don't go past the right edge of their window */
+    uint32_t window = SEQUENCE_GT(s->tx_win_high, s->tx_highest_seq) ? s->tx_win_high - s->tx_highest_seq : 0;
+    if (pending > window) {
+        /* if their window is shut and nothing is in flight, the retransmit timer probes it */
+        if (window == 0 && outstanding == 0)
+            tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, s->rto);
+        pending = window;
+    }
+
+    /* or past what the congestion window allows in flight, which pipe measures in sack recovery */
+    uint32_t in_flight = (s->ca_state != TCP_CA_OPEN && s->tx_sacked_count > 0) ? tcp_pipe(s) : outstanding;
+    uint32_t cwnd_avail = (s->cwnd > in_flight) ? s->cwnd - in_flight : 0;
+    pending = MIN(pending, cwnd_avail);
+
+    /* time one segment per round trip */
+    if (pending > 0 && !s->rtt_timing) {
+        s->rtt_timing = true;
+        s->rtt_seq = s->tx_highest_seq;
+        s->rtt_start = current_time();
+    }
+
     /* send packets that cover the pending area of the window */
     uint32_t offset = 0;
     while (offset < pending) {
         uint32_t tosend = MIN(s->mss, pending - offset);
 
-        tcp_socket_send(s, s->tx_buffer + outstanding + offset, tosend, PKT_ACK|PKT_PSH, NULL, 0, s->tx_highest_seq);
+        tcp_send_segment(s, s->tx_highest_seq, tosend);
         s->tx_highest_seq += tosend;
         offset += tosend;
     }
 
     /* reset the retransmit timer if we sent anything */
     if (offset > 0) {
-        tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, RETRANSMIT_TIMEOUT);
+        tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, s->rto);
     }
 
     return offset;
@@ -831,17 +1972,53 @@ static ssize_t tcp_retransmit(tcp_socket_t *s)
 
     /* how much data have we sent but not gotten an ack for? */
     uint32_t outstanding = (s->tx_highest_seq - s->tx_win_low);
-    if (outstanding == 0)
-        return 0;
+    if (outstanding == 0) {
+        /* nothing in flight, but if there's data queued behind a closed window, probe it with a byte */
+        if (s->tx_queued == 0)
+            return 0;
+
+        LTRACEF("s %p, window probe seq %u\n", s, s->tx_win_low);
+        tcp_send_segment(s, s->tx_win_low, 1);
+        s->tx_highest_seq++;
+        return 1;
+    }
 
+    /* start on the holes they've told us about, the rest follow as acks open cwnd */
+    if (s->tx_sacked_count > 0) {
+        uint32_t sent = tcp_sack_recover(s, true);
+        if (sent > 0)
+            return sent;
+    }
+
+    /* no scoreboard, or no hole left in it (they may have reneged), resend the left edge */
     uint32_t tosend = MIN(s->mss, outstanding);
 
-    LTRACEF("s %p, tosend %u seq %u\n", s, tosend, s->tx_win_low);
-    tcp_socket_send(s, s->tx_buffer, tosend, PKT_ACK|PKT_PSH, NULL, 0, s->tx_win_low);
+    tcp_resend(s, s->tx_win_low, tosend);
 
     return tosend;
 }
 
+/* send the SYN of an active open, offering every option we understand */
+static void tcp_send_syn(tcp_socket_t *s)
+{
+    uint8_t options[12];
+
+    options[0] = TCP_OPTION_MSS;
+    options[1] = 4;
+    options[2] = s->mss >> 8;
+    options[3] = s->mss;
+    options[4] = TCP_OPTION_NOP;
+    options[5] = TCP_OPTION_WSCALE;
+    options[6] = 3;
+    options[7] = s->rx_wscale;
+    options[8] = TCP_OPTION_NOP;
+    options[9] = TCP_OPTION_NOP;
+    options[10] = TCP_OPTION_SACK_PERMITTED;
+    options[11] = 2;
+
+    tcp_socket_send(s, NULL, 0, PKT_SYN, options, sizeof(options), s->tx_win_low - 1);
+}
+
 static void handle_retransmit_timeout(void *_s)
 {
     tcp_socket_t *s = _s;
@@ -852,10 +2029,35 @@ static void handle_retransmit_timeout(void *_s)
 
     mutex_acquire(&s->lock);
 
+    if (s->state == STATE_SYN_SENT) {
+        /* they never answered our SYN, try again */
+        s->rtt_timing = false;
+        tcp_send_syn(s);
+        s->rto = MIN(s->rto * 2, (uint32_t)TCP_MAX_RTO);
+        tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, s->rto);
+        goto done;
+    }
+
+    uint32_t flight = s->tx_highest_seq - s->tx_win_low;
+    if (flight > 0 && (s->state == STATE_ESTABLISHED || s->state == STATE_CLOSE_WAIT)) {
+        /* a timeout means the ack clock is gone, restart from one segment (RFC 5681 3.1).
+         * don't halve ssthresh again if the resend itself timed out. */
+        s->stats.timeouts++;
+        if (s->ca_state != TCP_CA_LOSS)
+            s->ssthresh = MAX(flight / 2, 2 * s->mss);
+        s->cwnd = s->mss;
+        s->ca_state = TCP_CA_LOSS;
+        s->recover = s->tx_highest_seq;
+        s->high_rxt = s->tx_win_low;
+        s->dup_ack_count = 0;
+    }
+
     if (tcp_retransmit(s) == 0)
         goto done;
 
-    tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, RETRANSMIT_TIMEOUT);
+    /* back off until a fresh rtt sample recomputes it (RFC 6298 5.5) */
+    s->rto = MIN(s->rto * 2, (uint32_t)TCP_MAX_RTO);
+    tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, s->rto);
 
 done:
     mutex_release(&s->lock);
@@ -922,10 +2124,13 @@ static void tcp_remote_close(tcp_socket_t *s)
     tcp_timer_cancel(s, &s->retransmit_timer);
     tcp_timer_cancel(s, &s->ack_delay_timer);
 
+    /* nothing queued can be delivered anymore */
+    tcp_tx_flush(s, ERR_CHANNEL_CLOSED);
+
     tcp_wakeup_waiters(s);
 }
 
-static tcp_socket_t *create_tcp_socket(bool alloc_buffers)
+static tcp_socket_t *create_tcp_socket(bool alloc_buffers, uint32_t rx_size, uint32_t tx_size)
 {
     tcp_socket_t *s;
 
@@ -937,23 +2142,31 @@ static tcp_socket_t *create_tcp_socket(bool alloc_buffers)
     s->ref = 1; // start with the ref already bumped
 
     s->state = STATE_CLOSED;
-    s->rx_win_size = DEFAULT_RX_WINDOW_SIZE;
+    s->rx_win_size = rx_size;
+    list_initialize(&s->rx_ooo_list);
     event_init(&s->rx_event, false, 0);
 
     s->mss = DEFAULT_MSS;
+    s->rto = TCP_INITIAL_RTO;
 
     s->tx_win_low = rand();
     s->tx_win_high = s->tx_win_low;
     s->tx_highest_seq = s->tx_win_low;
     event_init(&s->tx_event, true, 0);
 
+    list_initialize(&s->tx_chunk_list);
+
+    /* listen sockets only remember the sizes to hand to the sockets they accept */
+    s->tx_buffer_size = tx_size;
     if (alloc_buffers) {
-        // XXX check for error
         s->rx_buffer_raw = malloc(s->rx_win_size);
-        cbuf_initialize_etc(&s->rx_buffer, s->rx_win_size, s->rx_buffer_raw);
+        s->tx_ring = malloc(s->tx_buffer_size);
+        if (!s->rx_buffer_raw || !s->tx_ring) {
+            dec_socket_ref(s);
+            return NULL;
+        }
 
-        s->tx_buffer_size = DEFAULT_TX_BUFFER_SIZE;
-        s->tx_buffer = malloc(s->tx_buffer_size);
+        cbuf_initialize_etc(&s->rx_buffer, s->rx_win_size, s->rx_buffer_raw);
     }
 
     sem_init(&s->accept_sem, 0);
@@ -961,6 +2174,21 @@ static tcp_socket_t *create_tcp_socket(bool alloc_buffers)
     return s;
 }
 
+void tcp_init(void)
+{
+    tcp_hash_seed = rand();
+    tcp_next_ephemeral_port = rand();
+
+    for (uint i = 0; i < countof(tcp_conn_hash); i++) {
+        mutex_init(&tcp_conn_hash[i].lock);
+        list_initialize(&tcp_conn_hash[i].list);
+    }
+    for (uint i = 0; i < countof(tcp_listen_hash); i++) {
+        mutex_init(&tcp_listen_hash[i].lock);
+        list_initialize(&tcp_listen_hash[i].list);
+    }
+}
+
 /* user api */
 
 status_t tcp_open_listen(tcp_socket_t **handle, uint16_t port)
@@ -970,24 +2198,61 @@ status_t tcp_open_listen(tcp_socket_t **handle, uint16_t port)
     if (!handle)
         return ERR_INVALID_ARGS;
 
-    s = create_tcp_socket(false);
+    s = create_tcp_socket(false, TCP_DEFAULT_RX_BUFFER_SIZE, TCP_DEFAULT_TX_BUFFER_SIZE);
     if (!s)
         return ERR_NO_MEMORY;
 
-    // XXX see if there's another listen socket already on this port
-
     s->local_port = port;
 
     /* go to listen state */
     s->state = STATE_LISTEN;
 
-    add_socket_to_list(s);
+    status_t err = add_listen_socket_to_list(s);
+    if (err < 0) {
+        dec_socket_ref(s);
+        return err;
+    }
 
     *handle = s;
 
     return NO_ERROR;
 }
 
+static uint32_t tcp_round_buffer_size(size_t size)
+{
+    size = MAX(size, (size_t)DEFAULT_MSS);
+    return ispow2(size) ? size : valpow2(log2_uint(size) + 1);
+}
+
+status_t tcp_set_buffer_sizes(tcp_socket_t *socket, size_t rx_size, size_t tx_size)
+{
+    if (!socket)
+        return ERR_INVALID_ARGS;
+    if (rx_size > TCP_MAX_BUFFER_SIZE || tx_size > TCP_MAX_BUFFER_SIZE)
+        return ERR_TOO_BIG;
+
+    tcp_socket_t *s = socket;
+    status_t err = NO_ERROR;
+
+    mutex_acquire(&s->lock);
+
+    if (s->state != STATE_LISTEN) {
+        err = ERR_BAD_STATE;
+        goto out;
+    }
+
+    /* the rx buffer is a cbuf and the tx buffer a ring, both want a power of 2 */
+    if (rx_size > 0)
+        s->rx_win_size = tcp_round_buffer_size(rx_size);
+    if (tx_size > 0)
+        s->tx_buffer_size = tcp_round_buffer_size(tx_size);
+
+out:
+    mutex_release(&s->lock);
+
+    return err;
+}
+
 status_t tcp_accept_timeout(tcp_socket_t *listen_socket, tcp_socket_t **accept_socket, lk_time_t timeout)
 {
     if (!listen_socket || !accept_socket)
@@ -1015,6 +2280,70 @@ status_t tcp_accept_timeout(tcp_socket_t *listen_socket, tcp_socket_t **accept_s
     return NO_ERROR;
 }
 
+status_t tcp_connect_etc(tcp_socket_t **handle, uint32_t addr, uint16_t port,
+                         size_t rx_size, size_t tx_size, lk_time_t timeout)
+{
+    if (!handle || port == 0)
+        return ERR_INVALID_ARGS;
+    if (rx_size > TCP_MAX_BUFFER_SIZE || tx_size > TCP_MAX_BUFFER_SIZE)
+        return ERR_TOO_BIG;
+
+    tcp_socket_t *s = create_tcp_socket(true,
+            rx_size ? tcp_round_buffer_size(rx_size) : TCP_DEFAULT_RX_BUFFER_SIZE,
+            tx_size ? tcp_round_buffer_size(tx_size) : TCP_DEFAULT_TX_BUFFER_SIZE);
+    if (!s)
+        return ERR_NO_MEMORY;
+
+    s->local_ip = minip_is_loopback(addr) ? addr : minip_get_ipaddr();
+    s->remote_ip = addr;
+    s->remote_port = port;
+    s->rx_wscale = tcp_wscale_for_size(s->rx_win_size);
+    s->state = STATE_SYN_SENT;
+
+    status_t err = add_connect_socket_to_list(s);
+    if (err < 0) {
+        dec_socket_ref(s);
+        return err;
+    }
+
+    LTRACEF("socket %p, local port %u\n", s, s->local_port);
+
+    /* hold a ref across the wait, the socket may be reset out from under us */
+    inc_socket_ref(s);
+
+    mutex_acquire(&s->lock);
+
+    s->rtt_timing = true;
+    s->rtt_start = current_time();
+    tcp_send_syn(s);
+
+    /* SYN consumed a sequence */
+    s->tx_win_low++;
+
+    tcp_timer_set(s, &s->retransmit_timer, &handle_retransmit_timeout, s->rto);
+
+    mutex_release(&s->lock);
+
+    /* wait for the SYN-ACK, or a reset */
+    err = sem_timedwait(&s->accept_sem, timeout);
+
+    mutex_acquire(&s->lock);
+    if (err >= 0 && s->state != STATE_ESTABLISHED)
+        err = ERR_CHANNEL_CLOSED;
+    mutex_release(&s->lock);
+
+    dec_socket_ref(s);
+
+    if (err < 0) {
+        tcp_close(s);
+        return err;
+    }
+
+    *handle = s;
+
+    return NO_ERROR;
+}
+
 ssize_t tcp_read(tcp_socket_t *socket, void *buf, size_t len)
 {
     LTRACEF("socket %p, buf %p, len %zu\n", socket, buf, len);
@@ -1100,25 +2429,25 @@ ssize_t tcp_write(tcp_socket_t *socket, const void *buf, size_t len)
             return ERR_CHANNEL_CLOSED;
         }
 
-        DEBUG_ASSERT(s->tx_buffer_size > 0);
-        DEBUG_ASSERT(s->tx_buffer_offset <= s->tx_buffer_size);
-
-        /* figure out how much data to copy in */
-        size_t to_copy = MIN(s->tx_buffer_size - s->tx_buffer_offset, len - off);
-        if (to_copy == 0) {
+        /* copy as much as fits into the ring */
+        ssize_t to_copy = tcp_tx_ring_write(s, (const uint8_t *)buf + off, len - off);
+        if (to_copy < 0) {
             mutex_release(&s->lock);
-            continue;
+            dec_socket_ref(s);
+            return to_copy;
         }
 
-        memcpy(s->tx_buffer + s->tx_buffer_offset, (uint8_t *)buf + off, to_copy);
-        s->tx_buffer_offset += to_copy;
-
-        /* if this has completely filled it, unsignal the event */
-        DEBUG_ASSERT(s->tx_buffer_offset <= s->tx_buffer_size);
-        if (s->tx_buffer_offset == s->tx_buffer_size) {
+        /* if the ring is full, unsignal the event until acks drain it */
+        DEBUG_ASSERT(s->tx_ring_head - s->tx_ring_tail <= s->tx_buffer_size);
+        if (s->tx_ring_head - s->tx_ring_tail == s->tx_buffer_size) {
             event_unsignal(&s->tx_event);
         }
 
+        if (to_copy == 0) {
+            mutex_release(&s->lock);
+            continue;
+        }
+
         /* send as much data as we can */
         tcp_write_pending_data(s);
 
@@ -1131,6 +2460,102 @@ ssize_t tcp_write(tcp_socket_t *socket, const void *buf, size_t len)
     return len;
 }
 
+/* queue a list of chunks in one go, leaving them on the list if the socket is closed */
+static status_t tcp_write_chunks(tcp_socket_t *s, struct list_node *chunks)
+{
+    mutex_acquire(&s->lock);
+
+    if (s->state != STATE_ESTABLISHED && s->state != STATE_CLOSE_WAIT) {
+        mutex_release(&s->lock);
+        return ERR_CHANNEL_CLOSED;
+    }
+
+    tcp_tx_chunk_t *c;
+    while ((c = list_remove_head_type(chunks, tcp_tx_chunk_t, node)))
+        tcp_tx_queue_chunk(s, c);
+    tcp_write_pending_data(s);
+
+    mutex_release(&s->lock);
+
+    return NO_ERROR;
+}
+
+/* free chunks that never made it onto a socket, without telling their owners */
+static void tcp_free_chunks(struct list_node *chunks)
+{
+    tcp_tx_chunk_t *c;
+    while ((c = list_remove_head_type(chunks, tcp_tx_chunk_t, node))) {
+        c->pkt->free_cb = NULL;
+        pktbuf_free(c->pkt);
+        free(c);
+    }
+}
+
+status_t tcp_write_zerocopy(tcp_socket_t *socket, const void *buf, size_t len, tcp_write_callback_t callback, void *arg)
+{
+    LTRACEF("socket %p, buf %p, len %zu\n", socket, buf, len);
+    if (!socket || !buf || len == 0 || len > UINT32_MAX)
+        return ERR_INVALID_ARGS;
+
+    tcp_tx_chunk_t *c = calloc(1, sizeof(*c));
+    if (!c)
+        return ERR_NO_MEMORY;
+
+    /* the callback rides along on the pktbuf, and runs once the last reference to it is gone */
+    c->pkt = pktbuf_alloc_external(buf, len, callback, arg);
+    if (!c->pkt) {
+        free(c);
+        return ERR_NO_MEMORY;
+    }
+    c->data = buf;
+    c->len = len;
+
+    struct list_node chunks = LIST_INITIAL_VALUE(chunks);
+    list_add_tail(&chunks, &c->node);
+
+    status_t err = tcp_write_chunks(socket, &chunks);
+    if (err < 0)
+        tcp_free_chunks(&chunks);
+
+    return err;
+}
+
+status_t tcp_write_pktbuf(tcp_socket_t *socket, pktbuf_t *p)
+{
+    LTRACEF("socket %p, p %p\n", socket, p);
+    if (!socket || !p || pktbuf_chain_len(p) == 0)
+        return ERR_INVALID_ARGS;
+
+    /* a chunk per segment, each holding a clone so the chain can be let go of as a whole */
+    struct list_node chunks = LIST_INITIAL_VALUE(chunks);
+    for (pktbuf_t *seg = p; seg; seg = seg->next) {
+        if (seg->dlen == 0)
+            continue;
+
+        tcp_tx_chunk_t *c = calloc(1, sizeof(*c));
+        if (c)
+            c->pkt = pktbuf_clone(seg, 0, seg->dlen);
+        if (!c || !c->pkt) {
+            free(c);
+            tcp_free_chunks(&chunks);
+            return ERR_NO_MEMORY;
+        }
+        c->data = c->pkt->data;
+        c->len = c->pkt->dlen;
+        list_add_tail(&chunks, &c->node);
+    }
+
+    status_t err = tcp_write_chunks(socket, &chunks);
+    if (err < 0) {
+        tcp_free_chunks(&chunks);
+        return err;
+    }
+
+    pktbuf_free(p);
+
+    return NO_ERROR;
+}
+
 status_t tcp_close(tcp_socket_t *socket)
 {
     if (!socket)
@@ -1147,6 +2572,7 @@ status_t tcp_close(tcp_socket_t *socket)
     switch (s->state) {
         case STATE_CLOSED:
         case STATE_LISTEN:
+        case STATE_SYN_SENT:
             /* we can directly remove this socket */
             remove_socket_from_list(s);
 
@@ -1201,6 +2627,190 @@ out:
 }
 
 /* debug stuff */
+static void dump_hash_table(struct tcp_hash_bucket *table, uint count)
+{
+    for (uint i = 0; i < count; i++) {
+        mutex_acquire(&table[i].lock);
+        tcp_socket_t *s = NULL;
+        list_for_every_entry(&table[i].list, s, tcp_socket_t, node) {
+            dump_socket(s);
+        }
+        mutex_release(&table[i].lock);
+    }
+}
+
+void tcp_dump_sockets(void)
+{
+    dump_hash_table(tcp_listen_hash, countof(tcp_listen_hash));
+    dump_hash_table(tcp_conn_hash, countof(tcp_conn_hash));
+}
+
+/*
+ * Time the socket demux path: populate the connection table with <count>
+ * synthetic established sockets plus a listener, then look up a mix of hits,
+ * listen hits and misses. The fake peers live in 198.18.0.0/15 (the benchmark
+ * range) so they won't collide with real traffic.
+ */
+static void tcp_lookup_bench(uint count, uint iterations)
+{
+    const ipv4_addr local_ip = minip_get_ipaddr();
+    const uint16_t local_port = 0xbe00;
+    const uint16_t listen_port = 0xbeef;
+
+    tcp_socket_t **sockets = calloc(count, sizeof(tcp_socket_t *));
+    if (!sockets) {
+        printf("not enough memory\n");
+        return;
+    }
+
+    uint created;
+    for (created = 0; created < count; created++) {
+        tcp_socket_t *s = create_tcp_socket(false, 0, 0);
+        if (!s)
+            break;
+
+        s->local_ip = local_ip;
+        s->local_port = local_port;
+        s->remote_ip = htonl(0xc6120000 + created);
+        s->remote_port = 1024 + (created % 0xf000);
+        s->state = STATE_ESTABLISHED;
+
+        add_socket_to_list(s);
+        sockets[created] = s;
+    }
+
+    tcp_socket_t *listener = NULL;
+    if (tcp_open_listen(&listener, listen_port) < 0)
+        listener = NULL;
+
+    printf("%u sockets, %u connection buckets, %u listen buckets\n",
+           created, TCP_HASH_BUCKETS, TCP_LISTEN_BUCKETS);
+
+    if (created == 0)
+        goto out;
+
+    /* established hits, walking the sockets in a scattered order */
+    uint found = 0;
+    lk_bigtime_t t = current_time_hires();
+    for (uint i = 0; i < iterations; i++) {
+        uint n = (i * 7919) % created;
+        tcp_socket_t *s = lookup_socket(htonl(0xc6120000 + n), local_ip, 1024 + (n % 0xf000), local_port);
+        if (s) {
+            found++;
+            dec_socket_ref(s);
+        }
+    }
+    t = current_time_hires() - t;
+    printf("established: %u/%u found, %llu ns/lookup\n", found, iterations,
+           (unsigned long long)(t * 1000 / iterations));
+
+    /* segments for a listening port from unknown peers */
+    found = 0;
+    t = current_time_hires();
+    for (uint i = 0; i < iterations; i++) {
+        tcp_socket_t *s = lookup_socket(htonl(0xc6130000 + i), local_ip, 1024 + (i % 0xf000), listen_port);
+        if (s) {
+            found++;
+            dec_socket_ref(s);
+        }
+    }
+    t = current_time_hires() - t;
+    printf("listen: %u/%u found, %llu ns/lookup\n", found, iterations,
+           (unsigned long long)(t * 1000 / iterations));
+
+    /* segments that match nothing and would be answered with a RST */
+    found = 0;
+    t = current_time_hires();
+    for (uint i = 0; i < iterations; i++) {
+        tcp_socket_t *s = lookup_socket(htonl(0xc6130000 + i), local_ip, 1024 + (i % 0xf000), local_port + 1);
+        if (s) {
+            found++;
+            dec_socket_ref(s);
+        }
+    }
+    t = current_time_hires() - t;
+    printf("miss: %u/%u found, %llu ns/lookup\n", found, iterations,
+           (unsigned long long)(t * 1000 / iterations));
+
+out:
+    if (listener)
+        tcp_close(listener);
+
+    for (uint i = 0; i < created; i++) {
+        tcp_socket_t *s = sockets[i];
+
+        remove_socket_from_list(s);
+        s->state = STATE_CLOSED;
+        dec_socket_ref(s);
+    }
+    free(sockets);
+}
+
+/*
+ * feed handle_data() segments that overlap data already received, the way
+ * retransmits do, and check the reader sees every byte of the stream once
+ */
+static status_t tcp_rx_overlap_test(void)
+{
+    static const struct {
+        uint32_t start;
+        uint32_t len;
+    } segs[] = {
+        { 0, 16 },
+        { 8, 16 },  // starts below rx_win_low
+        { 0, 24 },  // nothing new, dropped
+        { 20, 20 },
+        { 39, 25 },
+    };
+    const uint32_t isn = 0xfffffff0; // make the sequence numbers wrap part way through
+    uint8_t stream[64];
+    uint8_t buf[sizeof(stream) + 1];
+    status_t err = NO_ERROR;
+
+    tcp_socket_t *s = create_tcp_socket(true, 1024, 1024);
+    if (!s)
+        return ERR_NO_MEMORY;
+
+    /* left closed, so the acks handle_data() would send are skipped */
+    s->rx_win_low = isn;
+    s->rx_win_high = isn + s->rx_win_size;
+
+    for (uint i = 0; i < sizeof(stream); i++)
+        stream[i] = i * 7 + 1;
+
+    mutex_acquire(&s->lock);
+    for (uint i = 0; i < countof(segs); i++) {
+        pktbuf_t *p = pktbuf_alloc();
+        if (!p) {
+            err = ERR_NO_MEMORY;
+            break;
+        }
+
+        memcpy(pktbuf_append(p, segs[i].len), stream + segs[i].start, segs[i].len);
+        handle_data(s, p, isn + segs[i].start);
+        pktbuf_free(p);
+    }
+    mutex_release(&s->lock);
+
+    if (err == NO_ERROR) {
+        size_t len = cbuf_read(&s->rx_buffer, buf, sizeof(buf), false);
+
+        if (s->rx_win_low != isn + sizeof(stream) || len != sizeof(stream) ||
+            memcmp(buf, stream, sizeof(stream)) != 0) {
+            printf("tcp rx overlap: rx_win_low %u (want %u), read %zu bytes (want %zu)\n",
+                   s->rx_win_low - isn, (uint)sizeof(stream), len, sizeof(stream));
+            if (len > 0)
+                hexdump8(buf, MIN(len, sizeof(buf)));
+            err = ERR_GENERIC;
+        }
+    }
+
+    tcp_timer_cancel(s, &s->ack_delay_timer);
+    dec_socket_ref(s);
+
+    return err;
+}
+
 static int cmd_tcp(int argc, const cmd_args *argv)
 {
     status_t err;
@@ -1212,17 +2822,23 @@ usage:
         printf("usage: %s sockets\n", argv[0].str);
         printf("usage: %s listenclose <port>\n", argv[0].str);
         printf("usage: %s listen <port>\n", argv[0].str);
+        printf("usage: %s bench <sockets> <iterations>\n", argv[0].str);
+        printf("usage: %s rxtest\n", argv[0].str);
         return ERR_INVALID_ARGS;
     }
 
     if (!strcmp(argv[1].str, "sockets")) {
+        tcp_dump_sockets();
+    } else if (!strcmp(argv[1].str, "bench")) {
+        if (argc < 4) goto notenoughargs;
 
-        mutex_acquire(&tcp_socket_list_lock);
-        tcp_socket_t *s = NULL;
-        list_for_every_entry(&tcp_socket_list, s, tcp_socket_t, node) {
-            dump_socket(s);
-        }
-        mutex_release(&tcp_socket_list_lock);
+        if (argv[2].u == 0 || argv[3].u == 0)
+            goto usage;
+
+        tcp_lookup_bench(argv[2].u, argv[3].u);
+    } else if (!strcmp(argv[1].str, "rxtest")) {
+        err = tcp_rx_overlap_test();
+        printf("tcp rx overlap test %s (%d)\n", err == NO_ERROR ? "passed" : "FAILED", err);
     } else if (!strcmp(argv[1].str, "listenclose")) {
         /* listen for a connection, accept it, then immediately close it */
         if (argc < 3) goto notenoughargs;
@@ -212,9 +212,6 @@ enum handler_return platform_irq(struct arm64_iframe_short *frame)
 
     KEVLOG_IRQ_EXIT(vector);
 
-    if (ret != INT_NO_RESCHEDULE)
-        thread_preempt();
-
     return ret;
 }
 
@@ -0,0 +1,247 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <sys/types.h>
+#include <debug.h>
+#include <trace.h>
+#include <err.h>
+#include <string.h>
+#include <compiler.h>
+#include <arch/mmu.h>
+#include <kernel/vm.h>
+#include "platform_p.h"
+
+/*
+ * Just enough acpi to find the local apic ids of the cpus in the MADT.
+ */
+
+#define LOCAL_TRACE 0
+
+struct acpi_rsdp {
+	char signature[8];
+	uint8_t checksum;
+	char oem_id[6];
+	uint8_t revision;
+	uint32_t rsdt_address;
+
+	/* revision 2 and up */
+	uint32_t length;
+	uint64_t xsdt_address;
+	uint8_t extended_checksum;
+	uint8_t reserved[3];
+} __PACKED;
+
+struct acpi_sdt_header {
+	char signature[4];
+	uint32_t length;
+	uint8_t revision;
+	uint8_t checksum;
+	char oem_id[6];
+	char oem_table_id[8];
+	uint32_t oem_revision;
+	uint32_t creator_id;
+	uint32_t creator_revision;
+} __PACKED;
+
+struct acpi_madt {
+	struct acpi_sdt_header header;
+	uint32_t local_apic_address;
+	uint32_t flags;
+} __PACKED;
+
+struct acpi_madt_entry {
+	uint8_t type;
+	uint8_t length;
+} __PACKED;
+
+#define ACPI_MADT_TYPE_LOCAL_APIC 0
+
+struct acpi_madt_local_apic {
+	struct acpi_madt_entry entry;
+	uint8_t processor_id;
+	uint8_t apic_id;
+	uint32_t flags;
+} __PACKED;
+
+#define ACPI_MADT_LOCAL_APIC_ENABLED (1 << 0)
+
+#define ACPI_RSDP_V1_LENGTH 20
+
+static paddr_t rsdp_paddr;
+
+static uint8_t acpi_checksum(const void *buf, size_t len)
+{
+	const uint8_t *b = buf;
+	uint8_t sum = 0;
+
+	while (len--)
+		sum += *b++;
+
+	return sum;
+}
+
+static const struct acpi_rsdp *acpi_scan_rsdp(paddr_t start, size_t len)
+{
+	/* the rsdp is always 16 byte aligned */
+	for (paddr_t p = ROUNDUP(start, 16); p + ACPI_RSDP_V1_LENGTH <= start + len; p += 16) {
+		const struct acpi_rsdp *rsdp = (const struct acpi_rsdp *)p;
+
+		if (!memcmp(rsdp->signature, "RSD PTR ", 8) &&
+		        acpi_checksum(rsdp, ACPI_RSDP_V1_LENGTH) == 0)
+			return rsdp;
+	}
+
+	return NULL;
+}
+
+/* runs while the boot identity mapping of low memory is still around */
+void acpi_init_early(void)
+{
+	const struct acpi_rsdp *rsdp;
+
+	/* first kb of the ebda, then the bios rom area */
+	volatile uint8_t *bda = platform_bios_data_area();
+	paddr_t ebda = (paddr_t)(bda[0x0e] | (bda[0x0f] << 8)) << 4;
+	rsdp = ebda ? acpi_scan_rsdp(ebda, 1024) : NULL;
+	if (!rsdp)
+		rsdp = acpi_scan_rsdp(0xe0000, 0x20000);
+
+	if (!rsdp) {
+		dprintf(INFO, "ACPI: no rsdp found\n");
+		return;
+	}
+
+	LTRACEF("rsdp at %p, revision %u\n", rsdp, rsdp->revision);
+
+	rsdp_paddr = (paddr_t)rsdp;
+}
+
+/* identity map the pages covering a table read only, leaving anything already mapped alone */
+static status_t acpi_map(paddr_t pa, size_t len)
+{
+	for (paddr_t p = ROUNDDOWN(pa, PAGE_SIZE); p < pa + len; p += PAGE_SIZE) {
+		paddr_t mapped_pa;
+		uint flags;
+
+		if (arch_mmu_query(p, &mapped_pa, &flags) == NO_ERROR)
+			continue;
+
+		int err = arch_mmu_map(p, p, 1, ARCH_MMU_FLAG_PERM_RO | ARCH_MMU_FLAG_PERM_NO_EXECUTE);
+		if (err < 0)
+			return err;
+	}
+
+	return NO_ERROR;
+}
+
+static const struct acpi_sdt_header *acpi_map_table(paddr_t pa)
+{
+	const struct acpi_sdt_header *header = (const struct acpi_sdt_header *)pa;
+
+	if (acpi_map(pa, sizeof(*header)) < 0)
+		return NULL;
+	if (acpi_map(pa, header->length) < 0)
+		return NULL;
+
+	if (acpi_checksum(header, header->length) != 0) {
+		TRACEF("bad checksum on table at 0x%lx\n", pa);
+		return NULL;
+	}
+
+	return header;
+}
+
+static const struct acpi_sdt_header *acpi_find_table(const char *signature)
+{
+	if (!rsdp_paddr)
+		return NULL;
+
+	if (acpi_map(rsdp_paddr, sizeof(struct acpi_rsdp)) < 0)
+		return NULL;
+
+	const struct acpi_rsdp *rsdp = (const struct acpi_rsdp *)rsdp_paddr;
+
+	/* prefer the xsdt, with its 64 bit pointers, when there is one */
+	bool xsdt = rsdp->revision >= 2 && rsdp->xsdt_address != 0;
+	const struct acpi_sdt_header *root =
+	    acpi_map_table(xsdt ? (paddr_t)rsdp->xsdt_address : (paddr_t)rsdp->rsdt_address);
+	if (!root)
+		return NULL;
+
+	size_t entry_size = xsdt ? sizeof(uint64_t) : sizeof(uint32_t);
+	size_t count = (root->length - sizeof(*root)) / entry_size;
+	const uint8_t *entries = (const uint8_t *)(root + 1);
+
+	for (size_t i = 0; i < count; i++) {
+		paddr_t pa;
+
+		/* the entries are not necessarily naturally aligned */
+		if (xsdt) {
+			uint64_t e;
+			memcpy(&e, entries + i * entry_size, sizeof(e));
+			pa = e;
+		} else {
+			uint32_t e;
+			memcpy(&e, entries + i * entry_size, sizeof(e));
+			pa = e;
+		}
+
+		const struct acpi_sdt_header *header = acpi_map_table(pa);
+		if (header && !memcmp(header->signature, signature, 4))
+			return header;
+	}
+
+	return NULL;
+}
+
+int acpi_get_cpu_apic_ids(uint32_t *ids, uint max)
+{
+	const struct acpi_madt *madt = (const struct acpi_madt *)acpi_find_table("APIC");
+	if (!madt)
+		return ERR_NOT_FOUND;
+
+	const uint8_t *p = (const uint8_t *)(madt + 1);
+	const uint8_t *end = (const uint8_t *)madt + madt->header.length;
+	uint count = 0;
+
+	/* x2apic entries are ignored, only the xapic is supported */
+	while (p + sizeof(struct acpi_madt_entry) <= end && count < max) {
+		const struct acpi_madt_entry *entry = (const struct acpi_madt_entry *)p;
+
+		if (entry->length < sizeof(*entry) || p + entry->length > end)
+			break;
+
+		if (entry->type == ACPI_MADT_TYPE_LOCAL_APIC &&
+		        entry->length >= sizeof(struct acpi_madt_local_apic)) {
+			const struct acpi_madt_local_apic *lapic = (const struct acpi_madt_local_apic *)entry;
+
+			if (lapic->flags & ACPI_MADT_LOCAL_APIC_ENABLED) {
+				LTRACEF("cpu %u, apic id %u\n", lapic->processor_id, lapic->apic_id);
+				ids[count++] = lapic->apic_id;
+			}
+		}
+
+		p += entry->length;
+	}
+
+	return count ? (int)count : ERR_NOT_FOUND;
+}
@@ -27,6 +27,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include "platform_p.h"
 
 /* CGA values */
 #define CURSOR_START        0x0A
@@ -44,6 +45,7 @@ static unsigned char curr_end;
 static unsigned char curr_attr;
 
 /* video page buffer */
+#define VIDEO_MEMORY    ((uintptr_t)0xB8000)
 #define VPAGE_SIZE      2048
 #define PAGE_MAX        8
 
@@ -123,19 +125,23 @@ void cursor(int start,int end)
 
 void curr_save(void)
 {
+	volatile uint8_t *bda = platform_bios_data_area();
+
 	/* grab some info from the bios data area (these should be defined in memmap.h */
-	curr_attr = *((unsigned char *)0xB8000 + 159);
-	curr_x = *((unsigned char *)0x00450);
-	curr_y = *((unsigned char *)0x00451);
-	curr_end = *((unsigned char *)0x00460);
-	curr_start = *((unsigned char *)0x00461);
+	curr_attr = *((unsigned char *)VIDEO_MEMORY + 159);
+	curr_x = bda[0x50];
+	curr_y = bda[0x51];
+	curr_end = bda[0x60];
+	curr_start = bda[0x61];
 	active_page = visual_page = 0;
 }
 
 void curr_restore(void)
 {
-	*((unsigned char *)0x00450) = curr_x;
-	*((unsigned char *)0x00451) = curr_y;
+	volatile uint8_t *bda = platform_bios_data_area();
+
+	bda[0x50] = curr_x;
+	bda[0x51] = curr_y;
 
 	place(curr_x, curr_y);
 	cursor(curr_start, curr_end);
@@ -160,7 +166,7 @@ void _clear(char c,char attr,int x1,int y1,int x2,int y2)
 	w |= c;
 	for (i = x1; i <= x2; i++) {
 		for (j = y1; j <= y2; j++) {
-			*((unsigned short *)(0xB8000 + 2*i+160*j + 2*active_page*VPAGE_SIZE)) = w;
+			*((unsigned short *)(VIDEO_MEMORY + 2*i+160*j + 2*active_page*VPAGE_SIZE)) = w;
 		}
 	}
 
@@ -179,7 +185,7 @@ void _scroll(char attr, int x1, int y1, int x2, int y2)
 {
 	register int x,y;
 	unsigned short xattr = attr << 8,w;
-	unsigned char *v = (unsigned char *)(0xB8000 + active_page*(2*VPAGE_SIZE));
+	unsigned char *v = (unsigned char *)(VIDEO_MEMORY + active_page*(2*VPAGE_SIZE));
 
 	for (y = y1+1; y <= y2; y++) {
 		for (x = x1; x <= x2; x++) {
@@ -202,7 +208,7 @@ void scroll(void)
 void cputc(char c)
 {
 	static unsigned short scan_x, x, y;
-	unsigned char *v = (unsigned char *)(0xB8000 + active_page*(2*VPAGE_SIZE));
+	unsigned char *v = (unsigned char *)(VIDEO_MEMORY + active_page*(2*VPAGE_SIZE));
 	x = curr_x;
 	y = curr_y;
 
@@ -269,7 +275,7 @@ void cputs(char *s)
 
 void puts_xy(int x,int y,char attr,char *s)
 {
-	unsigned char *v = (unsigned char *)(0xB8000 + (80*y+x)*2 + active_page*(2*VPAGE_SIZE));
+	unsigned char *v = (unsigned char *)(VIDEO_MEMORY + (80*y+x)*2 + active_page*(2*VPAGE_SIZE));
 	while (*s != 0) {
 		*v = *s;
 		s++;
@@ -281,7 +287,7 @@ void puts_xy(int x,int y,char attr,char *s)
 
 void putc_xy(int x, int y, char attr, char c)
 {
-	unsigned char *v = (unsigned char *)(0xB8000 + (80*y+x)*2 + active_page*(2*VPAGE_SIZE));
+	unsigned char *v = (unsigned char *)(VIDEO_MEMORY + (80*y+x)*2 + active_page*(2*VPAGE_SIZE));
 	*v = c;
 	v++;
 	*v = attr;
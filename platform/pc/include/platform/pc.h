@@ -29,7 +29,7 @@
 /* NOTE: keep arch/x86/crt0.S in sync with these definitions */
 
 /* interrupts */
-#define INT_VECTORS 0x31
+#define INT_VECTORS 0x40
 
 /* defined interrupts */
 #define INT_BASE            0x20
@@ -54,11 +54,15 @@
 #define INT_GP_FAULT        0x0d
 #define INT_PAGE_FAULT      0x0e
 
-/* APIC vectors */
-#define INT_APIC_TIMER      0x22
-
 #define INT_SYSCALL         0x30
 
+/* local APIC vectors, everything from the timer up to the spurious vector needs an eoi */
+#define INT_APIC_TIMER      0x31
+#define INT_IPI_GENERIC     0x32
+#define INT_IPI_RESCHEDULE  0x33
+#define INT_IPI_TLB         0x34
+#define INT_APIC_SPURIOUS   0x3f
+
 /* PIC remap bases */
 #define PIC1_BASE 0x20
 #define PIC2_BASE 0x28
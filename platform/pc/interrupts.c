@@ -31,6 +31,9 @@
 #include <kernel/spinlock.h>
 #include "platform_p.h"
 #include <platform/pc.h>
+#ifdef ARCH_X86_64
+#include <arch/x86/lapic.h>
+#endif
 
 static spin_lock_t lock;
 
@@ -148,6 +151,10 @@ void issueEOI(unsigned int vector)
 	} else if (vector >= PIC2_BASE && vector <= PIC2_BASE + 7) {
 		outp(PIC2, 0x20);
 		outp(PIC1, 0x20);   // must issue both for the second PIC
+#ifdef ARCH_X86_64
+	} else if (vector >= INT_APIC_TIMER && vector < INT_APIC_SPURIOUS) {
+		lapic_eoi();
+#endif
 	}
 }
 
@@ -37,6 +37,10 @@
 #include <string.h>
 #include <assert.h>
 #include <kernel/vm.h>
+#ifdef ARCH_X86_64
+#include <arch/x86/lapic.h>
+#include <arch/x86/mp.h>
+#endif
 
 extern multiboot_info_t *_multiboot_info;
 extern int _end_of_ram;
@@ -129,7 +133,7 @@ static pmm_arena_t heap_arena = {
     .flags = PMM_ARENA_FLAG_KMAP
 };
 
-void heap_arena_init()
+void heap_arena_init(void)
 {
 	uintptr_t heap_base = ((uintptr_t)_heap_start);
 	uintptr_t heap_size = (uintptr_t)_heap_end-(uintptr_t)_heap_start;
@@ -146,11 +150,10 @@ void platform_init_multiboot_info(void)
 	if (_multiboot_info) {
 		if (_multiboot_info->flags & MB_INFO_MEM_SIZE) {
 			_heap_end = _multiboot_info->mem_upper * 1024;
-			memory_map_t *mmap = (memory_map_t *) (_multiboot_info->mmap_addr - 4);
 		}
 
 		if (_multiboot_info->flags & MB_INFO_MMAP) {
-			memory_map_t *mmap = (memory_map_t *) (_multiboot_info->mmap_addr - 4);
+			memory_map_t *mmap = (memory_map_t *)(uintptr_t)(_multiboot_info->mmap_addr - 4);
 
 			for (i=0; i < _multiboot_info->mmap_length / sizeof(memory_map_t); i++) {
 
@@ -184,6 +187,12 @@ void platform_early_init(void)
 
 	/* initialize the timer */
 	platform_init_timer();
+
+#ifdef ARCH_X86_64
+	/* find the acpi tables while low memory is still identity mapped */
+	acpi_init_early();
+#endif
+
 	#if WITH_KERNEL_VM
 	heap_arena_init();
 	pmm_add_arena(&heap_arena);
@@ -191,6 +200,21 @@ void platform_early_init(void)
 
 }
 
+#if WITH_SMP
+static void platform_start_secondary_cpus(void)
+{
+	uint32_t apic_ids[SMP_MAX_CPUS];
+
+	int count = acpi_get_cpu_apic_ids(apic_ids, countof(apic_ids));
+	if (count < 0) {
+		dprintf(INFO, "PC: no cpus found in acpi, running on the boot cpu only\n");
+		return;
+	}
+
+	x86_mp_boot_cpus(apic_ids, count);
+}
+#endif
+
 void platform_init(void)
 {
 	uart_init();
@@ -204,6 +228,14 @@ void platform_init(void)
 #ifdef ARCH_X86_64
         arch_mmu_init();
         platform_init_mmu_mappings();
+
+	/* the local apic is mapped into the final page tables */
+	if (lapic_init() == NO_ERROR) {
+		platform_init_lapic_timer();
+#if WITH_SMP
+		platform_start_secondary_cpus();
+#endif
+	}
 #endif
 
 }
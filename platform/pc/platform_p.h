@@ -23,9 +23,28 @@
 #ifndef __PLATFORM_P_H
 #define __PLATFORM_P_H
 
+#include <sys/types.h>
+
+/* the bios data area lives in the first page, which newer compilers assume can't be
+ * dereferenced. hide the address from them. */
+static inline volatile uint8_t *platform_bios_data_area(void)
+{
+	volatile uint8_t *bda = (volatile uint8_t *)0x400;
+
+	__asm__("" : "+r" (bda));
+	return bda;
+}
+
 void platform_init_interrupts(void);
 void platform_init_timer(void);
 void platform_init_uart(void);
 
+#ifdef ARCH_X86_64
+void platform_init_lapic_timer(void);
+
+void acpi_init_early(void);
+int acpi_get_cpu_apic_ids(uint32_t *ids, uint max);
+#endif
+
 #endif
 
@@ -33,7 +33,13 @@ MODULE_SRCS += \
         $(LOCAL_DIR)/console.c \
         $(LOCAL_DIR)/keyboard.c \
         $(LOCAL_DIR)/uart.c \
+        $(LOCAL_DIR)/acpi.c \
 
+# the local apic timers provide per cpu one shot timers
+GLOBAL_DEFINES += \
+	PLATFORM_HAS_DYNAMIC_TIMER=1
+
+WITH_SMP ?= 1
 endif
 
 LINKER_SCRIPT += \
@@ -24,6 +24,8 @@
 #include <err.h>
 #include <reg.h>
 #include <debug.h>
+#include <assert.h>
+#include <stdlib.h>
 #include <kernel/thread.h>
 #include <kernel/spinlock.h>
 #include <platform.h>
@@ -33,6 +35,11 @@
 #include <platform/pc.h>
 #include "platform_p.h"
 #include <arch/x86.h>
+#if PLATFORM_HAS_DYNAMIC_TIMER
+#include <lk/init.h>
+#include <arch/ops.h>
+#include <arch/x86/lapic.h>
+#endif
 
 static platform_timer_callback t_callback;
 static void *callback_arg;
@@ -48,6 +55,24 @@ static uint16_t divisor;
 #define INTERNAL_FREQ 1193182ULL
 #define INTERNAL_FREQ_3X 3579546ULL
 
+#if PLATFORM_HAS_DYNAMIC_TIMER
+/*
+ * the pit stays the time base, one shot events run off each cpu's local apic
+ * timer once it has been calibrated against the pit. until then cpu 0's one
+ * shot is checked from the pit tick.
+ */
+static struct {
+	platform_timer_callback callback;
+	void *arg;
+} oneshot[SMP_MAX_CPUS];
+
+static bool lapic_timer_ready;
+static uint32_t lapic_ticks_per_ms;
+
+static bool pit_oneshot_armed;
+static uint64_t pit_oneshot_deadline;
+#endif
+
 status_t platform_set_periodic_timer(platform_timer_callback callback, void *arg, lk_time_t interval)
 {
 	t_callback = callback;
@@ -89,6 +114,14 @@ static enum handler_return os_timer_tick(void *arg)
 	//printf_xy(71, 0, WHITE, "%08u", (uint32_t) time);
 	//printf_xy(63, 1, WHITE, "%016llu", (uint64_t) btime);
 
+#if PLATFORM_HAS_DYNAMIC_TIMER
+	if (pit_oneshot_armed && timer_current_time >= pit_oneshot_deadline) {
+		pit_oneshot_armed = false;
+
+		return oneshot[0].callback(oneshot[0].arg, time);
+	}
+#endif
+
 	if (t_callback && timer_current_time >= next_trigger_time) {
 		delta = timer_current_time - next_trigger_time;
 		next_trigger_time = timer_current_time + next_trigger_delta - delta;
@@ -154,9 +187,107 @@ void platform_init_timer(void)
 	unmask_interrupt(INT_PIT);
 }
 
+#if PLATFORM_HAS_DYNAMIC_TIMER
+status_t platform_set_oneshot_timer(platform_timer_callback callback, void *arg, lk_time_t interval)
+{
+	uint cpu = arch_curr_cpu_num();
+
+	oneshot[cpu].callback = callback;
+	oneshot[cpu].arg = arg;
+
+	if (lapic_timer_ready) {
+		uint64_t count = (uint64_t)interval * lapic_ticks_per_ms;
+
+		if (count == 0)
+			count = 1;
+		else if (count > UINT32_MAX)
+			count = UINT32_MAX;
+
+		lapic_timer_start(count);
+	} else {
+		DEBUG_ASSERT(cpu == 0);
+
+		pit_oneshot_deadline = timer_current_time + ((uint64_t)interval << 32);
+		pit_oneshot_armed = true;
+	}
+
+	return NO_ERROR;
+}
+
+void platform_stop_timer(void)
+{
+	if (lapic_timer_ready)
+		lapic_timer_stop();
+	else
+		pit_oneshot_armed = false;
+}
+
+static enum handler_return lapic_timer_tick(void *arg)
+{
+	uint cpu = arch_curr_cpu_num();
+
+	if (!oneshot[cpu].callback)
+		return INT_NO_RESCHEDULE;
+
+	return oneshot[cpu].callback(oneshot[cpu].arg, current_time());
+}
+
+void platform_init_lapic_timer(void)
+{
+	lapic_timer_init_percpu();
+	register_int_handler(INT_APIC_TIMER, &lapic_timer_tick, NULL);
+
+	/* count the local apic timer down across 10 pit ticks */
+	lk_time_t t = current_time();
+	while (current_time() == t)
+		;
+
+	t = current_time();
+	lapic_timer_start(UINT32_MAX);
+	while (current_time() - t < 10)
+		;
+
+	uint32_t elapsed = UINT32_MAX - lapic_timer_current_count();
+	lapic_timer_stop();
+
+	lapic_ticks_per_ms = MAX(elapsed / 10, 1U);
+	dprintf(INFO, "PC: local apic timer at %u ticks per ms\n", lapic_ticks_per_ms);
+
+	/* move any one shot still pending on the pit over to the local apic timer */
+	spin_lock_saved_state_t state;
+	arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+	lapic_timer_ready = true;
+
+	if (pit_oneshot_armed) {
+		pit_oneshot_armed = false;
+
+		uint64_t remaining = 0;
+		if (pit_oneshot_deadline > timer_current_time)
+			remaining = pit_oneshot_deadline - timer_current_time;
+
+		platform_set_oneshot_timer(oneshot[0].callback, oneshot[0].arg, remaining >> 32);
+	}
+
+	arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+static void platform_init_lapic_timer_secondary(uint level)
+{
+	lapic_timer_init_percpu();
+}
+
+LK_INIT_HOOK_FLAGS(lapic_timer, &platform_init_lapic_timer_secondary,
+                   LK_INIT_LEVEL_THREADING - 1, LK_INIT_FLAG_SECONDARY_CPUS);
+#endif
+
 void platform_halt_timers(void)
 {
 	mask_interrupt(INT_PIT);
+#if PLATFORM_HAS_DYNAMIC_TIMER
+	if (lapic_timer_ready)
+		lapic_timer_stop();
+#endif
 }
 
 /* vim: set noexpandtab */
@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+/* up to 30 GB of ram */
+#define MEMORY_BASE_PHYS     (0x40000000)
+#define MEMORY_APERTURE_SIZE (30ULL * 1024 * 1024 * 1024)
+
+/* map all of 0-1GB into kernel space in one shot */
+#define PERIPHERAL_BASE_PHYS (0)
+#define PERIPHERAL_BASE_SIZE (0x40000000UL) // 1GB
+#define PERIPHERAL_BASE_VIRT (0xffffffffc0000000ULL) // -1GB
+
+/* individual peripherals in this mapping */
+#define CPUPRIV_BASE_VIRT   (PERIPHERAL_BASE_VIRT + 0x08000000)
+#define CPUPRIV_BASE_PHYS   (PERIPHERAL_BASE_PHYS + 0x08000000)
+#define CPUPRIV_SIZE        (0x00020000)
+#define UART_BASE           (PERIPHERAL_BASE_VIRT + 0x09000000)
+#define UART_SIZE           (0x00001000)
+#define VIRTIO_BASE         (PERIPHERAL_BASE_VIRT + 0x0a000000)
+#define VIRTIO_SIZE         (0x00000200)
+#define NUM_VIRTIO_TRANSPORTS 32
+
+/* interrupts */
+#define ARM_GENERIC_TIMER_VIRTUAL_INT 27
+#define ARM_GENERIC_TIMER_PHYSICAL_INT 30
+#define UART0_INT   (32 + 1)
+#define VIRTIO0_INT (32 + 16)
+
+#define MAX_INT 128
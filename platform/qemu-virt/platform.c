@@ -0,0 +1,166 @@
+/*
+ * Copyright (c) 2015 Travis Geiselbrecht
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <err.h>
+#include <debug.h>
+#include <trace.h>
+#include <arch.h>
+#include <arch/ops.h>
+#include <arch/arm64.h>
+#include <arch/arm64/mmu.h>
+#include <dev/interrupt/arm_gic.h>
+#include <dev/power/psci.h>
+#include <dev/timer/arm_generic.h>
+#include <dev/uart.h>
+#include <dev/virtio.h>
+#include <lk/init.h>
+#include <kernel/vm.h>
+#include <platform.h>
+#include <platform/gic.h>
+#include <platform/interrupts.h>
+#include <platform/qemu-virt.h>
+
+#if QEMU_VIRT_WITH_VIRTIO_NET
+#include <dev/virtio/net.h>
+#include <lib/minip.h>
+#endif
+
+#define LOCAL_TRACE 0
+
+/* initial memory mappings. parsed by start.S */
+struct mmu_initial_mapping mmu_initial_mappings[] = {
+    /* all of memory */
+    { .phys = MEMORY_BASE_PHYS,
+      .virt = KERNEL_BASE,
+      .size = MEMORY_APERTURE_SIZE,
+      .flags = 0,
+      .name = "memory" },
+
+    /* 1GB of peripherals */
+    { .phys = PERIPHERAL_BASE_PHYS,
+      .virt = PERIPHERAL_BASE_VIRT,
+      .size = PERIPHERAL_BASE_SIZE,
+      .flags = MMU_INITIAL_MAPPING_FLAG_DEVICE,
+      .name = "peripherals" },
+
+    /* null entry to terminate the list */
+    { 0 }
+};
+
+static pmm_arena_t arena = {
+    .name = "ram",
+    .base = MEMORY_BASE_PHYS,
+    .size = MEMSIZE,
+    .flags = PMM_ARENA_FLAG_KMAP,
+};
+
+void platform_init_mmu_mappings(void)
+{
+}
+
+#if WITH_SMP
+/* bring up the secondary cpus with psci, they enter at the physical address of _start */
+static void platform_start_secondary_cpus(void)
+{
+    int count;
+
+    for (count = 0; count < SMP_MAX_CPUS - 1; count++) {
+        uint cpu = count + 1;
+
+        int ret = psci_cpu_on(cpu, MEMBASE + KERNEL_LOAD_OFFSET, cpu);
+        LTRACEF("cpu %u, psci ret %d\n", cpu, ret);
+
+        /* the cpus come up in order, so stop at the first one that isn't there */
+        if (ret != PSCI_SUCCESS)
+            break;
+    }
+
+    dprintf(INFO, "started %d secondary cpu%c\n", count, count != 1 ? 's' : ' ');
+
+    arm64_set_secondary_cpu_count(count);
+}
+#endif
+
+void platform_early_init(void)
+{
+    uart_init_early();
+
+    /* initialize the interrupt controller */
+    arm_gic_init();
+
+    /* use the non secure physical timer */
+    arm_generic_timer_init(ARM_GENERIC_TIMER_PHYSICAL_INT, 0);
+
+    /* add the main memory arena */
+    pmm_add_arena(&arena);
+
+#if WITH_SMP
+    platform_start_secondary_cpus();
+#endif
+}
+
+void platform_init(void)
+{
+    uart_init();
+
+    /* detect any virtio devices, qemu hands the transports out from the top down */
+    uint virtio_irqs[NUM_VIRTIO_TRANSPORTS];
+    for (uint i = 0; i < NUM_VIRTIO_TRANSPORTS; i++)
+        virtio_irqs[i] = VIRTIO0_INT + i;
+
+    virtio_mmio_detect((void *)VIRTIO_BASE, NUM_VIRTIO_TRANSPORTS, virtio_irqs);
+
+#if QEMU_VIRT_WITH_VIRTIO_NET
+    /* bring up the network stack on the first virtio nic */
+    if (virtio_net_found() > 0) {
+        uint8_t mac_addr[6];
+
+        virtio_net_get_mac_addr(mac_addr);
+        minip_set_macaddr(mac_addr);
+
+        minip_init_dhcp(virtio_net_send_minip_pkt, NULL);
+        virtio_net_start();
+    }
+#endif
+}
+
+void platform_halt(platform_halt_action suggested_action,
+                   platform_halt_reason reason)
+{
+    switch (suggested_action) {
+        case HALT_ACTION_SHUTDOWN:
+            dprintf(ALWAYS, "POWEROFF\n");
+            psci_system_off();
+            break;
+        case HALT_ACTION_REBOOT:
+            dprintf(ALWAYS, "REBOOT\n");
+            psci_system_reset();
+            break;
+        default:
+            break;
+    }
+
+    dprintf(ALWAYS, "HALT: spinning forever... (reason = %d)\n", reason);
+    arch_disable_ints();
+    for (;;)
+        arch_idle();
+}
@@ -0,0 +1,50 @@
+LOCAL_DIR := $(GET_LOCAL_DIR)
+
+MODULE := $(LOCAL_DIR)
+
+ARCH := arm64
+ARM_CPU := cortex-a53
+WITH_SMP ?= 1
+
+# qemu implements psci itself and takes the calls at the hypervisor level
+PSCI_USE_HVC := 1
+
+GLOBAL_INCLUDES += \
+	$(LOCAL_DIR)/include
+
+MODULE_SRCS += \
+	$(LOCAL_DIR)/debug.c \
+	$(LOCAL_DIR)/platform.c \
+	$(LOCAL_DIR)/uart.c
+
+MEMBASE := 0x40000000
+MEMSIZE ?= 0x08000000	# 128MB
+# leave room at the base of ram for the device tree qemu places there
+KERNEL_LOAD_OFFSET := 0x00100000
+
+MODULE_DEPS += \
+	lib/cbuf \
+	dev/interrupt/arm_gic \
+	dev/power/psci \
+	dev/timer/arm_generic \
+	dev/virtio/block
+
+# virtio-net and dhcp on the first nic are opt in, the driver pulls in minip
+QEMU_VIRT_WITH_VIRTIO_NET ?= 0
+
+ifeq ($(QEMU_VIRT_WITH_VIRTIO_NET),1)
+GLOBAL_DEFINES += \
+	QEMU_VIRT_WITH_VIRTIO_NET=1
+
+MODULE_DEPS += \
+	dev/virtio/net
+endif
+
+GLOBAL_DEFINES += \
+	MEMBASE=$(MEMBASE) \
+	MEMSIZE=$(MEMSIZE)
+
+LINKER_SCRIPT += \
+	$(BUILDDIR)/system-onesegment.ld
+
+include make/module.mk
@@ -38,6 +38,11 @@
 #include <platform/vexpress-a9.h>
 #include "platform_p.h"
 
+#if VEXPRESS_A9_WITH_VIRTIO_NET
+#include <dev/virtio/net.h>
+#include <lib/minip.h>
+#endif
+
 #define SDRAM_SIZE (512*1024*1024) // XXX get this from the emulator somehow
 
 /* initial memory mappings. parsed by start.S */
@@ -112,4 +117,17 @@ void platform_init(void)
     /* detect any virtio devices */
     const uint virtio_irqs[] = { VIRTIO0_INT, VIRTIO1_INT, VIRTIO2_INT, VIRTIO3_INT };
     virtio_mmio_detect((void *)VIRTIO_BASE, 4, virtio_irqs);
+
+#if VEXPRESS_A9_WITH_VIRTIO_NET
+    /* bring up the network stack on the first virtio nic */
+    if (virtio_net_found() > 0) {
+        uint8_t mac_addr[6];
+
+        virtio_net_get_mac_addr(mac_addr);
+        minip_set_macaddr(mac_addr);
+
+        minip_init_dhcp(virtio_net_send_minip_pkt, NULL);
+        virtio_net_start();
+    }
+#endif
 }
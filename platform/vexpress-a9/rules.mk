@@ -21,8 +21,18 @@ MODULE_DEPS += \
 	lib/cbuf \
 	dev/interrupt/arm_gic \
 	dev/timer/arm_cortex_a9 \
-	dev/virtio/block \
+	dev/virtio/block
+
+# virtio-net and dhcp on the first nic are opt in, the driver pulls in minip
+VEXPRESS_A9_WITH_VIRTIO_NET ?= 0
+
+ifeq ($(VEXPRESS_A9_WITH_VIRTIO_NET),1)
+GLOBAL_DEFINES += \
+	VEXPRESS_A9_WITH_VIRTIO_NET=1
+
+MODULE_DEPS += \
 	dev/virtio/net
+endif
 
 GLOBAL_DEFINES += \
 	MEMBASE=$(MEMBASE) \
@@ -138,7 +138,7 @@ void gem_queue_for_tx(void) {
 
     int pos = 0;
     while ((p = list_remove_head_type(pending_tx_ptr, pktbuf_t, list)) != NULL) {
-        arch_clean_cache_range((addr_t)p->buffer, sizeof(p->buffer));
+        arch_clean_cache_range((addr_t)p->buffer, p->blen);
         state->tx[pos].addr = (uintptr_t) pktbuf_data_phys(p);
         state->tx[pos].ctrl = TX_BUF_LEN(p->dlen);
         if (pos == GEM_TX_BUF_CNT) {
@@ -170,6 +170,17 @@ int gem_send_raw_pkt(struct pktbuf *p)
         goto err;
     }
 
+    /* one descriptor per packet, so flatten chains */
+    if (p->next) {
+        pktbuf_t *flat = pktbuf_linearize(p);
+        if (!flat) {
+            pktbuf_free(p);
+            ret = -1;
+            goto err;
+        }
+        p = flat;
+    }
+
     LTRACEF("buf %p, len %zu, pkt %p\n", p->data, p->dlen, p);
 
     spin_lock_saved_state_t irqstate;
@@ -262,7 +273,7 @@ static void gem_cfg_buffer_descs(void)
         DEBUG_ASSERT(p);
 
         /* make sure the buffers start off with no stale data in them */
-        arch_invalidate_cache_range((addr_t)p->buffer, sizeof(p->buffer));
+        arch_invalidate_cache_range((addr_t)p->buffer, p->blen);
 
         state->rx[i].addr = (uintptr_t) pktbuf_data_phys(p);
         state->rx[i].ctrl = 0;
@@ -318,7 +329,7 @@ int gem_rx_thread(void *arg)
                 }
 
                 /* invalidate the buffer before putting it back */
-                arch_invalidate_cache_range((addr_t)p->buffer, sizeof(p->buffer));
+                arch_invalidate_cache_range((addr_t)p->buffer, p->blen);
 
                 state->rx[bp].addr &= ~RX_DESC_USED;
                 state->rx[bp].ctrl = 0;
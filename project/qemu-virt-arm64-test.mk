@@ -0,0 +1,13 @@
+# top level project rules for the qemu-virt-arm64-test project
+#
+TARGET := qemu-virt-arm64
+
+MODULES += \
+	app/tests \
+	app/stringtests \
+	app/shell \
+	lib/cksum \
+	lib/debugcommands
+
+WITH_LINKER_GC := 0
+
@@ -0,0 +1,127 @@
+#!/usr/bin/env python
+
+# converts a kernel event log (see include/kernel/debug.h) to chrome trace json,
+# for chrome://tracing or perfetto. the input is either the binary log from
+# 'lkboot <host> kevlog <file>' or a console capture of 'kevlog export'.
+
+from __future__ import print_function
+
+import json
+import struct
+import sys
+
+MAGIC = 0x4c56454b
+HEADER = 'IHHIIQII'
+RECORD = 'IHBBII'
+
+NAMES = [
+    None, 'context switch', 'preempt', 'timer tick', 'timer call',
+    'irq', 'irq exit', 'heap alloc', 'heap free',
+    'bio read', 'bio read end', 'bio write', 'bio write end',
+    'bio request', 'bio request end', 'net rx', 'net tx',
+]
+
+# ids that open and close a span on their cpu
+BEGIN = { 5: 'irq', 9: 'bio read', 11: 'bio write' }
+END = { 6: 5, 10: 9, 12: 11 }
+# async spans, matched on arg0
+ASYNC_BEGIN = { 13: 'bio request' }
+ASYNC_END = { 14: 13 }
+CONTEXT_SWITCH = 1
+
+def read_log(data):
+    # a console capture is hex after a 'KEVLOG ' tag
+    if b'KEVLOG ' in data:
+        hexdata = b''
+        for line in data.splitlines():
+            i = line.find(b'KEVLOG ')
+            if i >= 0 and not line[i + 7:].startswith(b'END'):
+                hexdata += line[i + 7:].strip()
+        data = bytearray.fromhex(hexdata.decode('ascii'))
+
+    for endian in '<>':
+        if struct.unpack_from(endian + 'I', data, 0)[0] == MAGIC:
+            break
+    else:
+        sys.exit('not a kernel event log')
+
+    hdr = struct.unpack_from(endian + HEADER, data, 0)
+    magic, version, record_size, cpus, count, now, dropped, _ = hdr
+    if version != 1:
+        sys.exit('unsupported version %d' % version)
+
+    off = struct.calcsize(HEADER)
+    records = []
+    for _ in range(count):
+        records.append(struct.unpack_from(endian + RECORD, data, off))
+        off += record_size
+
+    return now, dropped, records
+
+def unwrap(now, records):
+    # record times are the low 32 bits of a usec clock, walk each cpu back from now
+    by_cpu = {}
+    for r in records:
+        by_cpu.setdefault(r[2], []).append(r)
+
+    out = []
+    for cpu, recs in by_cpu.items():
+        base = now & ~0xffffffff
+        last = now & 0xffffffff
+        times = []
+        for r in reversed(recs):
+            if r[0] > last:
+                base -= 1 << 32
+            last = r[0]
+            times.append(base + r[0])
+        out.extend(zip(reversed(times), recs))
+
+    out.sort(key=lambda x: x[0])
+    return out
+
+def convert(now, records):
+    events = []
+    running = {}
+    for ts, (t, id, cpu, _, arg0, arg1) in unwrap(now, records):
+        name = NAMES[id] if id < len(NAMES) else 'event %d' % id
+        base = { 'pid': 0, 'tid': cpu, 'ts': ts }
+        args = { 'arg0': '0x%x' % arg0, 'arg1': '0x%x' % arg1 }
+
+        if id == CONTEXT_SWITCH:
+            # each cpu's track shows the thread running on it
+            if cpu in running:
+                events.append(dict(base, ph='E', name=running[cpu]))
+            running[cpu] = 'thread 0x%x' % arg1
+            events.append(dict(base, ph='B', name=running[cpu]))
+        elif id in BEGIN:
+            events.append(dict(base, ph='B', name='%s %d' % (BEGIN[id], arg0) if id == 5 else BEGIN[id], args=args))
+        elif id in END:
+            events.append(dict(base, ph='E', args=args))
+        elif id in ASYNC_BEGIN:
+            events.append(dict(base, ph='b', cat='bio', id='0x%x' % arg0, name=ASYNC_BEGIN[id], args=args))
+        elif id in ASYNC_END:
+            events.append(dict(base, ph='e', cat='bio', id='0x%x' % arg0, name=ASYNC_BEGIN[ASYNC_END[id]], args=args))
+        else:
+            events.append(dict(base, ph='i', s='t', name=name, args=args))
+
+    for cpu in range(max([r[2] for r in records] + [0]) + 1):
+        events.append({ 'ph': 'M', 'pid': 0, 'tid': cpu, 'name': 'thread_name', 'args': { 'name': 'cpu %d' % cpu } })
+
+    return events
+
+def main():
+    if len(sys.argv) < 3:
+        print('usage: %s <kevlog file> <json file>' % sys.argv[0])
+        sys.exit(1)
+
+    with open(sys.argv[1], 'rb') as f:
+        now, dropped, records = read_log(f.read())
+
+    if dropped:
+        print('%d records were overwritten before the log was read' % dropped, file=sys.stderr)
+
+    with open(sys.argv[2], 'w') as f:
+        json.dump({ 'traceEvents': convert(now, records), 'displayTimeUnit': 'ms' }, f)
+
+if __name__ == '__main__':
+    main()
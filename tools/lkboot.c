@@ -41,6 +41,7 @@ void usage(void) {
 "       lkboot <hostname> fpga <bitfile>\n"
 "       lkboot <hostname> boot <binary>\n"
 "       lkboot <hostname> getsysparam <name>\n"
+"       lkboot <hostname> kevlog <outfile>\n"
 "       lkboot <hostname> reboot\n"
 "       lkboot <hostname> :<commandname> [ <arg>* ]\n"
 "\n"
@@ -102,6 +103,25 @@ int main(int argc, char **argv) {
 		} else {
 			return -1;
 		}
+	} else if (!strcmp(cmd, "kevlog")) {
+		/* binary kernel event log, for tools/kevlog2json.py */
+		if (lkboot_txn(host, cmd, -1, "") == 0) {
+			void *rbuf = NULL;
+			unsigned len = lkboot_get_reply(&rbuf);
+			if ((fd = open(args, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+				fprintf(stderr, "error; cannot open '%s'\n", args);
+				return -1;
+			}
+			if (write(fd, rbuf, len) != (ssize_t)len) {
+				fprintf(stderr, "error; writing '%s'\n", args);
+				close(fd);
+				return -1;
+			}
+			close(fd);
+			return 0;
+		} else {
+			return -1;
+		}
 	} else if (cmd[0] == ':') {
 		return lkboot_txn(host, cmd + 1, -1, args);
 	} else {